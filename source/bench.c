@@ -0,0 +1,428 @@
+// Benchmarks for intmap and strmap. Build with optimizations, and with C_UTILS_THREAD_SAFE for the scaling benchmark:
+//
+//     gcc -O2 -DC_UTILS_THREAD_SAFE bench.c -lm -lpthread -o bench
+//
+// and run `bench` for all the benchmarks, or `bench hashtable`, `bench typed`, `bench bulk` or `bench scaling` for one
+// of them. A second argument sets the largest number of keys, as in `bench hashtable 100000000`, and defaults to 10M.
+// The numbers vary a lot between runs on a busy machine, so run them a few times. To compare the scaling with a single
+// lock per map, also define INTMAP_STRIPE_COUNT and STRMAP_STRIPE_COUNT as 1.
+
+//#define C_UTILS_THREAD_SAFE
+#include "c_utils/c_utils.h"
+#include "c_utils/hashtable.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#endif
+
+
+static double seconds( void ) {
+    #ifdef _WIN32
+        LARGE_INTEGER frequency, counter;
+        QueryPerformanceFrequency( &frequency );
+        QueryPerformanceCounter( &counter );
+        return (double) counter.QuadPart / (double) frequency.QuadPart;
+    #else
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+    #endif
+}
+
+
+// keys which are spread out, so intmap hashes them instead of storing them by index
+static int spread_key( int index ) {
+    return (int)( (uint32_t) index * 2654435761u );
+}
+
+
+static uint32_t random_next( uint32_t* state ) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+
+#define LOOKUPS 2000000
+
+// Times inserting `count` keys into hashtable_t, intmap and strmap, and looking up keys that are there and keys that
+// are not, in ns per operation
+static void bench_hashtable( int count ) {
+    int* indices = (int*) malloc( sizeof( int ) * LOOKUPS );
+    uint32_t state = 0x12345678u;
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        indices[ i ] = (int)( random_next( &state ) % (uint32_t) count );
+    }
+    int64_t checksum = 0;
+    printf( "hashtable: %d keys, ns per op    insert   hit      miss\n", count );
+
+    hashtable_t table;
+    double start = seconds();
+    hashtable_init( &table, sizeof( int ), sizeof( int64_t ), 256, NULL );
+    for( int i = 0; i < count; ++i ) {
+        int key = spread_key( i );
+        int64_t item = i;
+        hashtable_insert( &table, map_hash_int( key ), &key, &item );
+    }
+    double insert = seconds() - start;
+    start = seconds();
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        int key = spread_key( indices[ i ] );
+        int64_t const* item = (int64_t const*) hashtable_find( &table, map_hash_int( key ), &key );
+        checksum += item ? *item : 0;
+    }
+    double hit = seconds() - start;
+    start = seconds();
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        int key = spread_key( count + indices[ i ] );
+        checksum += hashtable_find( &table, map_hash_int( key ), &key ) != NULL;
+    }
+    double miss = seconds() - start;
+    hashtable_term( &table );
+    printf( "  hashtable_t                    %-9.1f%-9.1f%-9.1f\n", insert * 1e9 / count, hit * 1e9 / LOOKUPS, 
+        miss * 1e9 / LOOKUPS );
+
+    start = seconds();
+    intmap_t* intmap = intmap_create( sizeof( int64_t ) );
+    for( int i = 0; i < count; ++i ) {
+        int64_t item = i;
+        intmap_insert( intmap, spread_key( i ), &item );
+    }
+    insert = seconds() - start;
+    start = seconds();
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        int64_t item = 0;
+        intmap_find( intmap, spread_key( indices[ i ] ), &item );
+        checksum += item;
+    }
+    hit = seconds() - start;
+    start = seconds();
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        int64_t item = 0;
+        checksum += intmap_find( intmap, spread_key( count + indices[ i ] ), &item );
+    }
+    miss = seconds() - start;
+    intmap_destroy( intmap );
+    printf( "  intmap                         %-9.1f%-9.1f%-9.1f\n", insert * 1e9 / count, hit * 1e9 / LOOKUPS, 
+        miss * 1e9 / LOOKUPS );
+
+    // the strings are made up front, as interning them would take longer than the map operations being timed
+    str_t* strs = (str_t*) malloc( sizeof( str_t ) * (size_t) count * 2 );
+    for( int i = 0; i < count * 2; ++i ) {
+        strs[ i ] = format( str( "key%d" ), i );
+    }
+    start = seconds();
+    strmap_t* strmap = strmap_create( sizeof( int64_t ) );
+    for( int i = 0; i < count; ++i ) {
+        int64_t item = i;
+        strmap_insert( strmap, strs[ i ], &item );
+    }
+    insert = seconds() - start;
+    start = seconds();
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        int64_t item = 0;
+        strmap_find( strmap, strs[ indices[ i ] ], &item );
+        checksum += item;
+    }
+    hit = seconds() - start;
+    start = seconds();
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        int64_t item = 0;
+        checksum += strmap_find( strmap, strs[ count + indices[ i ] ], &item );
+    }
+    miss = seconds() - start;
+    strmap_destroy( strmap );
+    printf( "  strmap                         %-9.1f%-9.1f%-9.1f\n", insert * 1e9 / count, hit * 1e9 / LOOKUPS, 
+        miss * 1e9 / LOOKUPS );
+    printf( "  (checksum %lld)\n\n", (long long) checksum );
+    free( strs );
+    free( indices );
+}
+
+
+DEFINE_MAP( typed_int, int, int64_t, map_hash_int, MAP_EQUAL )
+DEFINE_MAP( typed_i64, int64_t, int64_t, map_hash_i64, MAP_EQUAL )
+
+
+static int64_t spread_key_i64( int index ) {
+    return (int64_t)( (uint64_t) index * 0x9e3779b97f4a7c15ull );
+}
+
+
+// Times maps made with DEFINE_MAP against intmap and against hashtable_t with 8 byte keys, inserting `count` keys and
+// then looking up keys of which half are there, in ns per operation
+static void bench_typed( int count ) {
+    int* indices = (int*) malloc( sizeof( int ) * LOOKUPS );
+    uint32_t state = 0x87654321u;
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        indices[ i ] = (int)( random_next( &state ) % (uint32_t)( count * 2 ) );
+    }
+    int64_t checksum = 0;
+    printf( "typed: %d keys, ns per op        insert   find\n", count );
+
+    double start = seconds();
+    intmap_t* intmap = intmap_create( sizeof( int64_t ) );
+    for( int i = 0; i < count; ++i ) {
+        int64_t item = i;
+        intmap_insert( intmap, spread_key( i ), &item );
+    }
+    double insert = seconds() - start;
+    start = seconds();
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        int64_t item = 0;
+        intmap_find( intmap, spread_key( indices[ i ] ), &item );
+        checksum += item;
+    }
+    double find = seconds() - start;
+    intmap_destroy( intmap );
+    printf( "  intmap, int keys              %-9.1f%-9.1f\n", insert * 1e9 / count, find * 1e9 / LOOKUPS );
+
+    start = seconds();
+    typed_int_t typed_int;
+    typed_int_init( &typed_int );
+    for( int i = 0; i < count; ++i ) {
+        typed_int_insert( &typed_int, spread_key( i ), i );
+    }
+    insert = seconds() - start;
+    start = seconds();
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        int64_t const* item = typed_int_find( &typed_int, spread_key( indices[ i ] ) );
+        checksum += item ? *item : 0;
+    }
+    find = seconds() - start;
+    typed_int_term( &typed_int );
+    printf( "  DEFINE_MAP, int keys          %-9.1f%-9.1f\n", insert * 1e9 / count, find * 1e9 / LOOKUPS );
+
+    start = seconds();
+    hashtable_t table;
+    hashtable_init( &table, sizeof( int64_t ), sizeof( int64_t ), 256, NULL );
+    for( int i = 0; i < count; ++i ) {
+        int64_t key = spread_key_i64( i );
+        int64_t item = i;
+        hashtable_insert( &table, map_hash_i64( key ), &key, &item );
+    }
+    insert = seconds() - start;
+    start = seconds();
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        int64_t key = spread_key_i64( indices[ i ] );
+        int64_t const* item = (int64_t const*) hashtable_find( &table, map_hash_i64( key ), &key );
+        checksum += item ? *item : 0;
+    }
+    find = seconds() - start;
+    hashtable_term( &table );
+    printf( "  hashtable_t, int64_t keys     %-9.1f%-9.1f\n", insert * 1e9 / count, find * 1e9 / LOOKUPS );
+
+    start = seconds();
+    typed_i64_t typed_i64;
+    typed_i64_init( &typed_i64 );
+    for( int i = 0; i < count; ++i ) {
+        typed_i64_insert( &typed_i64, spread_key_i64( i ), i );
+    }
+    insert = seconds() - start;
+    start = seconds();
+    for( int i = 0; i < LOOKUPS; ++i ) {
+        int64_t const* item = typed_i64_find( &typed_i64, spread_key_i64( indices[ i ] ) );
+        checksum += item ? *item : 0;
+    }
+    find = seconds() - start;
+    typed_i64_term( &typed_i64 );
+    printf( "  DEFINE_MAP, int64_t keys      %-9.1f%-9.1f\n", insert * 1e9 / count, find * 1e9 / LOOKUPS );
+    printf( "  (checksum %lld)\n\n", (long long) checksum );
+    free( indices );
+}
+
+
+// Times loading `count` keys into an intmap, and a fifth as many into a strmap, with a loop of inserts and with
+// X_insert_many, with and without a capacity hint, in ms
+static void bench_bulk( int count ) {
+    int* keys = (int*) malloc( sizeof( int ) * (size_t) count );
+    int64_t* items = (int64_t*) malloc( sizeof( int64_t ) * (size_t) count );
+    for( int i = 0; i < count; ++i ) {
+        keys[ i ] = spread_key( i );
+        items[ i ] = i;
+    }
+    printf( "bulk: %d keys, ms\n  %-25sloop     hinted   many     hinted many\n", count, "" );
+
+    double start = seconds();
+    intmap_t* intmap = intmap_create( sizeof( int64_t ) );
+    for( int i = 0; i < count; ++i ) intmap_insert( intmap, keys[ i ], &items[ i ] );
+    double loop = seconds() - start;
+    intmap_destroy( intmap );
+    start = seconds();
+    intmap = intmap_create_ex( sizeof( int64_t ), count, 0 );
+    for( int i = 0; i < count; ++i ) intmap_insert( intmap, keys[ i ], &items[ i ] );
+    double hinted = seconds() - start;
+    intmap_destroy( intmap );
+    start = seconds();
+    intmap = intmap_create( sizeof( int64_t ) );
+    intmap_insert_many( intmap, keys, items, count );
+    double many = seconds() - start;
+    intmap_destroy( intmap );
+    start = seconds();
+    intmap = intmap_create_ex( sizeof( int64_t ), count, 0 );
+    intmap_insert_many( intmap, keys, items, count );
+    double hinted_many = seconds() - start;
+    intmap_destroy( intmap );
+    printf( "  %-25s%-9.0f%-9.0f%-9.0f%-9.0f\n", "intmap, spread keys", loop * 1e3, hinted * 1e3, many * 1e3, 
+        hinted_many * 1e3 );
+
+    for( int i = 0; i < count; ++i ) keys[ i ] = i;
+    start = seconds();
+    intmap = intmap_create( sizeof( int64_t ) );
+    for( int i = 0; i < count; ++i ) intmap_insert( intmap, keys[ i ], &items[ i ] );
+    loop = seconds() - start;
+    intmap_destroy( intmap );
+    start = seconds();
+    intmap = intmap_create( sizeof( int64_t ) );
+    intmap_insert_many( intmap, keys, items, count );
+    many = seconds() - start;
+    intmap_destroy( intmap );
+    printf( "  %-25s%-18.0f%-9.0f\n", "intmap, keys 0..n", loop * 1e3, many * 1e3 );
+
+    int str_count = count / 5;
+    str_t* strs = (str_t*) malloc( sizeof( str_t ) * (size_t) str_count );
+    for( int i = 0; i < str_count; ++i ) {
+        strs[ i ] = format( str( "key%d" ), i );
+    }
+    start = seconds();
+    strmap_t* strmap = strmap_create( sizeof( int64_t ) );
+    for( int i = 0; i < str_count; ++i ) strmap_insert( strmap, strs[ i ], &items[ i ] );
+    loop = seconds() - start;
+    strmap_destroy( strmap );
+    start = seconds();
+    strmap = strmap_create_ex( sizeof( int64_t ), str_count );
+    strmap_insert_many( strmap, strs, items, str_count );
+    hinted_many = seconds() - start;
+    strmap_destroy( strmap );
+    char label[ 32 ];
+    snprintf( label, sizeof( label ), "strmap, %d keys", str_count );
+    printf( "  %-25s%-27.0f%-9.0f\n\n", label, loop * 1e3, hinted_many * 1e3 );
+    free( strs );
+    free( items );
+    free( keys );
+}
+
+
+#define SCALING_KEYS 100000
+#define SCALING_OPS 4000000
+
+typedef struct scaling_thread_t {
+    intmap_t* intmap;
+    strmap_t* strmap;
+    str_t const* strs;
+    int ops;
+    int write_percent;
+    uint32_t seed;
+    int64_t checksum;
+} scaling_thread_t;
+
+
+static int scaling_thread( void* user_data ) {
+    scaling_thread_t* thread = (scaling_thread_t*) user_data;
+    uint32_t state = thread->seed;
+    int64_t checksum = 0;
+    for( int i = 0; i < thread->ops; ++i ) {
+        uint32_t r = random_next( &state );
+        int index = (int)( ( r >> 8 ) % SCALING_KEYS );
+        bool write = (int)( r & 0x7f ) * 100 < thread->write_percent * 128;
+        int64_t item = (int64_t) i;
+        if( thread->intmap ) {
+            if( write ) {
+                intmap_insert( thread->intmap, spread_key( index ), &item );
+            } else if( intmap_find( thread->intmap, spread_key( index ), &item ) ) {
+                checksum += item;
+            }
+        } else {
+            if( write ) {
+                strmap_insert( thread->strmap, thread->strs[ index ], &item );
+            } else if( strmap_find( thread->strmap, thread->strs[ index ], &item ) ) {
+                checksum += item;
+            }
+        }
+    }
+    thread->checksum = checksum;
+    return 0;
+}
+
+
+// Runs 1 to 64 threads doing finds and inserts of existing keys on a shared map, and prints the throughput
+static void bench_scaling( void ) {
+    #ifndef C_UTILS_THREAD_SAFE
+        (void) scaling_thread; // unused when not thread safe
+        printf( "scaling: skipped, build with -DC_UTILS_THREAD_SAFE to run it\n\n" );
+    #else
+        str_t* strs = (str_t*) malloc( sizeof( str_t ) * SCALING_KEYS );
+        for( int i = 0; i < SCALING_KEYS; ++i ) {
+            strs[ i ] = format( str( "session%d" ), i );
+        }
+        int const write_percents[] = { 10, 50 };
+        printf( "scaling: %d keys, %d ops in total, Mops/s\n", SCALING_KEYS, SCALING_OPS );
+        printf( "  map     writes   threads: 1        2        4        8        16       32       64\n" );
+        for( int use_strmap = 0; use_strmap < 2; ++use_strmap ) {
+            for( int mix = 0; mix < 2; ++mix ) {
+                intmap_t* intmap = use_strmap ? NULL : intmap_create_ex( sizeof( int64_t ), SCALING_KEYS, 0 );
+                strmap_t* strmap = use_strmap ? strmap_create_ex( sizeof( int64_t ), SCALING_KEYS ) : NULL;
+                for( int i = 0; i < SCALING_KEYS; ++i ) {
+                    int64_t item = i;
+                    if( intmap ) intmap_insert( intmap, spread_key( i ), &item );
+                    if( strmap ) strmap_insert( strmap, strs[ i ], &item );
+                }
+                printf( "  %s  %2d%%     ", use_strmap ? "strmap" : "intmap", write_percents[ mix ] );
+                for( int thread_count = 1; thread_count <= 64; thread_count *= 2 ) {
+                    scaling_thread_t threads[ 64 ];
+                    thread_ptr_t handles[ 64 ];
+                    double start = seconds();
+                    for( int i = 0; i < thread_count; ++i ) {
+                        threads[ i ].intmap = intmap;
+                        threads[ i ].strmap = strmap;
+                        threads[ i ].strs = strs;
+                        threads[ i ].ops = SCALING_OPS / thread_count;
+                        threads[ i ].write_percent = write_percents[ mix ];
+                        threads[ i ].seed = 0x9e3779b9u * (uint32_t)( i + 1 );
+                        handles[ i ] = thread_create( scaling_thread, &threads[ i ], "scaling",
+                            THREAD_STACK_SIZE_DEFAULT );
+                    }
+                    for( int i = 0; i < thread_count; ++i ) {
+                        thread_join( handles[ i ] );
+                        thread_destroy( handles[ i ] );
+                    }
+                    double elapsed = seconds() - start;
+                    printf( "%-9.2f", (double)( SCALING_OPS / thread_count * thread_count ) / elapsed * 1e-6 );
+                    fflush( stdout );
+                }
+                printf( "\n" );
+                if( intmap ) intmap_destroy( intmap );
+                if( strmap ) strmap_destroy( strmap );
+            }
+        }
+        printf( "\n" );
+        free( strs );
+    #endif
+}
+
+
+int main( int argc, char** argv ) {
+    char const* only = argc > 1 ? argv[ 1 ] : NULL;
+    int max_count = argc > 2 ? atoi( argv[ 2 ] ) : 10000000;
+    if( !only || strcmp( only, "hashtable" ) == 0 ) {
+        for( int count = 1000000; count <= max_count && count <= 100000000; count *= 10 ) bench_hashtable( count );
+    }
+    if( !only || strcmp( only, "typed" ) == 0 ) {
+        for( int count = 10000; count <= max_count && count <= 100000000; count *= 10 ) bench_typed( count );
+    }
+    if( !only || strcmp( only, "bulk" ) == 0 ) bench_bulk( max_count );
+    if( !only || strcmp( only, "scaling" ) == 0 ) bench_scaling();
+    return 0;
+}
+
+#define C_UTILS_IMPLEMENTATION
+#include "c_utils/c_utils.h"
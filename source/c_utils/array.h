@@ -6,6 +6,10 @@
 typedef struct array_t array_t;
 
 array_t* array_create( int item_size );
+
+// create an array with room for `capacity_hint` items before it has to grow, rather than the 256 of array_create
+array_t* array_create_ex( int item_size, int capacity_hint );
+
 void array_destroy( array_t* array );
 void array_add( array_t* array, void* item );
 void array_remove( array_t* array, int index );
@@ -50,9 +54,13 @@ typedef struct array_t {
 #endif
 
 array_t* array_create( int item_size ) {
+    return array_create_ex( item_size, 256 );
+}
+
+array_t* array_create_ex( int item_size, int capacity_hint ) {
     array_t* array = (array_t*) malloc( sizeof( array_t ) );
     array->item_size = item_size;
-    array->capacity = 256;
+    array->capacity = capacity_hint > 0 ? capacity_hint : 1; // at least one, so doubling it makes room
     array->count = 0;
     array->items = malloc( array->capacity * item_size );
     #ifdef ARRAY_THREAD_SAFE
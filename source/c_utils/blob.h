@@ -0,0 +1,141 @@
+#ifndef blob_h
+#define blob_h
+
+// To make blob_t thread safe, do this before include: #define BLOB_THREAD_SAFE
+// A blob_t is an interned sequence of bytes, which can hold any binary data, such as packed structs or composite keys.
+// Each distinct sequence is stored only once, and two blobs are equal if and only if their ids are equal. Ids are
+// handed out densely, starting from 1, so they can be used as intmap keys or array indices. 0 is the empty blob.
+#include <stdint.h>
+
+typedef uint32_t blob_t;
+
+// create a blob_t from a number of bytes of data, which may contain any values, including zeros
+blob_t blob( void const* data, int size );
+
+// return the data of a blob_t, which is aligned to 8 bytes, and followed by a zero byte
+void const* blob_data( blob_t value );
+
+// give the size of a blob in bytes
+int blob_size( blob_t value );
+
+
+#endif /* blob_h */
+
+
+#ifdef BLOB_IMPLEMENTATION
+#undef BLOB_IMPLEMENTATION
+
+#include <stdlib.h>
+#include "strpool.h"
+
+typedef struct blobsys_t {
+    strpool_t pool;
+    #ifdef BLOB_THREAD_SAFE
+        thread_mutex_t mutex;
+    #endif
+} blobsys_t;
+
+thread_atomic_ptr_t g_blobsys;
+
+#ifdef BLOB_THREAD_SAFE
+    #define BLOB_MUTEX_LOCK(x) thread_mutex_lock( (x) )
+    #define BLOB_MUTEX_UNLOCK(x) thread_mutex_unlock( (x) )
+#else
+    #define BLOB_MUTEX_LOCK(x)
+    #define BLOB_MUTEX_UNLOCK(x)
+#endif
+
+#if defined( BLOB_THREAD_SAFE ) && !defined( STRPOOL_CONCURRENT )
+    #define BLOB_POOL_LOCK(x) thread_mutex_lock( (x) )
+    #define BLOB_POOL_UNLOCK(x) thread_mutex_unlock( (x) )
+#else
+    #define BLOB_POOL_LOCK(x)
+    #define BLOB_POOL_UNLOCK(x)
+#endif
+
+
+static void cleanup_blobsys( void ) {
+    blobsys_t* blobsys = (blobsys_t*) thread_atomic_ptr_load( &g_blobsys );
+    if( blobsys ) {
+        BLOB_MUTEX_LOCK( &blobsys->mutex );
+        strpool_term( &blobsys->pool );
+        BLOB_MUTEX_UNLOCK( &blobsys->mutex );
+        #ifdef BLOB_THREAD_SAFE
+            thread_mutex_term( &blobsys->mutex );
+        #endif
+        free( blobsys );
+    }
+}
+
+
+static blobsys_t* get_blobsys( void ) {
+    blobsys_t* pool = thread_atomic_ptr_load( &g_blobsys );
+    if( pool ) {
+        return pool;
+    } else {
+        // Blobs get a pool of their own, as they must be compared byte for byte, and their data must not be tail
+        // merged with other data, as that would break the alignment. With no counter bits, the handles are just the
+        // index of the blob plus one, which is what makes the ids dense.
+        blobsys_t* blobsys = (struct blobsys_t*) malloc( sizeof( blobsys_t ) );
+        strpool_config_t config = strpool_default_config;
+        config.ignore_case = 0;
+        config.counter_bits = 0;
+        config.tail_merge = 0;
+        strpool_init( &blobsys->pool, &config );
+        #ifdef BLOB_THREAD_SAFE
+            thread_mutex_init( &blobsys->mutex );
+        #endif
+
+        if( thread_atomic_ptr_compare_and_swap( &g_blobsys, NULL, blobsys ) == NULL ) {
+            atexit( cleanup_blobsys );
+            return blobsys;
+        } else {
+            strpool_term( &blobsys->pool );
+            #ifdef BLOB_THREAD_SAFE
+                thread_mutex_term( &blobsys->mutex );
+            #endif
+            free( blobsys );
+            return thread_atomic_ptr_load( &g_blobsys );
+        }
+    }
+}
+
+
+// create a blob_t from a number of bytes of data, which may contain any values, including zeros
+blob_t blob( void const* data, int size ) {
+    blobsys_t* blobsys = get_blobsys();
+    BLOB_POOL_LOCK( &blobsys->mutex );
+    STRPOOL_U64 handle = strpool_inject( &blobsys->pool, (char const*) data, data ? size : 0 );
+    BLOB_POOL_UNLOCK( &blobsys->mutex );
+    return (blob_t) handle;
+}
+
+
+// return the data of a blob_t, which is aligned to 8 bytes, and followed by a zero byte
+void const* blob_data( blob_t value ) {
+    // Pool storage is handed out in power-of-two slots of at least 32 bytes, from blocks aligned by malloc, and each
+    // slot starts with the 8 bytes of hash and length, so the data itself always ends up on an 8 byte boundary
+    static uint64_t const empty = 0;
+    blobsys_t* blobsys = get_blobsys();
+    BLOB_POOL_LOCK( &blobsys->mutex );
+    char const* result = strpool_cstr( &blobsys->pool, (STRPOOL_U64) value );
+    BLOB_POOL_UNLOCK( &blobsys->mutex );
+    return result ? (void const*) result : (void const*) &empty;
+}
+
+
+// give the size of a blob in bytes
+int blob_size( blob_t value ) {
+    blobsys_t* blobsys = get_blobsys();
+    BLOB_POOL_LOCK( &blobsys->mutex );
+    int result = strpool_length( &blobsys->pool, (STRPOOL_U64) value );
+    BLOB_POOL_UNLOCK( &blobsys->mutex );
+    return result;
+}
+
+#undef BLOB_MUTEX_LOCK
+#undef BLOB_MUTEX_UNLOCK
+#undef BLOB_POOL_LOCK
+#undef BLOB_POOL_UNLOCK
+
+#endif /* BLOB_IMPLEMENTATION */
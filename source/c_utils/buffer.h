@@ -27,6 +27,10 @@ int buffer_read_float( buffer_t* buffer, float* value, int count );
 int buffer_read_double( buffer_t* buffer, double* value, int count );
 int buffer_read_bool( buffer_t* buffer, bool* value, int count );
 
+// read `size` bytes as they are, without swapping endianness. Returns the number of bytes read, which is less than 
+// `size` if the end of the buffer was reached.
+int buffer_read_raw( buffer_t* buffer, void* data, int size );
+
 int buffer_write_char( buffer_t* buffer, char const* value, int count );
 int buffer_write_i8( buffer_t* buffer, int8_t const* value, int count );
 int buffer_write_i16( buffer_t* buffer, int16_t const* value, int count );
@@ -40,6 +44,9 @@ int buffer_write_float( buffer_t* buffer, float const* value, int count );
 int buffer_write_double( buffer_t* buffer, double const* value, int count );
 int buffer_write_bool( buffer_t* buffer, bool const* value, int count );
 
+// write `size` bytes as they are, without swapping endianness. Returns the number of bytes written.
+int buffer_write_raw( buffer_t* buffer, void const* data, int size );
+
 #endif /* buffer_h */
 
 
@@ -149,9 +156,10 @@ bool buffer_save( buffer_t* buffer, char const* filename ) {
     }
     BUFFER_MUTEX_LOCK( &buffer->mutex );
     int written = (int) fwrite( buffer->data, 1, buffer->size, fp ); 
-    fclose( fp );
-    return written == buffer->size;
+    bool result = written == buffer->size;
     BUFFER_MUTEX_UNLOCK( &buffer->mutex );
+    fclose( fp );
+    return result;
 }
 
 
@@ -251,6 +259,18 @@ int buffer_read_bool( buffer_t* buffer, bool* value, int count ) BUFFER_READ_IMP
 
 #undef BUFFER_READ_IMPL
 
+
+int buffer_read_raw( buffer_t* buffer, void* data, int size ) {
+    BUFFER_MUTEX_LOCK( &buffer->mutex );
+    int result = buffer->size - buffer->position < size ? buffer->size - buffer->position : size;
+    if( result > 0 ) {
+        memcpy( data, (void*)( ( (uintptr_t) buffer->data ) + buffer->position ), (size_t) result );
+        buffer->position += result;
+    }
+    BUFFER_MUTEX_UNLOCK( &buffer->mutex );
+    return result > 0 ? result : 0;
+}
+
 	
 #ifndef BUFFER_BIG_ENDIAN
     #define BUFFER_WRITE_IMPL \
@@ -269,8 +289,8 @@ int buffer_read_bool( buffer_t* buffer, bool* value, int count ) BUFFER_READ_IMP
                 buffer->position += sizeof( *value ); \
                 ++result; \
             } \
-            return result; \
             BUFFER_MUTEX_UNLOCK( &buffer->mutex ); \
+            return result; \
         }
 #else
     #define BUFFER_WRITE_IMPL \
@@ -310,8 +330,8 @@ int buffer_read_bool( buffer_t* buffer, bool* value, int count ) BUFFER_READ_IMP
                 buffer->position += sizeof( *value ); \
                 ++result; \
             } \
-            return result; \
             BUFFER_MUTEX_UNLOCK( &buffer->mutex ); \
+            return result; \
         }
 #endif
 
@@ -330,6 +350,23 @@ int buffer_write_bool( buffer_t* buffer, bool const* value, int count ) BUFFER_W
 
 #undef BUFFER_WRITE_IMPL
 
+
+int buffer_write_raw( buffer_t* buffer, void const* data, int size ) {
+    if( size <= 0 ) return 0;
+    BUFFER_MUTEX_LOCK( &buffer->mutex );
+    if( buffer->position + size > buffer->size ) {
+        buffer->size = buffer->position + size;
+        while( buffer->size > buffer->capacity ) {
+            buffer->capacity *= 2;
+        }
+        buffer->data = realloc( buffer->data, buffer->capacity );
+    }
+    memcpy( (void*)( ( (uintptr_t) buffer->data ) + buffer->position ), data, (size_t) size );
+    buffer->position += size;
+    BUFFER_MUTEX_UNLOCK( &buffer->mutex );
+    return size;
+}
+
 #undef BUFFER_MUTEX_LOCK
 #undef BUFFER_MUTEX_UNLOCK
 
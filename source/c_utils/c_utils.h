@@ -3,22 +3,35 @@
 
 #ifdef C_UTILS_THREAD_SAFE
     #define STR_THREAD_SAFE
+    #define BLOB_THREAD_SAFE
     #define ARRAY_THREAD_SAFE
     #define STRMAP_THREAD_SAFE
     #define INTMAP_THREAD_SAFE
+    #define STRCACHE_THREAD_SAFE
+    #define INTCACHE_THREAD_SAFE
     #define BUFFER_THREAD_SAFE
+    #define STRPOOL_CONCURRENT
 #endif
 
 #ifdef C_UTILS_BIG_ENDIAN
     #define BUFFER_BIG_ENDIAN
 #endif
 
+#ifdef C_UTILS_INCREMENTAL_RESIZE
+    #define HASHTABLE_INCREMENTAL_RESIZE
+#endif
+
 #include "thread.h"
 #include "str.h"
+#include "blob.h"
 #include "array.h"
+#include "buffer.h"
+#include "bloom.h"
 #include "strmap.h"
 #include "intmap.h"
-#include "buffer.h"
+#include "strcache.h"
+#include "intcache.h"
+#include "map.h"
 
 int compare_int( void const* a, void const* b );
 int compare_str( void const* a, void const* b );
@@ -47,6 +60,9 @@ int compare_str( void const* a, void const* b ) {
 #define STR_IMPLEMENTATION
 #include "str.h"
 
+#define BLOB_IMPLEMENTATION
+#include "blob.h"
+
 #define ARRAY_IMPLEMENTATION
 #include "array.h"
 
@@ -56,6 +72,12 @@ int compare_str( void const* a, void const* b ) {
 #define INTMAP_IMPLEMENTATION
 #include "intmap.h"
 
+#define STRCACHE_IMPLEMENTATION
+#include "strcache.h"
+
+#define INTCACHE_IMPLEMENTATION
+#include "intcache.h"
+
 #define BUFFER_IMPLEMENTATION
 #include "buffer.h"
 
@@ -16,6 +16,9 @@ before you include this file in *one* C/C++ file to create the implementation.
 #ifndef HASHTABLE_U32
     #define HASHTABLE_U32 unsigned int
 #endif
+#ifndef HASHTABLE_U64
+    #define HASHTABLE_U64 unsigned long long
+#endif
 
 typedef struct hashtable_t hashtable_t;
 
@@ -25,8 +28,12 @@ void hashtable_term( hashtable_t* table );
 void hashtable_insert( hashtable_t* table, HASHTABLE_U32 hash, void const* key, void const* item );
 void hashtable_remove( hashtable_t* table, HASHTABLE_U32 hash, void const* key );
 void hashtable_clear( hashtable_t* table );
+void hashtable_reserve( hashtable_t* table, int capacity );
 
 void* hashtable_find( hashtable_t const* table, HASHTABLE_U32 hash, void const* key );
+void* hashtable_find_or_insert( hashtable_t* table, HASHTABLE_U32 hash, void const* key, int* inserted );
+int hashtable_find_batch( hashtable_t const* table, int count, HASHTABLE_U32 const* hashes, void const* keys, 
+    void** items );
 
 int hashtable_count( hashtable_t const* table );
 void* hashtable_items( hashtable_t const* table );
@@ -34,6 +41,11 @@ void const* hashtable_keys( hashtable_t const* table );
 
 void hashtable_swap( hashtable_t* table, int index_a, int index_b );
 
+HASHTABLE_U64 hashtable_save_size( hashtable_t const* table );
+void hashtable_save( hashtable_t const* table, void* data );
+int hashtable_load( hashtable_t* table, int key_size, int item_size, void const* data, HASHTABLE_U64 size, 
+    void* memctx );
+
 
 #endif /* hashtable_h */
 
@@ -190,8 +202,12 @@ The key value must be unique per entry, and is hashed for efficient lookup using
 library does not support custom key types, so typically pointers or handles are used as key values.
 
 The library is written with efficiency in mind. Data and keys are stored in separate structures, for better cache 
-coherency, and hash collisions are resolved with open addressing/linear probing using the next available slot, which is
-also good for the cache. 
+coherency, and hash collisions are resolved with open addressing. The slots of the table are split into groups of 16, 
+and each slot has a control byte holding 7 bits of the hash of its key. A lookup compares the control bytes of a whole 
+group at once, using SSE2 instructions where available, so only slots which are likely to hold the key are looked at. 
+Keys of 8 bytes or less are also stored right in the slot, so comparing them does not need another memory access.
+The low bits of the hash are used to pick a group, and the high bits for the control byte, so the hash function used 
+should give well mixed bits across the whole value.
 
 
 ### Customization
@@ -277,6 +293,34 @@ to substitute them for your own. Here's an example:
 If no custom function is defined, hashtable.h will default to the C runtime library equivalent.
 
 
+#### SSE2
+
+When compiling for a target with SSE2 support, hashtable.h includes `<emmintrin.h>` and uses SSE2 instructions to look
+at the 16 control bytes of a group at once. Otherwise, it falls back to processing them eight at a time, using regular 
+64-bit arithmetic. To always use the fallback, and avoid including emmintrin.h, you can #define HASHTABLE_NO_SSE2:
+
+    #define HASHTABLE_IMPLEMENTATION
+    #define HASHTABLE_NO_SSE2
+    #include "hashtable.h"
+
+
+#### Incremental resize
+
+When the table grows, all keys are normally moved over to the bigger slot array, and all items copied to the bigger item
+arrays, in the call to `hashtable_insert` which made the table grow. For a big table, that single call can take a long
+time. To spread that work out instead, #define HASHTABLE_INCREMENTAL_RESIZE:
+
+    #define HASHTABLE_IMPLEMENTATION
+    #define HASHTABLE_INCREMENTAL_RESIZE
+    #include "hashtable.h"
+
+The old and new arrays are then kept around together for a while, and each call to `hashtable_insert` or 
+`hashtable_remove` moves a few keys and items over, until all are moved and the old arrays are released. Until then, 
+`hashtable_find` may have to look in both slot arrays, and calls to `hashtable_items` and `hashtable_keys` finish moving 
+the items, so they can be returned as single arrays. Memory use is higher, as the bigger item arrays are made when the 
+current ones are three quarters full, rather than when they are full.
+
+
 hashtable_init
 --------------
 
@@ -326,6 +370,16 @@ hashtable_clear
 Removes all the items stored in the hashtable, without deallocating any of the memory it has allocated.
 
 
+hashtable_reserve
+-----------------
+
+    void hashtable_reserve( hashtable_t* table, int capacity )
+
+Makes room for `capacity` items, so the table can be filled up to that many items without having to grow. Any resize 
+which is still going on is finished first, and the arrays are then grown once, straight to the size needed, rather than
+doubling several times. Use this before inserting many keys whose number is known up front. It never shrinks the table.
+
+
 hashtable_find
 --------------
 
@@ -335,6 +389,32 @@ Returns a pointer to the item associated with the specified key, or NULL it the
 designed for efficiency, and for minimizing cache missed.
 
 
+hashtable_find_or_insert
+------------------------
+
+    void* hashtable_find_or_insert( hashtable_t* table, HASHTABLE_U32 hash, void const* key, int* inserted )
+
+Returns a pointer to the item associated with the specified key, first inserting the key with an item where all bytes
+are zero if it was not already in the table. If `inserted` is not NULL, it is set to 1 if the key was inserted and to 0
+if it was found. Unlike calling `hashtable_find` followed by `hashtable_insert`, the probe done to find the key also 
+finds the slot to insert it into, which makes this the better choice for counting and aggregating. The returned
+pointer is only valid until the next call which modifies the table.
+
+
+hashtable_find_batch
+--------------------
+
+    int hashtable_find_batch( hashtable_t const* table, int count, HASHTABLE_U32 const* hashes, void const* keys, 
+        void** items )
+
+Looks up `count` keys at once, and stores a pointer to the item of each key in `items`, or NULL for keys which were not
+found. `hashes` holds the hash of each key, and `keys` holds the keys themselves, one after the other, each of the size
+given to `hashtable_init`. Returns the number of keys found. When looking up many keys which are not likely to be in 
+the cache, this is a lot faster than calling `hashtable_find` for each of them, as the lookups are done in small 
+batches, one step at a time, and the memory needed for the next step of every key in the batch is prefetched before 
+any of them is taken, so the cache misses of the different keys overlap rather than being waited for one at a time.
+
+
 hashtable_count
 ---------------
 
@@ -371,6 +451,38 @@ hashtable_swap
 Swaps the specified item/key pairs, and updates the hash lookup for both. Can be used to re-order the contents, as
 retrieved by calling `hashtable_items` and `hashtable_keys`, while keeping the hashing intact.
 
+
+hashtable_save_size
+-------------------
+
+    HASHTABLE_U64 hashtable_save_size( hashtable_t const* table )
+
+Returns the number of bytes `hashtable_save` will write for the table in its current state.
+
+
+hashtable_save
+--------------
+
+    void hashtable_save( hashtable_t const* table, void* data )
+
+Writes the complete state of the table, including its slots, to `data`, which must have room for the number of bytes
+returned by `hashtable_save_size`. Keys and items are written as plain bytes, in the byte order of the machine, so they
+should not hold pointers, and the saved table can only be loaded on a machine with the same byte order. Any resize 
+which is still going on is finished first.
+
+
+hashtable_load
+--------------
+
+    int hashtable_load( hashtable_t* table, int key_size, int item_size, void const* data, HASHTABLE_U64 size, 
+        void* memctx )
+
+Initializes `table` from data written by `hashtable_save`, as if by `hashtable_init` followed by inserting all the keys
+and items, but by copying the saved arrays as they are, without hashing or inserting anything. The data is checked to
+be a saved table with the given key and item sizes, and that it will not make the table access memory outside of its
+arrays. Returns 1 on success. If the data is not valid, returns 0 and leaves `table` untouched, so there is nothing to
+release with `hashtable_term`.
+
 */
 
 /*
@@ -382,11 +494,12 @@ retrieved by calling `hashtable_items` and `hashtable_keys`, while keeping the h
 #ifndef hashtable_t_h
 #define hashtable_t_h
 
-struct hashtable_internal_slot_t
+struct hashtable_internal_slots_t
     {
-    HASHTABLE_U32 key_hash;
-    int item_index;
-    int base_count;
+    unsigned char* slots;
+    unsigned char* control;
+    int capacity;
+    int deleted_count;
     };
 
 struct hashtable_t
@@ -395,16 +508,23 @@ struct hashtable_t
     int count;
     int key_size;
     int item_size;
+    int slot_size;
 
-    struct hashtable_internal_slot_t* slots;
-    int slot_capacity;
-    int prime_index;
+    struct hashtable_internal_slots_t slots;
+    struct hashtable_internal_slots_t old_slots;
+    int migrate_position;
+    int slot_generation;
 
     void* items_key;
     int* items_slot;
     void* items_data;
     int item_capacity;
 
+    void* old_items_key;
+    int* old_items_slot;
+    void* old_items_data;
+    int items_moved;
+
     void* swap_temp;
     };
 
@@ -479,6 +599,62 @@ struct hashtable_t
 #endif
 
 
+#ifndef HASHTABLE_MEMSET
+    #undef _CRT_NONSTDC_NO_DEPRECATE 
+    #define _CRT_NONSTDC_NO_DEPRECATE 
+    #undef _CRT_SECURE_NO_WARNINGS
+    #define _CRT_SECURE_NO_WARNINGS
+    #include <string.h>
+    #define HASHTABLE_MEMSET( ptr, val, cnt ) ( memset( ptr, val, cnt ) )
+#endif 
+
+#if !defined( HASHTABLE_NO_SSE2 ) && ( defined( __SSE2__ ) || defined( _M_X64 ) || defined( _M_AMD64 ) || \
+    ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) )
+    #include <emmintrin.h>
+    #define HASHTABLE_INTERNAL_SSE2
+#endif
+
+#if defined( _MSC_VER ) && !defined( __clang__ )
+    #include <intrin.h>
+#endif
+
+#if defined( HASHTABLE_INTERNAL_SSE2 )
+    #define HASHTABLE_INTERNAL_PREFETCH( ptr ) _mm_prefetch( (char const*)( ptr ), _MM_HINT_T0 )
+#elif defined( __GNUC__ ) || defined( __clang__ )
+    #define HASHTABLE_INTERNAL_PREFETCH( ptr ) __builtin_prefetch( ptr )
+#else
+    #define HASHTABLE_INTERNAL_PREFETCH( ptr )
+#endif
+
+
+#define HASHTABLE_INTERNAL_GROUP_SIZE 16
+#define HASHTABLE_INTERNAL_EMPTY 0x80
+#define HASHTABLE_INTERNAL_DELETED 0xfe
+#define HASHTABLE_INTERNAL_INLINE_KEY_SIZE 8
+#define HASHTABLE_INTERNAL_GENERATION_BIT 0x40000000
+#define HASHTABLE_INTERNAL_NOT_MOVING 0x7fffffff
+#define HASHTABLE_INTERNAL_BATCH_SIZE 16
+
+// How much of a resize is done on each insert or remove: the number of slots of the old slot array to move over, and 
+// the number of items to copy to the new item arrays. Without incremental resizing, all of it is done at once. A new 
+// slot array has room for at least 7/16 of its size in inserts before it needs to grow, so moving 4 slots per insert
+// is always done in time, even when rehashing at the same size.
+#ifdef HASHTABLE_INCREMENTAL_RESIZE
+    #define HASHTABLE_INTERNAL_MIGRATE_SLOTS 4
+    #define HASHTABLE_INTERNAL_MOVE_ITEMS 8
+#else
+    #define HASHTABLE_INTERNAL_MIGRATE_SLOTS 0x7fffffff
+    #define HASHTABLE_INTERNAL_MOVE_ITEMS 0x7fffffff
+#endif
+
+
+struct hashtable_internal_slot_t
+    {
+    HASHTABLE_U32 key_hash;
+    int item_index;
+    };
+
+
 static HASHTABLE_U32 hashtable_internal_pow2ceil( HASHTABLE_U32 v )
     {
     --v;
@@ -493,266 +669,677 @@ static HASHTABLE_U32 hashtable_internal_pow2ceil( HASHTABLE_U32 v )
     }
 
 
-static int hashtable_internal_primes[] = { 31, 67, 127, 257, 509, 1021, 2053, 4099, 8191, 16381, 32771, 65537, 131071, 
-    262147, 524287, 1048573, 2097143, 4194301, 8388617, 16777213, 33554467, 67108859, 134217757, 268435459, 536870909, 
-    1073741827, 2147483647 };
+static int hashtable_internal_lowest_bit( HASHTABLE_U32 mask )
+    {
+    #if defined( __GNUC__ ) || defined( __clang__ )
+        return __builtin_ctz( mask );
+    #elif defined( _MSC_VER )
+        unsigned long index;
+        _BitScanForward( &index, mask );
+        return (int) index;
+    #else
+        int index = 0;
+        while( !( mask & 1U ) ) { mask >>= 1; ++index; }
+        return index;
+    #endif
+    }
+
+
+#ifndef HASHTABLE_INTERNAL_SSE2
+
+// Without SSE2, the control bytes of a group are processed as two 64-bit words instead, eight bytes at a time
+
+static unsigned long long hashtable_internal_load_word( unsigned char const* bytes )
+    {
+    return (unsigned long long) bytes[ 0 ] | ( (unsigned long long) bytes[ 1 ] << 8 ) | 
+        ( (unsigned long long) bytes[ 2 ] << 16 ) | ( (unsigned long long) bytes[ 3 ] << 24 ) | 
+        ( (unsigned long long) bytes[ 4 ] << 32 ) | ( (unsigned long long) bytes[ 5 ] << 40 ) | 
+        ( (unsigned long long) bytes[ 6 ] << 48 ) | ( (unsigned long long) bytes[ 7 ] << 56 );
+    }
+
+
+// Takes a word with only the top bit of each byte possibly set, and packs those eight bits into the low byte
+static HASHTABLE_U32 hashtable_internal_pack_top_bits( unsigned long long word )
+    {
+    return (HASHTABLE_U32)( ( ( word >> 7 ) * 0x0102040810204080ULL ) >> 56 );
+    }
+
+
+static HASHTABLE_U32 hashtable_internal_match_word( unsigned long long word, unsigned char value )
+    {
+    unsigned long long const low_bits = 0x7f7f7f7f7f7f7f7fULL;
+    unsigned long long const x = word ^ ( 0x0101010101010101ULL * value );
+    return hashtable_internal_pack_top_bits( ~( ( ( x & low_bits ) + low_bits ) | x | low_bits ) );
+    }
+
+#endif /* HASHTABLE_INTERNAL_SSE2 */
+
+
+// Returns a mask with one bit set for each slot in the group whose control byte is equal to `value`
+static HASHTABLE_U32 hashtable_internal_match( unsigned char const* group, unsigned char value )
+    {
+    #ifdef HASHTABLE_INTERNAL_SSE2
+        __m128i const control = _mm_loadu_si128( (__m128i const*) group );
+        return (HASHTABLE_U32) _mm_movemask_epi8( _mm_cmpeq_epi8( control, _mm_set1_epi8( (char) value ) ) );
+    #else
+        return hashtable_internal_match_word( hashtable_internal_load_word( group ), value ) | 
+            ( hashtable_internal_match_word( hashtable_internal_load_word( group + 8 ), value ) << 8 );
+    #endif
+    }
+
+
+// Returns a mask with one bit set for each slot in the group which is empty or deleted. Those are the only control 
+// bytes with the top bit set, so it is just a matter of collecting the top bits.
+static HASHTABLE_U32 hashtable_internal_match_free( unsigned char const* group )
+    {
+    #ifdef HASHTABLE_INTERNAL_SSE2
+        return (HASHTABLE_U32) _mm_movemask_epi8( _mm_loadu_si128( (__m128i const*) group ) );
+    #else
+        unsigned long long const top_bits = 0x8080808080808080ULL;
+        return hashtable_internal_pack_top_bits( hashtable_internal_load_word( group ) & top_bits ) | 
+            ( hashtable_internal_pack_top_bits( hashtable_internal_load_word( group + 8 ) & top_bits ) << 8 );
+    #endif
+    }
+
+
+static struct hashtable_internal_slot_t* hashtable_internal_slot( hashtable_t const* table,
+    struct hashtable_internal_slots_t const* slots, int slot )
+    {
+    return (struct hashtable_internal_slot_t*)( slots->slots + (HASHTABLE_SIZE_T) slot * (HASHTABLE_SIZE_T) table->slot_size );
+    }
+
+
+// While the item arrays are being resized, the items which have already been copied to the new arrays are found there,
+// and the rest are still in the old ones. When no resize is going on, `items_moved` is HASHTABLE_INTERNAL_NOT_MOVING,
+// so all items are found in the current arrays.
+static void* hashtable_internal_item_key( hashtable_t const* table, int index )
+    {
+    void* const keys = index < table->items_moved ? table->items_key : table->old_items_key;
+    return (void*)( ( (uintptr_t) keys ) + (HASHTABLE_SIZE_T) index * (HASHTABLE_SIZE_T) table->key_size );
+    }
+
+
+static void* hashtable_internal_item_data( hashtable_t const* table, int index )
+    {
+    void* const items = index < table->items_moved ? table->items_data : table->old_items_data;
+    return (void*)( ( (uintptr_t) items ) + (HASHTABLE_SIZE_T) index * (HASHTABLE_SIZE_T) table->item_size );
+    }
+
+
+static int* hashtable_internal_item_slot_index( hashtable_t const* table, int index )
+    {
+    return ( index < table->items_moved ? table->items_slot : table->old_items_slot ) + index;
+    }
+
+
+// The slot index stored for each item has the generation bit of the slot array it is in. When a new slot array is
+// made, the current generation is flipped, so all the items are in the old array, without having to touch them
+static struct hashtable_internal_slot_t* hashtable_internal_item_slot( hashtable_t const* table, int index )
+    {
+    int const slot = *hashtable_internal_item_slot_index( table, index );
+    struct hashtable_internal_slots_t const* slots = ( slot & HASHTABLE_INTERNAL_GENERATION_BIT ) ==
+        table->slot_generation ? &table->slots : &table->old_slots;
+    return hashtable_internal_slot( table, slots, slot & ~HASHTABLE_INTERNAL_GENERATION_BIT );
+    }
+
+
+static void const* hashtable_internal_slot_key( hashtable_t const* table, struct hashtable_internal_slot_t const* slot )
+    {
+    if( table->slot_size > (int) sizeof( *slot ) ) return (void const*)( slot + 1 );
+    return hashtable_internal_item_key( table, slot->item_index );
+    }
+
+
+// The control bytes are kept in an array of their own, after the slots, so the control bytes of a group are next to
+// each other in memory, and a lookup of a key which is not in the table rarely needs to look at the slots at all
+static void hashtable_internal_alloc_slots( hashtable_t* table, struct hashtable_internal_slots_t* slots, int capacity )
+    {
+    HASHTABLE_SIZE_T const slots_size = (HASHTABLE_SIZE_T) capacity * (HASHTABLE_SIZE_T) table->slot_size;
+    slots->slots = (unsigned char*) HASHTABLE_MALLOC( table->memctx, slots_size + (HASHTABLE_SIZE_T) capacity );
+    HASHTABLE_ASSERT( slots->slots );
+    slots->control = slots->slots + slots_size;
+    HASHTABLE_MEMSET( slots->control, HASHTABLE_INTERNAL_EMPTY, (HASHTABLE_SIZE_T) capacity );
+    slots->capacity = capacity;
+    slots->deleted_count = 0;
+    }
+
+
+// The key, slot and item arrays share a single allocation, followed by space for swapping a key or an item
+static void hashtable_internal_alloc_items( hashtable_t* table, int capacity )
+    {
+    table->item_capacity = capacity;
+    table->items_key = HASHTABLE_MALLOC( table->memctx,
+        table->item_capacity * ( table->key_size + sizeof( *table->items_slot ) + table->item_size ) +
+        ( table->key_size > table->item_size ? table->key_size : table->item_size ) );
+    HASHTABLE_ASSERT( table->items_key );
+    table->items_slot = (int*)( ( (uintptr_t) table->items_key ) + table->key_size * table->item_capacity );
+    table->items_data = (void*)( table->items_slot + table->item_capacity );
+    table->swap_temp = (void*)( ( (uintptr_t) table->items_data ) + table->item_size * table->item_capacity );
+    }
+
+
+// Keys which are small enough are stored in the slot as well, right after the hash and item index
+static int hashtable_internal_slot_size( int key_size )
+    {
+    int slot_size = (int) sizeof( struct hashtable_internal_slot_t );
+    if( key_size <= HASHTABLE_INTERNAL_INLINE_KEY_SIZE ) slot_size += ( key_size + 3 ) & ~3;
+    return slot_size;
+    }
 
 
 void hashtable_init( hashtable_t* table, int key_size, int item_size, int initial_capacity, void* memctx )
     {
     initial_capacity = (int)hashtable_internal_pow2ceil( initial_capacity >=0 ? (HASHTABLE_U32) initial_capacity : 32U );
-    int prime_index = 0;
-    while( hashtable_internal_primes[ prime_index ] < initial_capacity + initial_capacity / 2 ) ++prime_index;
-    
+
     table->memctx = memctx;
     table->count = 0;
     table->key_size = key_size;
     table->item_size = item_size;
-    table->slot_capacity = hashtable_internal_primes[ prime_index ];
-    table->prime_index = prime_index;
+    table->slot_size = hashtable_internal_slot_size( key_size );
 
     if( key_size > 0 )
         {
-        int slots_size = (int)( table->slot_capacity * sizeof( *table->slots ) );
-        table->slots = (struct hashtable_internal_slot_t*) HASHTABLE_MALLOC( table->memctx, (HASHTABLE_SIZE_T) slots_size );
-        HASHTABLE_ASSERT( table->slots );
-
-        for( int i = 0; i < table->slot_capacity; ++i  )
-            {
-            table->slots[ i ].base_count = 0;
-            table->slots[ i ].item_index = -1;
-            }
+        int capacity = (int) hashtable_internal_pow2ceil( (HASHTABLE_U32)( initial_capacity + initial_capacity / 2 ) );
+        hashtable_internal_alloc_slots( table, &table->slots, capacity < HASHTABLE_INTERNAL_GROUP_SIZE ?
+            HASHTABLE_INTERNAL_GROUP_SIZE : capacity );
         }
     else
         {
-        table->slots = 0;
+        table->slots.slots = 0;
+        table->slots.control = 0;
+        table->slots.capacity = 0;
+        table->slots.deleted_count = 0;
         }
-
-    table->item_capacity = initial_capacity;
-    table->items_key = HASHTABLE_MALLOC( table->memctx, 
-        table->item_capacity * ( table->key_size + sizeof( *table->items_slot ) + table->item_size ) + 
-        ( table->key_size > table->item_size ? table->key_size : table->item_size ) );
-    HASHTABLE_ASSERT( table->items_key );
-    table->items_slot = (int*)( ( (uintptr_t) table->items_key ) + table->key_size * table->item_capacity );
-    table->items_data = (void*)( table->items_slot + table->item_capacity );
-    table->swap_temp = (void*)( ( (uintptr_t) table->items_data ) + table->item_size * table->item_capacity ); 
+    table->old_slots.slots = 0;
+    table->old_slots.control = 0;
+    table->old_slots.capacity = 0;
+    table->old_slots.deleted_count = 0;
+    table->migrate_position = 0;
+    table->slot_generation = 0;
+
+    hashtable_internal_alloc_items( table, initial_capacity );
+    table->old_items_key = 0;
+    table->old_items_slot = 0;
+    table->old_items_data = 0;
+    table->items_moved = HASHTABLE_INTERNAL_NOT_MOVING;
     }
 
 
 void hashtable_term( hashtable_t* table )
     {
+    if( table->old_items_key ) HASHTABLE_FREE( table->memctx, table->old_items_key );
     HASHTABLE_FREE( table->memctx, table->items_key );
-    HASHTABLE_FREE( table->memctx, table->slots );
+    if( table->old_slots.slots ) HASHTABLE_FREE( table->memctx, table->old_slots.slots );
+    HASHTABLE_FREE( table->memctx, table->slots.slots );
     }
 
 
-
-static int hashtable_internal_find_slot( hashtable_t const* table, HASHTABLE_U32 hash, void const* key )
+// The slots are split into groups of 16, each with 16 control bytes. A control byte holds the top 7 bits of the hash
+// of the key in the slot, or marks the slot as empty or deleted. The low bits of the hash select the first group to
+// look at, and all 16 control bytes are compared against the tag at once. Only slots with a matching tag need their
+// full hash and key compared, and as soon as a group with an empty slot has been looked at, we know the key is not
+// in the table. Groups are visited with triangular steps, which visits every group when there is a power-of-two
+// number of them. If `free_slot` is not NULL, it is set to the first empty or deleted slot passed on the way, which is
+// where hashtable_internal_find_free_slot would put the key, or left as it is if there was none.
+static int hashtable_internal_find_slot( hashtable_t const* table, struct hashtable_internal_slots_t const* slots,
+    HASHTABLE_U32 hash, void const* key, int* free_slot )
     {
-    HASHTABLE_U32 slot_capacity = (HASHTABLE_U32) table->slot_capacity;
-    int const base_slot = (int)( hash % slot_capacity );
-
-    int base_count = table->slots[ base_slot ].base_count;
-    int slot = base_slot;
-    while( base_count > 0 )
+    HASHTABLE_U32 const group_mask = (HASHTABLE_U32)( slots->capacity / HASHTABLE_INTERNAL_GROUP_SIZE ) - 1U;
+    unsigned char const tag = (unsigned char)( hash >> 25 );
+    HASHTABLE_U32 group = hash & group_mask;
+
+    // Most keys which are in the table are found in the first group, so its slots are fetched at the same time as its
+    // control bytes, rather than waiting for the tags to be compared first
+    uintptr_t const first_slot = (uintptr_t) hashtable_internal_slot( table, slots,
+        (int)( group * HASHTABLE_INTERNAL_GROUP_SIZE ) );
+    uintptr_t const last_slot = first_slot + HASHTABLE_INTERNAL_GROUP_SIZE * table->slot_size - 1;
+    for( uintptr_t line = first_slot & ~(uintptr_t) 63; line <= last_slot; line += 64 )
+        HASHTABLE_INTERNAL_PREFETCH( (void const*) line );
+
+    for( HASHTABLE_U32 step = 1; ; ++step )
         {
-        if( table->slots[ slot ].item_index >= 0 )
+        unsigned char const* control = slots->control + group * HASHTABLE_INTERNAL_GROUP_SIZE;
+        HASHTABLE_U32 match = hashtable_internal_match( control, tag );
+        while( match )
             {
-            HASHTABLE_U32 slot_hash = table->slots[ slot ].key_hash;
-            int slot_base = (int)( slot_hash % slot_capacity );
-            if( slot_base == base_slot ) 
-                {
-                HASHTABLE_ASSERT( base_count > 0 );
-                if( slot_hash == hash )
-                    {
-                    void const* slot_key = (void const*)( ( (uintptr_t) table->items_key ) + table->key_size * table->slots[ slot ].item_index );
-                    if( HASHTABLE_KEYCMP( slot_key, key, table->key_size ) )
-                        return slot;
-                    }
-                --base_count;
-                }
+            int const slot = (int)( group * HASHTABLE_INTERNAL_GROUP_SIZE ) + hashtable_internal_lowest_bit( match );
+            struct hashtable_internal_slot_t const* slot_data = hashtable_internal_slot( table, slots, slot );
+            if( slot_data->key_hash == hash &&
+                HASHTABLE_KEYCMP( hashtable_internal_slot_key( table, slot_data ), key, table->key_size ) )
+                return slot;
+            match &= match - 1U;
             }
-        slot = (int)( ( slot + 1 ) % slot_capacity );
-        }   
+        if( free_slot && *free_slot < 0 )
+            {
+            HASHTABLE_U32 const free_mask = hashtable_internal_match_free( control );
+            if( free_mask )
+                *free_slot = (int)( group * HASHTABLE_INTERNAL_GROUP_SIZE ) + 
+                    hashtable_internal_lowest_bit( free_mask );
+            }
+        if( hashtable_internal_match( control, HASHTABLE_INTERNAL_EMPTY ) )
+            return -1;
+        group = ( group + step ) & group_mask;
+        }
+    }
 
-    return -1;
+
+static int hashtable_internal_find_free_slot( struct hashtable_internal_slots_t const* slots, HASHTABLE_U32 hash )
+    {
+    HASHTABLE_U32 const group_mask = (HASHTABLE_U32)( slots->capacity / HASHTABLE_INTERNAL_GROUP_SIZE ) - 1U;
+    HASHTABLE_U32 group = hash & group_mask;
+    for( HASHTABLE_U32 step = 1; ; ++step )
+        {
+        HASHTABLE_U32 const free_mask = hashtable_internal_match_free( slots->control + group * HASHTABLE_INTERNAL_GROUP_SIZE );
+        if( free_mask )
+            return (int)( group * HASHTABLE_INTERNAL_GROUP_SIZE ) + hashtable_internal_lowest_bit( free_mask );
+        group = ( group + step ) & group_mask;
+        }
     }
 
 
-static void hashtable_internal_expand_slots( hashtable_t* table )
+// While a resize is going on, a key may be in either of the slot arrays. Keys are only ever added to the new one, so it
+// is looked at first.
+static int hashtable_internal_find( hashtable_t const* table, HASHTABLE_U32 hash, void const* key,
+    struct hashtable_internal_slots_t const** slots )
     {
-    if( !table->slots ) return;
+    int slot = hashtable_internal_find_slot( table, &table->slots, hash, key, 0 );
+    if( slot >= 0 || !table->old_slots.slots )
+        {
+        if( slots ) *slots = &table->slots;
+        return slot;
+        }
+    if( slots ) *slots = &table->old_slots;
+    return hashtable_internal_find_slot( table, &table->old_slots, hash, key, 0 );
+    }
 
-    int const old_capacity = table->slot_capacity;
-    struct hashtable_internal_slot_t* old_slots = table->slots;
 
-    table->slot_capacity = hashtable_internal_primes[ ++table->prime_index ];
-    HASHTABLE_U32 slot_capacity = (HASHTABLE_U32) table->slot_capacity;
+// Moves the used slots among the next `count` slots of the old slot array over to the new one, and releases the old
+// array once all of it has been moved. Moved slots are marked as deleted in the old array, rather than empty, so the
+// keys which are still there can be found.
+static void hashtable_internal_migrate_slots( hashtable_t* table, int count )
+    {
+    if( !table->old_slots.slots ) return;
+
+    struct hashtable_internal_slots_t* const old_slots = &table->old_slots;
+    int const end = old_slots->capacity - table->migrate_position > count ?
+        table->migrate_position + count : old_slots->capacity;
+
+    // Each key goes to a random place in the new array, and has its item's slot index updated, so when only a few are
+    // moved at a time, the memory they touch is all fetched first, to wait for those cache misses at the same time 
+    // rather than one after the other
+    #ifdef HASHTABLE_INCREMENTAL_RESIZE
+        HASHTABLE_U32 const group_mask = (HASHTABLE_U32)( table->slots.capacity / HASHTABLE_INTERNAL_GROUP_SIZE ) - 1U;
+        for( int i = table->migrate_position; i < end; ++i )
+            {
+            if( old_slots->control[ i ] & 0x80 ) continue;
+            struct hashtable_internal_slot_t const* old_slot = hashtable_internal_slot( table, old_slots, i );
+            HASHTABLE_U32 const group = old_slot->key_hash & group_mask;
+            HASHTABLE_INTERNAL_PREFETCH( table->slots.control + group * HASHTABLE_INTERNAL_GROUP_SIZE );
+            HASHTABLE_INTERNAL_PREFETCH( hashtable_internal_item_slot_index( table, old_slot->item_index ) );
+            }
+    #endif
 
-    int const size = (int)( table->slot_capacity * sizeof( *table->slots ) );
-    table->slots = (struct hashtable_internal_slot_t*) HASHTABLE_MALLOC( table->memctx, (HASHTABLE_SIZE_T) size );
-    HASHTABLE_ASSERT( table->slots );
-    for( int i = 0; i < table->slot_capacity; ++i  )
+    for( int i = table->migrate_position; i < end; ++i )
         {
-        table->slots[ i ].base_count = 0;
-        table->slots[ i ].item_index = -1;
+        unsigned char const control = old_slots->control[ i ];
+        if( control & 0x80 ) continue;
+
+        struct hashtable_internal_slot_t const* old_slot = hashtable_internal_slot( table, old_slots, i );
+        int const slot = hashtable_internal_find_free_slot( &table->slots, old_slot->key_hash );
+        if( table->slots.control[ slot ] == HASHTABLE_INTERNAL_DELETED ) --table->slots.deleted_count;
+        HASHTABLE_MEMCPY( hashtable_internal_slot( table, &table->slots, slot ), old_slot,
+            (HASHTABLE_SIZE_T) table->slot_size );
+        table->slots.control[ slot ] = control;
+        *hashtable_internal_item_slot_index( table, old_slot->item_index ) = slot | table->slot_generation;
+        old_slots->control[ i ] = HASHTABLE_INTERNAL_DELETED;
         }
+    table->migrate_position = end;
 
-    for( int i = 0; i < old_capacity; ++i )
+    if( table->migrate_position >= old_slots->capacity )
         {
-        if( old_slots[ i ].item_index >= 0 )
-            {
-            HASHTABLE_U32 const hash = old_slots[ i ].key_hash;
-            int const base_slot = (int)( hash % slot_capacity );
-            int slot = base_slot;
-            while( table->slots[ slot ].item_index >= 0 )
-                slot = (int)( ( slot + 1 ) % slot_capacity );
-            table->slots[ slot ].key_hash = hash;
-            int item_index = old_slots[ i ].item_index;
-            table->slots[ slot ].item_index = item_index;
-            table->items_slot[ item_index ] = slot; 
-            ++table->slots[ base_slot ].base_count;
-            }               
+        HASHTABLE_FREE( table->memctx, old_slots->slots );
+        old_slots->slots = 0;
+        old_slots->control = 0;
+        old_slots->capacity = 0;
         }
-
-    HASHTABLE_FREE( table->memctx, old_slots );
     }
 
 
-static void hashtable_internal_expand_items( hashtable_t* table )
+static void hashtable_internal_rehash_slots( hashtable_t* table, int capacity )
     {
-    table->item_capacity *= 2;
-    
-    void* const new_items_key = HASHTABLE_MALLOC( table->memctx, 
-        table->item_capacity * ( table->key_size + sizeof( *table->items_slot ) + table->item_size ) + 
-        ( table->key_size > table->item_size ? table->key_size : table->item_size ) );
-    HASHTABLE_ASSERT( new_items_key );
+    hashtable_internal_migrate_slots( table, HASHTABLE_INTERNAL_NOT_MOVING );
+    table->old_slots = table->slots;
+    hashtable_internal_alloc_slots( table, &table->slots, capacity );
+    table->slot_generation ^= HASHTABLE_INTERNAL_GENERATION_BIT;
+    table->migrate_position = 0;
+    }
 
-    int* const new_items_slot = (int*)( ( (uintptr_t) new_items_key ) + table->key_size * table->item_capacity );
-    void* const new_items_data = (void*)( new_items_slot + table->item_capacity );
-    void* const new_swap_temp = (void*)( ( (uintptr_t) new_items_data ) + table->item_size * table->item_capacity ); 
 
-    HASHTABLE_MEMCPY( new_items_key, table->items_key, table->count * table->key_size );
-    HASHTABLE_MEMCPY( new_items_slot, table->items_slot, table->count * sizeof( *table->items_slot ) );
-    HASHTABLE_MEMCPY( new_items_data, table->items_data, (HASHTABLE_SIZE_T) table->count * table->item_size );
-    
-    HASHTABLE_FREE( table->memctx, table->items_key );
+// Copies the next `count` items over to the new item arrays, and releases the old arrays once all items are copied
+static void hashtable_internal_move_items( hashtable_t* table, int count )
+    {
+    if( !table->old_items_key ) return;
+
+    int const start = table->items_moved;
+    int const end = table->count - start > count ? start + count : table->count;
+    if( end > start )
+        {
+        HASHTABLE_MEMCPY( (void*)( ( (uintptr_t) table->items_key ) + start * table->key_size ),
+            (void*)( ( (uintptr_t) table->old_items_key ) + start * table->key_size ),
+            (HASHTABLE_SIZE_T)( end - start ) * table->key_size );
+        HASHTABLE_MEMCPY( table->items_slot + start, table->old_items_slot + start,
+            (HASHTABLE_SIZE_T)( end - start ) * sizeof( *table->items_slot ) );
+        HASHTABLE_MEMCPY( (void*)( ( (uintptr_t) table->items_data ) + (HASHTABLE_SIZE_T) start * table->item_size ),
+            (void*)( ( (uintptr_t) table->old_items_data ) + (HASHTABLE_SIZE_T) start * table->item_size ),
+            (HASHTABLE_SIZE_T)( end - start ) * table->item_size );
+        }
+    table->items_moved = end;
 
-    table->items_key = new_items_key;
-    table->items_slot = new_items_slot;
-    table->items_data = new_items_data;
-    table->swap_temp = new_swap_temp;
+    if( table->items_moved >= table->count )
+        {
+        HASHTABLE_FREE( table->memctx, table->old_items_key );
+        table->old_items_key = 0;
+        table->old_items_slot = 0;
+        table->old_items_data = 0;
+        table->items_moved = HASHTABLE_INTERNAL_NOT_MOVING;
+        }
     }
 
 
-void hashtable_insert( hashtable_t* table, HASHTABLE_U32 hash, void const* key, void const* item )
+// Makes room for one more item. With incremental resizing, the bigger item arrays are made when the current ones are
+// three quarters full, and items are copied over a few at a time as more items are inserted or removed. New items are
+// added to the old arrays until they have all been copied, and as items are copied faster than they are added, the old
+// arrays never run out of room.
+static void hashtable_internal_expand_items( hashtable_t* table )
     {
-    if( !table->slots ) 
+    if( table->old_items_key )
         {
-        if( table->count >= table->item_capacity )
-            hashtable_internal_expand_items( table );
+        if( table->count >= table->item_capacity / 2 )
+            hashtable_internal_move_items( table, HASHTABLE_INTERNAL_NOT_MOVING );
+        return;
+        }
+
+    #ifdef HASHTABLE_INCREMENTAL_RESIZE
+        if( table->count < table->item_capacity - table->item_capacity / 4 ) return;
+    #else
+        if( table->count < table->item_capacity ) return;
+    #endif
+
+    table->old_items_key = table->items_key;
+    table->old_items_slot = table->items_slot;
+    table->old_items_data = table->items_data;
+    table->items_moved = 0;
+    hashtable_internal_alloc_items( table, table->item_capacity * 2 );
+    hashtable_internal_move_items( table, HASHTABLE_INTERNAL_MOVE_ITEMS );
+    }
+
+
+// Adds a key which is not in the table, with a copy of `item`, or an item of all zeros if `item` is NULL. If 
+// `free_slot` is not -1, it is the free slot a lookup of the key found, and the key is put there unless the slots are 
+// rehashed.
+static void hashtable_internal_insert( hashtable_t* table, HASHTABLE_U32 hash, void const* key, void const* item, 
+    int free_slot )
+    {
+    hashtable_internal_expand_items( table );
+
+    void* const item_data = hashtable_internal_item_data( table, table->count );
+    if( item )
+        HASHTABLE_ITEMCOPY( item_data, item, (HASHTABLE_SIZE_T) table->item_size );
+    else
+        HASHTABLE_MEMSET( item_data, 0, (HASHTABLE_SIZE_T) table->item_size );
 
-        void* dest_item = (void*)( ( (uintptr_t) table->items_data ) + table->count * table->item_size );
-        HASHTABLE_ITEMCOPY( dest_item, item, (HASHTABLE_SIZE_T) table->item_size );
+    if( !table->slots.slots )
+        {
         ++table->count;
+        hashtable_internal_move_items( table, HASHTABLE_INTERNAL_MOVE_ITEMS );
         return;
         }
 
-    HASHTABLE_ASSERT( hashtable_internal_find_slot( table, hash, key ) < 0 );
-
-    if( table->count >= ( table->slot_capacity - table->slot_capacity / 3 ) )
-        hashtable_internal_expand_slots( table );
-        
-    HASHTABLE_U32 slot_capacity = (HASHTABLE_U32) table->slot_capacity;
-    int const base_slot = (int)( hash % slot_capacity );
-    int base_count = table->slots[ base_slot ].base_count;
-    int slot = base_slot;
-    int first_free = slot;
-    while( base_count )
+    // Keep at least one slot in eight empty, counting deleted slots as used, so that every probe sequence ends. If
+    // most of the used slots are deleted ones, rehashing at the same capacity is enough to get rid of them. The count
+    // includes any items still in the old slot array, so this errs on the side of resizing too early.
+    int const capacity = table->slots.capacity;
+    int const max_used = capacity - capacity / 8;
+    if( table->count + table->slots.deleted_count >= max_used )
         {
-        if( table->slots[ slot ].item_index < 0 && table->slots[ first_free ].item_index >= 0 ) first_free = slot;
-        HASHTABLE_U32 const slot_hash = table->slots[ slot ].key_hash;
-        int slot_base = (int)( slot_hash % slot_capacity );
-        if( slot_base == base_slot ) 
-            --base_count;
-        slot = (int)( ( slot + 1 ) % slot_capacity );
-        }       
-
-    slot = first_free;
-    while( table->slots[ slot ].item_index >= 0  )
-        slot = (int)( ( slot + 1 ) % slot_capacity );
-
-    if( table->count >= table->item_capacity )
-        hashtable_internal_expand_items( table );
-
-    HASHTABLE_ASSERT( table->slots[ slot ].item_index < 0 && (int)( hash % slot_capacity ) == (HASHTABLE_U32) base_slot );
-    table->slots[ slot ].key_hash = hash;
-    table->slots[ slot ].item_index = table->count;
-    ++table->slots[ base_slot ].base_count;
-
-        
-    void* dest_item = (void*)( ( (uintptr_t) table->items_data ) + table->count * table->item_size );
-    HASHTABLE_ITEMCOPY( dest_item, item, (HASHTABLE_SIZE_T) table->item_size );
-    void* dest_key = (void*)( ( (uintptr_t) table->items_key ) + table->count * table->key_size );
-    HASHTABLE_KEYCOPY( dest_key, key, (HASHTABLE_SIZE_T) table->key_size );
-    table->items_slot[ table->count ] = slot;
+        hashtable_internal_rehash_slots( table, table->count < max_used / 2 ? capacity : capacity * 2 );
+        free_slot = -1;
+        }
+
+    int const slot = free_slot >= 0 ? free_slot : hashtable_internal_find_free_slot( &table->slots, hash );
+    if( table->slots.control[ slot ] == HASHTABLE_INTERNAL_DELETED ) --table->slots.deleted_count;
+    table->slots.control[ slot ] = (unsigned char)( hash >> 25 );
+    struct hashtable_internal_slot_t* slot_data = hashtable_internal_slot( table, &table->slots, slot );
+    slot_data->key_hash = hash;
+    slot_data->item_index = table->count;
+    if( table->slot_size > (int) sizeof( *slot_data ) )
+        HASHTABLE_KEYCOPY( slot_data + 1, key, (HASHTABLE_SIZE_T) table->key_size );
+
+    HASHTABLE_KEYCOPY( hashtable_internal_item_key( table, table->count ), key, (HASHTABLE_SIZE_T) table->key_size );
+    *hashtable_internal_item_slot_index( table, table->count ) = slot | table->slot_generation;
     ++table->count;
-    } 
+
+    hashtable_internal_migrate_slots( table, HASHTABLE_INTERNAL_MIGRATE_SLOTS );
+    hashtable_internal_move_items( table, HASHTABLE_INTERNAL_MOVE_ITEMS );
+    }
+
+
+void hashtable_insert( hashtable_t* table, HASHTABLE_U32 hash, void const* key, void const* item )
+    {
+    HASHTABLE_ASSERT( !table->slots.slots || hashtable_internal_find( table, hash, key, 0 ) < 0 );
+    hashtable_internal_insert( table, hash, key, item, -1 );
+    }
 
 
 void hashtable_remove( hashtable_t* table, HASHTABLE_U32 hash, void const* key )
     {
-    if( table->slots )
+    if( table->slots.slots )
         {
-        int const slot = hashtable_internal_find_slot( table, hash, key );
+        struct hashtable_internal_slots_t const* found_slots;
+        int const slot = hashtable_internal_find( table, hash, key, &found_slots );
         HASHTABLE_ASSERT( slot >= 0 );
+        struct hashtable_internal_slots_t* slots = found_slots == &table->slots ? &table->slots : &table->old_slots;
 
-        HASHTABLE_U32 slot_capacity = (HASHTABLE_U32) table->slot_capacity;
-        int const base_slot = (int)( hash % slot_capacity );
-        HASHTABLE_ASSERT( hash );
-        --table->slots[ base_slot ].base_count;
-        table->slots[ slot ].item_index = -1;
+        // If the group still has an empty slot, no probe sequence has ever continued past it, and the slot can be
+        // made empty again. Otherwise it has to be marked as deleted, so lookups know to keep looking.
+        unsigned char const* group = slots->control + ( slot & ~( HASHTABLE_INTERNAL_GROUP_SIZE - 1 ) );
+        if( hashtable_internal_match( group, HASHTABLE_INTERNAL_EMPTY ) )
+            {
+            slots->control[ slot ] = HASHTABLE_INTERNAL_EMPTY;
+            }
+        else
+            {
+            slots->control[ slot ] = HASHTABLE_INTERNAL_DELETED;
+            ++slots->deleted_count;
+            }
 
-        int index = table->slots[ slot ].item_index;
-        int last_index = table->count - 1;
+        int const index = hashtable_internal_slot( table, slots, slot )->item_index;
+        int const last_index = table->count - 1;
         if( index != last_index )
             {
-            void* dst_key = (void*)( ( (uintptr_t) table->items_key ) + index * table->key_size );
-            void* src_key = (void*)( ( (uintptr_t) table->items_key ) + last_index * table->key_size );
-            HASHTABLE_KEYCOPY( dst_key, src_key, (HASHTABLE_SIZE_T) table->key_size );
-            table->items_slot[ index ] = table->items_slot[ last_index ];
-            void* dst_item = (void*)( ( (uintptr_t) table->items_data ) + index * table->item_size );
-            void* src_item = (void*)( ( (uintptr_t) table->items_data ) + last_index * table->item_size );
-            HASHTABLE_ITEMCOPY( dst_item, src_item, (HASHTABLE_SIZE_T) table->item_size );
-            table->slots[ table->items_slot[ last_index ] ].item_index = index;
+            HASHTABLE_KEYCOPY( hashtable_internal_item_key( table, index ),
+                hashtable_internal_item_key( table, last_index ), (HASHTABLE_SIZE_T) table->key_size );
+            *hashtable_internal_item_slot_index( table, index ) = 
+                *hashtable_internal_item_slot_index( table, last_index );
+            HASHTABLE_ITEMCOPY( hashtable_internal_item_data( table, index ),
+                hashtable_internal_item_data( table, last_index ), (HASHTABLE_SIZE_T) table->item_size );
+            hashtable_internal_item_slot( table, index )->item_index = index;
             }
         }
     --table->count;
-    } 
+
+    hashtable_internal_migrate_slots( table, HASHTABLE_INTERNAL_MIGRATE_SLOTS );
+    hashtable_internal_move_items( table, HASHTABLE_INTERNAL_MOVE_ITEMS );
+    }
 
 
 void hashtable_clear( hashtable_t* table )
     {
     table->count = 0;
-    if( table->slots )
+    hashtable_internal_move_items( table, 0 );
+    if( table->old_slots.slots )
         {
-        for( int i = 0; i < table->slot_capacity; ++i  )
-            {
-            table->slots[ i ].base_count = 0;
-            table->slots[ i ].item_index = -1;
-            }  
+        table->migrate_position = table->old_slots.capacity;
+        hashtable_internal_migrate_slots( table, 0 );
+        }
+    if( table->slots.slots )
+        {
+        HASHTABLE_MEMSET( table->slots.control, HASHTABLE_INTERNAL_EMPTY, (HASHTABLE_SIZE_T) table->slots.capacity );
+        table->slots.deleted_count = 0;
+        }
+    }
+
+
+// With incremental resizing, the items grow when they are three quarters full, so there must be room for a third more
+// than the capacity. The slots are sized the way hashtable_init sizes them, and are rehashed even when they are big
+// enough, if deleted slots would otherwise make them run out before the table is full.
+void hashtable_reserve( hashtable_t* table, int capacity )
+    {
+    hashtable_internal_move_items( table, HASHTABLE_INTERNAL_NOT_MOVING );
+    hashtable_internal_migrate_slots( table, HASHTABLE_INTERNAL_NOT_MOVING );
+
+    #ifdef HASHTABLE_INCREMENTAL_RESIZE
+        int const item_capacity = capacity + capacity / 3 + 1;
+    #else
+        int const item_capacity = capacity;
+    #endif
+    if( item_capacity > table->item_capacity )
+        {
+        table->old_items_key = table->items_key;
+        table->old_items_slot = table->items_slot;
+        table->old_items_data = table->items_data;
+        table->items_moved = 0;
+        hashtable_internal_alloc_items( table, (int) hashtable_internal_pow2ceil( (HASHTABLE_U32) item_capacity ) );
+        hashtable_internal_move_items( table, HASHTABLE_INTERNAL_NOT_MOVING );
+        }
+
+    if( !table->slots.slots ) return;
+    int slot_capacity = (int) hashtable_internal_pow2ceil( (HASHTABLE_U32)( capacity + capacity / 2 ) );
+    slot_capacity = slot_capacity > table->slots.capacity ? slot_capacity : table->slots.capacity;
+    int const max_used = table->slots.capacity - table->slots.capacity / 8;
+    if( slot_capacity > table->slots.capacity || capacity + table->slots.deleted_count >= max_used )
+        {
+        hashtable_internal_rehash_slots( table, slot_capacity );
+        hashtable_internal_migrate_slots( table, HASHTABLE_INTERNAL_NOT_MOVING );
         }
     }
 
 
 void* hashtable_find( hashtable_t const* table, HASHTABLE_U32 hash, void const* key )
     {
-    int const slot = table->slots ? hashtable_internal_find_slot( table, hash, key ) : -1;
+    if( !table->slots.slots ) return 0;
+
+    struct hashtable_internal_slots_t const* slots;
+    int const slot = hashtable_internal_find( table, hash, key, &slots );
     if( slot < 0 ) return 0;
 
-    int const index = table->slots[ slot ].item_index;
-    void* const item = (void*)( ( (uintptr_t) table->items_data ) + index * table->item_size );
-    return item;
+    return hashtable_internal_item_data( table, hashtable_internal_slot( table, slots, slot )->item_index );
+    }
+
+
+void* hashtable_find_or_insert( hashtable_t* table, HASHTABLE_U32 hash, void const* key, int* inserted )
+    {
+    // The probe of the new slot array also finds the free slot to insert the key into, so a key which is not in the 
+    // table is only probed for once
+    int free_slot = -1;
+    if( table->slots.slots )
+        {
+        struct hashtable_internal_slots_t const* slots = &table->slots;
+        int slot = hashtable_internal_find_slot( table, slots, hash, key, &free_slot );
+        if( slot < 0 && table->old_slots.slots )
+            {
+            slots = &table->old_slots;
+            slot = hashtable_internal_find_slot( table, slots, hash, key, 0 );
+            }
+        if( inserted ) *inserted = slot < 0;
+        if( slot >= 0 )
+            return hashtable_internal_item_data( table, hashtable_internal_slot( table, slots, slot )->item_index );
+        }
+    else if( inserted )
+        {
+        *inserted = 1;
+        }
+
+    // Inserting may move the items to bigger arrays, so the item is looked up by its index afterwards
+    hashtable_internal_insert( table, hash, key, 0, free_slot );
+    return hashtable_internal_item_data( table, table->count - 1 );
+    }
+
+
+// Keys are looked up in batches, in a number of passes over the batch. Each pass prefetches what the next pass is
+// going to look at, for all the keys of the batch: first the control bytes of their first group, then the first slot
+// with a matching tag, then the key (if it is not stored in the slot) and last the item. The final pass does the full
+// lookup, which normally finds everything it needs in the cache by then.
+int hashtable_find_batch( hashtable_t const* table, int count, HASHTABLE_U32 const* hashes, void const* keys, 
+    void** items )
+    {
+    if( !table->slots.slots )
+        {
+        for( int i = 0; i < count; ++i ) items[ i ] = 0;
+        return 0;
+        }
+
+    struct hashtable_internal_slots_t const* const slots = &table->slots;
+    HASHTABLE_U32 const group_mask = (HASHTABLE_U32)( slots->capacity / HASHTABLE_INTERNAL_GROUP_SIZE ) - 1U;
+    int found_count = 0;
+    for( int start = 0; start < count; start += HASHTABLE_INTERNAL_BATCH_SIZE )
+        {
+        int const batch = count - start < HASHTABLE_INTERNAL_BATCH_SIZE ? count - start : HASHTABLE_INTERNAL_BATCH_SIZE;
+        HASHTABLE_U32 const* batch_hashes = hashes + start;
+        int candidates[ HASHTABLE_INTERNAL_BATCH_SIZE ];
+
+        for( int i = 0; i < batch; ++i )
+            {
+            HASHTABLE_INTERNAL_PREFETCH( slots->control + 
+                ( batch_hashes[ i ] & group_mask ) * HASHTABLE_INTERNAL_GROUP_SIZE );
+            }
+
+        for( int i = 0; i < batch; ++i )
+            {
+            HASHTABLE_U32 const group = batch_hashes[ i ] & group_mask;
+            HASHTABLE_U32 const match = hashtable_internal_match( 
+                slots->control + group * HASHTABLE_INTERNAL_GROUP_SIZE, (unsigned char)( batch_hashes[ i ] >> 25 ) );
+            candidates[ i ] = match ? 
+                (int)( group * HASHTABLE_INTERNAL_GROUP_SIZE ) + hashtable_internal_lowest_bit( match ) : -1;
+            if( candidates[ i ] >= 0 ) 
+                HASHTABLE_INTERNAL_PREFETCH( hashtable_internal_slot( table, slots, candidates[ i ] ) );
+            }
+
+        if( table->slot_size == (int) sizeof( struct hashtable_internal_slot_t ) )
+            {
+            for( int i = 0; i < batch; ++i )
+                {
+                if( candidates[ i ] < 0 ) continue;
+                struct hashtable_internal_slot_t const* slot = hashtable_internal_slot( table, slots, candidates[ i ] );
+                if( slot->key_hash == batch_hashes[ i ] ) 
+                    HASHTABLE_INTERNAL_PREFETCH( hashtable_internal_item_key( table, slot->item_index ) );
+                }
+            }
+
+        for( int i = 0; i < batch; ++i )
+            {
+            if( candidates[ i ] < 0 ) continue;
+            struct hashtable_internal_slot_t const* slot = hashtable_internal_slot( table, slots, candidates[ i ] );
+            if( slot->key_hash == batch_hashes[ i ] ) 
+                HASHTABLE_INTERNAL_PREFETCH( hashtable_internal_item_data( table, slot->item_index ) );
+            }
+
+        for( int i = 0; i < batch; ++i )
+            {
+            void const* key = (void const*)( ( (uintptr_t) keys ) + 
+                (HASHTABLE_SIZE_T)( start + i ) * (HASHTABLE_SIZE_T) table->key_size );
+            struct hashtable_internal_slots_t const* found_slots;
+            int const slot = hashtable_internal_find( table, batch_hashes[ i ], key, &found_slots );
+            items[ start + i ] = 0;
+            if( slot >= 0 ) 
+                {
+                items[ start + i ] = hashtable_internal_item_data( table, 
+                    hashtable_internal_slot( table, found_slots, slot )->item_index );
+                ++found_count;
+                }
+            }
+        }
+    return found_count;
     }
 
 
@@ -762,14 +1349,18 @@ int hashtable_count( hashtable_t const* table )
     }
 
 
+// The items and keys can only be handed out as single arrays once all of them are in the new arrays, so any resize
+// of the item arrays which is still going on is finished first
 void* hashtable_items( hashtable_t const* table )
     {
+    hashtable_internal_move_items( (hashtable_t*) table, HASHTABLE_INTERNAL_NOT_MOVING );
     return table->items_data;
     }
 
 
 void const* hashtable_keys( hashtable_t const* table )
     {
+    hashtable_internal_move_items( (hashtable_t*) table, HASHTABLE_INTERNAL_NOT_MOVING );
     return table->items_key;
     }
 
@@ -778,29 +1369,196 @@ void hashtable_swap( hashtable_t* table, int index_a, int index_b )
     {
     if( index_a < 0 || index_a >= table->count || index_b < 0 || index_b >= table->count ) return;
 
-    int slot_a = table->items_slot[ index_a ];
-    int slot_b = table->items_slot[ index_b ];
-
-    table->items_slot[ index_a ] = slot_b;
-    table->items_slot[ index_b ] = slot_a;
+    int* slot_a = hashtable_internal_item_slot_index( table, index_a );
+    int* slot_b = hashtable_internal_item_slot_index( table, index_b );
+    int const temp_slot = *slot_a;
+    *slot_a = *slot_b;
+    *slot_b = temp_slot;
 
-    void* key_a = (void*)( ( (uintptr_t) table->items_key ) + index_a * table->key_size );
-    void* key_b = (void*)( ( (uintptr_t) table->items_key ) + index_b * table->key_size );
+    void* key_a = hashtable_internal_item_key( table, index_a );
+    void* key_b = hashtable_internal_item_key( table, index_b );
     HASHTABLE_KEYCOPY( table->swap_temp, key_a, table->key_size );
     HASHTABLE_KEYCOPY( key_a, key_b, table->key_size );
     HASHTABLE_KEYCOPY( key_b, table->swap_temp, table->key_size );
 
-    void* item_a = (void*)( ( (uintptr_t) table->items_data ) + index_a * table->item_size );
-    void* item_b = (void*)( ( (uintptr_t) table->items_data ) + index_b * table->item_size );
+    void* item_a = hashtable_internal_item_data( table, index_a );
+    void* item_b = hashtable_internal_item_data( table, index_b );
     HASHTABLE_ITEMCOPY( table->swap_temp, item_a, table->item_size );
     HASHTABLE_ITEMCOPY( item_a, item_b, table->item_size );
     HASHTABLE_ITEMCOPY( item_b, table->swap_temp, table->item_size );
 
-    if( table->slots )
+    if( table->slots.slots )
+        {
+        hashtable_internal_item_slot( table, index_a )->item_index = index_a;
+        hashtable_internal_item_slot( table, index_b )->item_index = index_b;
+        }
+    }
+
+
+
+
+// A saved table is this header, followed by the slots and control bytes, and then the keys, slot indices and items 
+// of the item arrays, each block starting on an 8 byte boundary
+struct hashtable_internal_saved_t
+    {
+    HASHTABLE_U32 version;
+    HASHTABLE_U32 key_size;
+    HASHTABLE_U32 item_size;
+    HASHTABLE_U32 slot_size;
+    HASHTABLE_U32 count;
+    HASHTABLE_U32 slot_capacity;
+    HASHTABLE_U32 deleted_count;
+    HASHTABLE_U32 slot_generation;
+    };
+
+
+static HASHTABLE_SIZE_T hashtable_internal_saved_block( HASHTABLE_SIZE_T size )
+    {
+    return ( size + 7 ) & ~(HASHTABLE_SIZE_T) 7;
+    }
+
+
+HASHTABLE_U64 hashtable_save_size( hashtable_t const* table )
+    {
+    HASHTABLE_SIZE_T const count = (HASHTABLE_SIZE_T) table->count;
+    HASHTABLE_SIZE_T const capacity = (HASHTABLE_SIZE_T) table->slots.capacity;
+    return (HASHTABLE_U64)( sizeof( struct hashtable_internal_saved_t ) + 
+        hashtable_internal_saved_block( capacity * ( (HASHTABLE_SIZE_T) table->slot_size + 1 ) ) + 
+        hashtable_internal_saved_block( count * (HASHTABLE_SIZE_T) table->key_size ) + 
+        hashtable_internal_saved_block( count * sizeof( *table->items_slot ) ) + 
+        hashtable_internal_saved_block( count * (HASHTABLE_SIZE_T) table->item_size ) );
+    }
+
+
+void hashtable_save( hashtable_t const* table, void* data )
+    {
+    hashtable_internal_migrate_slots( (hashtable_t*) table, HASHTABLE_INTERNAL_NOT_MOVING );
+    hashtable_internal_move_items( (hashtable_t*) table, HASHTABLE_INTERNAL_NOT_MOVING );
+
+    struct hashtable_internal_saved_t header;
+    header.version = 1;
+    header.key_size = (HASHTABLE_U32) table->key_size;
+    header.item_size = (HASHTABLE_U32) table->item_size;
+    header.slot_size = (HASHTABLE_U32) table->slot_size;
+    header.count = (HASHTABLE_U32) table->count;
+    header.slot_capacity = (HASHTABLE_U32) table->slots.capacity;
+    header.deleted_count = (HASHTABLE_U32) table->slots.deleted_count;
+    header.slot_generation = (HASHTABLE_U32) table->slot_generation;
+
+    unsigned char* out = (unsigned char*) data;
+    HASHTABLE_MEMCPY( out, &header, sizeof( header ) );
+    out += sizeof( header );
+
+    HASHTABLE_SIZE_T const count = (HASHTABLE_SIZE_T) table->count;
+    HASHTABLE_SIZE_T const slots_size = (HASHTABLE_SIZE_T) table->slots.capacity * 
+        ( (HASHTABLE_SIZE_T) table->slot_size + 1 );
+    HASHTABLE_SIZE_T const sizes[ 4 ] = { slots_size, count * (HASHTABLE_SIZE_T) table->key_size,
+        count * sizeof( *table->items_slot ), count * (HASHTABLE_SIZE_T) table->item_size };
+    void const* const blocks[ 4 ] = { table->slots.slots, table->items_key, table->items_slot, table->items_data };
+    for( int i = 0; i < 4; ++i )
+        {
+        HASHTABLE_SIZE_T const block_size = hashtable_internal_saved_block( sizes[ i ] );
+        if( sizes[ i ] ) HASHTABLE_MEMCPY( out, blocks[ i ], sizes[ i ] );
+        HASHTABLE_MEMSET( out + sizes[ i ], 0, block_size - sizes[ i ] );
+        out += block_size;
+        }
+    }
+
+
+int hashtable_load( hashtable_t* table, int key_size, int item_size, void const* data, HASHTABLE_U64 size, 
+    void* memctx )
+    {
+    struct hashtable_internal_saved_t header;
+    if( size < sizeof( header ) ) return 0;
+    HASHTABLE_MEMCPY( &header, data, sizeof( header ) );
+
+    // A table made with the same key and item size has the same slot size, so the saved slots can be used as they are
+    HASHTABLE_U32 const capacity = header.slot_capacity;
+    int valid = header.version == 1 && header.key_size == (HASHTABLE_U32) key_size && 
+        header.item_size == (HASHTABLE_U32) item_size && 
+        header.slot_size == (HASHTABLE_U32) hashtable_internal_slot_size( key_size ) &&
+        ( header.slot_generation == 0 || header.slot_generation == HASHTABLE_INTERNAL_GENERATION_BIT ) && 
+        header.count < 0x40000000U && header.deleted_count <= capacity;
+    if( key_size > 0 )
+        valid = valid && capacity >= HASHTABLE_INTERNAL_GROUP_SIZE && capacity <= 0x40000000U &&
+            ( capacity & ( capacity - 1 ) ) == 0 && header.count < capacity;
+    else
+        valid = valid && capacity == 0;
+    if( !valid ) return 0;
+
+    HASHTABLE_SIZE_T const count = (HASHTABLE_SIZE_T) header.count;
+    HASHTABLE_SIZE_T const slots_size = (HASHTABLE_SIZE_T) capacity * ( (HASHTABLE_SIZE_T) header.slot_size + 1 );
+    HASHTABLE_SIZE_T const sizes[ 4 ] = { slots_size, count * (HASHTABLE_SIZE_T) key_size, count * sizeof( int ), 
+        count * (HASHTABLE_SIZE_T) item_size };
+    HASHTABLE_SIZE_T offsets[ 4 ];
+    HASHTABLE_U64 total = sizeof( header );
+    for( int i = 0; i < 4; ++i )
+        {
+        offsets[ i ] = (HASHTABLE_SIZE_T) total;
+        total += hashtable_internal_saved_block( sizes[ i ] );
+        }
+    if( total != size ) return 0;
+
+    // Lookups and removes index the item arrays with the item index of a slot, and the slots with the slot index of
+    // an item, so those are checked to be in range, and to point back at each other. Every probe sequence ends at a
+    // group with an empty slot, so there must be one, and the used and deleted slots must be as many as the header 
+    // says, as inserts rely on those counts to keep some slots empty. A damaged file which passes all of this can still
+    // give wrong results, but can not make the table access memory it does not own, or loop forever.
+    unsigned char const* in = (unsigned char const*) data;
+    unsigned char const* control = in + offsets[ 0 ] + (HASHTABLE_SIZE_T) capacity * header.slot_size;
+    HASHTABLE_U32 used_count = 0;
+    HASHTABLE_U32 deleted_count = 0;
+    HASHTABLE_U32 empty_count = 0;
+    for( HASHTABLE_U32 i = 0; i < capacity; ++i )
+        {
+        if( control[ i ] == HASHTABLE_INTERNAL_EMPTY ) 
+            {
+            ++empty_count;
+            continue;
+            }
+        if( control[ i ] == HASHTABLE_INTERNAL_DELETED ) 
+            {
+            ++deleted_count;
+            continue;
+            }
+        if( control[ i ] & 0x80 ) return 0;
+        struct hashtable_internal_slot_t slot;
+        HASHTABLE_MEMCPY( &slot, in + offsets[ 0 ] + (HASHTABLE_SIZE_T) i * header.slot_size, sizeof( slot ) );
+        if( slot.item_index < 0 || (HASHTABLE_U32) slot.item_index >= header.count ) return 0;
+        ++used_count;
+        }
+    if( key_size > 0 && ( used_count != header.count || deleted_count != header.deleted_count || empty_count == 0 ) ) 
+        return 0;
+    for( HASHTABLE_SIZE_T i = 0; i < count && key_size > 0; ++i )
+        {
+        int slot_index;
+        HASHTABLE_MEMCPY( &slot_index, in + offsets[ 2 ] + i * sizeof( int ), sizeof( int ) );
+        HASHTABLE_U32 const index = (HASHTABLE_U32)( slot_index & ~HASHTABLE_INTERNAL_GENERATION_BIT );
+        if( ( slot_index & HASHTABLE_INTERNAL_GENERATION_BIT ) != (int) header.slot_generation || index >= capacity ||
+            ( control[ index ] & 0x80 ) )
+            return 0;
+        struct hashtable_internal_slot_t slot;
+        HASHTABLE_MEMCPY( &slot, in + offsets[ 0 ] + (HASHTABLE_SIZE_T) index * header.slot_size, sizeof( slot ) );
+        if( (HASHTABLE_SIZE_T) slot.item_index != i ) return 0;
+        }
+
+    // The item arrays are made less than three quarters full, so incremental resizing does not start right away
+    hashtable_init( table, key_size, item_size, 0, memctx );
+    HASHTABLE_FREE( memctx, table->items_key );
+    hashtable_internal_alloc_items( table, (int) hashtable_internal_pow2ceil( header.count + header.count / 3 + 1 ) );
+    if( key_size > 0 )
         {
-        table->slots[ slot_a ].item_index = index_b;
-        table->slots[ slot_b ].item_index = index_a;
+        HASHTABLE_FREE( memctx, table->slots.slots );
+        hashtable_internal_alloc_slots( table, &table->slots, (int) capacity );
+        HASHTABLE_MEMCPY( table->slots.slots, in + offsets[ 0 ], sizes[ 0 ] );
+        table->slots.deleted_count = (int) header.deleted_count;
+        table->slot_generation = (int) header.slot_generation;
         }
+    table->count = (int) header.count;
+    if( sizes[ 1 ] ) HASHTABLE_MEMCPY( table->items_key, in + offsets[ 1 ], sizes[ 1 ] );
+    if( sizes[ 2 ] ) HASHTABLE_MEMCPY( table->items_slot, in + offsets[ 2 ], sizes[ 2 ] );
+    if( sizes[ 3 ] ) HASHTABLE_MEMCPY( table->items_data, in + offsets[ 3 ], sizes[ 3 ] );
+    return 1;
     }
 
 
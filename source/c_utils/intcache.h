@@ -0,0 +1,265 @@
+#ifndef intcache_h
+#define intcache_h
+
+// To make intcache thread safe, do this before include: #define INTCACHE_THREAD_SAFE
+// A intcache_t maps int keys to items of a fixed size, like an intmap, but holds at most a fixed number of keys, and
+// makes room for new ones by evicting keys which have not been looked up recently, picked with the CLOCK algorithm. It
+// is meant as a cache in front of something slow, and does not allocate memory for each lookup or insert.
+
+typedef struct intcache_t intcache_t;
+
+// create a cache which holds at most `capacity` keys. `evict`, which may be NULL, is called for each item as it
+// leaves the cache, whether it is evicted to make room, overwritten, removed, or dropped by intcache_clear or 
+// intcache_destroy, so anything the item refers to can be released. In thread safe builds, the cache is locked while 
+// `evict` is called, so it must not call any intcache function on the same cache.
+intcache_t* intcache_create( int item_size, int capacity, void (*evict)( void* user_data, int key, void* item ), 
+    void* user_data );
+
+void intcache_destroy( intcache_t* intcache );
+void intcache_clear( intcache_t* intcache );
+int intcache_count( intcache_t* intcache );
+
+// insert the key with a copy of the item, or overwrite its item if the key is already in the cache. If the cache is 
+// full, another key is evicted first.
+void intcache_insert( intcache_t* intcache, int key, void const* item );
+
+// copy the item of the key to `item`, and mark the key as recently used. Returns false if the key is not in the cache.
+bool intcache_find( intcache_t* intcache, int key, void* item );
+
+// remove the key, and return false if it was not in the cache
+bool intcache_remove( intcache_t* intcache, int key );
+
+// give the number of lookups which found their key, the number which did not, and the number of keys evicted to make 
+// room for others, since the cache was created. Any of the pointers may be NULL.
+void intcache_stats( intcache_t* intcache, int64_t* hits, int64_t* misses, int64_t* evictions );
+
+#endif /* intcache_h */
+
+
+#ifdef INTCACHE_IMPLEMENTATION
+#undef INTCACHE_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+
+
+static uint32_t intcache_hash_u32( uint32_t key ) {
+    key = ~key + ( key << 15 );
+    key = key ^ ( key >> 12 );
+    key = key + ( key << 2 );
+    key = key ^ ( key >> 4 );
+    key = (key + ( key << 3 ) ) + ( key << 11 );
+    key = key ^ ( key >> 16);
+    return key;
+}
+
+
+// The keys and items are kept in a hashtable which is made big enough to never have to grow, so the items stay in the
+// same dense array, where removing a key moves the last item into its place. Each item index has a byte in 
+// `referenced`, which is set when the key at that index is looked up. To make room, the clock hand sweeps over the
+// indices, clearing the bytes which are set, and evicts the first key whose byte was already clear, so every key which
+// has been looked up since the hand last passed it is kept for another round.
+typedef struct intcache_t {
+    int item_size;
+    int item_stride;
+    int capacity;
+    int hand;
+    unsigned char* referenced;
+    void (*evict)( void* user_data, int key, void* item );
+    void* user_data;
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    hashtable_t hashtable;
+    #ifdef INTCACHE_THREAD_SAFE
+        thread_mutex_t mutex;
+    #endif
+} intcache_t;
+
+
+#ifdef INTCACHE_THREAD_SAFE
+    #define INTCACHE_MUTEX_LOCK(x) thread_mutex_lock( (x) )
+    #define INTCACHE_MUTEX_UNLOCK(x) thread_mutex_unlock( (x) )
+#else
+    #define INTCACHE_MUTEX_LOCK(x) 
+    #define INTCACHE_MUTEX_UNLOCK(x) 
+#endif
+
+
+intcache_t* intcache_create( int item_size, int capacity, void (*evict)( void* user_data, int key, void* item ), 
+    void* user_data ) {
+
+    intcache_t* intcache = (intcache_t*) malloc( sizeof( intcache_t ) );
+    intcache->item_size = item_size;
+    intcache->item_stride = item_size > 0 ? item_size : 1; // so each item has an address to find its index from
+    intcache->capacity = capacity > 0 ? capacity : 1;
+    intcache->hand = 0;
+    intcache->referenced = (unsigned char*) malloc( (size_t) intcache->capacity );
+    intcache->evict = evict;
+    intcache->user_data = user_data;
+    intcache->hits = 0;
+    intcache->misses = 0;
+    intcache->evictions = 0;
+    // The hashtable grows its items when they are three quarters full (in builds with HASHTABLE_INCREMENTAL_RESIZE),
+    // so it is given room for a third more than the capacity, to never get there
+    int const hashtable_capacity = intcache->capacity + intcache->capacity / 3 + 1;
+    hashtable_init( &intcache->hashtable, sizeof( int ), intcache->item_stride, hashtable_capacity, NULL );
+    #ifdef INTCACHE_THREAD_SAFE
+        thread_mutex_init( &intcache->mutex );
+    #endif
+    return intcache;
+}
+
+
+// Calls the evict callback for every item in the cache, before they are all dropped at once
+static void intcache_evict_all( intcache_t* intcache ) {
+    if( intcache->evict ) {
+        int count = hashtable_count( &intcache->hashtable );
+        int const* keys = (int const*) hashtable_keys( &intcache->hashtable );
+        char* items = (char*) hashtable_items( &intcache->hashtable );
+        for( int i = 0; i < count; ++i ) {
+            intcache->evict( intcache->user_data, keys[ i ], items + (size_t) i * (size_t) intcache->item_stride );
+        }
+    }
+}
+
+
+void intcache_destroy( intcache_t* intcache ) {
+    INTCACHE_MUTEX_LOCK( &intcache->mutex );
+    intcache_evict_all( intcache );
+    hashtable_term( &intcache->hashtable );
+    INTCACHE_MUTEX_UNLOCK( &intcache->mutex );    
+    #ifdef INTCACHE_THREAD_SAFE
+        thread_mutex_term( &intcache->mutex );
+    #endif
+    free( intcache->referenced );
+    free( intcache );
+}
+
+
+void intcache_clear( intcache_t* intcache ) {
+    INTCACHE_MUTEX_LOCK( &intcache->mutex );
+    intcache_evict_all( intcache );
+    hashtable_clear( &intcache->hashtable );
+    intcache->hand = 0;
+    INTCACHE_MUTEX_UNLOCK( &intcache->mutex );    
+}
+
+
+int intcache_count( intcache_t* intcache ) {
+    INTCACHE_MUTEX_LOCK( &intcache->mutex );
+    int count = hashtable_count( &intcache->hashtable );
+    INTCACHE_MUTEX_UNLOCK( &intcache->mutex );    
+    return count;
+}
+
+
+// Gives the index of an item returned by hashtable_find. The hashtable never grows, so its items are never moving to
+// a new array, and are all in the one hashtable_items gives.
+static int intcache_index( intcache_t* intcache, void const* item ) {
+    char const* items = (char const*) hashtable_items( &intcache->hashtable );
+    return (int)( ( (char const*) item - items ) / intcache->item_stride );
+}
+
+
+// The hashtable moves its last item into the place of the removed one, so its referenced byte is moved along with it
+static void intcache_remove_index( intcache_t* intcache, uint32_t hash, int key, int index ) {
+    int last = hashtable_count( &intcache->hashtable ) - 1;
+    hashtable_remove( &intcache->hashtable, hash, &key );
+    intcache->referenced[ index ] = intcache->referenced[ last ];
+}
+
+
+// Every key the hand passes over has its byte cleared, so it stops within one sweep over all the keys, and on average
+// after only a few, as keys which have been looked up get their byte set again
+static void intcache_evict_one( intcache_t* intcache ) {
+    int count = hashtable_count( &intcache->hashtable );
+    int hand = intcache->hand < count ? intcache->hand : 0;
+    while( intcache->referenced[ hand ] ) {
+        intcache->referenced[ hand ] = 0;
+        hand = hand + 1 < count ? hand + 1 : 0;
+    }
+    intcache->hand = hand;
+
+    int key = ( (int const*) hashtable_keys( &intcache->hashtable ) )[ hand ];
+    if( intcache->evict ) {
+        char* items = (char*) hashtable_items( &intcache->hashtable );
+        intcache->evict( intcache->user_data, key, items + (size_t) hand * (size_t) intcache->item_stride );
+    }
+    intcache_remove_index( intcache, intcache_hash_u32( (uint32_t) key ), key, hand );
+    ++intcache->evictions;
+}
+
+
+void intcache_insert( intcache_t* intcache, int key, void const* item ) {
+    uint32_t hash = intcache_hash_u32( (uint32_t) key );
+    INTCACHE_MUTEX_LOCK( &intcache->mutex );
+    void* existing = hashtable_find( &intcache->hashtable, hash, &key );
+    if( existing ) {
+        if( intcache->evict ) {
+            intcache->evict( intcache->user_data, key, existing );
+        }
+        memcpy( existing, item, (size_t) intcache->item_size );
+    } else {
+        if( hashtable_count( &intcache->hashtable ) >= intcache->capacity ) {
+            intcache_evict_one( intcache );
+        }
+        void* inserted = hashtable_find_or_insert( &intcache->hashtable, hash, &key, NULL );
+        memcpy( inserted, item, (size_t) intcache->item_size );
+        intcache->referenced[ hashtable_count( &intcache->hashtable ) - 1 ] = 0;
+    }
+    INTCACHE_MUTEX_UNLOCK( &intcache->mutex );    
+}
+
+
+bool intcache_find( intcache_t* intcache, int key, void* item ) {
+    uint32_t hash = intcache_hash_u32( (uint32_t) key );
+    INTCACHE_MUTEX_LOCK( &intcache->mutex );
+    void const* result = hashtable_find( &intcache->hashtable, hash, &key );
+    if( result ) {
+        memcpy( item, result, (size_t) intcache->item_size );
+        intcache->referenced[ intcache_index( intcache, result ) ] = 1;
+        ++intcache->hits;
+    } else {
+        ++intcache->misses;
+    }
+    INTCACHE_MUTEX_UNLOCK( &intcache->mutex );    
+    return result != NULL;
+}
+
+
+bool intcache_remove( intcache_t* intcache, int key ) {
+    uint32_t hash = intcache_hash_u32( (uint32_t) key );
+    INTCACHE_MUTEX_LOCK( &intcache->mutex );
+    void* result = hashtable_find( &intcache->hashtable, hash, &key );
+    if( result ) {
+        if( intcache->evict ) {
+            intcache->evict( intcache->user_data, key, result );
+        }
+        intcache_remove_index( intcache, hash, key, intcache_index( intcache, result ) );
+    }
+    INTCACHE_MUTEX_UNLOCK( &intcache->mutex );    
+    return result != NULL;
+}
+
+
+void intcache_stats( intcache_t* intcache, int64_t* hits, int64_t* misses, int64_t* evictions ) {
+    INTCACHE_MUTEX_LOCK( &intcache->mutex );
+    if( hits ) {
+        *hits = intcache->hits;
+    }
+    if( misses ) {
+        *misses = intcache->misses;
+    }
+    if( evictions ) {
+        *evictions = intcache->evictions;
+    }
+    INTCACHE_MUTEX_UNLOCK( &intcache->mutex );    
+}
+
+
+#undef INTCACHE_MUTEX_LOCK
+#undef INTCACHE_MUTEX_UNLOCK
+
+#endif /* INTCACHE_IMPLEMENTATION */
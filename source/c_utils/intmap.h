@@ -2,17 +2,146 @@
 #define intmap_h
 
 // To make intmap thread safe, do this before include: #define INTMAP_THREAD_SAFE
+// The thread safe intmap is split into 64 separately locked stripes. To use a different number, which must be a power of 
+// two, #define INTMAP_STRIPE_COUNT as well. Other builds have a single stripe, unless INTMAP_STRIPE_COUNT is defined.
+// When the keys are close together, like IDs counting up from 0, an intmap stops hashing them, and stores each item at
+// the index given by its key in a plain array instead, so finding a key is a bounds check and a load. It switches to 
+// this by itself when at least half of the keys in the range from the lowest to the highest key are in the map, and 
+// back to hashing when fewer than one in eight are, or when a key far outside of the range is added.
 
 typedef struct intmap_t intmap_t;
 
+#define INTMAP_NO_DENSE 1 // flag for intmap_create_ex, to always hash the keys, even when they are close together
+
 intmap_t* intmap_create( int item_size );
+
+// create a map with room for `capacity_hint` keys, so it does not grow until it has that many, or which starts out
+// smaller than intmap_create would make it, if the hint is small. A hint of 0 gives the same size as intmap_create.
+// `flags` is 0 or INTMAP_NO_DENSE.
+intmap_t* intmap_create_ex( int item_size, int capacity_hint, int flags );
+
 void intmap_destroy( intmap_t* intmap );
 void intmap_clear( intmap_t* intmap );
+
+// insert the key with a copy of the item, overwriting its item if the key is already in the map
 void intmap_insert( intmap_t* intmap, int key, void const* item );
+
 void intmap_remove( intmap_t* intmap, int key );
 bool intmap_update( intmap_t* intmap, int key, void const* item );
 bool intmap_find( intmap_t* intmap, int key, void* item );
 
+// like intmap_insert, but returns true if the key was inserted, and false if its item was overwritten. The key is only
+// looked up once, and in thread safe builds, the lock is only taken once.
+bool intmap_upsert( intmap_t* intmap, int key, void const* item );
+
+// add `amount` to the int64_t counter at the start of the item of the key, inserting the key with an item of all zeros
+// first if it is not in the map, and return the new value of the counter. The item size must be at least 8 bytes. In 
+// thread safe builds, this is done while holding the lock, so no additions are lost when several threads count at once.
+int64_t intmap_add_i64( intmap_t* intmap, int key, int64_t amount );
+
+// call `callback` with a pointer to the item of the key as it is stored in the map, so it can be read or changed in 
+// place without being copied. In thread safe builds, the lock is held during the call, so the callback must be quick, 
+// and must not call any other intmap function on the same map. Returns false, without calling `callback`, if the key
+// is not in the map.
+bool intmap_with( intmap_t* intmap, int key, void (*callback)( void* user_data, void* item ), void* user_data );
+
+#ifndef INTMAP_THREAD_SAFE
+    // return a pointer to the item of the key as it is stored in the map, or NULL if the key is not in the map. The 
+    // pointer is only valid until the next insert, upsert or remove. Not available in thread safe builds, where the
+    // item could be changed or moved by another thread while the pointer is used; use intmap_with instead.
+    void* intmap_get_ptr( intmap_t* intmap, int key );
+#endif
+
+// look up `count` keys at once, copy the item of each key which is found to `items`, at the same index as the key,
+// and set the same entry of `found` (which may be NULL) to whether the key was found. Returns the number of keys found.
+// In thread safe builds, each stripe is locked once.
+int intmap_find_many( intmap_t* intmap, int const* keys, int count, void* items, bool* found );
+
+// insert `count` keys, with the item of each key at the same index in `items`, overwriting the item of any key which is
+// already in the map, or given more than once. In thread safe builds, each stripe is locked once, or while the keys are
+// stored by index, all of them are locked together.
+void intmap_insert_many( intmap_t* intmap, int const* keys, void const* items, int count );
+
+// give the number of keys in the map
+int intmap_count( intmap_t* intmap );
+
+// call `callback` for each key in the map, with a pointer to its item as it is stored in the map, so it can be changed
+// in place. In thread safe builds, stripes are locked while they are visited, so the callback must not call any other
+// intmap function on the same map.
+void intmap_foreach( intmap_t* intmap, void (*callback)( void* user_data, int key, void* item ), void* user_data );
+
+// call `callback` with the keys and items of the map as they are stored in it, in runs of `count` keys, with `items` 
+// holding the item of each key at the same index. `part` is always 0. Locking is as for intmap_foreach.
+void intmap_foreach_span( intmap_t* intmap, 
+    void (*callback)( void* user_data, int part, int const* keys, void* items, int count ), void* user_data );
+
+// like intmap_foreach_span, but with the keys split into at most `thread_count` parts, each given to `callback` from a
+// thread of its own, with `part` telling which one. In thread safe builds, all the stripes are locked for the whole
+// call. Threads are only used if thread.h is included before the implementation.
+void intmap_foreach_parallel( intmap_t* intmap, int thread_count, 
+    void (*callback)( void* user_data, int part, int const* keys, void* items, int count ), void* user_data );
+
+// give the map a Bloom filter with `bits_per_key` bits for each key, checked by lookups to rule out most missing
+// keys before the hashtable is searched, or remove it if `bits_per_key` is 0. It is not used while the keys are stored
+// by index.
+void intmap_bloom_filter( intmap_t* intmap, int bits_per_key );
+
+// give the number of bytes used by the Bloom filter, and the chance of it not ruling out a key which is not in the map
+void intmap_bloom_filter_stats( intmap_t* intmap, int* memory, float* false_positive_rate );
+
+// only available if buffer.h is included before intmap.h
+#ifdef buffer_h
+    // write the map to a buffer, as copies of the arrays of its hashtables, so it can be loaded without inserting any
+    // keys. Items are written as plain bytes, so they should not hold pointers. In thread safe builds, all the stripes
+    // are locked while the map is written. Returns false if the map does not fit in a buffer.
+    bool intmap_save( intmap_t* intmap, buffer_t* buffer );
+
+    // create an intmap from data written by intmap_save, starting at the current position of the buffer. Returns NULL
+    // if the data is not a saved intmap, or was saved on a machine with a different byte order. A map saved by a build
+    // with a different number of stripes can still be loaded, but its keys are then inserted one by one.
+    intmap_t* intmap_load( buffer_t* buffer );
+#endif
+
+// A snapshot is a read-only view of an intmap as it was when taken, which any number of threads can read without
+// locking while the map goes on changing. Nothing is copied when it is taken. Instead, the map copies a part of itself
+// the first time it changes it afterwards: a page of about 64 KB while the keys are stored by index, or otherwise the
+// hashtable of a stripe. With a single stripe, as in builds that are not thread safe unless INTMAP_STRIPE_COUNT is
+// defined, that is a copy of the whole map. The foreach functions copy every part they visit.
+typedef struct intmap_snapshot_t intmap_snapshot_t;
+
+// take a snapshot of the map. In thread safe builds, all the stripes are locked while it is taken.
+intmap_snapshot_t* intmap_snapshot( intmap_t* intmap );
+
+// release a snapshot, freeing the parts of it the map no longer uses. Takes no lock, and can be done after the map is
+// destroyed.
+void intmap_snapshot_release( intmap_snapshot_t* snapshot );
+
+int intmap_snapshot_count( intmap_snapshot_t const* snapshot );
+bool intmap_snapshot_find( intmap_snapshot_t const* snapshot, int key, void* item );
+
+// call `callback` with the keys and items of the snapshot in runs of `count` keys, as intmap_foreach_span does
+void intmap_snapshot_foreach_span( intmap_snapshot_t const* snapshot,
+    void (*callback)( void* user_data, int const* keys, void const* items, int count ), void* user_data );
+
+// A frozen intmap is a read-only copy of an intmap, which finds keys through a minimal perfect hash, so a lookup is one
+// hash and two memory reads (three for a few percent of the keys), and any number of threads can read it without
+// locking. It is a single flat block of memory, which can be written to a file as it is, and used directly when loaded
+// or memory mapped. Items are copied as plain bytes, so they should not hold pointers if the frozen intmap is saved.
+typedef struct intmap_frozen_t intmap_frozen_t;
+
+// build a frozen copy of the current contents of an intmap, and give its size in bytes. Returns NULL if it is too big.
+intmap_frozen_t* intmap_freeze( intmap_t* intmap, int* size );
+
+// release a frozen intmap returned by intmap_freeze
+void intmap_frozen_destroy( intmap_frozen_t* frozen );
+
+// use a block of memory holding a saved frozen intmap, without copying it. The memory must be aligned to 4 bytes and be 
+// kept around while the frozen intmap is used. Returns NULL if it is not a frozen intmap with items of `item_size` bytes.
+intmap_frozen_t const* intmap_frozen_map( void const* data, int size, int item_size );
+
+int intmap_frozen_count( intmap_frozen_t const* frozen );
+bool intmap_frozen_find( intmap_frozen_t const* frozen, int key, void* item );
+
 #endif /* intmap_h */
 
 
@@ -22,6 +151,7 @@ bool intmap_find( intmap_t* intmap, int key, void* item );
 #include <stdlib.h>
 #include <string.h>
 #include "hashtable.h"
+#include "bloom.h"
 
 static uint32_t intmap_hash_u32( uint32_t key ) {
     key = ~key + ( key << 15 );
@@ -34,12 +164,86 @@ static uint32_t intmap_hash_u32( uint32_t key ) {
 }
 
 
-typedef struct intmap_t {
+// In thread safe mode, the map is split into a number of stripes, each a hashtable of its own with its own lock, and
+// every key belongs to exactly one stripe, picked from its hash. Threads working on keys in different stripes never 
+// wait for each other, and a stripe growing its table only holds up the keys of that stripe, not the whole map.
+#ifdef INTMAP_THREAD_SAFE
+    #ifndef INTMAP_STRIPE_COUNT
+        #define INTMAP_STRIPE_COUNT 64
+    #endif
+#else
+    #ifndef INTMAP_STRIPE_COUNT
+        #define INTMAP_STRIPE_COUNT 1
+    #endif
+#endif
+
+
+// Snapshots are released without taking any lock, so in thread safe builds, the memory they share with the map is
+// counted with atomics
+#ifdef INTMAP_THREAD_SAFE
+    typedef thread_atomic_int_t intmap_refs_t;
+    #define INTMAP_REFS_INIT(x) thread_atomic_int_store( (x), 1 )
+    #define INTMAP_REFS_LOAD(x) thread_atomic_int_load( (x) )
+    #define INTMAP_REFS_INC(x) thread_atomic_int_inc( (x) )
+    #define INTMAP_REFS_DEC(x) thread_atomic_int_dec( (x) )
+#else
+    typedef int intmap_refs_t;
+    #define INTMAP_REFS_INIT(x) ( *(x) = 1 )
+    #define INTMAP_REFS_LOAD(x) ( *(x) )
+    #define INTMAP_REFS_INC(x) ( (*(x))++ )
+    #define INTMAP_REFS_DEC(x) ( (*(x))-- )
+#endif
+
+
+// The hashtable of a stripe, once a snapshot is taken of it. The stripe keeps reading from its table as it is, and
+// makes a copy of its own the first time it is about to change it, unless the snapshots have all been released by then.
+typedef struct intmap_shared_t {
+    intmap_refs_t refs; // the stripe, if it still uses the table, and each snapshot using it
     hashtable_t hashtable;
-    int item_size;
+} intmap_shared_t;
+
+
+// The dense arrays are split into pages, each holding the items of a range of keys, followed by a byte for each key
+// telling if it is in the map, so that a page can be shared with snapshots, and copied on its own when it is changed
+typedef struct intmap_page_t {
+    intmap_refs_t refs; // the map, if it still uses the page, and each snapshot using it
+    int capacity;
+    unsigned char* used;
+    // followed by the items
+} intmap_page_t;
+
+
+typedef struct intmap_stripe_t {
     #ifdef INTMAP_THREAD_SAFE
         thread_mutex_t mutex;
     #endif
+    hashtable_t hashtable;
+    intmap_shared_t* shared; // NULL unless the hashtable is shared with a snapshot
+    bloom_t bloom;
+    int dense_count; // the number of keys of this stripe which are in the dense arrays
+    int check_count; // the count of keys at which to see if the map should switch between dense and hashed keys
+    #ifdef INTMAP_THREAD_SAFE
+        char padding[ 64 ]; // keep the next stripe's mutex off the cache lines this stripe writes to
+    #endif
+} intmap_stripe_t;
+
+
+// When the map is dense, the keys are not in the hashtables of the stripes, but in two arrays covering the keys from
+// `dense_base` on, one holding the items, and one with a byte for each item, telling if its key is in the map. Bytes
+// rather than bits, so keys of different stripes never share a value which has to be written. The stripe of a key, and
+// so the lock guarding it, is picked from its hash either way, and switching between the two takes all of the locks,
+// so a stripe lock is enough to read which way the keys are stored. Both arrays are split into pages of a power of two
+// keys, with `dense_pages` pointing to each of them.
+typedef struct intmap_t {
+    int item_size;
+    int flags;
+    bool dense;
+    int dense_base;
+    int dense_capacity;
+    int dense_shift; // the number of keys in a page is 1 << dense_shift
+    intmap_page_t** dense_pages;
+    int next_scan; // the total count at which to next look for the lowest and highest key, while hashed
+    intmap_stripe_t stripes[ INTMAP_STRIPE_COUNT ];
 } intmap_t;
 
 
@@ -52,74 +256,1633 @@ typedef struct intmap_t {
 #endif
 
 
+static int intmap_stripe_index( uint32_t hash ) {
+    // The hashtable uses both the low and the high bits of the hash, so the stripe is picked from a remix of it, to 
+    // not leave each stripe with only a fraction of the possible hash values
+    return (int)( ( ( hash * 0x9e3779b9u ) >> 16 ) & ( INTMAP_STRIPE_COUNT - 1 ) );
+}
+
+
+static intmap_stripe_t* intmap_stripe( intmap_t* intmap, uint32_t hash ) {
+    return &intmap->stripes[ intmap_stripe_index( hash ) ];
+}
+
+
+// The Bloom filter of a stripe is built from the keys in its hashtable, with room for twice as many, and is built again
+// when it has had as many keys added as it has room for. Removed keys stay in the filter until then.
+static void intmap_bloom_rebuild( intmap_stripe_t* stripe, int bits_per_key ) {
+    bloom_term( &stripe->bloom );
+    if( bits_per_key <= 0 ) {
+        return;
+    }
+    int count = hashtable_count( &stripe->hashtable );
+    bloom_init( &stripe->bloom, count > 32 ? count * 2 : 64, bits_per_key );
+    int const* keys = (int const*) hashtable_keys( &stripe->hashtable );
+    for( int i = 0; i < count; ++i ) {
+        bloom_add( &stripe->bloom, intmap_hash_u32( (uint32_t) keys[ i ] ) );
+    }
+}
+
+
+static void intmap_bloom_add( intmap_stripe_t* stripe, uint32_t hash ) {
+    if( !stripe->bloom.memory ) {
+        return;
+    } else if( stripe->bloom.count < stripe->bloom.capacity ) {
+        bloom_add( &stripe->bloom, hash );
+    } else {
+        intmap_bloom_rebuild( stripe, stripe->bloom.bits_per_key );
+    }
+}
+
+
+// Returns true if the stripe has a Bloom filter, and the filter says the key is not in the stripe
+static bool intmap_bloom_excludes( intmap_stripe_t const* stripe, uint32_t hash ) {
+    return stripe->bloom.memory && !bloom_test( &stripe->bloom, hash );
+}
+
+
+static int intmap_initial_capacity( void ) {
+    return 256 / INTMAP_STRIPE_COUNT > 16 ? 256 / INTMAP_STRIPE_COUNT : 16;
+}
+
+
+// Stripes are always locked in order, so threads locking more than one of them never wait for each other in a circle
+static void intmap_lock_stripes( intmap_t* intmap, int first ) {
+    (void) intmap; // unused when not thread safe
+    for( int i = first; i < INTMAP_STRIPE_COUNT; ++i ) {
+        INTMAP_MUTEX_LOCK( &intmap->stripes[ i ].mutex );
+    }
+}
+
+
+static void intmap_unlock_stripes( intmap_t* intmap, int first ) {
+    (void) intmap; // unused when not thread safe
+    for( int i = first; i < INTMAP_STRIPE_COUNT; ++i ) {
+        INTMAP_MUTEX_UNLOCK( &intmap->stripes[ i ].mutex );    
+    }
+}
+
+
+static int intmap_page_count( int capacity, int shift ) {
+    return (int)( ( (int64_t) capacity + ( 1 << shift ) - 1 ) >> shift );
+}
+
+
+static intmap_page_t* intmap_page_create( intmap_t* intmap, int capacity ) {
+    size_t const items_size = (size_t) capacity * (size_t) intmap->item_size;
+    intmap_page_t* page = (intmap_page_t*) malloc( sizeof( intmap_page_t ) + items_size + (size_t) capacity );
+    INTMAP_REFS_INIT( &page->refs );
+    page->capacity = capacity;
+    page->used = (unsigned char*)( page + 1 ) + items_size;
+    memset( page->used, 0, (size_t) capacity );
+    return page;
+}
+
+
+static void intmap_page_release( intmap_page_t* page ) {
+    if( INTMAP_REFS_DEC( &page->refs ) == 1 ) {
+        free( page );
+    }
+}
+
+
+static char* intmap_page_item( intmap_page_t const* page, int offset, int item_size ) {
+    return (char*)( page + 1 ) + (size_t) offset * (size_t) item_size;
+}
+
+
+static char* intmap_dense_item( intmap_t* intmap, int index ) {
+    return intmap_page_item( intmap->dense_pages[ index >> intmap->dense_shift ],
+        index & ( ( 1 << intmap->dense_shift ) - 1 ), intmap->item_size );
+}
+
+
+static unsigned char* intmap_dense_used( intmap_t* intmap, int index ) {
+    return intmap->dense_pages[ index >> intmap->dense_shift ]->used + ( index & ( ( 1 << intmap->dense_shift ) - 1 ) );
+}
+
+
+// Lets go of the pages of the dense arrays, freeing those which no snapshot uses. All stripes must be locked.
+static void intmap_dense_free( intmap_t* intmap ) {
+    int const page_count = intmap_page_count( intmap->dense_capacity, intmap->dense_shift );
+    for( int i = 0; i < page_count; ++i ) {
+        intmap_page_release( intmap->dense_pages[ i ] );
+    }
+    free( intmap->dense_pages );
+    intmap->dense = false;
+    intmap->dense_base = 0;
+    intmap->dense_capacity = 0;
+    intmap->dense_pages = NULL;
+}
+
+
+static void intmap_shared_release( intmap_shared_t* shared ) {
+    if( INTMAP_REFS_DEC( &shared->refs ) == 1 ) {
+        hashtable_term( &shared->hashtable );
+        free( shared );
+    }
+}
+
+
+// Lets go of the hashtable of a stripe, freeing it unless a snapshot still uses it, and gives the stripe a new one with
+// room for `capacity` keys, or none if `capacity` is 0. The stripe must be locked.
+static void intmap_table_reset( intmap_t* intmap, intmap_stripe_t* stripe, int capacity ) {
+    if( stripe->shared ) {
+        intmap_shared_release( stripe->shared );
+        stripe->shared = NULL;
+    } else {
+        hashtable_term( &stripe->hashtable );
+    }
+    if( capacity > 0 ) {
+        hashtable_init( &stripe->hashtable, sizeof( int ), intmap->item_size, capacity, NULL );
+    }
+}
+
+
+// Gives a stripe a hashtable of its own again, if the one it has is shared with a snapshot, before it is changed. The
+// copy is made by saving the shared table and loading it, which only reads from it, as any resize was finished before
+// it was shared. If the snapshots have all been released, the table is taken back as it is. The stripe must be locked.
+static void intmap_unshare_table( intmap_t* intmap, intmap_stripe_t* stripe ) {
+    intmap_shared_t* shared = stripe->shared;
+    if( !shared ) {
+        return;
+    }
+    if( INTMAP_REFS_LOAD( &shared->refs ) > 1 ) {
+        HASHTABLE_U64 const size = hashtable_save_size( &shared->hashtable );
+        void* data = malloc( (size_t) size );
+        hashtable_save( &shared->hashtable, data );
+        hashtable_load( &stripe->hashtable, sizeof( int ), intmap->item_size, data, size, NULL );
+        free( data );
+        intmap_shared_release( shared );
+    } else {
+        free( shared );
+    }
+    stripe->shared = NULL;
+}
+
+
+// Gives the map a copy of its own of a page of the dense arrays, if the page is shared with a snapshot. Keys of every
+// stripe are in the page, so all stripes must be locked.
+static void intmap_unshare_page( intmap_t* intmap, int page_index ) {
+    intmap_page_t* page = intmap->dense_pages[ page_index ];
+    if( INTMAP_REFS_LOAD( &page->refs ) == 1 ) {
+        return;
+    }
+    intmap_page_t* copy = intmap_page_create( intmap, page->capacity );
+    memcpy( copy + 1, page + 1, (size_t) page->capacity * ( (size_t) intmap->item_size + 1 ) );
+    intmap->dense_pages[ page_index ] = copy;
+    intmap_page_release( page );
+}
+
+
+// Gives the map a copy of its own of the page holding the key, if the keys are stored by index and the key is within
+// the dense arrays. All stripes must be locked.
+static void intmap_unshare_key( intmap_t* intmap, int key ) {
+    uint32_t const index = (uint32_t) key - (uint32_t) intmap->dense_base;
+    if( intmap->dense && index < (uint32_t) intmap->dense_capacity ) {
+        intmap_unshare_page( intmap, (int)( index >> intmap->dense_shift ) );
+    }
+}
+
+
+// Returns true if the item of the key can be changed, or the key inserted, with the stripe of the key locked, after
+// giving the stripe a hashtable of its own, if needed. Returns false if the key is in a page of the dense arrays which
+// is shared with a snapshot, as copying the page takes all the stripes locked, to keep keys of the other stripes in it
+// from being changed while it is copied.
+static bool intmap_writable( intmap_t* intmap, intmap_stripe_t* stripe, int key ) {
+    if( !intmap->dense ) {
+        intmap_unshare_table( intmap, stripe );
+        return true;
+    }
+    uint32_t const index = (uint32_t) key - (uint32_t) intmap->dense_base;
+    return index >= (uint32_t) intmap->dense_capacity ||
+        INTMAP_REFS_LOAD( &intmap->dense_pages[ index >> intmap->dense_shift ]->refs ) == 1;
+}
+
+
+// Locks the stripe of the key, and makes sure the item of the key can be changed, copying its page of the dense arrays
+// if it has to. The stripe is unlocked while all of them are locked for that, so the map may have changed by the time
+// it is locked again, and is looked at once more.
+static void intmap_lock_writable( intmap_t* intmap, intmap_stripe_t* stripe, int key ) {
+    INTMAP_MUTEX_LOCK( &stripe->mutex );
+    while( !intmap_writable( intmap, stripe, key ) ) {
+        INTMAP_MUTEX_UNLOCK( &stripe->mutex );
+        intmap_lock_stripes( intmap, 0 );
+        intmap_unshare_key( intmap, key );
+        intmap_unlock_stripes( intmap, 0 );
+        INTMAP_MUTEX_LOCK( &stripe->mutex );
+    }
+}
+
+
+// Makes sure all the items in the dense arrays can be changed, for the functions giving their callback the items of
+// the map stripe by stripe, once they find it dense at stripe `first`, with that stripe and the ones after it locked.
+// Copying pages shared with a snapshot takes all the stripes locked, so if there are any, the stripes before `first`
+// are locked as well, after unlocking the rest, to keep to the order stripes are locked in. Returns false if the map
+// is no longer dense by then, with only stripe `first` left locked.
+static bool intmap_dense_writable( intmap_t* intmap, int first ) {
+    int const page_count = intmap_page_count( intmap->dense_capacity, intmap->dense_shift );
+    bool shared = false;
+    for( int i = 0; i < page_count && !shared; ++i ) {
+        shared = INTMAP_REFS_LOAD( &intmap->dense_pages[ i ]->refs ) > 1;
+    }
+    if( !shared ) {
+        return true;
+    }
+    if( first > 0 ) {
+        intmap_unlock_stripes( intmap, first );
+        intmap_lock_stripes( intmap, 0 );
+    }
+    bool const dense = intmap->dense;
+    for( int i = 0; dense && i < intmap_page_count( intmap->dense_capacity, intmap->dense_shift ); ++i ) {
+        intmap_unshare_page( intmap, i );
+    }
+    for( int i = 0; i < INTMAP_STRIPE_COUNT && first > 0; ++i ) {
+        if( i < first || ( !dense && i > first ) ) {
+            INTMAP_MUTEX_UNLOCK( &intmap->stripes[ i ].mutex );
+        }
+    }
+    return dense;
+}
+
+
+// Returns the item of the key, or NULL if it is not in the map. The stripe of the key must be locked.
+static void* intmap_find_item( intmap_t* intmap, intmap_stripe_t* stripe, uint32_t hash, int key ) {
+    if( intmap->dense ) {
+        uint32_t const index = (uint32_t) key - (uint32_t) intmap->dense_base;
+        return index < (uint32_t) intmap->dense_capacity && *intmap_dense_used( intmap, (int) index ) ? 
+            intmap_dense_item( intmap, (int) index ) : NULL;
+    }
+    return intmap_bloom_excludes( stripe, hash ) ? NULL : hashtable_find( &stripe->hashtable, hash, &key );
+}
+
+
+// Returns the item of the key, inserting the key with an item of all zeros first if it is not in the map, and sets 
+// `inserted` to whether it was. Returns NULL if the map is dense and the key is outside of the dense arrays, which then
+// have to be made to fit it, by intmap_rebalance, before trying again. The stripe of the key must be locked, and 
+// intmap_writable must have returned true for the key.
+static void* intmap_find_or_insert_item( intmap_t* intmap, intmap_stripe_t* stripe, uint32_t hash, int key, 
+    int* inserted ) {
+
+    if( intmap->dense ) {
+        uint32_t const index = (uint32_t) key - (uint32_t) intmap->dense_base;
+        if( index >= (uint32_t) intmap->dense_capacity ) {
+            return NULL;
+        }
+        char* item = intmap_dense_item( intmap, (int) index );
+        unsigned char* used = intmap_dense_used( intmap, (int) index );
+        *inserted = !*used;
+        if( *inserted ) {
+            memset( item, 0, (size_t) intmap->item_size );
+            *used = 1;
+            ++stripe->dense_count;
+        }
+        return item;
+    }
+    void* item = hashtable_find_or_insert( &stripe->hashtable, hash, &key, inserted );
+    if( *inserted ) {
+        intmap_bloom_add( stripe, hash );
+    }
+    return item;
+}
+
+
+// Moves all the keys into new dense arrays covering `capacity` keys from `base`, either from the dense arrays the map
+// already has, which must all be within the new ones, or from the hashtables of the stripes, which are then emptied.
+// The old pages and hashtables are kept for any snapshot still using them. All stripes must be locked.
+static void intmap_dense_build( intmap_t* intmap, int base, int capacity ) {
+    int const shift = intmap->dense_shift;
+    int const page_keys = 1 << shift;
+    int const page_count = intmap_page_count( capacity, shift );
+    intmap_page_t** pages = (intmap_page_t**) malloc( (size_t) page_count * sizeof( intmap_page_t* ) );
+    for( int i = 0; i < page_count; ++i ) {
+        int const left = capacity - i * page_keys;
+        pages[ i ] = intmap_page_create( intmap, left < page_keys ? left : page_keys );
+    }
+    bool const dense = intmap->dense;
+    int const old_base = intmap->dense_base;
+    int const old_capacity = intmap->dense_capacity;
+    intmap_page_t** old_pages = intmap->dense_pages;
+    intmap->dense = true;
+    intmap->dense_base = base;
+    intmap->dense_capacity = capacity;
+    intmap->dense_pages = pages;
+
+    size_t const item_size = (size_t) intmap->item_size;
+    if( dense ) {
+        // The old arrays are copied in runs which end where a page of either the old or the new arrays does
+        int const offset = (int)( (uint32_t) old_base - (uint32_t) base );
+        for( int i = 0; i < old_capacity; ) {
+            intmap_page_t const* page = old_pages[ i >> shift ];
+            int const from = i & ( page_keys - 1 );
+            int count = page->capacity - from;
+            count = count < page_keys - ( ( offset + i ) & ( page_keys - 1 ) ) ? 
+                count : page_keys - ( ( offset + i ) & ( page_keys - 1 ) );
+            memcpy( intmap_dense_item( intmap, offset + i ), intmap_page_item( page, from, intmap->item_size ), 
+                (size_t) count * item_size );
+            memcpy( intmap_dense_used( intmap, offset + i ), page->used + from, (size_t) count );
+            i += count;
+        }
+        for( int i = 0; i < intmap_page_count( old_capacity, shift ); ++i ) {
+            intmap_page_release( old_pages[ i ] );
+        }
+        free( old_pages );
+    } else {
+        for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+            intmap_stripe_t* stripe = &intmap->stripes[ i ];
+            int count = hashtable_count( &stripe->hashtable );
+            int const* keys = (int const*) hashtable_keys( &stripe->hashtable );
+            char const* stripe_items = (char const*) hashtable_items( &stripe->hashtable );
+            for( int j = 0; j < count; ++j ) {
+                int const index = (int)( (uint32_t) keys[ j ] - (uint32_t) base );
+                memcpy( intmap_dense_item( intmap, index ), stripe_items + (size_t) j * item_size, item_size );
+                *intmap_dense_used( intmap, index ) = 1;
+            }
+            stripe->dense_count = count;
+            intmap_table_reset( intmap, stripe, intmap_initial_capacity() );
+        }
+    }
+}
+
+
+// Moves all the keys from the dense arrays back into the hashtables of their stripes. All stripes must be locked.
+static void intmap_dense_release( intmap_t* intmap ) {
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        intmap_table_reset( intmap, stripe, 
+            stripe->dense_count > intmap_initial_capacity() ? stripe->dense_count : intmap_initial_capacity() );
+        stripe->dense_count = 0;
+    }
+    for( int i = 0; i < intmap->dense_capacity; ++i ) {
+        if( *intmap_dense_used( intmap, i ) ) {
+            int key = intmap->dense_base + i;
+            uint32_t hash = intmap_hash_u32( (uint32_t) key );
+            hashtable_insert( &intmap_stripe( intmap, hash )->hashtable, hash, &key, intmap_dense_item( intmap, i ) );
+        }
+    }
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        if( stripe->bloom.memory ) {
+            intmap_bloom_rebuild( stripe, stripe->bloom.bits_per_key );
+        }
+    }
+    intmap_dense_free( intmap );
+}
+
+
+// Dense arrays from `low` to `high`, with `extra` room past them on the side given by `grow_down`, as long as they fit 
+// in the range of an int. Returns false if the keys from `low` to `high` do not fit in an int count.
+static bool intmap_dense_range( int64_t low, int64_t high, int64_t extra, bool grow_down, int* base, int* capacity ) {
+    int64_t const max_capacity = 0x7fffffff;
+    if( high - low + 1 > max_capacity ) {
+        return false;
+    }
+    int64_t size = high - low + 1 + extra;
+    size = size < max_capacity ? size : max_capacity;
+    int64_t start = grow_down ? high - size + 1 : low;
+    start = start > (int64_t) INT32_MIN ? start : (int64_t) INT32_MIN;
+    size = start + size - 1 < (int64_t) INT32_MAX ? size : (int64_t) INT32_MAX - start + 1;
+    size = size < max_capacity ? size : max_capacity;
+    *base = (int) start;
+    *capacity = (int) size;
+    return true;
+}
+
+
+// Looks at the whole map to see if it should switch between hashed and dense keys. All stripes must be locked.
+// Hashed keys are made dense if at least half of the keys from the lowest to the highest are in the map, and dense 
+// keys go back to being hashed if fewer than one in eight of the keys covered by the dense arrays are in the map. If
+// `key` is not NULL, it is a key to make room for, by growing the dense arrays as long as at least one in four of the 
+// keys they cover would be in the map, and by switching to hashed keys if not. The lowest and highest keys are only
+// looked for each time the map has doubled in size, and each stripe is only checked again once it has grown by a 
+// share of the keys left until then, or while dense, shrunk to half its size, so the time spent here is small compared
+// to the inserts and removes leading up to it.
+static void intmap_rebalance_locked( intmap_t* intmap, int const* key ) {
+    int64_t count = 0;
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        count += intmap->dense ? stripe->dense_count : hashtable_count( &stripe->hashtable );
+    }
+
+    if( intmap->dense ) {
+        int64_t low = intmap->dense_base;
+        int64_t high = low + intmap->dense_capacity - 1;
+        int base = 0;
+        int capacity = 0;
+        if( key && ( *key < low || *key > high ) ) {
+            bool const grow_down = *key < low;
+            low = *key < low ? *key : low;
+            high = *key > high ? *key : high;
+            if( high - low + 1 <= ( count + 1 ) * 4 && 
+                intmap_dense_range( low, high, ( high - low + 1 ) / 2, grow_down, &base, &capacity ) ) {
+                intmap_dense_build( intmap, base, capacity );
+            } else {
+                intmap_dense_release( intmap );
+                intmap->next_scan = (int)( count * 2 < 0x7fffffff ? count * 2 : 0x7fffffff );
+            }
+        } else if( count < intmap->dense_capacity / 8 ) {
+            intmap_dense_release( intmap );
+            intmap->next_scan = (int)( count * 2 );
+        }
+    } else if( !( intmap->flags & INTMAP_NO_DENSE ) && count > 0 && count >= intmap->next_scan ) {
+        intmap->next_scan = (int)( count * 2 < 0x7fffffff ? count * 2 : 0x7fffffff );
+        int64_t low = INT32_MAX;
+        int64_t high = INT32_MIN;
+        for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+            intmap_stripe_t* stripe = &intmap->stripes[ i ];
+            int stripe_count = hashtable_count( &stripe->hashtable );
+            int const* keys = (int const*) hashtable_keys( &stripe->hashtable );
+            for( int j = 0; j < stripe_count; ++j ) {
+                low = keys[ j ] < low ? keys[ j ] : low;
+                high = keys[ j ] > high ? keys[ j ] : high;
+            }
+        }
+        int base = 0;
+        int capacity = 0;
+        if( high - low + 1 <= count * 2 && 
+            intmap_dense_range( low, high, ( high - low + 1 ) / 4, false, &base, &capacity ) ) {
+            intmap_dense_build( intmap, base, capacity );
+        }
+    }
+
+    // The stripes grow at about the same rate, so giving each an even share of the keys left until the next scan has
+    // the first of them get there close to when the whole map does
+    int64_t const left = ( intmap->next_scan - count ) / INTMAP_STRIPE_COUNT;
+    int const share = (int)( left > 16 ? left : 16 );
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        int const stripe_count = hashtable_count( &stripe->hashtable );
+        stripe->check_count = intmap->dense ? stripe->dense_count / 2 : 
+            ( stripe_count < 0x7fffffff - share ? stripe_count + share : 0x7fffffff );
+    }
+}
+
+
+static void intmap_rebalance( intmap_t* intmap, int const* key ) {
+    intmap_lock_stripes( intmap, 0 );
+    intmap_rebalance_locked( intmap, key );
+    intmap_unlock_stripes( intmap, 0 );
+}
+
+
+// Returns true if the key is in the stripe `first_stripe` or one after it. Used when going through the dense arrays
+// after the keys of the stripes before `first_stripe` have already been visited, while the map was still hashed.
+static bool intmap_dense_visits( intmap_t* intmap, int key, int first_stripe ) {
+    return first_stripe == 0 || intmap_stripe( intmap, intmap_hash_u32( (uint32_t) key ) ) - intmap->stripes >= 
+        first_stripe;
+}
+
+
+// Gives the keys and items in the dense arrays from index `begin` to `end` to the callback, in runs of keys which are
+// next to each other, within the same page. The keys are not stored, so each run has them written out to a local array.
+static void intmap_dense_spans( intmap_t* intmap, int begin, int end, int first_stripe, int part, 
+    void (*callback)( void* user_data, int part, int const* keys, void* items, int count ), void* user_data ) {
+
+    int keys[ 256 ];
+    int index = begin;
+    while( index < end ) {
+        int64_t const page_end = ( (int64_t) index | ( ( 1 << intmap->dense_shift ) - 1 ) ) + 1;
+        int const run_end = page_end < end ? (int) page_end : end;
+        int count = 0;
+        while( index + count < run_end && count < 256 && *intmap_dense_used( intmap, index + count ) && 
+            intmap_dense_visits( intmap, intmap->dense_base + index + count, first_stripe ) ) {
+            keys[ count ] = intmap->dense_base + index + count;
+            ++count;
+        }
+        if( count > 0 ) {
+            callback( user_data, part, keys, intmap_dense_item( intmap, index ), count );
+            index += count;
+        } else {
+            ++index;
+        }
+    }
+}
+
+
+// Locks the stripe of the key, and returns its item, inserting the key with an item of all zeros first if it is not
+// in the map, and setting `inserted` to whether it was. The caller unlocks the stripe, and then calls 
+// intmap_inserted, which sees if the map should switch to dense keys.
+static void* intmap_lock_item( intmap_t* intmap, int key, intmap_stripe_t** stripe, int* inserted ) {
+    uint32_t hash = intmap_hash_u32( (uint32_t) key );
+    *stripe = intmap_stripe( intmap, hash );
+    for( ; ; ) {
+        intmap_lock_writable( intmap, *stripe, key );
+        void* item = intmap_find_or_insert_item( intmap, *stripe, hash, key, inserted );
+        if( item ) {
+            return item;
+        }
+        INTMAP_MUTEX_UNLOCK( &( *stripe )->mutex );    
+        intmap_rebalance( intmap, &key );
+    }
+}
+
+
+// Returns true if the stripe of a key which was just inserted has grown enough to look at the whole map again. Must 
+// be called while the stripe is still locked.
+static bool intmap_inserted( intmap_t const* intmap, intmap_stripe_t const* stripe ) {
+    return !intmap->dense && !( intmap->flags & INTMAP_NO_DENSE ) && 
+        hashtable_count( &stripe->hashtable ) >= stripe->check_count;
+}
+
+
 intmap_t* intmap_create( int item_size ) {
+    return intmap_create_ex( item_size, 0, 0 );
+}
+
+
+intmap_t* intmap_create_ex( int item_size, int capacity_hint, int flags ) {
+    // Keys do not spread perfectly evenly over the stripes, so each stripe gets room for a bit more than its share
+    int share = ( capacity_hint + INTMAP_STRIPE_COUNT - 1 ) / INTMAP_STRIPE_COUNT;
+    share = INTMAP_STRIPE_COUNT > 1 ? share + share / 4 + 8 : share;
     intmap_t* intmap = (intmap_t*) malloc( sizeof( intmap_t ) );
-    int const initial_capacity = 256;
-    hashtable_init( &intmap->hashtable, sizeof( int ), item_size,  initial_capacity, NULL );
-    #ifdef INTMAP_THREAD_SAFE
-        thread_mutex_init( &intmap->mutex );
-    #endif
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        hashtable_init( &intmap->stripes[ i ].hashtable, sizeof( int ), item_size, 
+            capacity_hint > 0 ? 1 : intmap_initial_capacity(), NULL );
+        if( capacity_hint > 0 ) {
+            hashtable_reserve( &intmap->stripes[ i ].hashtable, share );
+        }
+        intmap->stripes[ i ].shared = NULL;
+        memset( &intmap->stripes[ i ].bloom, 0, sizeof( bloom_t ) );
+        intmap->stripes[ i ].dense_count = 0;
+        intmap->stripes[ i ].check_count = 16;
+        #ifdef INTMAP_THREAD_SAFE
+            thread_mutex_init( &intmap->stripes[ i ].mutex );
+        #endif
+    }
     intmap->item_size = item_size;
+    intmap->flags = flags;
+    intmap->dense = false;
+    intmap->dense_base = 0;
+    intmap->dense_capacity = 0;
+    intmap->dense_pages = NULL;
+    // Pages hold about 64 KB of items, and at least 256 keys, the longest run intmap_dense_spans gives
+    intmap->dense_shift = 8;
+    while( intmap->dense_shift < 16 && ( (int64_t) item_size << ( intmap->dense_shift + 1 ) ) <= 65536 ) {
+        ++intmap->dense_shift;
+    }
+    intmap->next_scan = 0;
     return intmap;
 }
 
 
 void intmap_destroy( intmap_t* intmap ) {
-    INTMAP_MUTEX_LOCK( &intmap->mutex );
-    hashtable_term( &intmap->hashtable );
-    INTMAP_MUTEX_UNLOCK( &intmap->mutex );    
-    #ifdef INTMAP_THREAD_SAFE
-        thread_mutex_term( &intmap->mutex );
-    #endif
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        INTMAP_MUTEX_LOCK( &stripe->mutex );
+        intmap_table_reset( intmap, stripe, 0 );
+        bloom_term( &stripe->bloom );
+        INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+        #ifdef INTMAP_THREAD_SAFE
+            thread_mutex_term( &stripe->mutex );
+        #endif
+    }
+    intmap_dense_free( intmap );
     free( intmap );
 }
 
 
 void intmap_clear( intmap_t* intmap ) {
-    INTMAP_MUTEX_LOCK( &intmap->mutex );
-    hashtable_clear( &intmap->hashtable );
-    INTMAP_MUTEX_UNLOCK( &intmap->mutex );    
+    intmap_lock_stripes( intmap, 0 );
+    intmap_dense_free( intmap );
+    intmap->next_scan = 0;
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        if( stripe->shared ) {
+            intmap_table_reset( intmap, stripe, intmap_initial_capacity() );
+        } else {
+            hashtable_clear( &stripe->hashtable );
+        }
+        if( stripe->bloom.memory ) {
+            bloom_clear( &stripe->bloom );
+        }
+        stripe->dense_count = 0;
+        stripe->check_count = 16;
+    }
+    intmap_unlock_stripes( intmap, 0 );
 }
 
 
 void intmap_insert( intmap_t* intmap, int key, void const* item ) {
-    INTMAP_MUTEX_LOCK( &intmap->mutex );
-    hashtable_insert( &intmap->hashtable, intmap_hash_u32( key ), &key, item );
-    INTMAP_MUTEX_UNLOCK( &intmap->mutex );    
+    intmap_stripe_t* stripe;
+    int inserted;
+    void* result = intmap_lock_item( intmap, key, &stripe, &inserted );
+    memcpy( result, item, (size_t) intmap->item_size );
+    bool check = intmap_inserted( intmap, stripe );
+    INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    if( check ) {
+        intmap_rebalance( intmap, NULL );
+    }
 }
 
 
 void intmap_remove( intmap_t* intmap, int key ) {
-    INTMAP_MUTEX_LOCK( &intmap->mutex );
-    hashtable_remove( &intmap->hashtable, intmap_hash_u32( key ), &key );
-    INTMAP_MUTEX_UNLOCK( &intmap->mutex );    
+    uint32_t hash = intmap_hash_u32( key );
+    intmap_stripe_t* stripe = intmap_stripe( intmap, hash );
+    intmap_lock_writable( intmap, stripe, key );
+    bool check = false;
+    if( intmap->dense ) {
+        uint32_t const index = (uint32_t) key - (uint32_t) intmap->dense_base;
+        if( index < (uint32_t) intmap->dense_capacity && *intmap_dense_used( intmap, (int) index ) ) {
+            *intmap_dense_used( intmap, (int) index ) = 0;
+            --stripe->dense_count;
+            check = stripe->dense_count <= stripe->check_count;
+        }
+    } else if( !intmap_bloom_excludes( stripe, hash ) ) {
+        hashtable_remove( &stripe->hashtable, hash, &key );
+    }
+    INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    if( check ) {
+        intmap_rebalance( intmap, NULL );
+    }
 }
 
 
 bool intmap_update( intmap_t* intmap, int key, void const* item ) {
-    INTMAP_MUTEX_LOCK( &intmap->mutex );
-    void* result = hashtable_find( &intmap->hashtable, intmap_hash_u32( key ), &key );
+    uint32_t hash = intmap_hash_u32( key );
+    intmap_stripe_t* stripe = intmap_stripe( intmap, hash );
+    intmap_lock_writable( intmap, stripe, key );
+    void* result = intmap_find_item( intmap, stripe, hash, key );
     if( result ) {
         memcpy( result, item, (size_t) intmap->item_size );
     }
-    INTMAP_MUTEX_UNLOCK( &intmap->mutex );    
+    INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
     return result != NULL;
 }
 
 
 bool intmap_find( intmap_t* intmap, int key, void* item ) {
-    INTMAP_MUTEX_LOCK( &intmap->mutex );
-    void const* result = hashtable_find( &intmap->hashtable, intmap_hash_u32( key ), &key );
+    uint32_t hash = intmap_hash_u32( key );
+    intmap_stripe_t* stripe = intmap_stripe( intmap, hash );
+    INTMAP_MUTEX_LOCK( &stripe->mutex );
+    void const* result = intmap_find_item( intmap, stripe, hash, key );
     if( result ) {
         memcpy( item, result, (size_t) intmap->item_size );
     }
-    INTMAP_MUTEX_UNLOCK( &intmap->mutex );    
+    INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    return result != NULL;
+}
+
+
+bool intmap_upsert( intmap_t* intmap, int key, void const* item ) {
+    intmap_stripe_t* stripe;
+    int inserted;
+    void* result = intmap_lock_item( intmap, key, &stripe, &inserted );
+    memcpy( result, item, (size_t) intmap->item_size );
+    bool check = intmap_inserted( intmap, stripe );
+    INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    if( check ) {
+        intmap_rebalance( intmap, NULL );
+    }
+    return inserted != 0;
+}
+
+
+int64_t intmap_add_i64( intmap_t* intmap, int key, int64_t amount ) {
+    intmap_stripe_t* stripe;
+    int inserted;
+    void* result = intmap_lock_item( intmap, key, &stripe, &inserted );
+    int64_t value;
+    memcpy( &value, result, sizeof( value ) ); // items are only aligned to their size, which may not be a multiple of 8
+    value += amount;
+    memcpy( result, &value, sizeof( value ) );
+    bool check = intmap_inserted( intmap, stripe );
+    INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    if( check ) {
+        intmap_rebalance( intmap, NULL );
+    }
+    return value;
+}
+
+
+bool intmap_with( intmap_t* intmap, int key, void (*callback)( void* user_data, void* item ), void* user_data ) {
+    uint32_t hash = intmap_hash_u32( key );
+    intmap_stripe_t* stripe = intmap_stripe( intmap, hash );
+    intmap_lock_writable( intmap, stripe, key );
+    void* result = intmap_find_item( intmap, stripe, hash, key );
+    if( result ) {
+        callback( user_data, result );
+    }
+    INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
     return result != NULL;
 }
 
 
+#ifndef INTMAP_THREAD_SAFE
+    void* intmap_get_ptr( intmap_t* intmap, int key ) {
+        uint32_t hash = intmap_hash_u32( key );
+        intmap_stripe_t* stripe = intmap_stripe( intmap, hash );
+        intmap_lock_writable( intmap, stripe, key ); // nothing is locked, but the item is copied if a snapshot has it
+        return intmap_find_item( intmap, stripe, hash, key );
+    }
+#endif
+
+
+int intmap_find_many( intmap_t* intmap, int const* keys, int count, void* items, bool* found ) {
+    if( count <= 0 ) return 0;
+
+    void** results = (void**) malloc( (size_t) count * ( sizeof( void* ) + sizeof( uint32_t ) * 2 + sizeof( int ) + 
+        sizeof( int ) ) );
+    uint32_t* hashes = (uint32_t*)( results + count );
+    for( int i = 0; i < count; ++i ) hashes[ i ] = intmap_hash_u32( (uint32_t) keys[ i ] );
+
+    // The keys are sorted by stripe, so that each stripe is locked only once, and all of its keys are looked up in one
+    // call to hashtable_find_batch. With a single stripe, they can be used as they are.
+    int stripe_start[ INTMAP_STRIPE_COUNT + 1 ] = { 0 };
+    uint32_t const* sorted_hashes = hashes;
+    int const* sorted_keys = keys;
+    int* order = NULL;
+    if( INTMAP_STRIPE_COUNT > 1 ) {
+        uint32_t* stripe_hashes = hashes + count;
+        int* stripe_keys = (int*)( stripe_hashes + count );
+        order = (int*)( stripe_keys + count );
+        for( int i = 0; i < count; ++i ) ++stripe_start[ intmap_stripe( intmap, hashes[ i ] ) - intmap->stripes + 1 ];
+        for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) stripe_start[ i + 1 ] += stripe_start[ i ];
+        for( int i = 0; i < count; ++i ) {
+            int const position = stripe_start[ intmap_stripe( intmap, hashes[ i ] ) - intmap->stripes ]++;
+            stripe_hashes[ position ] = hashes[ i ];
+            stripe_keys[ position ] = keys[ i ];
+            order[ position ] = i;
+        }
+        sorted_hashes = stripe_hashes;
+        sorted_keys = stripe_keys;
+    } else {
+        stripe_start[ 0 ] = count;
+    }
+
+    int found_count = 0;
+    int begin = 0;
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        int const end = stripe_start[ i ];
+        if( begin == end ) continue;
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        INTMAP_MUTEX_LOCK( &stripe->mutex );
+        if( intmap->dense ) {
+            for( int j = begin; j < end; ++j ) {
+                results[ j ] = intmap_find_item( intmap, stripe, sorted_hashes[ j ], sorted_keys[ j ] );
+                found_count += results[ j ] != NULL;
+            }
+        } else {
+            found_count += hashtable_find_batch( &stripe->hashtable, end - begin, sorted_hashes + begin, 
+                sorted_keys + begin, results + begin );
+        }
+        for( int j = begin; j < end; ++j ) {
+            int const index = order ? order[ j ] : j;
+            if( results[ j ] ) {
+                memcpy( (char*) items + (size_t) index * (size_t) intmap->item_size, results[ j ], 
+                    (size_t) intmap->item_size );
+            }
+            if( found ) found[ index ] = results[ j ] != NULL;
+        }
+        INTMAP_MUTEX_UNLOCK( &stripe->mutex );
+        begin = end;
+    }
+
+    free( results );
+    return found_count;
+}
+
+
+void intmap_insert_many( intmap_t* intmap, int const* keys, void const* items, int count ) {
+    if( count <= 0 ) return;
+
+    // All the keys are hashed in a loop of their own, which compilers vectorize at -O3, and the lowest and highest
+    // keys are found in another, to see if the keys should be stored by index
+    uint32_t* hashes = (uint32_t*) malloc( (size_t) count * ( sizeof( uint32_t ) + sizeof( int ) ) );
+    for( int i = 0; i < count; ++i ) hashes[ i ] = intmap_hash_u32( (uint32_t) keys[ i ] );
+    int64_t low = keys[ 0 ];
+    int64_t high = keys[ 0 ];
+    for( int i = 1; i < count; ++i ) {
+        low = keys[ i ] < low ? keys[ i ] : low;
+        high = keys[ i ] > high ? keys[ i ] : high;
+    }
+
+    // An empty map gets dense arrays right away, by the same rule as intmap_rebalance_locked uses, rather than having
+    // the keys put in the hashtables only to move them out again. Keys stored by index are put in the order they are 
+    // given, with all the stripes locked, so keys given in order fill the arrays from front to back, and those left
+    // if the map switches to hashed keys part way are put in as below.
+    int start = 0;
+    bool check = false;
+    if( !( intmap->flags & INTMAP_NO_DENSE ) ) {
+        intmap_lock_stripes( intmap, 0 );
+        bool empty = !intmap->dense && high - low + 1 <= (int64_t) count * 2;
+        for( int i = 0; i < INTMAP_STRIPE_COUNT && empty; ++i ) {
+            empty = hashtable_count( &intmap->stripes[ i ].hashtable ) == 0;
+        }
+        int base = 0;
+        int capacity = 0;
+        if( empty && intmap_dense_range( low, high, ( high - low + 1 ) / 4, false, &base, &capacity ) ) {
+            intmap_dense_build( intmap, base, capacity );
+        }
+        for( ; start < count && intmap->dense; ++start ) {
+            intmap_stripe_t* stripe = intmap_stripe( intmap, hashes[ start ] );
+            intmap_unshare_key( intmap, keys[ start ] );
+            int inserted;
+            void* item = intmap_find_or_insert_item( intmap, stripe, hashes[ start ], keys[ start ], &inserted );
+            if( !item ) {
+                intmap_rebalance_locked( intmap, &keys[ start ] );
+                --start;
+                continue;
+            }
+            memcpy( item, (char const*) items + (size_t) start * (size_t) intmap->item_size, 
+                (size_t) intmap->item_size );
+        }
+        // The counts at which the stripes are checked next are set for the keys just put in
+        if( start > 0 ) {
+            intmap_rebalance_locked( intmap, NULL );
+        }
+        intmap_unlock_stripes( intmap, 0 );
+    }
+
+    // The rest of the keys are put in order of stripe, as for intmap_find_many
+    int stripe_start[ INTMAP_STRIPE_COUNT + 1 ] = { 0 };
+    int* order = NULL;
+    if( INTMAP_STRIPE_COUNT > 1 ) {
+        order = (int*)( hashes + count );
+        for( int i = start; i < count; ++i ) {
+            ++stripe_start[ intmap_stripe( intmap, hashes[ i ] ) - intmap->stripes + 1 ];
+        }
+        stripe_start[ 0 ] = start;
+        for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) stripe_start[ i + 1 ] += stripe_start[ i ];
+        for( int i = start; i < count; ++i ) {
+            order[ stripe_start[ intmap_stripe( intmap, hashes[ i ] ) - intmap->stripes ]++ ] = i;
+        }
+    } else {
+        stripe_start[ 0 ] = count;
+    }
+
+    // Each stripe is grown once to fit all of its keys
+    int begin = start;
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        int const end = stripe_start[ i ];
+        if( begin >= end ) continue;
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        INTMAP_MUTEX_LOCK( &stripe->mutex );
+        if( !intmap->dense ) {
+            intmap_unshare_table( intmap, stripe );
+            hashtable_reserve( &stripe->hashtable, hashtable_count( &stripe->hashtable ) + end - begin );
+        }
+        for( int j = begin; j < end; ++j ) {
+            int const index = order ? order[ j ] : j;
+            if( !intmap_writable( intmap, stripe, keys[ index ] ) ) {
+                INTMAP_MUTEX_UNLOCK( &stripe->mutex );
+                intmap_lock_writable( intmap, stripe, keys[ index ] );
+            }
+            int inserted;
+            void* item = intmap_find_or_insert_item( intmap, stripe, hashes[ index ], keys[ index ], &inserted );
+            if( !item ) {
+                // A key outside of the dense arrays, so they are grown or released, as for intmap_lock_item
+                INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+                intmap_rebalance( intmap, &keys[ index ] );
+                INTMAP_MUTEX_LOCK( &stripe->mutex );
+                --j;
+                continue;
+            }
+            memcpy( item, (char const*) items + (size_t) index * (size_t) intmap->item_size, 
+                (size_t) intmap->item_size );
+        }
+        check = check || intmap_inserted( intmap, stripe );
+        INTMAP_MUTEX_UNLOCK( &stripe->mutex );
+        begin = end;
+    }
+    free( hashes );
+
+    if( check ) {
+        intmap_rebalance( intmap, NULL );
+    }
+}
+
+
+int intmap_count( intmap_t* intmap ) {
+    int count = 0;
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        INTMAP_MUTEX_LOCK( &stripe->mutex );
+        count += intmap->dense ? stripe->dense_count : hashtable_count( &stripe->hashtable );
+        INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+    return count;
+}
+
+
+void intmap_foreach( intmap_t* intmap, void (*callback)( void* user_data, int key, void* item ), void* user_data ) {
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        INTMAP_MUTEX_LOCK( &stripe->mutex );
+        if( intmap->dense ) {
+            // The dense arrays hold the keys of all the stripes, so the rest of them are locked too, and only the keys
+            // of this stripe and the ones after it are visited, in case the map was still hashed for the ones before 
+            intmap_lock_stripes( intmap, i + 1 );
+            if( intmap_dense_writable( intmap, i ) ) {
+                for( int j = 0; j < intmap->dense_capacity; ++j ) {
+                    if( *intmap_dense_used( intmap, j ) && intmap_dense_visits( intmap, intmap->dense_base + j, i ) ) {
+                        callback( user_data, intmap->dense_base + j, intmap_dense_item( intmap, j ) );
+                    }
+                }
+                intmap_unlock_stripes( intmap, i );
+                return;
+            }
+        }
+        intmap_unshare_table( intmap, stripe );
+        int count = hashtable_count( &stripe->hashtable );
+        int const* keys = (int const*) hashtable_keys( &stripe->hashtable );
+        char* items = (char*) hashtable_items( &stripe->hashtable );
+        for( int j = 0; j < count; ++j ) {
+            callback( user_data, keys[ j ], items + (size_t) j * (size_t) intmap->item_size );
+        }
+        INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+}
+
+
+void intmap_foreach_span( intmap_t* intmap, 
+    void (*callback)( void* user_data, int part, int const* keys, void* items, int count ), void* user_data ) {
+
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        INTMAP_MUTEX_LOCK( &stripe->mutex );
+        if( intmap->dense ) {
+            // As for intmap_foreach
+            intmap_lock_stripes( intmap, i + 1 );
+            if( intmap_dense_writable( intmap, i ) ) {
+                intmap_dense_spans( intmap, 0, intmap->dense_capacity, i, 0, callback, user_data );
+                intmap_unlock_stripes( intmap, i );
+                return;
+            }
+        }
+        intmap_unshare_table( intmap, stripe );
+        int count = hashtable_count( &stripe->hashtable );
+        if( count > 0 ) {
+            callback( user_data, 0, (int const*) hashtable_keys( &stripe->hashtable ), 
+                hashtable_items( &stripe->hashtable ), count );
+        }
+        INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+}
+
+
+// The keys of all the stripes are numbered as if they were in one array, stripe after stripe, and each part is a 
+// range of that, which is given to the callback as one run for each stripe it overlaps. When the map is dense, each
+// part is a range of the dense arrays instead.
+typedef struct intmap_parallel_t {
+    intmap_t* intmap;
+    bool dense;
+    int const* keys[ INTMAP_STRIPE_COUNT ];
+    char* items[ INTMAP_STRIPE_COUNT ];
+    int counts[ INTMAP_STRIPE_COUNT ];
+    int total;
+    int item_size;
+    int part_count;
+    void (*callback)( void* user_data, int part, int const* keys, void* items, int count );
+    void* user_data;
+} intmap_parallel_t;
+
+
+typedef struct intmap_parallel_part_t {
+    intmap_parallel_t* parallel;
+    int index;
+} intmap_parallel_part_t;
+
+
+static int intmap_parallel_proc( void* user_data ) {
+    intmap_parallel_part_t* part = (intmap_parallel_part_t*) user_data;
+    intmap_parallel_t* parallel = part->parallel;
+    int begin = (int)( (int64_t) parallel->total * part->index / parallel->part_count );
+    int end = (int)( (int64_t) parallel->total * ( part->index + 1 ) / parallel->part_count );
+    if( parallel->dense ) {
+        intmap_dense_spans( parallel->intmap, begin, end, 0, part->index, parallel->callback, parallel->user_data );
+        return 0;
+    }
+    int start = 0;
+    for( int i = 0; i < INTMAP_STRIPE_COUNT && start < end; ++i ) {
+        int from = begin > start ? begin - start : 0;
+        int to = end - start < parallel->counts[ i ] ? end - start : parallel->counts[ i ];
+        if( from < to ) {
+            parallel->callback( parallel->user_data, part->index, parallel->keys[ i ] + from, 
+                parallel->items[ i ] + (size_t) from * (size_t) parallel->item_size, to - from );
+        }
+        start += parallel->counts[ i ];
+    }
+    return 0;
+}
+
+
+void intmap_foreach_parallel( intmap_t* intmap, int thread_count, 
+    void (*callback)( void* user_data, int part, int const* keys, void* items, int count ), void* user_data ) {
+
+    intmap_parallel_t parallel;
+    parallel.intmap = intmap;
+    parallel.total = 0;
+    parallel.item_size = intmap->item_size;
+    parallel.callback = callback;
+    parallel.user_data = user_data;
+    intmap_lock_stripes( intmap, 0 );
+    parallel.dense = intmap->dense;
+    if( parallel.dense ) {
+        intmap_dense_writable( intmap, 0 );
+    }
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        intmap_unshare_table( intmap, stripe );
+        parallel.counts[ i ] = hashtable_count( &stripe->hashtable );
+        parallel.keys[ i ] = (int const*) hashtable_keys( &stripe->hashtable );
+        parallel.items[ i ] = (char*) hashtable_items( &stripe->hashtable );
+        parallel.total += parallel.counts[ i ];
+    }
+    if( parallel.dense ) {
+        parallel.total = intmap->dense_capacity;
+    }
+
+    int const max_threads = parallel.total / 65536 + 1;
+    parallel.part_count = thread_count < 1 ? 1 : thread_count > 64 ? 64 : thread_count;
+    parallel.part_count = parallel.part_count < max_threads ? parallel.part_count : max_threads;
+    intmap_parallel_part_t parts[ 64 ];
+    for( int i = 0; i < parallel.part_count; ++i ) {
+        parts[ i ].parallel = &parallel;
+        parts[ i ].index = i;
+    }
+    #ifdef thread_h
+        thread_ptr_t threads[ 64 ];
+        for( int i = 1; i < parallel.part_count; ++i ) {
+            threads[ i ] = thread_create( intmap_parallel_proc, &parts[ i ], "intmap_foreach", 
+                THREAD_STACK_SIZE_DEFAULT );
+        }
+        intmap_parallel_proc( &parts[ 0 ] );
+        for( int i = 1; i < parallel.part_count; ++i ) {
+            thread_join( threads[ i ] );
+            thread_destroy( threads[ i ] );
+        }
+    #else
+        for( int i = 0; i < parallel.part_count; ++i ) {
+            intmap_parallel_proc( &parts[ i ] );
+        }
+    #endif
+
+    intmap_unlock_stripes( intmap, 0 );
+}
+
+
+void intmap_bloom_filter( intmap_t* intmap, int bits_per_key ) {
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        INTMAP_MUTEX_LOCK( &stripe->mutex );
+        intmap_bloom_rebuild( stripe, bits_per_key );
+        INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+}
+
+
+void intmap_bloom_filter_stats( intmap_t* intmap, int* memory, float* false_positive_rate ) {
+    // Each stripe is equally likely to be the one a missing key is looked for in, and one with no filter lets every
+    // key through
+    int total_memory = 0;
+    float total_rate = 0.0f;
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        INTMAP_MUTEX_LOCK( &stripe->mutex );
+        total_memory += bloom_memory( &stripe->bloom );
+        total_rate += stripe->bloom.memory ? bloom_false_positive_rate( &stripe->bloom ) : 1.0f;
+        INTMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+    if( memory ) {
+        *memory = total_memory;
+    }
+    if( false_positive_rate ) {
+        *false_positive_rate = total_rate / INTMAP_STRIPE_COUNT;
+    }
+}
+
+
+#ifdef buffer_h
+
+// A saved intmap is a header, followed by the size and data of the saved hashtable of each stripe
+#define INTMAP_SAVE_MAGIC 0x50414d49u /* "IMAP" */
+#define INTMAP_SAVE_VERSION 1u
+#define INTMAP_SAVE_BYTE_ORDER 0x01020304u
+
+
+bool intmap_save( intmap_t* intmap, buffer_t* buffer ) {
+    uint32_t header[ 6 ] = { INTMAP_SAVE_MAGIC, INTMAP_SAVE_VERSION, INTMAP_SAVE_BYTE_ORDER, 
+        (uint32_t) intmap->item_size, INTMAP_STRIPE_COUNT, 0 };
+    if( buffer_write_raw( buffer, header, sizeof( header ) ) != sizeof( header ) ) return false;
+
+    // Dense keys are put in the hashtables they would be in if the map was hashed, and saved from those, so a saved 
+    // map is the same either way
+    intmap_lock_stripes( intmap, 0 );
+    hashtable_t* tables = NULL;
+    if( intmap->dense ) {
+        tables = (hashtable_t*) malloc( INTMAP_STRIPE_COUNT * sizeof( hashtable_t ) );
+        for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+            hashtable_init( &tables[ i ], sizeof( int ), intmap->item_size, intmap->stripes[ i ].dense_count > 
+                intmap_initial_capacity() ? intmap->stripes[ i ].dense_count : intmap_initial_capacity(), NULL );
+        }
+        for( int i = 0; i < intmap->dense_capacity; ++i ) {
+            if( *intmap_dense_used( intmap, i ) ) {
+                int key = intmap->dense_base + i;
+                uint32_t hash = intmap_hash_u32( (uint32_t) key );
+                hashtable_insert( &tables[ intmap_stripe( intmap, hash ) - intmap->stripes ], hash, &key, 
+                    intmap_dense_item( intmap, i ) );
+            }
+        }
+    }
+    bool result = true;
+    for( int i = 0; i < INTMAP_STRIPE_COUNT && result; ++i ) {
+        hashtable_t* table = tables ? &tables[ i ] : &intmap->stripes[ i ].hashtable;
+        uint64_t size = hashtable_save_size( table );
+        if( size + sizeof( size ) > (uint64_t)( 0x7fffffff - buffer_position( buffer ) ) ) {
+            result = false;
+        } else {
+            void* data = malloc( (size_t) size );
+            hashtable_save( table, data );
+            result = buffer_write_raw( buffer, &size, sizeof( size ) ) == sizeof( size ) && 
+                buffer_write_raw( buffer, data, (int) size ) == (int) size;
+            free( data );
+        }
+    }
+    if( tables ) {
+        for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+            hashtable_term( &tables[ i ] );
+        }
+        free( tables );
+    }
+    intmap_unlock_stripes( intmap, 0 );
+    return result;
+}
+
+
+intmap_t* intmap_load( buffer_t* buffer ) {
+    uint32_t header[ 6 ];
+    if( buffer_read_raw( buffer, header, sizeof( header ) ) != sizeof( header ) || header[ 0 ] != INTMAP_SAVE_MAGIC || 
+        header[ 1 ] != INTMAP_SAVE_VERSION || header[ 2 ] != INTMAP_SAVE_BYTE_ORDER || header[ 3 ] > 0x7fffffff || 
+        header[ 4 ] == 0 || header[ 4 ] > 0x10000 ) {
+        return NULL;
+    }
+
+    intmap_t* intmap = intmap_create( (int) header[ 3 ] );
+    for( uint32_t i = 0; i < header[ 4 ]; ++i ) {
+        uint64_t size = 0;
+        void* data = NULL;
+        hashtable_t loaded;
+        bool valid = buffer_read_raw( buffer, &size, sizeof( size ) ) == sizeof( size ) && 
+            size <= (uint64_t)( buffer_size( buffer ) - buffer_position( buffer ) );
+        if( valid ) {
+            data = malloc( (size_t) size );
+            valid = buffer_read_raw( buffer, data, (int) size ) == (int) size && 
+                hashtable_load( &loaded, sizeof( int ), intmap->item_size, data, size, NULL );
+            free( data );
+        }
+        if( !valid ) {
+            intmap_destroy( intmap );
+            return NULL;
+        }
+
+        // With the same number of stripes, every key is in the same stripe as when it was saved
+        if( header[ 4 ] == INTMAP_STRIPE_COUNT ) {
+            hashtable_term( &intmap->stripes[ i ].hashtable );
+            intmap->stripes[ i ].hashtable = loaded;
+        } else {
+            int const* keys = (int const*) hashtable_keys( &loaded );
+            char const* items = (char const*) hashtable_items( &loaded );
+            for( int j = 0; j < hashtable_count( &loaded ); ++j ) {
+                intmap_upsert( intmap, keys[ j ], items + (size_t) j * (size_t) intmap->item_size );
+            }
+            hashtable_term( &loaded );
+        }
+    }
+    intmap_rebalance( intmap, NULL );
+    return intmap;
+}
+
+#endif /* buffer_h */
+
+
+// A snapshot holds a reference to the hashtable of each stripe, or while the keys are stored by index, to each page of
+// the dense arrays, and is read the same way as the map, just without locking
+typedef struct intmap_snapshot_t {
+    int item_size;
+    int count;
+    int dense_base;
+    int dense_capacity;
+    int dense_shift;
+    intmap_page_t** dense_pages; // NULL unless the keys were stored by index
+    intmap_shared_t* tables[ INTMAP_STRIPE_COUNT ];
+} intmap_snapshot_t;
+
+
+intmap_snapshot_t* intmap_snapshot( intmap_t* intmap ) {
+    intmap_snapshot_t* snapshot = (intmap_snapshot_t*) malloc( sizeof( intmap_snapshot_t ) );
+    snapshot->item_size = intmap->item_size;
+    snapshot->count = 0;
+    intmap_lock_stripes( intmap, 0 );
+    snapshot->dense_base = intmap->dense_base;
+    snapshot->dense_capacity = intmap->dense_capacity;
+    snapshot->dense_shift = intmap->dense_shift;
+    snapshot->dense_pages = NULL;
+    if( intmap->dense ) {
+        int const page_count = intmap_page_count( intmap->dense_capacity, intmap->dense_shift );
+        snapshot->dense_pages = (intmap_page_t**) malloc( (size_t) page_count * sizeof( intmap_page_t* ) );
+        for( int i = 0; i < page_count; ++i ) {
+            snapshot->dense_pages[ i ] = intmap->dense_pages[ i ];
+            INTMAP_REFS_INC( &snapshot->dense_pages[ i ]->refs );
+        }
+    }
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        snapshot->tables[ i ] = NULL;
+        if( intmap->dense ) {
+            snapshot->count += stripe->dense_count;
+            continue;
+        }
+        if( !stripe->shared ) {
+            // Any resize still going on is finished first, as it would otherwise go on when the table is next read,
+            // and neither the map nor the snapshots must write to a shared table
+            hashtable_reserve( &stripe->hashtable, 0 );
+            stripe->shared = (intmap_shared_t*) malloc( sizeof( intmap_shared_t ) );
+            INTMAP_REFS_INIT( &stripe->shared->refs );
+            stripe->shared->hashtable = stripe->hashtable;
+        }
+        INTMAP_REFS_INC( &stripe->shared->refs );
+        snapshot->tables[ i ] = stripe->shared;
+        snapshot->count += hashtable_count( &stripe->hashtable );
+    }
+    intmap_unlock_stripes( intmap, 0 );
+    return snapshot;
+}
+
+
+void intmap_snapshot_release( intmap_snapshot_t* snapshot ) {
+    if( snapshot->dense_pages ) {
+        for( int i = 0; i < intmap_page_count( snapshot->dense_capacity, snapshot->dense_shift ); ++i ) {
+            intmap_page_release( snapshot->dense_pages[ i ] );
+        }
+        free( snapshot->dense_pages );
+    }
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        if( snapshot->tables[ i ] ) {
+            intmap_shared_release( snapshot->tables[ i ] );
+        }
+    }
+    free( snapshot );
+}
+
+
+int intmap_snapshot_count( intmap_snapshot_t const* snapshot ) {
+    return snapshot->count;
+}
+
+
+bool intmap_snapshot_find( intmap_snapshot_t const* snapshot, int key, void* item ) {
+    void const* result = NULL;
+    if( snapshot->dense_pages ) {
+        uint32_t const index = (uint32_t) key - (uint32_t) snapshot->dense_base;
+        if( index < (uint32_t) snapshot->dense_capacity ) {
+            intmap_page_t const* page = snapshot->dense_pages[ index >> snapshot->dense_shift ];
+            int const offset = (int)( index & ( ( 1u << snapshot->dense_shift ) - 1 ) );
+            result = page->used[ offset ] ? intmap_page_item( page, offset, snapshot->item_size ) : NULL;
+        }
+    } else {
+        uint32_t const hash = intmap_hash_u32( (uint32_t) key );
+        result = hashtable_find( &snapshot->tables[ intmap_stripe_index( hash ) ]->hashtable, hash, &key );
+    }
+    if( result ) {
+        memcpy( item, result, (size_t) snapshot->item_size );
+    }
+    return result != NULL;
+}
+
+
+void intmap_snapshot_foreach_span( intmap_snapshot_t const* snapshot,
+    void (*callback)( void* user_data, int const* keys, void const* items, int count ), void* user_data ) {
+
+    if( snapshot->dense_pages ) {
+        // As for intmap_dense_spans
+        int keys[ 256 ];
+        int index = 0;
+        while( index < snapshot->dense_capacity ) {
+            intmap_page_t const* page = snapshot->dense_pages[ index >> snapshot->dense_shift ];
+            int const offset = index & ( ( 1 << snapshot->dense_shift ) - 1 );
+            int count = 0;
+            while( offset + count < page->capacity && count < 256 && page->used[ offset + count ] ) {
+                keys[ count ] = snapshot->dense_base + index + count;
+                ++count;
+            }
+            if( count > 0 ) {
+                callback( user_data, keys, intmap_page_item( page, offset, snapshot->item_size ), count );
+                index += count;
+            } else {
+                ++index;
+            }
+        }
+        return;
+    }
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        hashtable_t const* table = &snapshot->tables[ i ]->hashtable;
+        int count = hashtable_count( table );
+        if( count > 0 ) {
+            callback( user_data, (int const*) hashtable_keys( table ), hashtable_items( table ), count );
+        }
+    }
+}
+
+
+typedef struct intmap_frozen_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t count;
+    uint32_t item_size;
+    uint32_t entry_size;
+    uint32_t key_offset;
+    uint32_t seed;
+    uint32_t bucket_count;
+    uint32_t slot_count;
+    uint32_t entries_offset;
+    uint32_t reserved;
+    // followed by a pilot for each bucket, then the remap table for the slots past the last entry, and then the entries,
+    // each holding an item followed by its key
+} intmap_frozen_t;
+
+#define INTMAP_FROZEN_MAGIC 0x5a464d49u // "IMFZ"
+#define INTMAP_FROZEN_VERSION 1u
+#define INTMAP_FROZEN_MAX_SEEDS 64u
+
+
+static uint64_t intmap_frozen_mix( uint64_t x ) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+
+// A different key always gives a different hash, for the same seed
+static uint64_t intmap_frozen_hash( int key, uint32_t seed ) {
+    return intmap_frozen_mix( (uint64_t)(uint32_t) key | ( (uint64_t) seed << 32 ) );
+}
+
+
+// Maps a 32-bit value to the range 0 to count-1, without a division
+static uint32_t intmap_frozen_range( uint32_t value, uint32_t count ) {
+    return (uint32_t)( ( (uint64_t) value * count ) >> 32 );
+}
+
+
+// The high half of the hash picks the bucket, and the low half, mixed with the pilot of the bucket, picks the slot
+static uint32_t intmap_frozen_slot( uint64_t hash, uint64_t pilot_hash, uint32_t slot_count ) {
+    return intmap_frozen_range( (uint32_t)( hash ^ pilot_hash ), slot_count );
+}
+
+
+// The keys are split into buckets of about four keys each, and the buckets are placed one at a time, biggest first. For
+// each bucket, we search for a pilot value which sends all of its keys to slots which are still free, and only the pilot
+// is stored. A lookup then just needs the pilot of the key's bucket to know the slot of the key. There are a few percent
+// more slots than keys, so that the last buckets placed still have some free slots to find. Keys which end up in the
+// slots past the end of the entries are moved into the slots left free, and found through a small remap table. In the
+// unlikely case that no pilot can be found for a bucket, we start over with another seed.
+static intmap_frozen_t* intmap_frozen_build( int const* keys, char const* items, int count, int item_size, int* size ) {
+    uint32_t const n = (uint32_t) count;
+    uint32_t const bucket_count = n / 4 + 1;
+    uint32_t const slot_count = n + n / 32 + 1;
+    uint32_t const key_offset = ( (uint32_t) item_size + 3u ) & ~3u;
+    uint32_t const entry_size = ( key_offset + 4u + 7u ) & ~7u;
+    size_t const entries_offset = ( sizeof( intmap_frozen_t ) +
+        ( (size_t) bucket_count + slot_count - n ) * sizeof( uint32_t ) + 7u ) & ~(size_t) 7u;
+    size_t const total_size = entries_offset + (size_t) n * entry_size;
+    if( total_size > 0x7fffffffu ) return NULL;
+
+    intmap_frozen_t* frozen = (intmap_frozen_t*) malloc( total_size );
+    memset( frozen, 0, total_size );
+    uint32_t* pilots = (uint32_t*)( frozen + 1 );
+    uint32_t* remap = pilots + bucket_count;
+    char* entries = (char*) frozen + entries_offset;
+
+    uint64_t* hashes = (uint64_t*) malloc( ( n + 1 ) * sizeof( uint64_t ) );
+    uint32_t* key_slots = (uint32_t*) malloc( ( n + 1 ) * sizeof( uint32_t ) );
+    uint32_t* bucket_start = (uint32_t*) malloc( ( bucket_count + 1 ) * sizeof( uint32_t ) );
+    uint32_t* bucket_fill = (uint32_t*) malloc( bucket_count * sizeof( uint32_t ) );
+    uint32_t* bucket_keys = (uint32_t*) malloc( ( n + 1 ) * sizeof( uint32_t ) );
+    uint32_t* taken = (uint32_t*) malloc( ( slot_count / 32 + 1 ) * sizeof( uint32_t ) );
+    uint32_t* order = bucket_fill;
+
+    bool placed = false;
+    for( uint32_t seed = 0; seed < INTMAP_FROZEN_MAX_SEEDS && !placed; ++seed ) {
+        frozen->seed = seed;
+
+        // sort the keys by bucket
+        memset( bucket_start, 0, ( bucket_count + 1 ) * sizeof( uint32_t ) );
+        for( uint32_t i = 0; i < n; ++i ) {
+            hashes[ i ] = intmap_frozen_hash( keys[ i ], seed );
+            ++bucket_start[ intmap_frozen_range( (uint32_t)( hashes[ i ] >> 32 ), bucket_count ) + 1 ];
+        }
+        uint32_t max_bucket_size = 0;
+        for( uint32_t b = 0; b < bucket_count; ++b ) {
+            max_bucket_size = bucket_start[ b + 1 ] > max_bucket_size ? bucket_start[ b + 1 ] : max_bucket_size;
+            bucket_start[ b + 1 ] += bucket_start[ b ];
+            bucket_fill[ b ] = bucket_start[ b ];
+        }
+        for( uint32_t i = 0; i < n; ++i ) {
+            bucket_keys[ bucket_fill[ intmap_frozen_range( (uint32_t)( hashes[ i ] >> 32 ), bucket_count ) ]++ ] = i;
+        }
+
+        // sort the buckets by size, biggest first
+        uint32_t* size_start = (uint32_t*) malloc( ( max_bucket_size + 2 ) * sizeof( uint32_t ) );
+        memset( size_start, 0, ( max_bucket_size + 2 ) * sizeof( uint32_t ) );
+        for( uint32_t b = 0; b < bucket_count; ++b ) {
+            ++size_start[ max_bucket_size - ( bucket_start[ b + 1 ] - bucket_start[ b ] ) + 1 ];
+        }
+        for( uint32_t i = 0; i <= max_bucket_size; ++i ) size_start[ i + 1 ] += size_start[ i ];
+        for( uint32_t b = 0; b < bucket_count; ++b ) {
+            order[ size_start[ max_bucket_size - ( bucket_start[ b + 1 ] - bucket_start[ b ] ) ]++ ] = b;
+        }
+        free( size_start );
+
+        // find a pilot for each bucket. Two keys of a bucket with the same low half of the hash would always go to the
+        // same slot, so that is caught early, rather than trying every pilot
+        memset( taken, 0, ( slot_count / 32 + 1 ) * sizeof( uint32_t ) );
+        memset( pilots, 0, bucket_count * sizeof( uint32_t ) );
+        placed = true;
+        for( uint32_t i = 0; i < bucket_count && placed; ++i ) {
+            uint32_t const bucket = order[ i ];
+            uint32_t const first = bucket_start[ bucket ];
+            uint32_t const bucket_size = bucket_start[ bucket + 1 ] - first;
+            if( bucket_size == 0 ) break;
+            for( uint32_t j = 1; j < bucket_size && placed; ++j ) {
+                for( uint32_t k = 0; k < j; ++k ) {
+                    uint32_t const a = (uint32_t) hashes[ bucket_keys[ first + j ] ];
+                    uint32_t const b = (uint32_t) hashes[ bucket_keys[ first + k ] ];
+                    if( a == b ) placed = false;
+                }
+            }
+
+            bool found = false;
+            for( uint32_t pilot = 0; pilot < 0x100000u && placed && !found; ++pilot ) {
+                uint64_t const pilot_hash = intmap_frozen_mix( pilot );
+                uint32_t j = 0;
+                for( ; j < bucket_size; ++j ) {
+                    uint32_t const index = bucket_keys[ first + j ];
+                    uint32_t const slot = intmap_frozen_slot( hashes[ index ], pilot_hash, slot_count );
+                    if( taken[ slot / 32 ] & ( 1u << ( slot % 32 ) ) ) break;
+                    taken[ slot / 32 ] |= 1u << ( slot % 32 );
+                    key_slots[ index ] = slot;
+                }
+                if( j == bucket_size ) {
+                    pilots[ bucket ] = pilot;
+                    found = true;
+                } else {
+                    while( j > 0 ) {
+                        uint32_t const slot = key_slots[ bucket_keys[ first + --j ] ];
+                        taken[ slot / 32 ] &= ~( 1u << ( slot % 32 ) );
+                    }
+                }
+            }
+            placed = found;
+        }
+    }
+
+    if( placed ) {
+        // pair up the slots taken past the end of the entries with the slots left free before it
+        uint32_t free_slot = 0;
+        for( uint32_t slot = n; slot < slot_count; ++slot ) {
+            if( taken[ slot / 32 ] & ( 1u << ( slot % 32 ) ) ) {
+                while( taken[ free_slot / 32 ] & ( 1u << ( free_slot % 32 ) ) ) ++free_slot;
+                remap[ slot - n ] = free_slot++;
+            }
+        }
+        for( uint32_t i = 0; i < n; ++i ) {
+            uint32_t const slot = key_slots[ i ] < n ? key_slots[ i ] : remap[ key_slots[ i ] - n ];
+            char* entry = entries + (size_t) slot * entry_size;
+            memcpy( entry, items + (size_t) i * (size_t) item_size, (size_t) item_size );
+            memcpy( entry + key_offset, &keys[ i ], sizeof( int ) );
+        }
+    }
+
+    free( taken );
+    free( bucket_keys );
+    free( bucket_fill );
+    free( bucket_start );
+    free( key_slots );
+    free( hashes );
+    if( !placed ) {
+        free( frozen );
+        return NULL;
+    }
+
+    frozen->magic = INTMAP_FROZEN_MAGIC;
+    frozen->version = INTMAP_FROZEN_VERSION;
+    frozen->size = (uint32_t) total_size;
+    frozen->count = n;
+    frozen->item_size = (uint32_t) item_size;
+    frozen->entry_size = entry_size;
+    frozen->key_offset = key_offset;
+    frozen->bucket_count = bucket_count;
+    frozen->slot_count = slot_count;
+    frozen->entries_offset = (uint32_t) entries_offset;
+    if( size ) *size = (int) total_size;
+    return frozen;
+}
+
+
+intmap_frozen_t* intmap_freeze( intmap_t* intmap, int* size ) {
+    // All the stripes are locked while the keys and items are copied, so the frozen copy is of the map as it was at one
+    // point in time
+    intmap_lock_stripes( intmap, 0 );
+    int total = 0;
+    for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+        intmap_stripe_t* stripe = &intmap->stripes[ i ];
+        total += intmap->dense ? stripe->dense_count : hashtable_count( &stripe->hashtable );
+    }
+    int count = 0;
+    int* keys = (int*) malloc( ( total > 0 ? total : 1 ) * sizeof( int ) );
+    char* items = (char*) malloc( (size_t)( total > 0 ? total : 1 ) * (size_t) intmap->item_size );
+    if( intmap->dense ) {
+        for( int i = 0; i < intmap->dense_capacity; ++i ) {
+            if( *intmap_dense_used( intmap, i ) ) {
+                keys[ count ] = intmap->dense_base + i;
+                memcpy( items + (size_t) count * (size_t) intmap->item_size, intmap_dense_item( intmap, i ), 
+                    (size_t) intmap->item_size );
+                ++count;
+            }
+        }
+    } else {
+        for( int i = 0; i < INTMAP_STRIPE_COUNT; ++i ) {
+            intmap_stripe_t* stripe = &intmap->stripes[ i ];
+            int stripe_count = hashtable_count( &stripe->hashtable );
+            memcpy( keys + count, hashtable_keys( &stripe->hashtable ), stripe_count * sizeof( int ) );
+            memcpy( items + (size_t) count * (size_t) intmap->item_size, hashtable_items( &stripe->hashtable ), 
+                (size_t) stripe_count * (size_t) intmap->item_size );
+            count += stripe_count;
+        }
+    }
+    intmap_unlock_stripes( intmap, 0 );
+
+    intmap_frozen_t* frozen = intmap_frozen_build( keys, items, count, intmap->item_size, size );
+    free( items );
+    free( keys );
+    return frozen;
+}
+
+
+void intmap_frozen_destroy( intmap_frozen_t* frozen ) {
+    free( frozen );
+}
+
+
+intmap_frozen_t const* intmap_frozen_map( void const* data, int size, int item_size ) {
+    intmap_frozen_t const* frozen = (intmap_frozen_t const*) data;
+    if( !data || ( (uintptr_t) data & 3u ) || size < (int) sizeof( intmap_frozen_t ) ) return NULL;
+    if( frozen->magic != INTMAP_FROZEN_MAGIC || frozen->version != INTMAP_FROZEN_VERSION ) return NULL;
+    if( frozen->size != (uint32_t) size || frozen->item_size != (uint32_t) item_size ) return NULL;
+    if( frozen->bucket_count == 0 || frozen->slot_count <= frozen->count ) return NULL;
+    if( frozen->key_offset < frozen->item_size || frozen->key_offset + sizeof( int ) > frozen->entry_size ) return NULL;
+    uint64_t const tables_size = 
+        ( (uint64_t) frozen->bucket_count + frozen->slot_count - frozen->count ) * sizeof( uint32_t );
+    if( frozen->entries_offset < sizeof( intmap_frozen_t ) + tables_size ||
+        frozen->entries_offset + (uint64_t) frozen->count * frozen->entry_size > frozen->size ) {
+        return NULL;
+    }
+    // the remap table is the only thing read from the image which is used as an index, so it is checked as well
+    uint32_t const* remap = (uint32_t const*)( frozen + 1 ) + frozen->bucket_count;
+    for( uint32_t i = 0; i < frozen->slot_count - frozen->count; ++i ) {
+        if( remap[ i ] >= frozen->count && frozen->count > 0 ) return NULL;
+    }
+    return frozen;
+}
+
+
+int intmap_frozen_count( intmap_frozen_t const* frozen ) {
+    return (int) frozen->count;
+}
+
+
+bool intmap_frozen_find( intmap_frozen_t const* frozen, int key, void* item ) {
+    if( frozen->count == 0 ) return false;
+    uint64_t const hash = intmap_frozen_hash( key, frozen->seed );
+    uint32_t const* pilots = (uint32_t const*)( frozen + 1 );
+    uint32_t const pilot = pilots[ intmap_frozen_range( (uint32_t)( hash >> 32 ), frozen->bucket_count ) ];
+    uint32_t slot = intmap_frozen_slot( hash, intmap_frozen_mix( pilot ), frozen->slot_count );
+    if( slot >= frozen->count ) slot = pilots[ frozen->bucket_count + slot - frozen->count ];
+    char const* entry = (char const*) frozen + frozen->entries_offset + (size_t) slot * frozen->entry_size;
+    int entry_key;
+    memcpy( &entry_key, entry + frozen->key_offset, sizeof( int ) );
+    if( entry_key != key ) return false;
+    memcpy( item, entry, frozen->item_size );
+    return true;
+}
+
+
+#undef INTMAP_SAVE_MAGIC
+#undef INTMAP_SAVE_VERSION
+#undef INTMAP_SAVE_BYTE_ORDER
+#undef INTMAP_FROZEN_MAGIC
+#undef INTMAP_FROZEN_VERSION
+#undef INTMAP_FROZEN_MAX_SEEDS
 #undef INTMAP_MUTEX_LOCK
 #undef INTMAP_MUTEX_UNLOCK
+#undef INTMAP_REFS_INIT
+#undef INTMAP_REFS_LOAD
+#undef INTMAP_REFS_INC
+#undef INTMAP_REFS_DEC
 
 
 #endif /* INTMAP_IMPLEMENTATION */
@@ -0,0 +1,246 @@
+#ifndef map_h
+#define map_h
+
+// DEFINE_MAP( name, key_type, item_type, hash_fn, equal_fn ) defines `name_t`, a hash map from key_type to item_type,
+// and the functions listed below to work with it. Unlike intmap and strmap, which copy and compare keys and items of a
+// size only known at runtime, a map defined this way works on the actual types, so the compiler can inline all the
+// hashing, comparing and copying. It is meant for small keys of a fixed size, like int, int64_t, uintptr_t or str_t.
+//
+// `hash_fn( key )` must return a well mixed uint32_t, as the low bits pick where a key goes and the top bits are kept
+// as a tag to compare against before comparing keys, and `equal_fn( a, b )` must return nonzero if two keys are equal.
+// Either can be a function or a macro, and the ones below cover the common key types:
+//
+//     DEFINE_MAP( intcount, int, int64_t, map_hash_int, MAP_EQUAL )
+//     DEFINE_MAP( strindex, str_t, int, map_hash_str, MAP_EQUAL )
+//
+// All the functions are static inline, so a map can be defined in any number of source files. Maps are not thread safe.
+//
+//     void name_init( name_t* map );
+//     void name_term( name_t* map );
+//     void name_clear( name_t* map );
+//     int name_count( name_t const* map );
+//
+//     // return a pointer to the item of the key, or NULL if it is not in the map
+//     item_type* name_find( name_t const* map, key_type key );
+//
+//     // return a pointer to the item of the key, inserting the key with an item of all zeros first if it is not in the
+//     // map, and set `inserted` (which may be NULL) to whether it was inserted
+//     item_type* name_find_or_insert( name_t* map, key_type key, bool* inserted );
+//
+//     // insert the key with the item, or overwrite its item if the key is already in the map
+//     void name_insert( name_t* map, key_type key, item_type item );
+//
+//     // remove the key and its item, and return false if the key was not in the map
+//     bool name_remove( name_t* map, key_type key );
+//
+// Pointers to items are only valid until the next insert or remove.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static inline uint32_t map_hash_u32( uint32_t key ) {
+    key ^= key >> 16;
+    key *= 0x85ebca6bu;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35u;
+    key ^= key >> 16;
+    return key;
+}
+
+
+static inline uint32_t map_hash_u64( uint64_t key ) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return (uint32_t) key;
+}
+
+
+#define map_hash_int( key ) map_hash_u32( (uint32_t)( key ) )
+#define map_hash_i64( key ) map_hash_u64( (uint64_t)( key ) )
+#define map_hash_uintptr( key ) map_hash_u64( (uint64_t)( key ) )
+#define map_hash_str( key ) map_hash_u32( (uint32_t)( key ) )
+#define MAP_EQUAL( a, b ) ( (a) == (b) )
+
+
+// Control bytes are looked at eight at a time, as one 64-bit word, loaded the same way on any byte order
+static inline uint64_t map_internal_load_word( unsigned char const* bytes ) {
+    return (uint64_t) bytes[ 0 ] | ( (uint64_t) bytes[ 1 ] << 8 ) | ( (uint64_t) bytes[ 2 ] << 16 ) | 
+        ( (uint64_t) bytes[ 3 ] << 24 ) | ( (uint64_t) bytes[ 4 ] << 32 ) | ( (uint64_t) bytes[ 5 ] << 40 ) | 
+        ( (uint64_t) bytes[ 6 ] << 48 ) | ( (uint64_t) bytes[ 7 ] << 56 );
+}
+
+
+// Returns the word with the top bit set in each byte which is equal to `value`, and all other bits clear
+static inline uint64_t map_internal_match( uint64_t word, unsigned char value ) {
+    uint64_t const low_bits = 0x7f7f7f7f7f7f7f7full;
+    uint64_t const x = word ^ ( 0x0101010101010101ull * value );
+    return ~( ( ( x & low_bits ) + low_bits ) | x | low_bits );
+}
+
+
+// Returns the index of the lowest byte with its top bit set
+static inline uint32_t map_internal_lowest_byte( uint64_t mask ) {
+    #if defined( __GNUC__ ) || defined( __clang__ )
+        return (uint32_t) __builtin_ctzll( mask ) / 8;
+    #else
+        uint32_t index = 0;
+        while( !( mask & 0x80 ) ) { mask >>= 8; ++index; }
+        return index;
+    #endif
+}
+
+
+// An empty map has a single slot, which is always empty, so lookups need no special case for a map which has not
+// allocated anything yet. The seven bytes after it are the copies of the first control bytes described below.
+static unsigned char const map_internal_empty_control[ 8 ] = { 0 };
+
+
+// Keys and items are stored next to each other in one array of entries, with a separate array of one control byte per
+// entry, which is 0 for an empty entry, or the top 7 bits of the hash of the key with the high bit set. Keys are found
+// by linear probing from the entry picked by the low bits of the hash, looking at the control bytes of eight entries at
+// a time, so most entries which do not hold the key are ruled out eight at a time, without touching the entries. The
+// first seven control bytes are repeated after the last one, so eight of them can be read starting from any entry. The
+// map is kept at most three quarters full, and removing a key shifts the keys after it back, so there are no deleted
+// entries to skip over.
+#define DEFINE_MAP( name, key_type, item_type, hash_fn, equal_fn ) \
+    typedef struct name##_entry_t { \
+        key_type key; \
+        item_type item; \
+    } name##_entry_t; \
+    \
+    typedef struct name##_t { \
+        name##_entry_t* entries; \
+        unsigned char* control; \
+        uint32_t mask; \
+        int count; \
+    } name##_t; \
+    \
+    \
+    static inline void name##_init( name##_t* map ) { \
+        map->entries = NULL; \
+        map->control = (unsigned char*) map_internal_empty_control; \
+        map->mask = 0; \
+        map->count = 0; \
+    } \
+    \
+    \
+    static inline void name##_term( name##_t* map ) { \
+        if( map->mask ) free( map->entries ); \
+        name##_init( map ); \
+    } \
+    \
+    \
+    static inline void name##_clear( name##_t* map ) { \
+        if( map->mask ) memset( map->control, 0, (size_t) map->mask + 8 ); \
+        map->count = 0; \
+    } \
+    \
+    \
+    static inline int name##_count( name##_t const* map ) { \
+        return map->count; \
+    } \
+    \
+    \
+    /* Returns the index of the entry holding the key, or if it is not in the map, the index of the empty entry where */ \
+    /* it would go, with the top bit set */ \
+    static inline uint32_t name##_internal_find_index( name##_t const* map, key_type key, uint32_t hash ) { \
+        unsigned char const tag = (unsigned char)( 0x80u | ( hash >> 25 ) ); \
+        for( uint32_t i = hash & map->mask; ; i = ( i + 8 ) & map->mask ) { \
+            uint64_t const word = map_internal_load_word( map->control + i ); \
+            uint64_t const empty = ~word & 0x8080808080808080ull; \
+            uint64_t match = map_internal_match( word, tag ) & ( ( empty & ( 0 - empty ) ) - 1 ); \
+            while( match ) { \
+                uint32_t const index = ( i + map_internal_lowest_byte( match ) ) & map->mask; \
+                if( equal_fn( map->entries[ index ].key, key ) ) return index; \
+                match &= match - 1; \
+            } \
+            if( empty ) return ( ( i + map_internal_lowest_byte( empty ) ) & map->mask ) | 0x80000000u; \
+        } \
+    } \
+    \
+    \
+    static inline void name##_internal_set_control( name##_t* map, uint32_t index, unsigned char value ) { \
+        map->control[ index ] = value; \
+        map->control[ ( ( index - 7 ) & map->mask ) + 7 ] = value; \
+    } \
+    \
+    \
+    static inline item_type* name##_find( name##_t const* map, key_type key ) { \
+        uint32_t const index = name##_internal_find_index( map, key, hash_fn( key ) ); \
+        return index & 0x80000000u ? NULL : &map->entries[ index ].item; \
+    } \
+    \
+    \
+    static inline void name##_internal_grow( name##_t* map ) { \
+        uint32_t const capacity = map->mask ? ( map->mask + 1 ) * 2 : 16; \
+        name##_entry_t* entries = (name##_entry_t*) malloc( capacity * ( sizeof( name##_entry_t ) + 1 ) + 8 ); \
+        unsigned char* control = (unsigned char*)( entries + capacity ); \
+        memset( control, 0, capacity + 8 ); \
+        for( uint32_t i = 0; map->mask && i <= map->mask; ++i ) { \
+            if( map->control[ i ] == 0 ) continue; \
+            uint32_t slot = hash_fn( map->entries[ i ].key ) & ( capacity - 1 ); \
+            while( control[ slot ] ) slot = ( slot + 1 ) & ( capacity - 1 ); \
+            control[ slot ] = map->control[ i ]; \
+            entries[ slot ] = map->entries[ i ]; \
+        } \
+        memcpy( control + capacity, control, 7 ); \
+        if( map->mask ) free( map->entries ); \
+        map->entries = entries; \
+        map->control = control; \
+        map->mask = capacity - 1; \
+    } \
+    \
+    \
+    static inline item_type* name##_find_or_insert( name##_t* map, key_type key, bool* inserted ) { \
+        uint32_t const hash = hash_fn( key ); \
+        uint32_t index = name##_internal_find_index( map, key, hash ); \
+        if( !( index & 0x80000000u ) ) { \
+            if( inserted ) *inserted = false; \
+            return &map->entries[ index ].item; \
+        } \
+        if( ( (uint64_t) map->count + 1 ) * 4 > ( (uint64_t) map->mask + 1 ) * 3 ) { \
+            name##_internal_grow( map ); \
+            for( index = hash & map->mask; map->control[ index ]; index = ( index + 1 ) & map->mask ) {} \
+        } \
+        index &= map->mask; \
+        name##_internal_set_control( map, index, (unsigned char)( 0x80u | ( hash >> 25 ) ) ); \
+        map->entries[ index ].key = key; \
+        memset( &map->entries[ index ].item, 0, sizeof( item_type ) ); \
+        ++map->count; \
+        if( inserted ) *inserted = true; \
+        return &map->entries[ index ].item; \
+    } \
+    \
+    \
+    static inline void name##_insert( name##_t* map, key_type key, item_type item ) { \
+        *name##_find_or_insert( map, key, NULL ) = item; \
+    } \
+    \
+    \
+    static inline bool name##_remove( name##_t* map, key_type key ) { \
+        uint32_t hole = name##_internal_find_index( map, key, hash_fn( key ) ); \
+        if( hole & 0x80000000u ) return false; \
+        \
+        /* Each key after the removed one, up to the next empty entry, is moved back into the hole if that does not */ \
+        /* put it before the entry its hash picks, which leaves every key reachable from where its probing starts */ \
+        for( uint32_t i = ( hole + 1 ) & map->mask; map->control[ i ]; i = ( i + 1 ) & map->mask ) { \
+            uint32_t const start = hash_fn( map->entries[ i ].key ) & map->mask; \
+            if( ( ( i - start ) & map->mask ) >= ( ( i - hole ) & map->mask ) ) { \
+                map->entries[ hole ] = map->entries[ i ]; \
+                name##_internal_set_control( map, hole, map->control[ i ] ); \
+                hole = i; \
+            } \
+        } \
+        name##_internal_set_control( map, hole, 0 ); \
+        --map->count; \
+        return true; \
+    }
+
+
+#endif /* map_h */
@@ -2,6 +2,7 @@
 #define str_h
 
 // To make str_t thread safe, do this before include: #define STR_THREAD_SAFE
+// If the string pool is built with STRPOOL_CONCURRENT, str/cstr/len don't need to take the lock at all
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -11,6 +12,10 @@ typedef uint32_t str_t;
 // create a str_t from a c string
 str_t str( char const* string );
 
+// look up the str_t for the first `length` characters of `string`, without creating it. Returns false if no str_t has 
+// been created for that string, which costs no allocation, so it can be used for strings from untrusted input.
+bool str_find( char const* string, int length, str_t* result );
+
 // return the c string for a str_t
 char const* cstr( str_t string );
 
@@ -103,6 +108,14 @@ thread_atomic_ptr_t g_strsys;
     #define STR_MUTEX_UNLOCK(x) 
 #endif
 
+#if defined( STR_THREAD_SAFE ) && !defined( STRPOOL_CONCURRENT )
+    #define STR_POOL_LOCK(x) thread_mutex_lock( (x) )
+    #define STR_POOL_UNLOCK(x) thread_mutex_unlock( (x) )
+#else
+    #define STR_POOL_LOCK(x) 
+    #define STR_POOL_UNLOCK(x) 
+#endif
+
 typedef uint32_t str_t;
 
 
@@ -167,28 +180,43 @@ static char* get_strtemp( strsys_t* strsys, int required_capacity ) {
 // create a str_t from a c string
 str_t str( char const* string ) {
     strsys_t* strsys = get_strsys();
-    STR_MUTEX_LOCK( &strsys->mutex );
+    STR_POOL_LOCK( &strsys->mutex );
     STRPOOL_U64 handle = strpool_inject( &strsys->pool, string ? string : "", string ? (int) strlen( string ) : 0 );
-    STR_MUTEX_UNLOCK( &strsys->mutex );
+    STR_POOL_UNLOCK( &strsys->mutex );
     return (str_t) handle;
 }
 
 
+// look up the str_t for a string, without creating it
+bool str_find( char const* string, int length, str_t* result ) {
+    if( !string || length <= 0 ) {
+        *result = 0; // the empty string, which str() also gives a handle of 0
+        return true;
+    }
+    strsys_t* strsys = get_strsys();
+    STR_POOL_LOCK( &strsys->mutex );
+    STRPOOL_U64 handle = strpool_find( &strsys->pool, string, length );
+    STR_POOL_UNLOCK( &strsys->mutex );
+    *result = (str_t) handle;
+    return handle != 0;
+}
+
+
 // return the c string for a str_t
 char const* cstr( str_t string ) {
     strsys_t* strsys = get_strsys();
-    STR_MUTEX_LOCK( &strsys->mutex );
+    STR_POOL_LOCK( &strsys->mutex );
     char const* result = strpool_cstr( &strsys->pool, (STRPOOL_U64) string );
-    STR_MUTEX_UNLOCK( &strsys->mutex );
+    STR_POOL_UNLOCK( &strsys->mutex );
     return result ? result : "";
 }
 
 // give the length of a string
 int len( str_t string ) {
     strsys_t* strsys = get_strsys();
-    STR_MUTEX_LOCK( &strsys->mutex );
+    STR_POOL_LOCK( &strsys->mutex );
     int result = strpool_length( &strsys->pool, (STRPOOL_U64) string );
-    STR_MUTEX_UNLOCK( &strsys->mutex );
+    STR_POOL_UNLOCK( &strsys->mutex );
     return result;
 }
 
@@ -482,5 +510,7 @@ int int_from_string( str_t string ) {
 
 #undef STR_MUTEX_LOCK
 #undef STR_MUTEX_UNLOCK
+#undef STR_POOL_LOCK
+#undef STR_POOL_UNLOCK
 
 #endif /* STR_IMPLEMENTATION */
\ No newline at end of file
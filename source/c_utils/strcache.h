@@ -0,0 +1,265 @@
+#ifndef strcache_h
+#define strcache_h
+
+// To make strcache thread safe, do this before include: #define STRCACHE_THREAD_SAFE
+// A strcache_t maps str_t keys to items of a fixed size, like a strmap, but holds at most a fixed number of keys, and
+// makes room for new ones by evicting keys which have not been looked up recently, picked with the CLOCK algorithm. It
+// is meant as a cache in front of something slow, and does not allocate memory for each lookup or insert.
+
+typedef struct strcache_t strcache_t;
+
+// create a cache which holds at most `capacity` keys. `evict`, which may be NULL, is called for each item as it
+// leaves the cache, whether it is evicted to make room, overwritten, removed, or dropped by strcache_clear or 
+// strcache_destroy, so anything the item refers to can be released. In thread safe builds, the cache is locked while 
+// `evict` is called, so it must not call any strcache function on the same cache.
+strcache_t* strcache_create( int item_size, int capacity, void (*evict)( void* user_data, str_t key, void* item ), 
+    void* user_data );
+
+void strcache_destroy( strcache_t* strcache );
+void strcache_clear( strcache_t* strcache );
+int strcache_count( strcache_t* strcache );
+
+// insert the key with a copy of the item, or overwrite its item if the key is already in the cache. If the cache is 
+// full, another key is evicted first.
+void strcache_insert( strcache_t* strcache, str_t key, void const* item );
+
+// copy the item of the key to `item`, and mark the key as recently used. Returns false if the key is not in the cache.
+bool strcache_find( strcache_t* strcache, str_t key, void* item );
+
+// remove the key, and return false if it was not in the cache
+bool strcache_remove( strcache_t* strcache, str_t key );
+
+// give the number of lookups which found their key, the number which did not, and the number of keys evicted to make 
+// room for others, since the cache was created. Any of the pointers may be NULL.
+void strcache_stats( strcache_t* strcache, int64_t* hits, int64_t* misses, int64_t* evictions );
+
+#endif /* strcache_h */
+
+
+#ifdef STRCACHE_IMPLEMENTATION
+#undef STRCACHE_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+
+
+static uint32_t strcache_hash_u32( uint32_t key ) {
+    key = ~key + ( key << 15 );
+    key = key ^ ( key >> 12 );
+    key = key + ( key << 2 );
+    key = key ^ ( key >> 4 );
+    key = (key + ( key << 3 ) ) + ( key << 11 );
+    key = key ^ ( key >> 16);
+    return key;
+}
+
+
+// The keys and items are kept in a hashtable which is made big enough to never have to grow, so the items stay in the
+// same dense array, where removing a key moves the last item into its place. Each item index has a byte in 
+// `referenced`, which is set when the key at that index is looked up. To make room, the clock hand sweeps over the
+// indices, clearing the bytes which are set, and evicts the first key whose byte was already clear, so every key which
+// has been looked up since the hand last passed it is kept for another round.
+typedef struct strcache_t {
+    int item_size;
+    int item_stride;
+    int capacity;
+    int hand;
+    unsigned char* referenced;
+    void (*evict)( void* user_data, str_t key, void* item );
+    void* user_data;
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    hashtable_t hashtable;
+    #ifdef STRCACHE_THREAD_SAFE
+        thread_mutex_t mutex;
+    #endif
+} strcache_t;
+
+
+#ifdef STRCACHE_THREAD_SAFE
+    #define STRCACHE_MUTEX_LOCK(x) thread_mutex_lock( (x) )
+    #define STRCACHE_MUTEX_UNLOCK(x) thread_mutex_unlock( (x) )
+#else
+    #define STRCACHE_MUTEX_LOCK(x) 
+    #define STRCACHE_MUTEX_UNLOCK(x) 
+#endif
+
+
+strcache_t* strcache_create( int item_size, int capacity, void (*evict)( void* user_data, str_t key, void* item ), 
+    void* user_data ) {
+
+    strcache_t* strcache = (strcache_t*) malloc( sizeof( strcache_t ) );
+    strcache->item_size = item_size;
+    strcache->item_stride = item_size > 0 ? item_size : 1; // so each item has an address to find its index from
+    strcache->capacity = capacity > 0 ? capacity : 1;
+    strcache->hand = 0;
+    strcache->referenced = (unsigned char*) malloc( (size_t) strcache->capacity );
+    strcache->evict = evict;
+    strcache->user_data = user_data;
+    strcache->hits = 0;
+    strcache->misses = 0;
+    strcache->evictions = 0;
+    // The hashtable grows its items when they are three quarters full (in builds with HASHTABLE_INCREMENTAL_RESIZE),
+    // so it is given room for a third more than the capacity, to never get there
+    int const hashtable_capacity = strcache->capacity + strcache->capacity / 3 + 1;
+    hashtable_init( &strcache->hashtable, sizeof( str_t ), strcache->item_stride, hashtable_capacity, NULL );
+    #ifdef STRCACHE_THREAD_SAFE
+        thread_mutex_init( &strcache->mutex );
+    #endif
+    return strcache;
+}
+
+
+// Calls the evict callback for every item in the cache, before they are all dropped at once
+static void strcache_evict_all( strcache_t* strcache ) {
+    if( strcache->evict ) {
+        int count = hashtable_count( &strcache->hashtable );
+        str_t const* keys = (str_t const*) hashtable_keys( &strcache->hashtable );
+        char* items = (char*) hashtable_items( &strcache->hashtable );
+        for( int i = 0; i < count; ++i ) {
+            strcache->evict( strcache->user_data, keys[ i ], items + (size_t) i * (size_t) strcache->item_stride );
+        }
+    }
+}
+
+
+void strcache_destroy( strcache_t* strcache ) {
+    STRCACHE_MUTEX_LOCK( &strcache->mutex );
+    strcache_evict_all( strcache );
+    hashtable_term( &strcache->hashtable );
+    STRCACHE_MUTEX_UNLOCK( &strcache->mutex );    
+    #ifdef STRCACHE_THREAD_SAFE
+        thread_mutex_term( &strcache->mutex );
+    #endif
+    free( strcache->referenced );
+    free( strcache );
+}
+
+
+void strcache_clear( strcache_t* strcache ) {
+    STRCACHE_MUTEX_LOCK( &strcache->mutex );
+    strcache_evict_all( strcache );
+    hashtable_clear( &strcache->hashtable );
+    strcache->hand = 0;
+    STRCACHE_MUTEX_UNLOCK( &strcache->mutex );    
+}
+
+
+int strcache_count( strcache_t* strcache ) {
+    STRCACHE_MUTEX_LOCK( &strcache->mutex );
+    int count = hashtable_count( &strcache->hashtable );
+    STRCACHE_MUTEX_UNLOCK( &strcache->mutex );    
+    return count;
+}
+
+
+// Gives the index of an item returned by hashtable_find. The hashtable never grows, so its items are never moving to
+// a new array, and are all in the one hashtable_items gives.
+static int strcache_index( strcache_t* strcache, void const* item ) {
+    char const* items = (char const*) hashtable_items( &strcache->hashtable );
+    return (int)( ( (char const*) item - items ) / strcache->item_stride );
+}
+
+
+// The hashtable moves its last item into the place of the removed one, so its referenced byte is moved along with it
+static void strcache_remove_index( strcache_t* strcache, uint32_t hash, str_t key, int index ) {
+    int last = hashtable_count( &strcache->hashtable ) - 1;
+    hashtable_remove( &strcache->hashtable, hash, &key );
+    strcache->referenced[ index ] = strcache->referenced[ last ];
+}
+
+
+// Every key the hand passes over has its byte cleared, so it stops within one sweep over all the keys, and on average
+// after only a few, as keys which have been looked up get their byte set again
+static void strcache_evict_one( strcache_t* strcache ) {
+    int count = hashtable_count( &strcache->hashtable );
+    int hand = strcache->hand < count ? strcache->hand : 0;
+    while( strcache->referenced[ hand ] ) {
+        strcache->referenced[ hand ] = 0;
+        hand = hand + 1 < count ? hand + 1 : 0;
+    }
+    strcache->hand = hand;
+
+    str_t key = ( (str_t const*) hashtable_keys( &strcache->hashtable ) )[ hand ];
+    if( strcache->evict ) {
+        char* items = (char*) hashtable_items( &strcache->hashtable );
+        strcache->evict( strcache->user_data, key, items + (size_t) hand * (size_t) strcache->item_stride );
+    }
+    strcache_remove_index( strcache, strcache_hash_u32( key ), key, hand );
+    ++strcache->evictions;
+}
+
+
+void strcache_insert( strcache_t* strcache, str_t key, void const* item ) {
+    uint32_t hash = strcache_hash_u32( key );
+    STRCACHE_MUTEX_LOCK( &strcache->mutex );
+    void* existing = hashtable_find( &strcache->hashtable, hash, &key );
+    if( existing ) {
+        if( strcache->evict ) {
+            strcache->evict( strcache->user_data, key, existing );
+        }
+        memcpy( existing, item, (size_t) strcache->item_size );
+    } else {
+        if( hashtable_count( &strcache->hashtable ) >= strcache->capacity ) {
+            strcache_evict_one( strcache );
+        }
+        void* inserted = hashtable_find_or_insert( &strcache->hashtable, hash, &key, NULL );
+        memcpy( inserted, item, (size_t) strcache->item_size );
+        strcache->referenced[ hashtable_count( &strcache->hashtable ) - 1 ] = 0;
+    }
+    STRCACHE_MUTEX_UNLOCK( &strcache->mutex );    
+}
+
+
+bool strcache_find( strcache_t* strcache, str_t key, void* item ) {
+    uint32_t hash = strcache_hash_u32( key );
+    STRCACHE_MUTEX_LOCK( &strcache->mutex );
+    void const* result = hashtable_find( &strcache->hashtable, hash, &key );
+    if( result ) {
+        memcpy( item, result, (size_t) strcache->item_size );
+        strcache->referenced[ strcache_index( strcache, result ) ] = 1;
+        ++strcache->hits;
+    } else {
+        ++strcache->misses;
+    }
+    STRCACHE_MUTEX_UNLOCK( &strcache->mutex );    
+    return result != NULL;
+}
+
+
+bool strcache_remove( strcache_t* strcache, str_t key ) {
+    uint32_t hash = strcache_hash_u32( key );
+    STRCACHE_MUTEX_LOCK( &strcache->mutex );
+    void* result = hashtable_find( &strcache->hashtable, hash, &key );
+    if( result ) {
+        if( strcache->evict ) {
+            strcache->evict( strcache->user_data, key, result );
+        }
+        strcache_remove_index( strcache, hash, key, strcache_index( strcache, result ) );
+    }
+    STRCACHE_MUTEX_UNLOCK( &strcache->mutex );    
+    return result != NULL;
+}
+
+
+void strcache_stats( strcache_t* strcache, int64_t* hits, int64_t* misses, int64_t* evictions ) {
+    STRCACHE_MUTEX_LOCK( &strcache->mutex );
+    if( hits ) {
+        *hits = strcache->hits;
+    }
+    if( misses ) {
+        *misses = strcache->misses;
+    }
+    if( evictions ) {
+        *evictions = strcache->evictions;
+    }
+    STRCACHE_MUTEX_UNLOCK( &strcache->mutex );    
+}
+
+
+#undef STRCACHE_MUTEX_LOCK
+#undef STRCACHE_MUTEX_UNLOCK
+
+#endif /* STRCACHE_IMPLEMENTATION */
@@ -2,17 +2,149 @@
 #define strmap_h
 
 // To make strmap thread safe, do this before include: #define STRMAP_THREAD_SAFE
+// The thread safe strmap is split into 64 separately locked stripes. To use a different number, which must be a power of 
+// two, #define STRMAP_STRIPE_COUNT as well. Other builds have a single stripe, unless STRMAP_STRIPE_COUNT is defined.
 
 typedef struct strmap_t strmap_t;
 
 strmap_t* strmap_create( int item_size );
+
+// create a map with room for `capacity_hint` keys, so it does not grow until it has that many, or which starts out
+// smaller than strmap_create would make it, if the hint is small. A hint of 0 gives the same size as strmap_create.
+strmap_t* strmap_create_ex( int item_size, int capacity_hint );
+
 void strmap_destroy( strmap_t* strmap );
 void strmap_clear( strmap_t* strmap );
+
+// insert the key with a copy of the item, overwriting its item if the key is already in the map
 void strmap_insert( strmap_t* strmap, str_t key, void const* item );
+
 void strmap_remove( strmap_t* strmap, str_t key );
 bool strmap_update( strmap_t* strmap, str_t key, void const* item );
 bool strmap_find( strmap_t* strmap, str_t key, void* item );
 
+// look up the key given as the first `length` characters of `string`, without making a str_t of it. A string which no
+// str_t has been made for can not be a key, so it is not found without looking in the map, and without adding it to 
+// the string pool, as calling str() for it would. Use this for keys from untrusted input.
+bool strmap_find_cstr( strmap_t* strmap, char const* string, int length, void* item );
+
+// like strmap_insert, but returns true if the key was inserted, and false if its item was overwritten. The key is only
+// looked up once, and in thread safe builds, the lock is only taken once.
+bool strmap_upsert( strmap_t* strmap, str_t key, void const* item );
+
+// add `amount` to the int64_t counter at the start of the item of the key, inserting the key with an item of all zeros
+// first if it is not in the map, and return the new value of the counter. The item size must be at least 8 bytes. In 
+// thread safe builds, this is done while holding the lock, so no additions are lost when several threads count at once.
+int64_t strmap_add_i64( strmap_t* strmap, str_t key, int64_t amount );
+
+// call `callback` with a pointer to the item of the key as it is stored in the map, so it can be read or changed in 
+// place without being copied. In thread safe builds, the lock is held during the call, so the callback must be quick, 
+// and must not call any other strmap function on the same map. Returns false, without calling `callback`, if the key
+// is not in the map.
+bool strmap_with( strmap_t* strmap, str_t key, void (*callback)( void* user_data, void* item ), void* user_data );
+
+#ifndef STRMAP_THREAD_SAFE
+    // return a pointer to the item of the key as it is stored in the map, or NULL if the key is not in the map. The 
+    // pointer is only valid until the next insert, upsert or remove. Not available in thread safe builds, where the
+    // item could be changed or moved by another thread while the pointer is used; use strmap_with instead.
+    void* strmap_get_ptr( strmap_t* strmap, str_t key );
+#endif
+
+// look up `count` keys at once, copy the item of each key which is found to `items`, at the same index as the key,
+// and set the same entry of `found` (which may be NULL) to whether the key was found. Returns the number of keys found.
+// In thread safe builds, each stripe is locked once.
+int strmap_find_many( strmap_t* strmap, str_t const* keys, int count, void* items, bool* found );
+
+// insert `count` keys, with the item of each key at the same index in `items`, overwriting the item of any key which is
+// already in the map, or given more than once. In thread safe builds, each stripe is locked once.
+void strmap_insert_many( strmap_t* strmap, str_t const* keys, void const* items, int count );
+
+// give the number of keys in the map
+int strmap_count( strmap_t* strmap );
+
+// call `callback` for each key in the map, with a pointer to its item as it is stored in the map, so it can be changed
+// in place. In thread safe builds, stripes are locked while they are visited, so the callback must not call any other
+// strmap function on the same map.
+void strmap_foreach( strmap_t* strmap, void (*callback)( void* user_data, str_t key, void* item ), void* user_data );
+
+// call `callback` with the keys and items of the map as they are stored in it, in runs of `count` keys, with `items` 
+// holding the item of each key at the same index. `part` is always 0. Locking is as for strmap_foreach.
+void strmap_foreach_span( strmap_t* strmap, 
+    void (*callback)( void* user_data, int part, str_t const* keys, void* items, int count ), void* user_data );
+
+// like strmap_foreach_span, but with the keys split into at most `thread_count` parts, each given to `callback` from a
+// thread of its own, with `part` telling which one. In thread safe builds, all the stripes are locked for the whole
+// call. Threads are only used if thread.h is included before the implementation.
+void strmap_foreach_parallel( strmap_t* strmap, int thread_count, 
+    void (*callback)( void* user_data, int part, str_t const* keys, void* items, int count ), void* user_data );
+
+// give the map a Bloom filter with `bits_per_key` bits for each key, checked by lookups to rule out most missing
+// keys before the hashtable is searched, or remove it if `bits_per_key` is 0.
+void strmap_bloom_filter( strmap_t* strmap, int bits_per_key );
+
+// give the number of bytes used by the Bloom filter, and the chance of it not ruling out a key which is not in the map
+void strmap_bloom_filter_stats( strmap_t* strmap, int* memory, float* false_positive_rate );
+
+// only available if buffer.h is included before strmap.h
+#ifdef buffer_h
+    // write the map to a buffer, as copies of the arrays of its hashtables, along with the strings of its keys. Items
+    // are written as plain bytes, so they should not hold pointers. In thread safe builds, each stripe is locked only
+    // while it is written. Returns false if the map does not fit in a buffer.
+    bool strmap_save( strmap_t* strmap, buffer_t* buffer );
+
+    // create a strmap from data written by strmap_save, starting at the current position of the buffer. Returns NULL
+    // if the data is not a saved strmap, or was saved on a machine with a different byte order. As str_t handles are
+    // only valid in the process which made them, the hashtables are only used as they are if the key strings give the
+    // same handles as when they were saved, like when loading into the process which saved them, or into a new process
+    // which makes the same strings in the same order. Otherwise, or if the map was saved by a build with a different
+    // number of stripes, the keys are inserted one by one.
+    strmap_t* strmap_load( buffer_t* buffer );
+#endif
+
+// A snapshot is a read-only view of a strmap as it was when taken, which any number of threads can read without
+// locking while the map goes on changing. Nothing is copied when it is taken. Instead, each stripe copies its hashtable
+// the first time it changes it afterwards. With a single stripe, as in builds that are not thread safe unless
+// STRMAP_STRIPE_COUNT is defined, that is a copy of the whole map. The foreach functions copy every stripe they visit.
+typedef struct strmap_snapshot_t strmap_snapshot_t;
+
+// take a snapshot of the map. In thread safe builds, all the stripes are locked while it is taken.
+strmap_snapshot_t* strmap_snapshot( strmap_t* strmap );
+
+// release a snapshot, freeing the tables of it the map no longer uses. Takes no lock, and can be done after the map is
+// destroyed.
+void strmap_snapshot_release( strmap_snapshot_t* snapshot );
+
+int strmap_snapshot_count( strmap_snapshot_t const* snapshot );
+bool strmap_snapshot_find( strmap_snapshot_t const* snapshot, str_t key, void* item );
+
+// call `callback` with the keys and items of the snapshot in runs of `count` keys, as strmap_foreach_span does
+void strmap_snapshot_foreach_span( strmap_snapshot_t const* snapshot,
+    void (*callback)( void* user_data, str_t const* keys, void const* items, int count ), void* user_data );
+
+// A frozen strmap is a read-only copy of a strmap, which finds keys through a minimal perfect hash, so a lookup is one
+// hash of the key string and a few memory reads, and any number of threads can read it without locking. Key strings are
+// stored along with the items, so it is a single flat block of memory, which can be written to a file as it is, and
+// used directly when loaded or memory mapped, in any process. Items are copied as plain bytes, so they should not hold
+// pointers (or str_t values) if the frozen strmap is saved.
+typedef struct strmap_frozen_t strmap_frozen_t;
+
+// build a frozen copy of the current contents of a strmap, and give its size in bytes. Returns NULL if it is too big.
+strmap_frozen_t* strmap_freeze( strmap_t* strmap, int* size );
+
+// release a frozen strmap returned by strmap_freeze
+void strmap_frozen_destroy( strmap_frozen_t* frozen );
+
+// use a block of memory holding a saved frozen strmap, without copying it. The memory must be aligned to 4 bytes and be
+// kept around while the frozen strmap is used. Returns NULL if it is not a frozen strmap with items of `item_size` bytes.
+strmap_frozen_t const* strmap_frozen_map( void const* data, int size, int item_size );
+
+int strmap_frozen_count( strmap_frozen_t const* frozen );
+bool strmap_frozen_find( strmap_frozen_t const* frozen, str_t key, void* item );
+
+// look up a key given as `length` bytes of string data, which is faster than looking up a str_t, as the str_t must first
+// be turned into its string data, and which also works for strings which were never made into str_t values
+bool strmap_frozen_find_cstr( strmap_frozen_t const* frozen, char const* string, int length, void* item );
+
 #endif /* strmap_h */
 
 
@@ -22,6 +154,7 @@ bool strmap_find( strmap_t* strmap, str_t key, void* item );
 #include <stdlib.h>
 #include <string.h>
 #include "hashtable.h"
+#include "bloom.h"
 
 
 static uint32_t strmap_hash_u32( uint32_t key ) {
@@ -35,12 +168,61 @@ static uint32_t strmap_hash_u32( uint32_t key ) {
 }
 
 
-typedef struct strmap_t {
+// In thread safe mode, the map is split into a number of stripes, each a hashtable of its own with its own lock, and
+// every key belongs to exactly one stripe, picked from its hash. Threads working on keys in different stripes never 
+// wait for each other, and a stripe growing its table only holds up the keys of that stripe, not the whole map.
+#ifdef STRMAP_THREAD_SAFE
+    #ifndef STRMAP_STRIPE_COUNT
+        #define STRMAP_STRIPE_COUNT 64
+    #endif
+#else
+    #ifndef STRMAP_STRIPE_COUNT
+        #define STRMAP_STRIPE_COUNT 1
+    #endif
+#endif
+
+
+// Snapshots are released without taking any lock, so in thread safe builds, the tables they share with the map are
+// counted with atomics
+#ifdef STRMAP_THREAD_SAFE
+    typedef thread_atomic_int_t strmap_refs_t;
+    #define STRMAP_REFS_INIT(x) thread_atomic_int_store( (x), 1 )
+    #define STRMAP_REFS_LOAD(x) thread_atomic_int_load( (x) )
+    #define STRMAP_REFS_INC(x) thread_atomic_int_inc( (x) )
+    #define STRMAP_REFS_DEC(x) thread_atomic_int_dec( (x) )
+#else
+    typedef int strmap_refs_t;
+    #define STRMAP_REFS_INIT(x) ( *(x) = 1 )
+    #define STRMAP_REFS_LOAD(x) ( *(x) )
+    #define STRMAP_REFS_INC(x) ( (*(x))++ )
+    #define STRMAP_REFS_DEC(x) ( (*(x))-- )
+#endif
+
+
+// The hashtable of a stripe, once a snapshot is taken of it. The stripe keeps reading from its table as it is, and
+// makes a copy of its own the first time it is about to change it, unless the snapshots have all been released by then.
+typedef struct strmap_shared_t {
+    strmap_refs_t refs; // the stripe, if it still uses the table, and each snapshot using it
     hashtable_t hashtable;
-    int item_size;
+} strmap_shared_t;
+
+
+typedef struct strmap_stripe_t {
     #ifdef STRMAP_THREAD_SAFE
         thread_mutex_t mutex;
     #endif
+    hashtable_t hashtable;
+    strmap_shared_t* shared; // NULL unless the hashtable is shared with a snapshot
+    bloom_t bloom;
+    #ifdef STRMAP_THREAD_SAFE
+        char padding[ 64 ]; // keep the next stripe's mutex off the cache lines this stripe writes to
+    #endif
+} strmap_stripe_t;
+
+
+typedef struct strmap_t {
+    int item_size;
+    strmap_stripe_t stripes[ STRMAP_STRIPE_COUNT ];
 } strmap_t;
 
 
@@ -53,74 +235,1072 @@ typedef struct strmap_t {
 #endif
 
 
+static int strmap_stripe_index( uint32_t hash ) {
+    // The hashtable uses both the low and the high bits of the hash, so the stripe is picked from a remix of it, to 
+    // not leave each stripe with only a fraction of the possible hash values
+    return (int)( ( ( hash * 0x9e3779b9u ) >> 16 ) & ( STRMAP_STRIPE_COUNT - 1 ) );
+}
+
+
+static strmap_stripe_t* strmap_stripe( strmap_t* strmap, uint32_t hash ) {
+    return &strmap->stripes[ strmap_stripe_index( hash ) ];
+}
+
+
+static void strmap_shared_release( strmap_shared_t* shared ) {
+    if( STRMAP_REFS_DEC( &shared->refs ) == 1 ) {
+        hashtable_term( &shared->hashtable );
+        free( shared );
+    }
+}
+
+
+// Lets go of the hashtable of a stripe, freeing it unless a snapshot still uses it. The stripe must be locked.
+static void strmap_table_release( strmap_stripe_t* stripe ) {
+    if( stripe->shared ) {
+        strmap_shared_release( stripe->shared );
+        stripe->shared = NULL;
+    } else {
+        hashtable_term( &stripe->hashtable );
+    }
+}
+
+
+// Locks a stripe which is about to be changed, and gives it a hashtable of its own again, if the one it has is shared
+// with a snapshot. The copy is made by saving the shared table and loading it, which only reads from it, as any resize
+// was finished before it was shared. If the snapshots have all been released, the table is taken back as it is.
+static void strmap_lock_writable( strmap_t* strmap, strmap_stripe_t* stripe ) {
+    STRMAP_MUTEX_LOCK( &stripe->mutex );
+    strmap_shared_t* shared = stripe->shared;
+    if( !shared ) {
+        return;
+    }
+    if( STRMAP_REFS_LOAD( &shared->refs ) > 1 ) {
+        HASHTABLE_U64 const size = hashtable_save_size( &shared->hashtable );
+        void* data = malloc( (size_t) size );
+        hashtable_save( &shared->hashtable, data );
+        hashtable_load( &stripe->hashtable, sizeof( str_t ), strmap->item_size, data, size, NULL );
+        free( data );
+        strmap_shared_release( shared );
+    } else {
+        free( shared );
+    }
+    stripe->shared = NULL;
+}
+
+
+// The Bloom filter of a stripe is built from the keys in its hashtable, with room for twice as many, and is built again
+// when it has had as many keys added as it has room for. Removed keys stay in the filter until then.
+static void strmap_bloom_rebuild( strmap_stripe_t* stripe, int bits_per_key ) {
+    bloom_term( &stripe->bloom );
+    if( bits_per_key <= 0 ) {
+        return;
+    }
+    int count = hashtable_count( &stripe->hashtable );
+    bloom_init( &stripe->bloom, count > 32 ? count * 2 : 64, bits_per_key );
+    str_t const* keys = (str_t const*) hashtable_keys( &stripe->hashtable );
+    for( int i = 0; i < count; ++i ) {
+        bloom_add( &stripe->bloom, strmap_hash_u32( keys[ i ] ) );
+    }
+}
+
+
+static void strmap_bloom_add( strmap_stripe_t* stripe, uint32_t hash ) {
+    if( !stripe->bloom.memory ) {
+        return;
+    } else if( stripe->bloom.count < stripe->bloom.capacity ) {
+        bloom_add( &stripe->bloom, hash );
+    } else {
+        strmap_bloom_rebuild( stripe, stripe->bloom.bits_per_key );
+    }
+}
+
+
+// Returns true if the stripe has a Bloom filter, and the filter says the key is not in the stripe
+static bool strmap_bloom_excludes( strmap_stripe_t const* stripe, uint32_t hash ) {
+    return stripe->bloom.memory && !bloom_test( &stripe->bloom, hash );
+}
+
+
 strmap_t* strmap_create( int item_size ) {
+    return strmap_create_ex( item_size, 0 );
+}
+
+
+strmap_t* strmap_create_ex( int item_size, int capacity_hint ) {
+    // Keys do not spread perfectly evenly over the stripes, so each stripe gets room for a bit more than its share
+    int share = ( capacity_hint + STRMAP_STRIPE_COUNT - 1 ) / STRMAP_STRIPE_COUNT;
+    share = STRMAP_STRIPE_COUNT > 1 ? share + share / 4 + 8 : share;
     strmap_t* strmap = (strmap_t*) malloc( sizeof( strmap_t ) );
-    int const initial_capacity = 256;
-    hashtable_init( &strmap->hashtable, sizeof( str_t ), item_size,  initial_capacity, NULL );
-    #ifdef STRMAP_THREAD_SAFE
-        thread_mutex_init( &strmap->mutex );
-    #endif
+    int const initial_capacity = 256 / STRMAP_STRIPE_COUNT > 16 ? 256 / STRMAP_STRIPE_COUNT : 16;
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        hashtable_init( &strmap->stripes[ i ].hashtable, sizeof( str_t ), item_size, 
+            capacity_hint > 0 ? 1 : initial_capacity, NULL );
+        if( capacity_hint > 0 ) {
+            hashtable_reserve( &strmap->stripes[ i ].hashtable, share );
+        }
+        strmap->stripes[ i ].shared = NULL;
+        memset( &strmap->stripes[ i ].bloom, 0, sizeof( bloom_t ) );
+        #ifdef STRMAP_THREAD_SAFE
+            thread_mutex_init( &strmap->stripes[ i ].mutex );
+        #endif
+    }
     strmap->item_size = item_size;
     return strmap;
 }
 
 
 void strmap_destroy( strmap_t* strmap ) {
-    STRMAP_MUTEX_LOCK( &strmap->mutex );
-    hashtable_term( &strmap->hashtable );
-    STRMAP_MUTEX_UNLOCK( &strmap->mutex );    
-    #ifdef STRMAP_THREAD_SAFE
-        thread_mutex_term( &strmap->mutex );
-    #endif
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        STRMAP_MUTEX_LOCK( &stripe->mutex );
+        strmap_table_release( stripe );
+        bloom_term( &stripe->bloom );
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+        #ifdef STRMAP_THREAD_SAFE
+            thread_mutex_term( &stripe->mutex );
+        #endif
+    }
     free( strmap );
 }
 
 
 void strmap_clear( strmap_t* strmap ) {
-    STRMAP_MUTEX_LOCK( &strmap->mutex );
-    hashtable_clear( &strmap->hashtable );
-    STRMAP_MUTEX_UNLOCK( &strmap->mutex );    
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        STRMAP_MUTEX_LOCK( &stripe->mutex );
+        if( stripe->shared ) {
+            int const capacity = 256 / STRMAP_STRIPE_COUNT > 16 ? 256 / STRMAP_STRIPE_COUNT : 16;
+            strmap_table_release( stripe );
+            hashtable_init( &stripe->hashtable, sizeof( str_t ), strmap->item_size, capacity, NULL );
+        } else {
+            hashtable_clear( &stripe->hashtable );
+        }
+        if( stripe->bloom.memory ) {
+            bloom_clear( &stripe->bloom );
+        }
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
 }
 
 
 void strmap_insert( strmap_t* strmap, str_t key, void const* item ) {
-    STRMAP_MUTEX_LOCK( &strmap->mutex );
-    hashtable_insert( &strmap->hashtable, strmap_hash_u32( key ), &key, item );
-    STRMAP_MUTEX_UNLOCK( &strmap->mutex );    
+    strmap_upsert( strmap, key, item );
 }
 
 
 void strmap_remove( strmap_t* strmap, str_t key ) {
-    STRMAP_MUTEX_LOCK( &strmap->mutex );
-    hashtable_remove( &strmap->hashtable, strmap_hash_u32( key ), &key );
-    STRMAP_MUTEX_UNLOCK( &strmap->mutex );    
+    uint32_t hash = strmap_hash_u32( key );
+    strmap_stripe_t* stripe = strmap_stripe( strmap, hash );
+    strmap_lock_writable( strmap, stripe );
+    if( !strmap_bloom_excludes( stripe, hash ) ) {
+        hashtable_remove( &stripe->hashtable, hash, &key );
+    }
+    STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
 }
 
 
 bool strmap_update( strmap_t* strmap, str_t key, void const* item ) {
-    STRMAP_MUTEX_LOCK( &strmap->mutex );
-    void* result = hashtable_find( &strmap->hashtable, strmap_hash_u32( key ), &key );
+    uint32_t hash = strmap_hash_u32( key );
+    strmap_stripe_t* stripe = strmap_stripe( strmap, hash );
+    strmap_lock_writable( strmap, stripe );
+    void* result = strmap_bloom_excludes( stripe, hash ) ? NULL : hashtable_find( &stripe->hashtable, hash, &key );
     if( result ) {
         memcpy( result, item, (size_t) strmap->item_size );
     }
-    STRMAP_MUTEX_UNLOCK( &strmap->mutex );    
+    STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
     return result != NULL;
 }
 
 
 bool strmap_find( strmap_t* strmap, str_t key, void* item ) {
-    STRMAP_MUTEX_LOCK( &strmap->mutex );
-    void const* result = hashtable_find( &strmap->hashtable, strmap_hash_u32( key ), &key );
+    uint32_t hash = strmap_hash_u32( key );
+    strmap_stripe_t* stripe = strmap_stripe( strmap, hash );
+    STRMAP_MUTEX_LOCK( &stripe->mutex );
+    void const* result = strmap_bloom_excludes( stripe, hash ) ? NULL : 
+        hashtable_find( &stripe->hashtable, hash, &key );
     if( result ) {
         memcpy( item, result, (size_t) strmap->item_size );
     }
-    STRMAP_MUTEX_UNLOCK( &strmap->mutex );    
+    STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    return result != NULL;
+}
+
+
+bool strmap_find_cstr( strmap_t* strmap, char const* string, int length, void* item ) {
+    str_t key;
+    if( !str_find( string, length, &key ) ) {
+        return false;
+    }
+    return strmap_find( strmap, key, item );
+}
+
+
+bool strmap_upsert( strmap_t* strmap, str_t key, void const* item ) {
+    uint32_t hash = strmap_hash_u32( key );
+    strmap_stripe_t* stripe = strmap_stripe( strmap, hash );
+    strmap_lock_writable( strmap, stripe );
+    int inserted;
+    void* result = hashtable_find_or_insert( &stripe->hashtable, hash, &key, &inserted );
+    memcpy( result, item, (size_t) strmap->item_size );
+    if( inserted ) {
+        strmap_bloom_add( stripe, hash );
+    }
+    STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    return inserted != 0;
+}
+
+
+int64_t strmap_add_i64( strmap_t* strmap, str_t key, int64_t amount ) {
+    uint32_t hash = strmap_hash_u32( key );
+    strmap_stripe_t* stripe = strmap_stripe( strmap, hash );
+    strmap_lock_writable( strmap, stripe );
+    int inserted;
+    void* result = hashtable_find_or_insert( &stripe->hashtable, hash, &key, &inserted );
+    int64_t value;
+    memcpy( &value, result, sizeof( value ) ); // items are only aligned to their size, which may not be a multiple of 8
+    value += amount;
+    memcpy( result, &value, sizeof( value ) );
+    if( inserted ) {
+        strmap_bloom_add( stripe, hash );
+    }
+    STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    return value;
+}
+
+
+bool strmap_with( strmap_t* strmap, str_t key, void (*callback)( void* user_data, void* item ), void* user_data ) {
+    uint32_t hash = strmap_hash_u32( key );
+    strmap_stripe_t* stripe = strmap_stripe( strmap, hash );
+    strmap_lock_writable( strmap, stripe );
+    void* result = strmap_bloom_excludes( stripe, hash ) ? NULL : hashtable_find( &stripe->hashtable, hash, &key );
+    if( result ) {
+        callback( user_data, result );
+    }
+    STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    return result != NULL;
+}
+
+
+#ifndef STRMAP_THREAD_SAFE
+    void* strmap_get_ptr( strmap_t* strmap, str_t key ) {
+        uint32_t hash = strmap_hash_u32( key );
+        strmap_stripe_t* stripe = strmap_stripe( strmap, hash );
+        strmap_lock_writable( strmap, stripe ); // nothing is locked, but the table is copied if a snapshot has it
+        return strmap_bloom_excludes( stripe, hash ) ? NULL : hashtable_find( &stripe->hashtable, hash, &key );
+    }
+#endif
+
+
+int strmap_find_many( strmap_t* strmap, str_t const* keys, int count, void* items, bool* found ) {
+    if( count <= 0 ) return 0;
+
+    void** results = (void**) malloc( (size_t) count * ( sizeof( void* ) + sizeof( uint32_t ) * 2 + sizeof( str_t ) + 
+        sizeof( int ) ) );
+    uint32_t* hashes = (uint32_t*)( results + count );
+    for( int i = 0; i < count; ++i ) hashes[ i ] = strmap_hash_u32( keys[ i ] );
+
+    // The keys are sorted by stripe, so that each stripe is locked only once, and all of its keys are looked up in one
+    // call to hashtable_find_batch. With a single stripe, they can be used as they are.
+    int stripe_start[ STRMAP_STRIPE_COUNT + 1 ] = { 0 };
+    uint32_t const* sorted_hashes = hashes;
+    str_t const* sorted_keys = keys;
+    int* order = NULL;
+    if( STRMAP_STRIPE_COUNT > 1 ) {
+        uint32_t* stripe_hashes = hashes + count;
+        str_t* stripe_keys = (str_t*)( stripe_hashes + count );
+        order = (int*)( stripe_keys + count );
+        for( int i = 0; i < count; ++i ) ++stripe_start[ strmap_stripe( strmap, hashes[ i ] ) - strmap->stripes + 1 ];
+        for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) stripe_start[ i + 1 ] += stripe_start[ i ];
+        for( int i = 0; i < count; ++i ) {
+            int const position = stripe_start[ strmap_stripe( strmap, hashes[ i ] ) - strmap->stripes ]++;
+            stripe_hashes[ position ] = hashes[ i ];
+            stripe_keys[ position ] = keys[ i ];
+            order[ position ] = i;
+        }
+        sorted_hashes = stripe_hashes;
+        sorted_keys = stripe_keys;
+    } else {
+        stripe_start[ 0 ] = count;
+    }
+
+    int found_count = 0;
+    int begin = 0;
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        int const end = stripe_start[ i ];
+        if( begin == end ) continue;
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        STRMAP_MUTEX_LOCK( &stripe->mutex );
+        found_count += hashtable_find_batch( &stripe->hashtable, end - begin, sorted_hashes + begin, 
+            sorted_keys + begin, results + begin );
+        for( int j = begin; j < end; ++j ) {
+            int const index = order ? order[ j ] : j;
+            if( results[ j ] ) {
+                memcpy( (char*) items + (size_t) index * (size_t) strmap->item_size, results[ j ], 
+                    (size_t) strmap->item_size );
+            }
+            if( found ) found[ index ] = results[ j ] != NULL;
+        }
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );
+        begin = end;
+    }
+
+    free( results );
+    return found_count;
+}
+
+
+void strmap_insert_many( strmap_t* strmap, str_t const* keys, void const* items, int count ) {
+    if( count <= 0 ) return;
+
+    // All the keys are hashed in a loop of their own, which compilers vectorize at -O3, and then put in order of 
+    // stripe, as for strmap_find_many
+    uint32_t* hashes = (uint32_t*) malloc( (size_t) count * ( sizeof( uint32_t ) + sizeof( int ) ) );
+    for( int i = 0; i < count; ++i ) hashes[ i ] = strmap_hash_u32( keys[ i ] );
+    int stripe_start[ STRMAP_STRIPE_COUNT + 1 ] = { 0 };
+    int* order = NULL;
+    if( STRMAP_STRIPE_COUNT > 1 ) {
+        order = (int*)( hashes + count );
+        for( int i = 0; i < count; ++i ) ++stripe_start[ strmap_stripe( strmap, hashes[ i ] ) - strmap->stripes + 1 ];
+        for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) stripe_start[ i + 1 ] += stripe_start[ i ];
+        for( int i = 0; i < count; ++i ) {
+            order[ stripe_start[ strmap_stripe( strmap, hashes[ i ] ) - strmap->stripes ]++ ] = i;
+        }
+    } else {
+        stripe_start[ 0 ] = count;
+    }
+
+    int begin = 0;
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        int const end = stripe_start[ i ];
+        if( begin == end ) continue;
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        strmap_lock_writable( strmap, stripe );
+        hashtable_reserve( &stripe->hashtable, hashtable_count( &stripe->hashtable ) + end - begin );
+        for( int j = begin; j < end; ++j ) {
+            int const index = order ? order[ j ] : j;
+            int inserted;
+            void* item = hashtable_find_or_insert( &stripe->hashtable, hashes[ index ], &keys[ index ], &inserted );
+            memcpy( item, (char const*) items + (size_t) index * (size_t) strmap->item_size, 
+                (size_t) strmap->item_size );
+            if( inserted ) {
+                strmap_bloom_add( stripe, hashes[ index ] );
+            }
+        }
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );
+        begin = end;
+    }
+    free( hashes );
+}
+
+
+int strmap_count( strmap_t* strmap ) {
+    int count = 0;
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        STRMAP_MUTEX_LOCK( &stripe->mutex );
+        count += hashtable_count( &stripe->hashtable );
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+    return count;
+}
+
+
+void strmap_foreach( strmap_t* strmap, void (*callback)( void* user_data, str_t key, void* item ), void* user_data ) {
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        strmap_lock_writable( strmap, stripe );
+        int count = hashtable_count( &stripe->hashtable );
+        str_t const* keys = (str_t const*) hashtable_keys( &stripe->hashtable );
+        char* items = (char*) hashtable_items( &stripe->hashtable );
+        for( int j = 0; j < count; ++j ) {
+            callback( user_data, keys[ j ], items + (size_t) j * (size_t) strmap->item_size );
+        }
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+}
+
+
+void strmap_foreach_span( strmap_t* strmap, 
+    void (*callback)( void* user_data, int part, str_t const* keys, void* items, int count ), void* user_data ) {
+
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        strmap_lock_writable( strmap, stripe );
+        int count = hashtable_count( &stripe->hashtable );
+        if( count > 0 ) {
+            callback( user_data, 0, (str_t const*) hashtable_keys( &stripe->hashtable ), 
+                hashtable_items( &stripe->hashtable ), count );
+        }
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+}
+
+
+// The keys of all the stripes are numbered as if they were in one array, stripe after stripe, and each part is a 
+// range of that, which is given to the callback as one run for each stripe it overlaps
+typedef struct strmap_parallel_t {
+    str_t const* keys[ STRMAP_STRIPE_COUNT ];
+    char* items[ STRMAP_STRIPE_COUNT ];
+    int counts[ STRMAP_STRIPE_COUNT ];
+    int total;
+    int item_size;
+    int part_count;
+    void (*callback)( void* user_data, int part, str_t const* keys, void* items, int count );
+    void* user_data;
+} strmap_parallel_t;
+
+
+typedef struct strmap_parallel_part_t {
+    strmap_parallel_t* parallel;
+    int index;
+} strmap_parallel_part_t;
+
+
+static int strmap_parallel_proc( void* user_data ) {
+    strmap_parallel_part_t* part = (strmap_parallel_part_t*) user_data;
+    strmap_parallel_t* parallel = part->parallel;
+    int begin = (int)( (int64_t) parallel->total * part->index / parallel->part_count );
+    int end = (int)( (int64_t) parallel->total * ( part->index + 1 ) / parallel->part_count );
+    int start = 0;
+    for( int i = 0; i < STRMAP_STRIPE_COUNT && start < end; ++i ) {
+        int from = begin > start ? begin - start : 0;
+        int to = end - start < parallel->counts[ i ] ? end - start : parallel->counts[ i ];
+        if( from < to ) {
+            parallel->callback( parallel->user_data, part->index, parallel->keys[ i ] + from, 
+                parallel->items[ i ] + (size_t) from * (size_t) parallel->item_size, to - from );
+        }
+        start += parallel->counts[ i ];
+    }
+    return 0;
+}
+
+
+void strmap_foreach_parallel( strmap_t* strmap, int thread_count, 
+    void (*callback)( void* user_data, int part, str_t const* keys, void* items, int count ), void* user_data ) {
+
+    strmap_parallel_t parallel;
+    parallel.total = 0;
+    parallel.item_size = strmap->item_size;
+    parallel.callback = callback;
+    parallel.user_data = user_data;
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        strmap_lock_writable( strmap, stripe );
+        parallel.counts[ i ] = hashtable_count( &stripe->hashtable );
+        parallel.keys[ i ] = (str_t const*) hashtable_keys( &stripe->hashtable );
+        parallel.items[ i ] = (char*) hashtable_items( &stripe->hashtable );
+        parallel.total += parallel.counts[ i ];
+    }
+
+    int const max_threads = parallel.total / 65536 + 1;
+    parallel.part_count = thread_count < 1 ? 1 : thread_count > 64 ? 64 : thread_count;
+    parallel.part_count = parallel.part_count < max_threads ? parallel.part_count : max_threads;
+    strmap_parallel_part_t parts[ 64 ];
+    for( int i = 0; i < parallel.part_count; ++i ) {
+        parts[ i ].parallel = &parallel;
+        parts[ i ].index = i;
+    }
+    #ifdef thread_h
+        thread_ptr_t threads[ 64 ];
+        for( int i = 1; i < parallel.part_count; ++i ) {
+            threads[ i ] = thread_create( strmap_parallel_proc, &parts[ i ], "strmap_foreach", 
+                THREAD_STACK_SIZE_DEFAULT );
+        }
+        strmap_parallel_proc( &parts[ 0 ] );
+        for( int i = 1; i < parallel.part_count; ++i ) {
+            thread_join( threads[ i ] );
+            thread_destroy( threads[ i ] );
+        }
+    #else
+        for( int i = 0; i < parallel.part_count; ++i ) {
+            strmap_parallel_proc( &parts[ i ] );
+        }
+    #endif
+
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        STRMAP_MUTEX_UNLOCK( &strmap->stripes[ i ].mutex );    
+    }
+}
+
+
+void strmap_bloom_filter( strmap_t* strmap, int bits_per_key ) {
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        STRMAP_MUTEX_LOCK( &stripe->mutex );
+        strmap_bloom_rebuild( stripe, bits_per_key );
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+}
+
+
+void strmap_bloom_filter_stats( strmap_t* strmap, int* memory, float* false_positive_rate ) {
+    // Each stripe is equally likely to be the one a missing key is looked for in, and one with no filter lets every
+    // key through
+    int total_memory = 0;
+    float total_rate = 0.0f;
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        STRMAP_MUTEX_LOCK( &stripe->mutex );
+        total_memory += bloom_memory( &stripe->bloom );
+        total_rate += stripe->bloom.memory ? bloom_false_positive_rate( &stripe->bloom ) : 1.0f;
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+    if( memory ) {
+        *memory = total_memory;
+    }
+    if( false_positive_rate ) {
+        *false_positive_rate = total_rate / STRMAP_STRIPE_COUNT;
+    }
+}
+
+
+#ifdef buffer_h
+
+// A saved strmap is a header, followed by the strings of the keys and the saved hashtable of each stripe. The strings 
+// are stored in the same order as the keys of the hashtable, each as its length, its characters and a terminating 
+// zero, padded to a multiple of four bytes.
+#define STRMAP_SAVE_MAGIC 0x50414d53u /* "SMAP" */
+#define STRMAP_SAVE_VERSION 1u
+#define STRMAP_SAVE_BYTE_ORDER 0x01020304u
+
+
+bool strmap_save( strmap_t* strmap, buffer_t* buffer ) {
+    uint32_t header[ 6 ] = { STRMAP_SAVE_MAGIC, STRMAP_SAVE_VERSION, STRMAP_SAVE_BYTE_ORDER, 
+        (uint32_t) strmap->item_size, STRMAP_STRIPE_COUNT, 0 };
+    if( buffer_write_raw( buffer, header, sizeof( header ) ) != sizeof( header ) ) return false;
+    bool result = true;
+    for( int i = 0; i < STRMAP_STRIPE_COUNT && result; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        STRMAP_MUTEX_LOCK( &stripe->mutex );
+        int count = hashtable_count( &stripe->hashtable );
+        str_t const* keys = (str_t const*) hashtable_keys( &stripe->hashtable );
+        uint64_t strings_size = 0;
+        for( int j = 0; j < count; ++j ) {
+            strings_size += sizeof( uint32_t ) + ( ( (uint64_t) len( keys[ j ] ) + 4 ) & ~3ull );
+        }
+        uint64_t size = hashtable_save_size( &stripe->hashtable );
+        if( strings_size + size + 2 * sizeof( size ) > (uint64_t)( 0x7fffffff - buffer_position( buffer ) ) ) {
+            result = false;
+        } else {
+            char* data = (char*) malloc( (size_t)( strings_size > size ? strings_size : size ) );
+            char* out = data;
+            for( int j = 0; j < count; ++j ) {
+                uint32_t length = (uint32_t) len( keys[ j ] );
+                uint32_t padded = ( length + 4 ) & ~3u;
+                memcpy( out, &length, sizeof( length ) );
+                memset( out + sizeof( length ) + length, 0, padded - length );
+                memcpy( out + sizeof( length ), cstr( keys[ j ] ), length );
+                out += sizeof( length ) + padded;
+            }
+            result = buffer_write_raw( buffer, &strings_size, sizeof( strings_size ) ) == sizeof( strings_size ) && 
+                buffer_write_raw( buffer, data, (int) strings_size ) == (int) strings_size;
+            hashtable_save( &stripe->hashtable, data );
+            result = result && buffer_write_raw( buffer, &size, sizeof( size ) ) == sizeof( size ) && 
+                buffer_write_raw( buffer, data, (int) size ) == (int) size;
+            free( data );
+        }
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );    
+    }
+    return result;
+}
+
+
+// Reads a size followed by that many bytes from the buffer, into memory which the caller must free
+static void* strmap_load_block( buffer_t* buffer, uint64_t* size ) {
+    if( buffer_read_raw( buffer, size, sizeof( *size ) ) != sizeof( *size ) || 
+        *size > (uint64_t)( buffer_size( buffer ) - buffer_position( buffer ) ) ) {
+        return NULL;
+    }
+    void* data = malloc( *size ? (size_t) *size : 1 );
+    if( buffer_read_raw( buffer, data, (int) *size ) != (int) *size ) {
+        free( data );
+        return NULL;
+    }
+    return data;
+}
+
+
+strmap_t* strmap_load( buffer_t* buffer ) {
+    uint32_t header[ 6 ];
+    if( buffer_read_raw( buffer, header, sizeof( header ) ) != sizeof( header ) || header[ 0 ] != STRMAP_SAVE_MAGIC || 
+        header[ 1 ] != STRMAP_SAVE_VERSION || header[ 2 ] != STRMAP_SAVE_BYTE_ORDER || header[ 3 ] > 0x7fffffff || 
+        header[ 4 ] == 0 || header[ 4 ] > 0x10000 ) {
+        return NULL;
+    }
+
+    strmap_t* strmap = strmap_create( (int) header[ 3 ] );
+    for( uint32_t i = 0; i < header[ 4 ]; ++i ) {
+        uint64_t strings_size = 0;
+        uint64_t size = 0;
+        char* strings = (char*) strmap_load_block( buffer, &strings_size );
+        void* data = strings ? strmap_load_block( buffer, &size ) : NULL;
+        hashtable_t loaded;
+        bool valid = data && hashtable_load( &loaded, sizeof( str_t ), strmap->item_size, data, size, NULL );
+        free( data );
+        if( !valid ) {
+            free( strings );
+            strmap_destroy( strmap );
+            return NULL;
+        }
+
+        // Make a handle for each key string, and check if they all match the handles the keys were saved with
+        int count = hashtable_count( &loaded );
+        str_t* keys = (str_t*) hashtable_keys( &loaded );
+        str_t* handles = (str_t*) malloc( ( (size_t) count + 1 ) * sizeof( str_t ) );
+        bool same = true;
+        uint64_t offset = 0;
+        for( int j = 0; j < count && valid; ++j ) {
+            uint32_t length = 0;
+            if( strings_size - offset < sizeof( length ) ) { valid = false; break; }
+            memcpy( &length, strings + offset, sizeof( length ) );
+            uint64_t padded = ( (uint64_t) length + 4 ) & ~3ull;
+            char const* string = strings + offset + sizeof( length );
+            if( strings_size - offset - sizeof( length ) < padded || 
+                memchr( string, 0, (size_t) length + 1 ) != string + length ) {
+                valid = false;
+                break;
+            }
+            handles[ j ] = str( string );
+            same = same && handles[ j ] == keys[ j ];
+            offset += sizeof( length ) + padded;
+        }
+        free( strings );
+        if( !valid || offset != strings_size ) {
+            free( handles );
+            hashtable_term( &loaded );
+            strmap_destroy( strmap );
+            return NULL;
+        }
+
+        // The hashtable can only be used as it is if the keys have the same handles, and so the same hashes, and go to
+        // a stripe which keys from other stripes have not already been inserted into
+        strmap_stripe_t* stripe = &strmap->stripes[ i < STRMAP_STRIPE_COUNT ? i : 0 ];
+        if( same && header[ 4 ] == STRMAP_STRIPE_COUNT && hashtable_count( &stripe->hashtable ) == 0 ) {
+            hashtable_term( &stripe->hashtable );
+            stripe->hashtable = loaded;
+        } else {
+            char const* items = (char const*) hashtable_items( &loaded );
+            for( int j = 0; j < count; ++j ) {
+                strmap_upsert( strmap, handles[ j ], items + (size_t) j * (size_t) strmap->item_size );
+            }
+            hashtable_term( &loaded );
+        }
+        free( handles );
+    }
+    return strmap;
+}
+
+#endif /* buffer_h */
+
+
+// A snapshot holds a reference to the hashtable of each stripe, and is read the same way as the map, just without 
+// locking
+typedef struct strmap_snapshot_t {
+    int item_size;
+    int count;
+    strmap_shared_t* tables[ STRMAP_STRIPE_COUNT ];
+} strmap_snapshot_t;
+
+
+strmap_snapshot_t* strmap_snapshot( strmap_t* strmap ) {
+    strmap_snapshot_t* snapshot = (strmap_snapshot_t*) malloc( sizeof( strmap_snapshot_t ) );
+    snapshot->item_size = strmap->item_size;
+    snapshot->count = 0;
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        STRMAP_MUTEX_LOCK( &strmap->stripes[ i ].mutex );
+    }
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        if( !stripe->shared ) {
+            // Any resize still going on is finished first, as it would otherwise go on when the table is next read,
+            // and neither the map nor the snapshots must write to a shared table
+            hashtable_reserve( &stripe->hashtable, 0 );
+            stripe->shared = (strmap_shared_t*) malloc( sizeof( strmap_shared_t ) );
+            STRMAP_REFS_INIT( &stripe->shared->refs );
+            stripe->shared->hashtable = stripe->hashtable;
+        }
+        STRMAP_REFS_INC( &stripe->shared->refs );
+        snapshot->tables[ i ] = stripe->shared;
+        snapshot->count += hashtable_count( &stripe->hashtable );
+    }
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        STRMAP_MUTEX_UNLOCK( &strmap->stripes[ i ].mutex );    
+    }
+    return snapshot;
+}
+
+
+void strmap_snapshot_release( strmap_snapshot_t* snapshot ) {
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_shared_release( snapshot->tables[ i ] );
+    }
+    free( snapshot );
+}
+
+
+int strmap_snapshot_count( strmap_snapshot_t const* snapshot ) {
+    return snapshot->count;
+}
+
+
+bool strmap_snapshot_find( strmap_snapshot_t const* snapshot, str_t key, void* item ) {
+    uint32_t const hash = strmap_hash_u32( key );
+    void const* result = hashtable_find( &snapshot->tables[ strmap_stripe_index( hash ) ]->hashtable, hash, &key );
+    if( result ) {
+        memcpy( item, result, (size_t) snapshot->item_size );
+    }
     return result != NULL;
 }
 
 
+void strmap_snapshot_foreach_span( strmap_snapshot_t const* snapshot,
+    void (*callback)( void* user_data, str_t const* keys, void const* items, int count ), void* user_data ) {
+
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        hashtable_t const* table = &snapshot->tables[ i ]->hashtable;
+        int count = hashtable_count( table );
+        if( count > 0 ) {
+            callback( user_data, (str_t const*) hashtable_keys( table ), hashtable_items( table ), count );
+        }
+    }
+}
+
+
+typedef struct strmap_frozen_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t count;
+    uint32_t item_size;
+    uint32_t entry_size;
+    uint32_t key_offset;
+    uint32_t seed;
+    uint32_t bucket_count;
+    uint32_t slot_count;
+    uint32_t entries_offset;
+    uint32_t strings_offset;
+    // followed by a pilot for each bucket, then the remap table for the slots past the last entry, then the entries, 
+    // each holding an item followed by a strmap_frozen_key_t, and last the zero terminated key strings
+} strmap_frozen_t;
+
+typedef struct strmap_frozen_key_t {
+    uint32_t check;
+    uint32_t offset;
+    uint32_t length;
+} strmap_frozen_key_t;
+
+#define STRMAP_FROZEN_MAGIC 0x5a464d53u // "SMFZ"
+#define STRMAP_FROZEN_VERSION 1u
+#define STRMAP_FROZEN_MAX_SEEDS 64u
+
+
+static uint64_t strmap_frozen_mix( uint64_t x ) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+
+// 64-bit FNV-1a, started from a different value for each seed, so that keys colliding for one seed won't for the next
+static uint64_t strmap_frozen_hash( char const* string, int length, uint32_t seed ) {
+    uint64_t hash = 0xcbf29ce484222325ull ^ ( (uint64_t) seed * 0x9e3779b97f4a7c15ull );
+    for( int i = 0; i < length; ++i ) {
+        hash ^= (unsigned char) string[ i ];
+        hash *= 0x100000001b3ull;
+    }
+    return strmap_frozen_mix( hash );
+}
+
+
+// Maps a 32-bit value to the range 0 to count-1, without a division
+static uint32_t strmap_frozen_range( uint32_t value, uint32_t count ) {
+    return (uint32_t)( ( (uint64_t) value * count ) >> 32 );
+}
+
+
+// The high half of the hash picks the bucket, and the low half, mixed with the pilot of the bucket, picks the slot
+static uint32_t strmap_frozen_slot( uint64_t hash, uint64_t pilot_hash, uint32_t slot_count ) {
+    return strmap_frozen_range( (uint32_t)( hash ^ pilot_hash ), slot_count );
+}
+
+
+// Same construction as for the frozen intmap: the keys are split into buckets of about four keys, and for each bucket,
+// biggest first, we search for a pilot value which sends all of its keys to slots which are still free. The slots past
+// the end of the entries are remapped to the ones left free, and if some bucket can't be placed, we try another seed.
+static strmap_frozen_t* strmap_frozen_build( char const* const* strings, int const* lengths, char const* items,
+    int count, int item_size, int* size ) {
+
+    uint32_t const n = (uint32_t) count;
+    uint32_t const bucket_count = n / 4 + 1;
+    uint32_t const slot_count = n + n / 32 + 1;
+    uint32_t const key_offset = ( (uint32_t) item_size + 3u ) & ~3u;
+    uint32_t const entry_size = ( key_offset + (uint32_t) sizeof( strmap_frozen_key_t ) + 7u ) & ~7u;
+    size_t const entries_offset = ( sizeof( strmap_frozen_t ) +
+        ( (size_t) bucket_count + slot_count - n ) * sizeof( uint32_t ) + 7u ) & ~(size_t) 7u;
+    size_t const strings_offset = entries_offset + (size_t) n * entry_size;
+    size_t total_size = strings_offset;
+    for( uint32_t i = 0; i < n; ++i ) total_size += (size_t) lengths[ i ] + 1;
+    total_size = ( total_size + 7u ) & ~(size_t) 7u;
+    if( total_size > 0x7fffffffu ) return NULL;
+
+    strmap_frozen_t* frozen = (strmap_frozen_t*) malloc( total_size );
+    memset( frozen, 0, total_size );
+    uint32_t* pilots = (uint32_t*)( frozen + 1 );
+    uint32_t* remap = pilots + bucket_count;
+    char* entries = (char*) frozen + entries_offset;
+
+    uint64_t* hashes = (uint64_t*) malloc( ( n + 1 ) * sizeof( uint64_t ) );
+    uint32_t* key_slots = (uint32_t*) malloc( ( n + 1 ) * sizeof( uint32_t ) );
+    uint32_t* bucket_start = (uint32_t*) malloc( ( bucket_count + 1 ) * sizeof( uint32_t ) );
+    uint32_t* bucket_fill = (uint32_t*) malloc( bucket_count * sizeof( uint32_t ) );
+    uint32_t* bucket_keys = (uint32_t*) malloc( ( n + 1 ) * sizeof( uint32_t ) );
+    uint32_t* taken = (uint32_t*) malloc( ( slot_count / 32 + 1 ) * sizeof( uint32_t ) );
+    uint32_t* order = bucket_fill;
+
+    bool placed = false;
+    for( uint32_t seed = 0; seed < STRMAP_FROZEN_MAX_SEEDS && !placed; ++seed ) {
+        frozen->seed = seed;
+
+        // sort the keys by bucket
+        memset( bucket_start, 0, ( bucket_count + 1 ) * sizeof( uint32_t ) );
+        for( uint32_t i = 0; i < n; ++i ) {
+            hashes[ i ] = strmap_frozen_hash( strings[ i ], lengths[ i ], seed );
+            ++bucket_start[ strmap_frozen_range( (uint32_t)( hashes[ i ] >> 32 ), bucket_count ) + 1 ];
+        }
+        uint32_t max_bucket_size = 0;
+        for( uint32_t b = 0; b < bucket_count; ++b ) {
+            max_bucket_size = bucket_start[ b + 1 ] > max_bucket_size ? bucket_start[ b + 1 ] : max_bucket_size;
+            bucket_start[ b + 1 ] += bucket_start[ b ];
+            bucket_fill[ b ] = bucket_start[ b ];
+        }
+        for( uint32_t i = 0; i < n; ++i ) {
+            bucket_keys[ bucket_fill[ strmap_frozen_range( (uint32_t)( hashes[ i ] >> 32 ), bucket_count ) ]++ ] = i;
+        }
+
+        // sort the buckets by size, biggest first
+        uint32_t* size_start = (uint32_t*) malloc( ( max_bucket_size + 2 ) * sizeof( uint32_t ) );
+        memset( size_start, 0, ( max_bucket_size + 2 ) * sizeof( uint32_t ) );
+        for( uint32_t b = 0; b < bucket_count; ++b ) {
+            ++size_start[ max_bucket_size - ( bucket_start[ b + 1 ] - bucket_start[ b ] ) + 1 ];
+        }
+        for( uint32_t i = 0; i <= max_bucket_size; ++i ) size_start[ i + 1 ] += size_start[ i ];
+        for( uint32_t b = 0; b < bucket_count; ++b ) {
+            order[ size_start[ max_bucket_size - ( bucket_start[ b + 1 ] - bucket_start[ b ] ) ]++ ] = b;
+        }
+        free( size_start );
+
+        // find a pilot for each bucket. Two keys of a bucket with the same low half of the hash would always go to the
+        // same slot, so that is caught early, rather than trying every pilot
+        memset( taken, 0, ( slot_count / 32 + 1 ) * sizeof( uint32_t ) );
+        memset( pilots, 0, bucket_count * sizeof( uint32_t ) );
+        placed = true;
+        for( uint32_t i = 0; i < bucket_count && placed; ++i ) {
+            uint32_t const bucket = order[ i ];
+            uint32_t const first = bucket_start[ bucket ];
+            uint32_t const bucket_size = bucket_start[ bucket + 1 ] - first;
+            if( bucket_size == 0 ) break;
+            for( uint32_t j = 1; j < bucket_size && placed; ++j ) {
+                for( uint32_t k = 0; k < j; ++k ) {
+                    uint32_t const a = (uint32_t) hashes[ bucket_keys[ first + j ] ];
+                    uint32_t const b = (uint32_t) hashes[ bucket_keys[ first + k ] ];
+                    if( a == b ) placed = false;
+                }
+            }
+
+            bool found = false;
+            for( uint32_t pilot = 0; pilot < 0x100000u && placed && !found; ++pilot ) {
+                uint64_t const pilot_hash = strmap_frozen_mix( pilot );
+                uint32_t j = 0;
+                for( ; j < bucket_size; ++j ) {
+                    uint32_t const index = bucket_keys[ first + j ];
+                    uint32_t const slot = strmap_frozen_slot( hashes[ index ], pilot_hash, slot_count );
+                    if( taken[ slot / 32 ] & ( 1u << ( slot % 32 ) ) ) break;
+                    taken[ slot / 32 ] |= 1u << ( slot % 32 );
+                    key_slots[ index ] = slot;
+                }
+                if( j == bucket_size ) {
+                    pilots[ bucket ] = pilot;
+                    found = true;
+                } else {
+                    while( j > 0 ) {
+                        uint32_t const slot = key_slots[ bucket_keys[ first + --j ] ];
+                        taken[ slot / 32 ] &= ~( 1u << ( slot % 32 ) );
+                    }
+                }
+            }
+            placed = found;
+        }
+    }
+
+    if( placed ) {
+        // pair up the slots taken past the end of the entries with the slots left free before it
+        uint32_t free_slot = 0;
+        for( uint32_t slot = n; slot < slot_count; ++slot ) {
+            if( taken[ slot / 32 ] & ( 1u << ( slot % 32 ) ) ) {
+                while( taken[ free_slot / 32 ] & ( 1u << ( free_slot % 32 ) ) ) ++free_slot;
+                remap[ slot - n ] = free_slot++;
+            }
+        }
+        uint32_t string_offset = 0;
+        for( uint32_t i = 0; i < n; ++i ) {
+            uint32_t const slot = key_slots[ i ] < n ? key_slots[ i ] : remap[ key_slots[ i ] - n ];
+            char* entry = entries + (size_t) slot * entry_size;
+            memcpy( entry, items + (size_t) i * (size_t) item_size, (size_t) item_size );
+            strmap_frozen_key_t key;
+            key.check = (uint32_t)( hashes[ i ] >> 32 );
+            key.offset = string_offset;
+            key.length = (uint32_t) lengths[ i ];
+            memcpy( entry + key_offset, &key, sizeof( key ) );
+            memcpy( (char*) frozen + strings_offset + string_offset, strings[ i ], (size_t) lengths[ i ] );
+            string_offset += (uint32_t) lengths[ i ] + 1;
+        }
+    }
+
+    free( taken );
+    free( bucket_keys );
+    free( bucket_fill );
+    free( bucket_start );
+    free( key_slots );
+    free( hashes );
+    if( !placed ) {
+        free( frozen );
+        return NULL;
+    }
+
+    frozen->magic = STRMAP_FROZEN_MAGIC;
+    frozen->version = STRMAP_FROZEN_VERSION;
+    frozen->size = (uint32_t) total_size;
+    frozen->count = n;
+    frozen->item_size = (uint32_t) item_size;
+    frozen->entry_size = entry_size;
+    frozen->key_offset = key_offset;
+    frozen->bucket_count = bucket_count;
+    frozen->slot_count = slot_count;
+    frozen->entries_offset = (uint32_t) entries_offset;
+    frozen->strings_offset = (uint32_t) strings_offset;
+    if( size ) *size = (int) total_size;
+    return frozen;
+}
+
+
+strmap_frozen_t* strmap_freeze( strmap_t* strmap, int* size ) {
+    // Each stripe is copied while holding its lock, but changes made to other stripes by other threads while freezing
+    // may or may not make it into the frozen copy
+    int count = 0;
+    int capacity = 256;
+    str_t* keys = (str_t*) malloc( capacity * sizeof( str_t ) );
+    char* items = (char*) malloc( (size_t) capacity * (size_t) strmap->item_size );
+    for( int i = 0; i < STRMAP_STRIPE_COUNT; ++i ) {
+        strmap_stripe_t* stripe = &strmap->stripes[ i ];
+        STRMAP_MUTEX_LOCK( &stripe->mutex );
+        int stripe_count = hashtable_count( &stripe->hashtable );
+        if( count + stripe_count > capacity ) {
+            while( count + stripe_count > capacity ) capacity *= 2;
+            keys = (str_t*) realloc( keys, capacity * sizeof( str_t ) );
+            items = (char*) realloc( items, (size_t) capacity * (size_t) strmap->item_size );
+        }
+        memcpy( keys + count, hashtable_keys( &stripe->hashtable ), stripe_count * sizeof( str_t ) );
+        memcpy( items + (size_t) count * (size_t) strmap->item_size, hashtable_items( &stripe->hashtable ), 
+            (size_t) stripe_count * (size_t) strmap->item_size );
+        count += stripe_count;
+        STRMAP_MUTEX_UNLOCK( &stripe->mutex );
+    }
+
+    // The key strings are looked up after the stripes are unlocked, as interned strings never change
+    char const** strings = (char const**) malloc( ( count + 1 ) * sizeof( char const* ) );
+    int* lengths = (int*) malloc( ( count + 1 ) * sizeof( int ) );
+    for( int i = 0; i < count; ++i ) {
+        strings[ i ] = cstr( keys[ i ] );
+        lengths[ i ] = len( keys[ i ] );
+    }
+
+    strmap_frozen_t* frozen = strmap_frozen_build( strings, lengths, items, count, strmap->item_size, size );
+    free( lengths );
+    free( strings );
+    free( items );
+    free( keys );
+    return frozen;
+}
+
+
+void strmap_frozen_destroy( strmap_frozen_t* frozen ) {
+    free( frozen );
+}
+
+
+strmap_frozen_t const* strmap_frozen_map( void const* data, int size, int item_size ) {
+    strmap_frozen_t const* frozen = (strmap_frozen_t const*) data;
+    if( !data || ( (uintptr_t) data & 3u ) || size < (int) sizeof( strmap_frozen_t ) ) return NULL;
+    if( frozen->magic != STRMAP_FROZEN_MAGIC || frozen->version != STRMAP_FROZEN_VERSION ) return NULL;
+    if( frozen->size != (uint32_t) size || frozen->item_size != (uint32_t) item_size ) return NULL;
+    if( frozen->bucket_count == 0 || frozen->slot_count <= frozen->count ) return NULL;
+    if( frozen->key_offset < frozen->item_size || 
+        frozen->key_offset + sizeof( strmap_frozen_key_t ) > frozen->entry_size ) {
+        return NULL;
+    }
+    uint64_t const tables_size = 
+        ( (uint64_t) frozen->bucket_count + frozen->slot_count - frozen->count ) * sizeof( uint32_t );
+    if( frozen->entries_offset < sizeof( strmap_frozen_t ) + tables_size ||
+        frozen->entries_offset + (uint64_t) frozen->count * frozen->entry_size > frozen->strings_offset ||
+        frozen->strings_offset > frozen->size ) {
+        return NULL;
+    }
+    // the remap table is the only thing read from the image which is used as an index, so it is checked as well, and 
+    // the string offsets are checked when they are used
+    uint32_t const* remap = (uint32_t const*)( frozen + 1 ) + frozen->bucket_count;
+    for( uint32_t i = 0; i < frozen->slot_count - frozen->count; ++i ) {
+        if( remap[ i ] >= frozen->count && frozen->count > 0 ) return NULL;
+    }
+    return frozen;
+}
+
+
+int strmap_frozen_count( strmap_frozen_t const* frozen ) {
+    return (int) frozen->count;
+}
+
+
+bool strmap_frozen_find( strmap_frozen_t const* frozen, str_t key, void* item ) {
+    return strmap_frozen_find_cstr( frozen, cstr( key ), len( key ), item );
+}
+
+
+bool strmap_frozen_find_cstr( strmap_frozen_t const* frozen, char const* string, int length, void* item ) {
+    if( frozen->count == 0 ) return false;
+    uint64_t const hash = strmap_frozen_hash( string, length, frozen->seed );
+    uint32_t const* pilots = (uint32_t const*)( frozen + 1 );
+    uint32_t const pilot = pilots[ strmap_frozen_range( (uint32_t)( hash >> 32 ), frozen->bucket_count ) ];
+    uint32_t slot = strmap_frozen_slot( hash, strmap_frozen_mix( pilot ), frozen->slot_count );
+    if( slot >= frozen->count ) slot = pilots[ frozen->bucket_count + slot - frozen->count ];
+    char const* entry = (char const*) frozen + frozen->entries_offset + (size_t) slot * frozen->entry_size;
+    strmap_frozen_key_t entry_key;
+    memcpy( &entry_key, entry + frozen->key_offset, sizeof( entry_key ) );
+    if( entry_key.check != (uint32_t)( hash >> 32 ) || entry_key.length != (uint32_t) length ) return false;
+    if( (uint64_t) entry_key.offset + entry_key.length > frozen->size - frozen->strings_offset ) return false;
+    if( memcmp( (char const*) frozen + frozen->strings_offset + entry_key.offset, string, (size_t) length ) != 0 ) {
+        return false;
+    }
+    memcpy( item, entry, frozen->item_size );
+    return true;
+}
+
+
+#undef STRMAP_SAVE_MAGIC
+#undef STRMAP_SAVE_VERSION
+#undef STRMAP_SAVE_BYTE_ORDER
+#undef STRMAP_FROZEN_MAGIC
+#undef STRMAP_FROZEN_VERSION
+#undef STRMAP_FROZEN_MAX_SEEDS
 #undef STRMAP_MUTEX_LOCK
 #undef STRMAP_MUTEX_UNLOCK
+#undef STRMAP_REFS_INIT
+#undef STRMAP_REFS_LOAD
+#undef STRMAP_REFS_INC
+#undef STRMAP_REFS_DEC
 
 
 #endif /* STRMAP_IMPLEMENTATION */
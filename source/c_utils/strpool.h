@@ -32,6 +32,8 @@ typedef struct strpool_config_t
     int block_capacity;
     int block_size;
     int min_length;
+    int prefix_index;
+    int tail_merge;
     } strpool_config_t;
 
 extern strpool_config_t const strpool_default_config;
@@ -39,10 +41,30 @@ extern strpool_config_t const strpool_default_config;
 void strpool_init( strpool_t* pool, strpool_config_t const* config );
 void strpool_term( strpool_t* pool );
 
+int strpool_save_image( strpool_t const* pool, char const* filename );
+int strpool_map_image( strpool_t* pool, strpool_config_t const* config, char const* filename );
+
 void strpool_defrag( strpool_t* pool );
 
+typedef struct strpool_stats_t
+    {
+    int string_count;
+    int shared_count;
+    STRPOOL_U64 string_bytes;
+    STRPOOL_U64 stored_bytes;
+    STRPOOL_U64 free_bytes;
+    STRPOOL_U64 retained_bytes;
+    STRPOOL_U64 block_bytes;
+    STRPOOL_U64 table_bytes;
+    } strpool_stats_t;
+
+void strpool_stats( strpool_t const* pool, strpool_stats_t* stats );
+
 STRPOOL_U64 strpool_inject( strpool_t* pool, char const* string, int length );
+STRPOOL_U64 strpool_find( strpool_t* pool, char const* string, int length );
+int strpool_build_from_lines( strpool_t* pool, char const* data, STRPOOL_U64 size, int thread_count );
 void strpool_discard( strpool_t* pool, STRPOOL_U64 handle );
+void strpool_discard_many( strpool_t* pool, STRPOOL_U64 const* handles, int count );
 
 int strpool_incref( strpool_t* pool, STRPOOL_U64 handle );
 int strpool_decref( strpool_t* pool, STRPOOL_U64 handle );
@@ -53,6 +75,21 @@ int strpool_isvalid( strpool_t const* pool, STRPOOL_U64 handle );
 char const* strpool_cstr( strpool_t const* pool, STRPOOL_U64 handle );
 int strpool_length( strpool_t const* pool, STRPOOL_U64 handle );
 
+int strpool_find_prefix( strpool_t const* pool, char const* prefix, int length, 
+    int (*callback)( void* user_data, STRPOOL_U64 handle, char const* string, int length ), void* user_data );
+int strpool_count_prefix( strpool_t const* pool, char const* prefix, int length );
+
+typedef struct strpool_iter_t
+    {
+    int index;
+    int end;
+    } strpool_iter_t;
+
+void strpool_iter_begin( strpool_t const* pool, strpool_iter_t* iter );
+void strpool_iter_chunk( strpool_t const* pool, strpool_iter_t* iter, int chunk, int chunk_count );
+int strpool_iter_next( strpool_t const* pool, strpool_iter_t* iter, STRPOOL_U64* handle, char const** string, 
+    int* length );
+
 char* strpool_collate( strpool_t const* pool, int* count );
 void strpool_free_collated( strpool_t const* pool, char* collated_ptr );
 
@@ -167,12 +204,13 @@ Note that if you only want the asserts to trigger in debug builds, you must add
 
 #### Custom C runtime function
 
-The library makes use of four additional functions from the C runtime library, and for full flexibility, it allows you 
+The library makes use of five additional functions from the C runtime library, and for full flexibility, it allows you 
 to substitute them for your own. Here's an example:
 
     #define STRPOOL_IMPLEMENTATION
     #define STRPOOL_MEMSET( ptr, val, cnt ) ( my_memset_func( ptr, val, cnt ) )
     #define STRPOOL_MEMCPY( dst, src, cnt ) ( my_memcpy_func( dst, src, cnt ) )
+    #define STRPOOL_MEMMOVE( dst, src, cnt ) ( my_memmove_func( dst, src, cnt ) )
     #define STRPOOL_MEMCMP( pr1, pr2, cnt ) ( my_memcmp_func( pr1, pr2, cnt ) )
     #define STRPOOL_STRNICMP( s1, s2, len ) ( my_strnicmp_func( s1, s2, len ) )
     #include "strpool.h"
@@ -180,6 +218,60 @@ to substitute them for your own. Here's an example:
 If no custom function is defined, strpool.h will default to the C runtime library equivalent.
 
 
+#### Image files
+
+`strpool_save_image` and `strpool_map_image` use the platform file mapping API (`mmap` or `MapViewOfFile`), which means
+the implementation of strpool.h will include `<windows.h>` or the POSIX headers for it. If you don't need the image 
+functions, or your platform lacks memory mapped files, you can leave them out by doing this before including strpool.h:
+
+    #define STRPOOL_NO_IMAGE
+
+
+#### Worker threads
+
+`strpool_build_from_lines` can split its work across several threads. It uses thread.h for this, and it does so if 
+thread.h has been included before the implementation of strpool.h. If it has not, or if you do this before including
+the implementation, all the work is done on the calling thread instead:
+
+    #define STRPOOL_NO_THREADS
+
+
+#### Concurrent access
+
+By default, a pool instance has no internal synchronization, and it is up to the calling code to make sure only one
+thread at a time accesses it. If many threads need to share a pool, you can instead build it in concurrent mode:
+
+    #define STRPOOL_CONCURRENT
+    #include "strpool.h"
+
+In concurrent mode, `strpool_inject`, `strpool_find`, `strpool_cstr`, `strpool_length` and `strpool_isvalid` may be 
+called from any number of threads at the same time, without any external locking. Looking up a string which is already
+in the pool is lock-free and finishes in a bounded number of steps, so injecting strings which mostly exist already 
+scales with the number of threads. Adding a new string takes a short internal spin lock, only held while the new string is stored.
+When the internal tables grow, the old ones are kept alive until `strpool_defrag` or `strpool_term` is called, as other
+threads might still be reading from them. All other functions (including `strpool_discard`, reference counting and
+`strpool_defrag`) require exclusive access to the pool, the same as in the default mode.
+
+As STRPOOL_CONCURRENT changes the layout of `strpool_t`, it needs to be defined in every place where you include
+strpool.h, just like STRPOOL_U32 and STRPOOL_U64.
+
+
+#### Stable handles
+
+Normally, looking up the string for a handle (`strpool_cstr`, `strpool_length`) goes from the handle to an internal 
+handle record, from there to an internal entry, and from the entry to the string data. On large pools, each of those 
+steps is likely to be a cache miss. If you do lots of lookups, and strings are rarely discarded, you can do this:
+
+    #define STRPOOL_STABLE_HANDLES
+    #include "strpool.h"
+
+This makes each handle record also hold the string pointer and length directly, so a lookup is a single indirection
+from the handle. The cost is a larger handle record (an extra pointer and an int per string), and some extra work when 
+strings are moved by `strpool_defrag`, as the handle records need to be updated too. Stable handles only change the 
+implementation, so the define is only needed where STRPOOL_IMPLEMENTATION is defined, but an image saved by 
+`strpool_save_image` can only be mapped by an implementation with the same setting.
+
+
 strpool_init
 ------------
 
@@ -204,6 +296,11 @@ instance. It contains the following fields:
     is 256 kilobyte. 
 * min_length - minimum space to allocate for each string. A higher value wastes more space, but makes it more likely 
     that recycled storage can be re-used by subsequent requests. Default is a string length of 23 characters.
+* prefix_index - set to 1 to maintain an index of all strings in sorted order, which is required for using 
+    `strpool_find_prefix` and `strpool_count_prefix`. It makes `strpool_inject` (for new strings) and `strpool_discard`
+    a bit slower, and takes an additional 4 bytes per string. Default is 0.
+* tail_merge - set to 1 to make `strpool_defrag` store strings which are the tail end of other strings inside those 
+    strings, rather than separately. See `strpool_defrag` for details. Default is 0.
 
 The function `strpool_inject` returns a 64-bit handle. Using the settings `counter_bits`/`index_bits`, you can control
 how many bits of the handle is in use, and how many are used for index vs counter. For example, setting `counter_bits`
@@ -232,7 +329,37 @@ strpool_term
     void strpool_term( strpool_t* pool )
 
 Terminates a string pool instance, releasing all memory used by it. No further calls to the strpool API are valid until
-the instance is reinitialized by another call to `strpool_init`.
+the instance is reinitialized by another call to `strpool_init`. If the pool was created with `strpool_map_image`, this 
+is also where the image file gets unmapped.
+
+
+strpool_save_image
+------------------
+
+    int strpool_save_image( strpool_t const* pool, char const* filename )
+
+Writes the full state of the pool (all storage blocks, the internal entry and handle arrays, and the hash table) to the
+specified file, in a position-independent format suitable for `strpool_map_image`. The image is a raw copy of the
+internal data, so it can only be loaded on the same platform (same endianness and pointer size) as it was saved on.
+Returns 1 if the image was successfully written, and 0 if the file could not be written.
+
+
+strpool_map_image
+-----------------
+
+    int strpool_map_image( strpool_t* pool, strpool_config_t const* config, char const* filename )
+
+Initializes a pool instance from an image file written by `strpool_save_image`, by memory mapping it rather than reading
+it. Nothing is hashed or copied - the only work done is a single pass over the internal entry array to turn stored 
+offsets back into pointers - so mapping even a very large pool is near instant, and the string data is only paged in as 
+it is accessed. All handles which were valid for the saved pool are valid for the mapped one. The mapping is private and
+copy-on-write, so the pool can be modified as usual after mapping: the image file is never written to, and only the 
+pages which are actually changed take up memory of their own. The `config` parameter is used for `memctx` and the 
+settings controlling further growth of the pool (`entry_capacity`, `block_capacity`, `block_size`, `min_length`), while
+`ignore_case`, `counter_bits`, `index_bits` and `prefix_index` are taken from the image, as the stored data depends on 
+them. It can be NULL, in which case the default settings are used. Returns 1 on success, and 0 if the file could not be mapped
+or is not a valid image, in which case `pool` is left uninitialized. A mapped pool is terminated with `strpool_term`, 
+just like one created with `strpool_init`.
 
 
 strpool_defrag
@@ -247,6 +374,38 @@ specified when the pool was initialized), and recreates the internal hash table.
 blocks will be deallocated, making the memory used by the pool as little as it can be to fit the current set of strings.
 All string handles remain valid after a call to `strpool_defrag`.
 
+If the pool was initialized with `tail_merge` set to 1, `strpool_defrag` also looks for strings which are the tail end 
+of another string in the pool, such as "example.com" and "www.example.com", and stores them inside the longest string 
+they are a tail of, instead of giving them storage of their own. Since every string ends with the zero terminator, the 
+shorter string is already there, complete, and its handle will simply point into the longer one. Strings are compared 
+byte by byte for this, even if `ignore_case` is set. This can save a lot of memory for things like file paths, domain
+names or identifiers with common suffixes, at the cost of `strpool_defrag` having to sort the strings. If a string which
+holds other strings is discarded, its storage is kept until the next call to `strpool_defrag`. 
+
+
+strpool_stats
+-------------
+
+    void strpool_stats( strpool_t const* pool, strpool_stats_t* stats )
+
+Fills in `stats` with a report on how much memory the pool is using, and for what. The fields are:
+
+* string_count - number of strings in the pool.
+* shared_count - number of strings which are stored inside another string, by `strpool_defrag` with `tail_merge`.
+* string_bytes - total size of all the strings, including their zero terminators, as if each was stored separately.
+* stored_bytes - storage block memory used by the strings, including the hash and length stored with each of them, and 
+    the padding from rounding each allocation up to a power of two.
+* free_bytes - storage block memory which is available for new strings.
+* retained_bytes - storage block memory held by discarded strings which other strings are still stored inside of, 
+    which will be released by the next `strpool_defrag`.
+* block_bytes - total size of all the storage blocks, which is the sum of `stored_bytes`, `free_bytes` and
+    `retained_bytes`.
+* table_bytes - memory used for the internal hash table, entry, handle and block arrays, and the prefix index.
+
+The fraction of `block_bytes` which is free is a measure of how fragmented the pool is, and how much `strpool_defrag` 
+can be expected to save. Comparing `stored_bytes` to `string_bytes` shows the overhead of the storage scheme, or the 
+savings from `tail_merge`. `strpool_stats` needs to walk the free lists of all blocks, so it is not instant.
+
 
 strpool_inject
 --------------
@@ -264,6 +423,36 @@ pool, it will be. If `string` is NULL or length is 0, a handle with a value of 0
 string.
 
 
+strpool_find
+------------
+
+    STRPOOL_U64 strpool_find( strpool_t* pool, char const* string, int length )
+
+Returns the handle of a string if it is already in the pool, or 0 if it is not, without adding it. Looking up a string
+which is not in the pool costs hashing it and probing the hash table, and never allocates memory, so it is safe to use 
+for strings which come from untrusted input, where calling `strpool_inject` just to look them up would let the pool 
+grow without limit. In STRPOOL_CONCURRENT mode, a string which is not found is looked up once more while holding the 
+internal lock, as the lock-free lookup can miss strings while the hash table is being resized. The handle for an empty
+string is 0 as well, the same as returned by `strpool_inject`.
+
+
+strpool_build_from_lines
+------------------------
+
+    int strpool_build_from_lines( strpool_t* pool, char const* data, STRPOOL_U64 size, int thread_count )
+
+Adds every line of the text in `data` (which is `size` bytes long) to the pool, as if `strpool_inject` was called for 
+each of them, and returns the number of strings which were added (lines which were already in the pool, or occur more 
+than once, are only counted once). Lines are separated by '\n', a '\r' at the end of a line is not included in the 
+string, and empty lines are skipped. This is a lot faster than injecting the lines one by one: the internal tables are 
+resized once, up front, the lines are hashed and inserted in parallel, and the string data is copied straight into new
+storage blocks, which are sized to fit. Lines are split into partitions by hash value, and each partition is handled by
+one thread, so threads don't have to synchronize with each other while inserting. `thread_count` is the number of 
+threads to use, including the calling thread, or 0 to use one for each processor core (see "Worker threads" above). 
+Handles for the lines are not returned, but can be looked up by calling `strpool_inject` for them. The pool must not 
+be accessed by any other thread while `strpool_build_from_lines` is running, even in STRPOOL_CONCURRENT mode.
+
+
 strpool_discard
 ---------------
 
@@ -274,6 +463,19 @@ string will be recycled and used for further `strpool_inject` calls. If `handle`
 nothing.
 
 
+strpool_discard_many
+--------------------
+
+    void strpool_discard_many( strpool_t* pool, STRPOOL_U64 const* handles, int count )
+
+Removes `count` strings from the pool in one go, with the same rules as for `strpool_discard` applied to each handle in
+the `handles` array (invalid handles, and handles for strings with a reference count above 0, are skipped). This is a 
+lot faster than calling `strpool_discard` for each string when removing a large batch: the internal entry array is
+compacted in a single pass, each storage block gets its free list rebuilt once, memory blocks which end up holding no 
+strings at all are deallocated, and if the remaining number of strings is small compared to the size of the internal 
+hash table, the hash table is shrunk to fit.
+
+
 strpool_incref
 --------------
 
@@ -337,6 +539,65 @@ value, and always grab it fresh by another call to `strpool_length` when it is n
 function to call - it does little more than an array lookup. If `handle` is invalid, `strpool_length` returns 0.
 
 
+strpool_find_prefix
+-------------------
+
+    int strpool_find_prefix( strpool_t const* pool, char const* prefix, int length, 
+        int (*callback)( void* user_data, STRPOOL_U64 handle, char const* string, int length ), void* user_data )
+
+Finds all strings in the pool which start with the first `length` characters of `prefix`, and calls `callback` for each
+of them, in sorted order, passing along `user_data` together with the handle, string and length of the match. If the 
+callback returns 0, the search stops. Returns the number of strings passed to the callback. The pool must have been 
+initialized with `prefix_index` set to 1 in the config, otherwise no strings will be found. The time taken depends on 
+the number of matching strings, not on the total number of strings in the pool. If the pool uses `ignore_case`, the 
+prefix is matched case insensitively too. A `length` of 0 matches all strings in the pool.
+
+
+strpool_count_prefix
+--------------------
+
+    int strpool_count_prefix( strpool_t const* pool, char const* prefix, int length )
+
+Returns the number of strings in the pool which start with the first `length` characters of `prefix`, without looking
+at the strings themselves, apart from the few needed to find where the matches start and end. As for 
+`strpool_find_prefix`, the pool must have been initialized with `prefix_index` set to 1.
+
+
+strpool_iter_begin
+------------------
+
+    void strpool_iter_begin( strpool_t const* pool, strpool_iter_t* iter )
+
+Initializes `iter` to step through all the strings currently stored in the string pool, using `strpool_iter_next`. 
+Iterating does not allocate any memory or copy any strings - each step just reads the next entry of the pool. The pool
+must not be modified while it is being iterated, apart from changing reference counts, and strings injected after the
+call to `strpool_iter_begin` will not be visited.
+
+
+strpool_iter_chunk
+------------------
+
+    void strpool_iter_chunk( strpool_t const* pool, strpool_iter_t* iter, int chunk, int chunk_count )
+
+Initializes `iter` to step through one part of the strings in the string pool. The strings are split into `chunk_count`
+parts of roughly equal size, and `chunk` is the zero-based index of the part to visit. Iterating over every chunk from 
+0 to `chunk_count - 1` visits each string exactly once, so this can be used to split the work of processing all the 
+strings across several threads, each with its own iterator and chunk index. Iterators only read from the pool, so any
+number of them can be used at the same time, as long as the pool is not being modified.
+
+
+strpool_iter_next
+-----------------
+
+    int strpool_iter_next( strpool_t const* pool, strpool_iter_t* iter, STRPOOL_U64* handle, char const** string, 
+        int* length )
+
+Advances `iter` to the next string, and stores its handle, its zero-terminated C string and its length in the variables
+pointed to by `handle`, `string` and `length`. Any of those pointers can be NULL, if that value is not needed. Returns 1
+if a string was found, and 0 if there are no more strings to visit, in which case nothing is stored. The order in which
+the strings are visited is not defined. The string pointers are valid for as long as those returned by `strpool_cstr`.
+
+
 strpool_collate
 ---------------
 
@@ -345,7 +606,8 @@ strpool_collate
 Returns a list of all the strings currently stored in the string pool, and stores the number of strings in the int
 variable pointed to by `count`. If there are no strings in the string pool, `strpool_collate` returns NULL. The pointer
 returned points to the first character of the first string. Strings are zero-terminated, and immediately after the 
-termination character, comes the first character of the next string.
+termination character, comes the first character of the next string. Note that this copies every string in the pool
+into a single allocation, so for large pools it is better to use `strpool_iter_begin` and `strpool_iter_next` instead.
 
 
 strpool_free_collated
@@ -371,6 +633,7 @@ struct strpool_internal_hash_slot_t;
 struct strpool_internal_entry_t;
 struct strpool_internal_handle_t;
 struct strpool_internal_block_t;
+struct strpool_internal_retired_t;
 
 struct strpool_t
     {
@@ -402,6 +665,25 @@ struct strpool_t
     int block_capacity;
     int block_count;
     int current_block;
+
+    int prefix_index;
+    int* prefix_main;
+    int prefix_main_count;
+    int prefix_main_dead;
+    int* prefix_tail;
+    int prefix_tail_count;
+    int prefix_tail_capacity;
+
+    int tail_merge;
+    int shared_count;
+
+    void* image;
+    STRPOOL_U64 image_size;
+
+    #ifdef STRPOOL_CONCURRENT
+        int insert_lock;
+        struct strpool_internal_retired_t* retired;
+    #endif
     };
 
 
@@ -436,6 +718,13 @@ struct strpool_t
     #define STRPOOL_MEMCPY( dst, src, cnt ) ( memcpy( dst, src, cnt ) )
 #endif 
 
+#ifndef STRPOOL_MEMMOVE
+    #define _CRT_NONSTDC_NO_DEPRECATE 
+    #define _CRT_SECURE_NO_WARNINGS
+    #include <string.h>
+    #define STRPOOL_MEMMOVE( dst, src, cnt ) ( memmove( dst, src, cnt ) )
+#endif 
+
 #ifndef STRPOOL_MEMCMP
     #define _CRT_NONSTDC_NO_DEPRECATE 
     #define _CRT_SECURE_NO_WARNINGS
@@ -463,6 +752,54 @@ struct strpool_t
     #define STRPOOL_FREE( ctx, ptr ) ( free( ptr ) )
 #endif
 
+#ifndef STRPOOL_NO_IMAGE
+    #include <stdio.h>
+    #if defined( _WIN32 )
+        #pragma warning( push )
+        #pragma warning( disable: 4668 ) // 'symbol' is not defined as a preprocessor macro, replacing with '0' for 'directives'
+        #pragma warning( disable: 4255 ) // 'function' : no function prototype given: converting '()' to '(void)'
+        #include <windows.h>
+        #pragma warning( pop )
+    #else
+        #include <fcntl.h>
+        #include <sys/mman.h>
+        #include <sys/stat.h>
+        #include <unistd.h>
+    #endif
+#endif
+
+#ifdef STRPOOL_CONCURRENT
+    #if defined( _MSC_VER )
+        #include <intrin.h>
+    #endif
+    #if !defined( STRPOOL_YIELD )
+        #if defined( _WIN32 )
+            #ifdef __cplusplus
+                extern "C" __declspec( dllimport ) int __stdcall SwitchToThread( void );
+            #else
+                __declspec( dllimport ) int __stdcall SwitchToThread( void );
+            #endif
+            #define STRPOOL_YIELD() ( (void) SwitchToThread() )
+        #else
+            #include <sched.h>
+            #define STRPOOL_YIELD() ( (void) sched_yield() )
+        #endif
+    #endif
+#endif
+
+#if defined( thread_h ) && !defined( STRPOOL_NO_THREADS )
+    #define STRPOOL_INTERNAL_THREADS
+    #if defined( _WIN32 )
+        #pragma warning( push )
+        #pragma warning( disable: 4668 ) // 'symbol' is not defined as a preprocessor macro, replacing with '0' for 'directives'
+        #pragma warning( disable: 4255 ) // 'function' : no function prototype given: converting '()' to '(void)'
+        #include <windows.h>
+        #pragma warning( pop )
+    #else
+        #include <unistd.h>
+    #endif
+#endif
+
 
 typedef struct strpool_internal_hash_slot_t
     {
@@ -480,6 +817,7 @@ typedef struct strpool_internal_entry_t
     int size;
     int length;
     int refcount;
+    int shared; // other strings are stored inside this one, so its storage can't be freed until the next defrag
     } strpool_internal_entry_t;
 
 
@@ -487,6 +825,10 @@ typedef struct strpool_internal_handle_t
     {
     int entry_index;
     int counter;
+    #ifdef STRPOOL_STABLE_HANDLES
+        char* data; // points at the string itself, past the hash and length fields
+        int length;
+    #endif
     } strpool_internal_handle_t;
 
 
@@ -506,6 +848,54 @@ typedef struct strpool_internal_free_block_t
     } strpool_internal_free_block_t;
 
 
+typedef struct strpool_internal_image_block_t
+    {
+    STRPOOL_U64 offset;
+    int size;
+    int free_list;
+    } strpool_internal_image_block_t;
+
+
+typedef struct strpool_internal_image_header_t
+    {
+    STRPOOL_U32 magic;
+    STRPOOL_U32 version;
+    STRPOOL_U32 pointer_size;
+    STRPOOL_U32 entry_size;
+    STRPOOL_U32 handle_size;
+
+    int ignore_case;
+    int counter_shift;
+    STRPOOL_U64 counter_mask;
+    STRPOOL_U64 index_mask;
+
+    int hash_capacity;
+    int entry_count;
+    int handle_count;
+    int handle_freelist_head;
+    int handle_freelist_tail;
+    int block_count;
+    int prefix_index;
+    int prefix_main_count;
+    int prefix_main_dead;
+    int prefix_tail_count;
+
+    STRPOOL_U64 hash_table_offset;
+    STRPOOL_U64 entries_offset;
+    STRPOOL_U64 handles_offset;
+    STRPOOL_U64 blocks_offset;
+    STRPOOL_U64 prefix_offset;
+    STRPOOL_U64 image_size;
+    } strpool_internal_image_header_t;
+
+
+typedef struct strpool_internal_retired_t
+    {
+    void* ptr;
+    struct strpool_internal_retired_t* next;
+    } strpool_internal_retired_t;
+
+
 strpool_config_t const strpool_default_config = 
     { 
     /* memctx         = */ 0,
@@ -516,6 +906,8 @@ strpool_config_t const strpool_default_config =
     /* block_capacity = */ 32, 
     /* block_size     = */ 256 * 1024, 
     /* min_length     = */ 23,
+    /* prefix_index   = */ 0,
+    /* tail_merge     = */ 0,
     };
 
 
@@ -534,31 +926,151 @@ static STRPOOL_U32 strpool_internal_pow2ceil( STRPOOL_U32 v )
     }
 
 
+// In STRPOOL_CONCURRENT mode, every field which lookups read without holding the insert lock is accessed through these,
+// so that a reader which observes a published value also observes everything written before it was published. In the
+// default mode they compile down to plain loads and stores.
+
+#ifdef STRPOOL_CONCURRENT
+
+    #if defined( _MSC_VER )
+
+        static int strpool_internal_load_int( int const* ptr )
+            { int v = *(int const volatile*) ptr; _ReadWriteBarrier(); return v; }
+        static STRPOOL_U32 strpool_internal_load_u32( STRPOOL_U32 const* ptr )
+            { STRPOOL_U32 v = *(STRPOOL_U32 const volatile*) ptr; _ReadWriteBarrier(); return v; }
+        static void* strpool_internal_atomic_load_ptr( void* const* ptr )
+            { void* v = *(void* const volatile*) ptr; _ReadWriteBarrier(); return v; }
+        static void strpool_internal_store_int( int* ptr, int value )
+            { _ReadWriteBarrier(); *(int volatile*) ptr = value; }
+        static void strpool_internal_store_u32( STRPOOL_U32* ptr, STRPOOL_U32 value )
+            { _ReadWriteBarrier(); *(STRPOOL_U32 volatile*) ptr = value; }
+        static void strpool_internal_atomic_store_ptr( void** ptr, void* value )
+            { _ReadWriteBarrier(); *(void* volatile*) ptr = value; }
+        static int strpool_internal_try_lock( int* lock )
+            { return _InterlockedCompareExchange( (long volatile*) lock, 1, 0 ) == 0; }
+
+    #else
+
+        static int strpool_internal_load_int( int const* ptr )
+            { return __atomic_load_n( ptr, __ATOMIC_ACQUIRE ); }
+        static STRPOOL_U32 strpool_internal_load_u32( STRPOOL_U32 const* ptr )
+            { return __atomic_load_n( ptr, __ATOMIC_ACQUIRE ); }
+        static void* strpool_internal_atomic_load_ptr( void* const* ptr )
+            { return __atomic_load_n( ptr, __ATOMIC_ACQUIRE ); }
+        static void strpool_internal_store_int( int* ptr, int value )
+            { __atomic_store_n( ptr, value, __ATOMIC_RELEASE ); }
+        static void strpool_internal_store_u32( STRPOOL_U32* ptr, STRPOOL_U32 value )
+            { __atomic_store_n( ptr, value, __ATOMIC_RELEASE ); }
+        static void strpool_internal_atomic_store_ptr( void** ptr, void* value )
+            { __atomic_store_n( ptr, value, __ATOMIC_RELEASE ); }
+        static int strpool_internal_try_lock( int* lock )
+            { return __sync_bool_compare_and_swap( lock, 0, 1 ); }
+
+    #endif
+
+    #define strpool_internal_load_ptr( ptr ) strpool_internal_atomic_load_ptr( (void* const*)( ptr ) )
+    #define strpool_internal_store_ptr( ptr, value ) strpool_internal_atomic_store_ptr( (void**)( ptr ), (void*)( value ) )
+
+    static void strpool_internal_lock( strpool_t* pool )
+        {
+        int spins = 0;
+        while( !strpool_internal_try_lock( &pool->insert_lock ) )
+            {
+            while( strpool_internal_load_int( &pool->insert_lock ) ) 
+                if( ++spins >= 64 ) { STRPOOL_YIELD(); spins = 0; } // the lock holder might not be running
+            }
+        }
+
+
+    static void strpool_internal_unlock( strpool_t* pool )
+        {
+        strpool_internal_store_int( &pool->insert_lock, 0 );
+        }
+
+#else
+
+    #define strpool_internal_load_int( ptr ) ( *(ptr) )
+    #define strpool_internal_load_u32( ptr ) ( *(ptr) )
+    #define strpool_internal_load_ptr( ptr ) ( *(ptr) )
+    #define strpool_internal_store_int( ptr, value ) ( *(ptr) = (value) )
+    #define strpool_internal_store_u32( ptr, value ) ( *(ptr) = (value) )
+    #define strpool_internal_store_ptr( ptr, value ) ( *(ptr) = (value) )
+
+#endif
+
+
+static void strpool_internal_unmap_image( strpool_t* pool );
+
+
+// Frees memory owned by the pool. Tables and blocks of a pool created by `strpool_map_image` may point straight into the
+// mapped image, and those are released when the image is unmapped instead.
+static void strpool_internal_release( strpool_t* pool, void* ptr )
+    {
+    char* image = (char*) pool->image;
+    if( image && (char*) ptr >= image && (char*) ptr < image + pool->image_size ) return;
+    STRPOOL_FREE( pool->memctx, ptr );
+    }
+
+
+// Releases a table which has been replaced by a larger one. Lock-free readers might still be looking at the old table, so
+// in STRPOOL_CONCURRENT mode it is kept alive until the next point where the pool is known to be exclusively owned
+// (`strpool_defrag` or `strpool_term`).
+static void strpool_internal_retire( strpool_t* pool, void* ptr )
+    {
+    #ifdef STRPOOL_CONCURRENT
+        strpool_internal_retired_t* retired = (strpool_internal_retired_t*) STRPOOL_MALLOC( pool->memctx,
+            sizeof( strpool_internal_retired_t ) );
+        STRPOOL_ASSERT( retired, "Allocation failed" );
+        retired->ptr = ptr;
+        retired->next = pool->retired;
+        pool->retired = retired;
+    #else
+        strpool_internal_release( pool, ptr );
+    #endif
+    }
+
+
+static void strpool_internal_free_retired( strpool_t* pool )
+    {
+    #ifdef STRPOOL_CONCURRENT
+        while( pool->retired )
+            {
+            strpool_internal_retired_t* next = pool->retired->next;
+            strpool_internal_release( pool, pool->retired->ptr );
+            STRPOOL_FREE( pool->memctx, pool->retired );
+            pool->retired = next;
+            }
+    #else
+        (void) pool;
+    #endif
+    }
+
+
 static int strpool_internal_add_block( strpool_t* pool, int size )
     {
-    if( pool->block_count >= pool->block_capacity ) 
+    if( pool->block_count >= pool->block_capacity )
         {
         pool->block_capacity *= 2;
-        strpool_internal_block_t* new_blocks = (strpool_internal_block_t*) STRPOOL_MALLOC( pool->memctx, 
+        strpool_internal_block_t* new_blocks = (strpool_internal_block_t*) STRPOOL_MALLOC( pool->memctx,
             pool->block_capacity * sizeof( *pool->blocks ) );
         STRPOOL_ASSERT( new_blocks, "Allocation failed" );
         STRPOOL_MEMCPY( new_blocks, pool->blocks, pool->block_count * sizeof( *pool->blocks ) );
-        STRPOOL_FREE( pool->memctx, pool->blocks );
-        pool->blocks = new_blocks;
+        strpool_internal_retire( pool, pool->blocks );
+        strpool_internal_store_ptr( &pool->blocks, new_blocks );
         }
     pool->blocks[ pool->block_count ].capacity = size;
     pool->blocks[ pool->block_count ].data = (char*) STRPOOL_MALLOC( pool->memctx, (size_t) size );
     STRPOOL_ASSERT( pool->blocks[ pool->block_count ].data, "Allocation failed" );
     pool->blocks[ pool->block_count ].tail = pool->blocks[ pool->block_count ].data;
     pool->blocks[ pool->block_count ].free_list = -1;
-    return pool->block_count++;
+    strpool_internal_store_int( &pool->block_count, pool->block_count + 1 );
+    return pool->block_count - 1;
     }
 
 
-void strpool_init( strpool_t* pool, strpool_config_t const* config )
+// Sets up the settings shared by `strpool_init` and `strpool_map_image`
+static void strpool_internal_apply_config( strpool_t* pool, strpool_config_t const* config )
     {
-    if( !config ) config = &strpool_default_config;
-
     pool->memctx = config->memctx;
     pool->ignore_case = config->ignore_case;
 
@@ -576,6 +1088,31 @@ void strpool_init( strpool_t* pool, strpool_config_t const* config )
     pool->min_data_size = 
         (int) ( sizeof( int ) * 2 + 1 + ( config->min_length > 8 ? (STRPOOL_U32)config->min_length : 8U ) );
 
+    pool->prefix_index = config->prefix_index ? 1 : 0;
+    pool->prefix_main = 0;
+    pool->prefix_main_count = 0;
+    pool->prefix_main_dead = 0;
+    pool->prefix_tail = 0;
+    pool->prefix_tail_count = 0;
+    pool->prefix_tail_capacity = 0;
+
+    pool->tail_merge = config->tail_merge ? 1 : 0;
+    pool->shared_count = 0;
+
+    pool->image = 0;
+    pool->image_size = 0;
+    #ifdef STRPOOL_CONCURRENT
+        pool->insert_lock = 0;
+        pool->retired = 0;
+    #endif
+    }
+
+
+void strpool_init( strpool_t* pool, strpool_config_t const* config )
+    {
+    if( !config ) config = &strpool_default_config;
+    strpool_internal_apply_config( pool, config );
+
     pool->hash_capacity = pool->initial_entry_capacity * 2;
     pool->entry_capacity = pool->initial_entry_capacity;
     pool->handle_capacity = pool->initial_entry_capacity;
@@ -647,24 +1184,113 @@ void strpool_term( strpool_t* pool )
     printf( "\n\n" );
 #endif
 
-    for( int i = 0; i < pool->block_count; ++i ) STRPOOL_FREE( pool->memctx, pool->blocks[ i ].data );
+    for( int i = 0; i < pool->block_count; ++i ) strpool_internal_release( pool, pool->blocks[ i ].data );
     STRPOOL_FREE( pool->memctx, pool->blocks );         
-    STRPOOL_FREE( pool->memctx, pool->handles );            
-    STRPOOL_FREE( pool->memctx, pool->entries );            
-    STRPOOL_FREE( pool->memctx, pool->hash_table );         
+    strpool_internal_release( pool, pool->handles );            
+    strpool_internal_release( pool, pool->entries );            
+    strpool_internal_release( pool, pool->hash_table );         
+    if( pool->prefix_main ) strpool_internal_release( pool, pool->prefix_main );
+    if( pool->prefix_tail ) STRPOOL_FREE( pool->memctx, pool->prefix_tail );
+    strpool_internal_free_retired( pool );
+    strpool_internal_unmap_image( pool );
+    }
+
+
+// Returns the size of the storage slot used for `size` bytes of string data
+static int strpool_internal_storage_size( strpool_t const* pool, int size )
+    {
+    if( size < (int) sizeof( strpool_internal_free_block_t ) ) size = (int) sizeof( strpool_internal_free_block_t );
+    if( size < pool->min_data_size ) size = pool->min_data_size;
+    return (int)strpool_internal_pow2ceil( (STRPOOL_U32)size );
+    }
+
+
+// Compares two strings from their last character towards their first
+static int strpool_internal_compare_reversed( char const* a, int a_length, char const* b, int b_length )
+    {
+    int length = a_length < b_length ? a_length : b_length;
+    for( int i = 1; i <= length; ++i )
+        {
+        unsigned char ca = (unsigned char) a[ a_length - i ];
+        unsigned char cb = (unsigned char) b[ b_length - i ];
+        if( ca != cb ) return ca < cb ? -1 : 1;
+        }
+    return a_length - b_length;
+    }
+
+
+// Finds, for each entry, the entry whose storage it will share when tail merging. Sorting the strings by their reversed
+// content places each string right before the strings it is a tail of, so a string is a tail of another string if and 
+// only if it is a tail of the one following it in that order. Going through the sorted strings backwards, each string 
+// is then stored inside the same string as the one after it, or is stored on its own.
+static void strpool_internal_find_tail_owners( strpool_t const* pool, int* owner, int* order, int* temp, int count )
+    {
+    strpool_internal_entry_t const* entries = pool->entries;
+    for( int i = 0; i < count; ++i ) order[ i ] = i;
+
+    // Bottom-up merge sort, as the comparison needs the pool, and `qsort` can't be given any context
+    for( int width = 1; width < count; width *= 2 )
+        {
+        for( int start = 0; start < count; start += 2 * width )
+            {
+            int mid = start + width < count ? start + width : count;
+            int end = start + 2 * width < count ? start + 2 * width : count;
+            int a = start;
+            int b = mid;
+            int out = start;
+            while( a < mid && b < end )
+                {
+                strpool_internal_entry_t const* ea = &entries[ order[ a ] ];
+                strpool_internal_entry_t const* eb = &entries[ order[ b ] ];
+                int cmp = strpool_internal_compare_reversed( ea->data + 2 * sizeof( STRPOOL_U32 ), ea->length, 
+                    eb->data + 2 * sizeof( STRPOOL_U32 ), eb->length );
+                temp[ out++ ] = cmp <= 0 ? order[ a++ ] : order[ b++ ];
+                }
+            while( a < mid ) temp[ out++ ] = order[ a++ ];
+            while( b < end ) temp[ out++ ] = order[ b++ ];
+            }
+        int* swap = order;
+        order = temp;
+        temp = swap;
+        }
+
+    for( int i = count - 1; i >= 0; --i )
+        {
+        int index = order[ i ];
+        owner[ index ] = index;
+        if( i == count - 1 ) continue;
+        strpool_internal_entry_t const* entry = &entries[ index ];
+        strpool_internal_entry_t const* next = &entries[ order[ i + 1 ] ];
+        if( entry->length < next->length && STRPOOL_MEMCMP( entry->data + 2 * sizeof( STRPOOL_U32 ), 
+            next->data + 2 * sizeof( STRPOOL_U32 ) + next->length - entry->length, (size_t) entry->length ) == 0 )
+            owner[ index ] = owner[ order[ i + 1 ] ];
+        }
     }
 
 
 void strpool_defrag( strpool_t* pool )
     {
+    strpool_internal_free_retired( pool );
+
+    // Each string gets storage of its own, unless tail merging finds another string to store it inside
+    int* owner = 0;
+    if( pool->tail_merge && pool->entry_count > 1 )
+        {
+        owner = (int*) STRPOOL_MALLOC( pool->memctx, 3 * pool->entry_count * sizeof( int ) );
+        STRPOOL_ASSERT( owner, "Allocation failed" );
+        strpool_internal_find_tail_owners( pool, owner, owner + pool->entry_count, owner + 2 * pool->entry_count, 
+            pool->entry_count );
+        }
+
     int data_size = 0;
     int count = 0;
     for( int i = 0; i < pool->entry_count; ++i )
         {
         strpool_internal_entry_t* entry = &pool->entries[ i ];
-        if( entry->refcount > 0 )
+        if( entry->refcount >= 0 )
             {
-            data_size += entry->size;
+            if( !owner || owner[ i ] == i )
+                data_size += strpool_internal_storage_size( pool, entry->length + 1 + (int)( 2 * sizeof( STRPOOL_U32 ) ) );
             ++count;
             }
         }
@@ -688,13 +1314,15 @@ void strpool_defrag( strpool_t* pool )
         capacity * sizeof( *entries ) );
     STRPOOL_ASSERT( entries, "Allocation failed" );
     int index = 0;
+    int shared_count = 0;
     char* tail = data;
     for( int i = 0; i < pool->entry_count; ++i )
         {
         strpool_internal_entry_t* entry = &pool->entries[ i ];
-        if( entry->refcount > 0 )
+        if( entry->refcount >= 0 )
             {
             entries[ index ] = *entry;
+            entries[ index ].shared = 0;
 
             STRPOOL_U32 hash = pool->hash_table[ entry->hash_slot ].hash_key;
             int base_slot = (int)( hash & (STRPOOL_U32)( hash_capacity - 1 ) );
@@ -707,19 +1335,59 @@ void strpool_defrag( strpool_t* pool )
             ++hash_table[ base_slot ].base_count;
 
             entries[ index ].hash_slot = slot;
-            entries[ index ].data = tail;
             entries[ index ].handle_index = entry->handle_index;
             pool->handles[ entry->handle_index ].entry_index = index;
-            STRPOOL_MEMCPY( tail, entry->data, entry->length + 1 + 2 * sizeof( STRPOOL_U32 ) );
-            tail += entry->size;
+
+            // Strings stored inside other strings don't have a hash and length in front of them, so those are written 
+            // from the entry rather than copied
+            if( !owner || owner[ i ] == i )
+                {
+                entries[ index ].data = tail;
+                entries[ index ].size = strpool_internal_storage_size( pool, 
+                    entry->length + 1 + (int)( 2 * sizeof( STRPOOL_U32 ) ) );
+                *(STRPOOL_U32*)( tail ) = hash;
+                *(STRPOOL_U32*)( tail + sizeof( STRPOOL_U32 ) ) = (STRPOOL_U32) entry->length;
+                STRPOOL_MEMCPY( tail + 2 * sizeof( STRPOOL_U32 ), entry->data + 2 * sizeof( STRPOOL_U32 ), 
+                    (size_t) entry->length + 1 );
+                tail += entries[ index ].size;
+                }
+            else
+                {
+                entries[ index ].size = 0;
+                ++shared_count;
+                }
+            if( owner ) owner[ i ] = owner[ i ] == i ? -1 - index : owner[ i ];
+            ++index;
+            }
+        }
+
+    // With all the strings which have storage of their own laid out, the ones stored inside them can be pointed there. 
+    // Owners have had their entry in `owner` replaced by their new index (encoded as a negative value).
+    if( owner )
+        {
+        index = 0;
+        for( int i = 0; i < pool->entry_count; ++i )
+            {
+            if( pool->entries[ i ].refcount < 0 ) continue;
+            if( owner[ i ] >= 0 )
+                {
+                strpool_internal_entry_t* holder = &entries[ -1 - owner[ owner[ i ] ] ];
+                holder->shared = 1;
+                entries[ index ].data = holder->data + holder->length - entries[ index ].length;
+                }
             ++index;
             }
+        STRPOOL_FREE( pool->memctx, owner );
         }
+    #ifdef STRPOOL_STABLE_HANDLES
+        for( int i = 0; i < count; ++i )
+            pool->handles[ entries[ i ].handle_index ].data = entries[ i ].data + 2 * sizeof( STRPOOL_U32 );
+    #endif
 
 
-    STRPOOL_FREE( pool->memctx, pool->hash_table );
-    STRPOOL_FREE( pool->memctx, pool->entries );
-    for( int i = 0; i < pool->block_count; ++i ) STRPOOL_FREE( pool->memctx, pool->blocks[ i ].data );
+    strpool_internal_release( pool, pool->hash_table );
+    strpool_internal_release( pool, pool->entries );
+    for( int i = 0; i < pool->block_count; ++i ) strpool_internal_release( pool, pool->blocks[ i ].data );
 
     if( pool->block_capacity != pool->initial_block_capacity )
         {
@@ -742,6 +1410,42 @@ void strpool_defrag( strpool_t* pool )
     pool->entries = entries;
     pool->entry_capacity = capacity;
     pool->entry_count = count;
+    pool->shared_count = shared_count;
+    }
+
+
+void strpool_stats( strpool_t const* pool, strpool_stats_t* stats )
+    {
+    STRPOOL_MEMSET( stats, 0, sizeof( *stats ) );
+    stats->string_count = pool->entry_count;
+    stats->shared_count = pool->shared_count;
+    for( int i = 0; i < pool->entry_count; ++i )
+        {
+        stats->string_bytes += (STRPOOL_U64) pool->entries[ i ].length + 1;
+        stats->stored_bytes += (STRPOOL_U64) pool->entries[ i ].size;
+        }
+
+    for( int i = 0; i < pool->block_count; ++i )
+        {
+        strpool_internal_block_t const* block = &pool->blocks[ i ];
+        stats->block_bytes += (STRPOOL_U64) block->capacity;
+        stats->free_bytes += (STRPOOL_U64)( block->capacity - ( block->tail - block->data ) );
+        for( int free_list = block->free_list; free_list >= 0; )
+            {
+            strpool_internal_free_block_t const* free_entry = 
+                (strpool_internal_free_block_t const*) ( block->data + free_list );
+            stats->free_bytes += (STRPOOL_U64) free_entry->size;
+            free_list = free_entry->next;
+            }
+        }
+    stats->retained_bytes = stats->block_bytes - stats->stored_bytes - stats->free_bytes;
+
+    stats->table_bytes = 
+          (STRPOOL_U64) pool->hash_capacity * sizeof( *pool->hash_table )
+        + (STRPOOL_U64) pool->entry_capacity * sizeof( *pool->entries )
+        + (STRPOOL_U64) pool->handle_capacity * sizeof( *pool->handles )
+        + (STRPOOL_U64) pool->block_capacity * sizeof( *pool->blocks )
+        + (STRPOOL_U64) ( pool->prefix_main_count + pool->prefix_tail_capacity ) * sizeof( int );
     }
 
 
@@ -771,27 +1475,57 @@ static strpool_internal_entry_t* strpool_internal_get_entry( strpool_t const* po
     int index = strpool_internal_index_from_handle( handle, pool->index_mask );
     int counter = strpool_internal_counter_from_handle( handle, pool->counter_shift, pool->counter_mask );
 
-    if( index >= 0 && index < pool->handle_count && 
-        counter == (int) ( pool->handles[ index ].counter & pool->counter_mask ) )
-            return &pool->entries[ pool->handles[ index ].entry_index ];
+    if( index >= 0 && index < strpool_internal_load_int( &pool->handle_count ) )
+        {
+        strpool_internal_handle_t const* handles = (strpool_internal_handle_t const*) 
+            strpool_internal_load_ptr( &pool->handles );
+        strpool_internal_entry_t* entries = (strpool_internal_entry_t*) strpool_internal_load_ptr( &pool->entries );
+        if( counter == (int) ( handles[ index ].counter & pool->counter_mask ) )
+            return &entries[ handles[ index ].entry_index ];
+        }
 
     return 0;
     }
 
 
+#ifdef STRPOOL_STABLE_HANDLES
+
+    // Lookup which only touches the handle record, for the functions which only need the string data
+    static strpool_internal_handle_t const* strpool_internal_get_handle( strpool_t const* pool, STRPOOL_U64 handle )
+        {
+        int index = strpool_internal_index_from_handle( handle, pool->index_mask );
+        int counter = strpool_internal_counter_from_handle( handle, pool->counter_shift, pool->counter_mask );
+
+        if( index >= 0 && index < strpool_internal_load_int( &pool->handle_count ) )
+            {
+            strpool_internal_handle_t const* handles = (strpool_internal_handle_t const*) 
+                strpool_internal_load_ptr( &pool->handles );
+            if( counter == (int) ( handles[ index ].counter & pool->counter_mask ) && handles[ index ].data )
+                return &handles[ index ];
+            }
+
+        return 0;
+        }
+
+#endif /* STRPOOL_STABLE_HANDLES */
+
+
 static STRPOOL_U32 strpool_internal_find_in_blocks( strpool_t const* pool, char const* string, int length )
     {
-    for( int i = 0; i < pool->block_count; ++i )
+    int block_count = strpool_internal_load_int( &pool->block_count );
+    strpool_internal_block_t const* blocks = (strpool_internal_block_t const*) strpool_internal_load_ptr( &pool->blocks );
+    for( int i = 0; i < block_count; ++i )
         {
-        strpool_internal_block_t* block = &pool->blocks[ i ];
+        strpool_internal_block_t const* block = &blocks[ i ];
         // Check if string comes from pool
         if( string >= block->data + 2 * sizeof( STRPOOL_U32 ) && string < block->data + block->capacity ) 
             {
-            STRPOOL_U32* ptr = (STRPOOL_U32*) string;
-            int stored_length = (int)( *( ptr - 1 ) ); // Length is stored immediately before string
-            if( stored_length != length || string[ length ] != '\0' ) return 0; // Invalid string
-            STRPOOL_U32 hash = *( ptr - 2 ); // Hash is stored before the length field
-            return hash;
+            // The hash and length are stored immediately before the string. The pointer might not be aligned if it doesn't 
+            // actually point at the start of a string, so they are copied out rather than read in place.
+            STRPOOL_U32 header[ 2 ];
+            STRPOOL_MEMCPY( header, string - sizeof( header ), sizeof( header ) );
+            if( (int) header[ 1 ] != length || string[ length ] != '\0' ) return 0; // Invalid string
+            return header[ 0 ];
             }
         }
 
@@ -826,36 +1560,38 @@ static STRPOOL_U32 strpool_internal_calculate_hash( char const* string, int leng
     }
 
 
-static void strpool_internal_expand_hash_table( strpool_t* pool )
+static void strpool_internal_resize_hash_table( strpool_t* pool, int hash_capacity )
     {
     int old_capacity = pool->hash_capacity;
     strpool_internal_hash_slot_t* old_table = pool->hash_table;
 
-    pool->hash_capacity *= 2;
-
-    pool->hash_table = (strpool_internal_hash_slot_t*) STRPOOL_MALLOC( pool->memctx, 
-        pool->hash_capacity * sizeof( *pool->hash_table ) );
-    STRPOOL_ASSERT( pool->hash_table, "Allocation failed" );
-    STRPOOL_MEMSET( pool->hash_table, 0, pool->hash_capacity * sizeof( *pool->hash_table ) );
+    strpool_internal_hash_slot_t* hash_table = (strpool_internal_hash_slot_t*) STRPOOL_MALLOC( pool->memctx, 
+        hash_capacity * sizeof( *hash_table ) );
+    STRPOOL_ASSERT( hash_table, "Allocation failed" );
+    STRPOOL_MEMSET( hash_table, 0, hash_capacity * sizeof( *hash_table ) );
 
     for( int i = 0; i < old_capacity; ++i )
         {
         STRPOOL_U32 hash_key = old_table[ i ].hash_key;
         if( hash_key )
             {
-            int base_slot = (int)( hash_key & (STRPOOL_U32)( pool->hash_capacity - 1 ) );
+            int base_slot = (int)( hash_key & (STRPOOL_U32)( hash_capacity - 1 ) );
             int slot = base_slot;
-            while( pool->hash_table[ slot ].hash_key )
-                slot = ( slot + 1 ) & ( pool->hash_capacity - 1 );
+            while( hash_table[ slot ].hash_key )
+                slot = ( slot + 1 ) & ( hash_capacity - 1 );
             STRPOOL_ASSERT( hash_key, "Invalid hash" );
-            pool->hash_table[ slot ].hash_key = hash_key;
-            pool->hash_table[ slot ].entry_index = old_table[ i ].entry_index;  
-            pool->entries[ pool->hash_table[ slot ].entry_index ].hash_slot = slot; 
-            ++pool->hash_table[ base_slot ].base_count;
+            hash_table[ slot ].hash_key = hash_key;
+            hash_table[ slot ].entry_index = old_table[ i ].entry_index;  
+            pool->entries[ hash_table[ slot ].entry_index ].hash_slot = slot; 
+            ++hash_table[ base_slot ].base_count;
             }               
         }
 
-    STRPOOL_FREE( pool->memctx, old_table );
+    // Table must be published before the capacity, as lock-free readers load the capacity first - that way, they can
+    // see a new table with the old capacity (which just makes them miss), but never an old table with the new capacity
+    strpool_internal_store_ptr( &pool->hash_table, hash_table );
+    strpool_internal_store_int( &pool->hash_capacity, hash_capacity );
+    strpool_internal_retire( pool, old_table );
     }
 
 
@@ -866,8 +1602,8 @@ static void strpool_internal_expand_entries( strpool_t* pool )
         pool->entry_capacity * sizeof( *pool->entries ) );
     STRPOOL_ASSERT( new_entries, "Allocation failed" );
     STRPOOL_MEMCPY( new_entries, pool->entries, pool->entry_count * sizeof( *pool->entries ) );
-    STRPOOL_FREE( pool->memctx, pool->entries );
-    pool->entries = new_entries;    
+    strpool_internal_retire( pool, pool->entries );
+    strpool_internal_store_ptr( &pool->entries, new_entries );
     }
 
 
@@ -878,16 +1614,14 @@ static void strpool_internal_expand_handles( strpool_t* pool )
         pool->handle_capacity * sizeof( *pool->handles ) );
     STRPOOL_ASSERT( new_handles, "Allocation failed" );
     STRPOOL_MEMCPY( new_handles, pool->handles, pool->handle_count * sizeof( *pool->handles ) );
-    STRPOOL_FREE( pool->memctx, pool->handles );
-    pool->handles = new_handles;
+    strpool_internal_retire( pool, pool->handles );
+    strpool_internal_store_ptr( &pool->handles, new_handles );
     }
 
 
 static char* strpool_internal_get_data_storage( strpool_t* pool, int size, int* alloc_size )
     {
-    if( size < sizeof( strpool_internal_free_block_t ) ) size = sizeof( strpool_internal_free_block_t );
-    if( size < pool->min_data_size ) size = pool->min_data_size;
-    size = (int)strpool_internal_pow2ceil( (STRPOOL_U32)size );
+    size = strpool_internal_storage_size( pool, size );
     
     // Try to find a large enough free slot in existing blocks
     for( int i = 0; i < pool->block_count; ++i )
@@ -940,14 +1674,264 @@ static char* strpool_internal_get_data_storage( strpool_t* pool, int size, int*
     }
     
 
-STRPOOL_U64 strpool_inject( strpool_t* pool, char const* string, int length )
+// Lookup of an existing string, returning 0 if it is not found. In STRPOOL_CONCURRENT mode this is lock-free: each step 
+// only reads values which have been published with release semantics, and the probe is bounded by the capacity it 
+// started out with, so it always completes in a finite number of steps, regardless of what other threads are doing. 
+// The string might then also not be found if an insert or a table expansion is in progress - the caller then retries 
+// under the insert lock.
+static STRPOOL_U64 strpool_internal_find( strpool_t const* pool, STRPOOL_U32 hash, char const* string, int length )
     {
-    if( !string || length <= 0 ) return 0;
+    int hash_capacity = strpool_internal_load_int( &pool->hash_capacity );
+    strpool_internal_hash_slot_t const* hash_table = (strpool_internal_hash_slot_t const*) 
+        strpool_internal_load_ptr( &pool->hash_table );
 
-    STRPOOL_U32 hash = strpool_internal_find_in_blocks( pool, string, length );
-    // If no stored hash, calculate it from data
-    if( !hash ) hash = strpool_internal_calculate_hash( string, length, pool->ignore_case ); 
+    int base_slot = (int)( hash & (STRPOOL_U32)( hash_capacity - 1 ) );
+    int base_count = strpool_internal_load_int( &hash_table[ base_slot ].base_count );
+    int slot = base_slot;
+    for( int probes = 0; base_count > 0 && probes < hash_capacity; ++probes )
+        {
+        STRPOOL_U32 slot_hash = strpool_internal_load_u32( &hash_table[ slot ].hash_key );
+        if( slot_hash && (int)( slot_hash & (STRPOOL_U32)( hash_capacity - 1 ) ) == base_slot ) 
+            {
+            --base_count;
+            if( slot_hash == hash )
+                {
+                strpool_internal_entry_t const* entries = (strpool_internal_entry_t const*) 
+                    strpool_internal_load_ptr( &pool->entries );
+                strpool_internal_entry_t const* entry = &entries[ hash_table[ slot ].entry_index ];
+                if( entry->length == length && 
+                    ( 
+                       ( !pool->ignore_case &&   STRPOOL_MEMCMP( entry->data + 2 * sizeof( STRPOOL_U32 ), string, (size_t)length ) == 0 )
+                    || (  pool->ignore_case && STRPOOL_STRNICMP( entry->data + 2 * sizeof( STRPOOL_U32 ), string, (size_t)length ) == 0 ) 
+                    ) 
+                  )
+                    {
+                    strpool_internal_handle_t const* handles = (strpool_internal_handle_t const*) 
+                        strpool_internal_load_ptr( &pool->handles );
+                    int handle_index = entry->handle_index;
+                    return strpool_internal_make_handle( handle_index, handles[ handle_index ].counter, 
+                        pool->index_mask, pool->counter_shift, pool->counter_mask );
+                    }
+                }
+            }
+        slot = ( slot + 1 ) & ( hash_capacity - 1 );
+        }
 
+    return 0;
+    }
+
+
+// The prefix index is a sorted array of handle indices (the main run), plus a small sorted array of recently added ones
+// (the tail run). New strings are inserted into the tail run, which is merged into the main run when it gets full. The
+// tail run holds a few times the square root of the main run size, which balances the cost of inserting into it against
+// the cost of merging it. Strings removed from the main run are replaced by tombstones, stored as the bitwise inverse of
+// the handle index of a live neighbor, so that the run remains sorted and can still be binary searched. The main run is
+// compacted when it holds too many. 
+
+static char const* strpool_internal_handle_string( strpool_t const* pool, int handle_index, int* length )
+    {
+    #ifdef STRPOOL_STABLE_HANDLES
+        *length = pool->handles[ handle_index ].length;
+        return pool->handles[ handle_index ].data;
+    #else
+        strpool_internal_entry_t const* entry = &pool->entries[ pool->handles[ handle_index ].entry_index ];
+        *length = entry->length;
+        return entry->data + 2 * sizeof( STRPOOL_U32 );
+    #endif
+    }
+
+
+static int strpool_internal_compare( strpool_t const* pool, char const* a, int a_length, char const* b, int b_length )
+    {
+    int length = a_length < b_length ? a_length : b_length;
+    if( pool->ignore_case )
+        {
+        for( int i = 0; i < length; ++i )
+            {
+            unsigned char ca = (unsigned char) a[ i ];
+            unsigned char cb = (unsigned char) b[ i ];
+            ca = (unsigned char)( ( ca <= 'z' && ca >= 'a' ) ? ca - ( 'a' - 'A' ) : ca );
+            cb = (unsigned char)( ( cb <= 'z' && cb >= 'a' ) ? cb - ( 'a' - 'A' ) : cb );
+            if( ca != cb ) return ca < cb ? -1 : 1;
+            }
+        }
+    else if( length > 0 )
+        {
+        int result = STRPOOL_MEMCMP( a, b, (size_t) length );
+        if( result ) return result;
+        }
+    return a_length < b_length ? -1 : a_length > b_length ? 1 : 0;
+    }
+
+
+// Returns the first position in the run with a string which sorts at or after `string`, or, if `past_prefix` is set, 
+// the first position with a string which sorts after all strings starting with `string`
+static int strpool_internal_prefix_search( strpool_t const* pool, int const* run, int count, char const* string, 
+    int length, int past_prefix )
+    {
+    int low = 0;
+    int high = count;
+    while( low < high )
+        {
+        int mid = ( low + high ) / 2;
+        int key_length;
+        char const* key = strpool_internal_handle_string( pool, run[ mid ] < 0 ? ~run[ mid ] : run[ mid ], &key_length );
+        if( past_prefix && key_length > length ) key_length = length;
+        int result = strpool_internal_compare( pool, key, key_length, string, length );
+        if( result < 0 || ( past_prefix && result == 0 ) ) low = mid + 1; else high = mid;
+        }
+    return low;
+    }
+
+
+static void strpool_internal_prefix_merge( strpool_t* pool )
+    {
+    int count = pool->prefix_main_count - pool->prefix_main_dead + pool->prefix_tail_count;
+    int* run = (int*) STRPOOL_MALLOC( pool->memctx, ( count > 0 ? count : 1 ) * sizeof( int ) );
+    STRPOOL_ASSERT( run, "Allocation failed" );
+
+    // Find where each tail string goes with an exponential search from where the previous one went, rather than comparing
+    // against every string in the main run
+    int const* main = pool->prefix_main;
+    int out = 0;
+    int pos = 0;
+    for( int i = 0; i < pool->prefix_tail_count; ++i )
+        {
+        int length;
+        char const* string = strpool_internal_handle_string( pool, pool->prefix_tail[ i ], &length );
+        int step = 1;
+        int low = pos;
+        int high = pos;
+        while( high < pool->prefix_main_count )
+            {
+            int key_length;
+            char const* key = strpool_internal_handle_string( pool, main[ high ] < 0 ? ~main[ high ] : main[ high ], 
+                &key_length );
+            if( strpool_internal_compare( pool, key, key_length, string, length ) >= 0 ) break;
+            low = high + 1;
+            high += step;
+            step *= 2;
+            }
+        if( high > pool->prefix_main_count ) high = pool->prefix_main_count;
+        int end = low + strpool_internal_prefix_search( pool, main + low, high - low, string, length, 0 );
+        for( ; pos < end; ++pos ) if( main[ pos ] >= 0 ) run[ out++ ] = main[ pos ];
+        run[ out++ ] = pool->prefix_tail[ i ];
+        }
+    for( ; pos < pool->prefix_main_count; ++pos ) if( main[ pos ] >= 0 ) run[ out++ ] = main[ pos ];
+    STRPOOL_ASSERT( out == count, "Invalid prefix index" );
+
+    if( pool->prefix_main ) strpool_internal_release( pool, pool->prefix_main );
+    pool->prefix_main = run;
+    pool->prefix_main_count = count;
+    pool->prefix_main_dead = 0;
+    pool->prefix_tail_count = 0;
+
+    int capacity = 256;
+    while( capacity * capacity < 32 * count ) capacity *= 2;
+    if( capacity > pool->prefix_tail_capacity )
+        {
+        if( pool->prefix_tail ) STRPOOL_FREE( pool->memctx, pool->prefix_tail );
+        pool->prefix_tail = (int*) STRPOOL_MALLOC( pool->memctx, capacity * sizeof( int ) );
+        STRPOOL_ASSERT( pool->prefix_tail, "Allocation failed" );
+        pool->prefix_tail_capacity = capacity;
+        }
+    }
+
+
+static void strpool_internal_prefix_insert( strpool_t* pool, int handle_index )
+    {
+    if( pool->prefix_tail_count >= pool->prefix_tail_capacity ) strpool_internal_prefix_merge( pool );
+    int length;
+    char const* string = strpool_internal_handle_string( pool, handle_index, &length );
+    int pos = strpool_internal_prefix_search( pool, pool->prefix_tail, pool->prefix_tail_count, string, length, 0 );
+    STRPOOL_MEMMOVE( pool->prefix_tail + pos + 1, pool->prefix_tail + pos, 
+        ( pool->prefix_tail_count - pos ) * sizeof( int ) );
+    pool->prefix_tail[ pos ] = handle_index;
+    ++pool->prefix_tail_count;
+    }
+
+
+static void strpool_internal_prefix_compact( strpool_t* pool )
+    {
+    int count = 0;
+    for( int i = 0; i < pool->prefix_main_count; ++i )
+        if( pool->prefix_main[ i ] >= 0 ) pool->prefix_main[ count++ ] = pool->prefix_main[ i ];
+    pool->prefix_main_count = count;
+    pool->prefix_main_dead = 0;
+    }
+
+
+// Must be called while the string is still stored, as it is needed to find its place in the index
+static void strpool_internal_prefix_remove( strpool_t* pool, int handle_index )
+    {
+    int length;
+    char const* string = strpool_internal_handle_string( pool, handle_index, &length );
+
+    int pos = strpool_internal_prefix_search( pool, pool->prefix_tail, pool->prefix_tail_count, string, length, 0 );
+    if( pos < pool->prefix_tail_count && pool->prefix_tail[ pos ] == handle_index )
+        {
+        STRPOOL_MEMMOVE( pool->prefix_tail + pos, pool->prefix_tail + pos + 1, 
+            ( pool->prefix_tail_count - pos - 1 ) * sizeof( int ) );
+        --pool->prefix_tail_count;
+        return;
+        }
+
+    // In the main run, the string sorts equal only to its own tombstones, which are all next to it. They all become 
+    // tombstones for the nearest live neighbor instead.
+    int* main = pool->prefix_main;
+    int first = strpool_internal_prefix_search( pool, main, pool->prefix_main_count, string, length, 0 );
+    int last = first;
+    while( last + 1 < pool->prefix_main_count && ( main[ last + 1 ] == handle_index || main[ last + 1 ] == ~handle_index ) ) 
+        ++last;
+    STRPOOL_ASSERT( first < pool->prefix_main_count && ( main[ first ] == handle_index || main[ first ] == ~handle_index ),
+        "String not found in prefix index" );
+
+    int neighbor;
+    if( first > 0 ) 
+        neighbor = main[ first - 1 ];
+    else if( last + 1 < pool->prefix_main_count ) 
+        neighbor = main[ last + 1 ];
+    else
+        {
+        pool->prefix_main_count = 0;
+        pool->prefix_main_dead = 0;
+        return;
+        }
+    neighbor = neighbor < 0 ? neighbor : ~neighbor;
+    for( int i = first; i <= last; ++i ) main[ i ] = neighbor;
+
+    ++pool->prefix_main_dead;
+    if( pool->prefix_main_dead > 64 && pool->prefix_main_dead * 4 > pool->prefix_main_count ) 
+        strpool_internal_prefix_compact( pool );
+    }
+
+
+// Used by strpool_discard_many, to drop all strings marked for removal in one pass
+static void strpool_internal_prefix_filter( strpool_t* pool )
+    {
+    int count = 0;
+    for( int i = 0; i < pool->prefix_main_count; ++i )
+        {
+        int handle_index = pool->prefix_main[ i ];
+        if( handle_index >= 0 && pool->entries[ pool->handles[ handle_index ].entry_index ].refcount >= 0 ) 
+            pool->prefix_main[ count++ ] = handle_index;
+        }
+    pool->prefix_main_count = count;
+    pool->prefix_main_dead = 0;
+
+    count = 0;
+    for( int i = 0; i < pool->prefix_tail_count; ++i )
+        {
+        int handle_index = pool->prefix_tail[ i ];
+        if( pool->entries[ pool->handles[ handle_index ].entry_index ].refcount >= 0 ) 
+            pool->prefix_tail[ count++ ] = handle_index;
+        }
+    pool->prefix_tail_count = count;
+    }
+
+
+static STRPOOL_U64 strpool_internal_inject( strpool_t* pool, STRPOOL_U32 hash, char const* string, int length )
+    {
     // Return handle to existing string, if it is already in pool
     int base_slot = (int)( hash & (STRPOOL_U32)( pool->hash_capacity - 1 ) );
     int base_count = pool->hash_table[ base_slot ].base_count;
@@ -958,7 +1942,7 @@ STRPOOL_U64 strpool_inject( strpool_t* pool, char const* string, int length )
         STRPOOL_U32 slot_hash = pool->hash_table[ slot ].hash_key;
         if( slot_hash == 0 && pool->hash_table[ first_free ].hash_key != 0 ) first_free = slot;
         int slot_base = (int)( slot_hash & (STRPOOL_U32)( pool->hash_capacity - 1 ) );
-        if( slot_base == base_slot ) 
+        if( slot_hash && slot_base == base_slot ) // empty slots must not be counted towards base slot 0
             {
             STRPOOL_ASSERT( base_count > 0, "Invalid base count" );
             --base_count;
@@ -986,7 +1970,7 @@ STRPOOL_U64 strpool_inject( strpool_t* pool, char const* string, int length )
 
     if( pool->entry_count >= ( pool->hash_capacity  - pool->hash_capacity / 3 ) )
         {
-        strpool_internal_expand_hash_table( pool );
+        strpool_internal_resize_hash_table( pool, pool->hash_capacity * 2 );
 
         base_slot = (int)( hash & (STRPOOL_U32)( pool->hash_capacity - 1 ) );
         slot = base_slot;
@@ -996,7 +1980,7 @@ STRPOOL_U64 strpool_inject( strpool_t* pool, char const* string, int length )
             STRPOOL_U32 slot_hash = pool->hash_table[ slot ].hash_key;
             if( slot_hash == 0 && pool->hash_table[ first_free ].hash_key != 0 ) first_free = slot;
             int slot_base = (int)( slot_hash & (STRPOOL_U32)( pool->hash_capacity - 1 ) );
-            if( slot_base == base_slot )  --base_count;
+            if( slot_hash && slot_base == base_slot ) --base_count;
             slot = ( slot + 1 ) & ( pool->hash_capacity - 1 );
             }       
         }
@@ -1010,17 +1994,15 @@ STRPOOL_U64 strpool_inject( strpool_t* pool, char const* string, int length )
 
     STRPOOL_ASSERT( !pool->hash_table[ slot ].hash_key && ( hash & ( (STRPOOL_U32) pool->hash_capacity - 1 ) ) == (STRPOOL_U32) base_slot, "Invalid slot" );
     STRPOOL_ASSERT( hash, "Invalid hash" );
-    pool->hash_table[ slot ].hash_key = hash;
-    pool->hash_table[ slot ].entry_index = pool->entry_count;
-    ++pool->hash_table[ base_slot ].base_count;
 
     int handle_index;
+    int new_handle_count = pool->handle_count;
 
     if( pool->handle_count < pool->handle_capacity )
         {
         handle_index = pool->handle_count;
         pool->handles[ pool->handle_count ].counter = 1;
-        ++pool->handle_count;           
+        ++new_handle_count;           
         }
     else if( pool->handle_freelist_head >= 0 )
         {
@@ -1034,13 +2016,12 @@ STRPOOL_U64 strpool_inject( strpool_t* pool, char const* string, int length )
         strpool_internal_expand_handles( pool );
         handle_index = pool->handle_count;
         pool->handles[ pool->handle_count ].counter = 1;
-        ++pool->handle_count;           
+        ++new_handle_count;           
         }
 
     pool->handles[ handle_index ].entry_index = pool->entry_count;
         
     strpool_internal_entry_t* entry = &pool->entries[ pool->entry_count ];
-    ++pool->entry_count;
         
     int data_size = length + 1 + (int) ( 2 * sizeof( STRPOOL_U32 ) );
     char* data = strpool_internal_get_data_storage( pool, data_size, &data_size );
@@ -1050,6 +2031,7 @@ STRPOOL_U64 strpool_inject( strpool_t* pool, char const* string, int length )
     entry->size = data_size;
     entry->length = length;
     entry->refcount = 0;
+    entry->shared = 0;
 
     *(STRPOOL_U32*)(data) = hash;
     data += sizeof( STRPOOL_U32 );
@@ -1057,87 +2039,596 @@ STRPOOL_U64 strpool_inject( strpool_t* pool, char const* string, int length )
     data += sizeof( STRPOOL_U32 );
     STRPOOL_MEMCPY( data, string, (size_t) length ); 
     data[ length ] = 0; // Ensure trailing zero
+    #ifdef STRPOOL_STABLE_HANDLES
+        pool->handles[ handle_index ].data = data;
+        pool->handles[ handle_index ].length = length;
+    #endif
+
+    // The string is fully written before it is made visible, by publishing the handle and the hash slot last
+    strpool_internal_store_int( &pool->handle_count, new_handle_count );
+    pool->hash_table[ slot ].entry_index = pool->entry_count;
+    strpool_internal_store_u32( &pool->hash_table[ slot ].hash_key, hash );
+    strpool_internal_store_int( &pool->hash_table[ base_slot ].base_count, pool->hash_table[ base_slot ].base_count + 1 );
+    ++pool->entry_count;
+
+    if( pool->prefix_index ) strpool_internal_prefix_insert( pool, handle_index );
 
     return strpool_internal_make_handle( handle_index, pool->handles[ handle_index ].counter, pool->index_mask, 
         pool->counter_shift, pool->counter_mask );
     }
 
 
-void strpool_discard( strpool_t* pool, STRPOOL_U64 handle )
-    {   
-    strpool_internal_entry_t* entry = strpool_internal_get_entry( pool, handle );
-    if( entry && entry->refcount == 0 )
+STRPOOL_U64 strpool_inject( strpool_t* pool, char const* string, int length )
+    {
+    if( !string || length <= 0 ) return 0;
+
+    // If the string is already in the pool, its hash is stored in front of it. A pointer into the pool could also point
+    // into the middle of another string though, which is quite likely with binary data, in which case the stored hash
+    // is just whatever bytes happen to be there. So it is only used for looking up the string, and if that fails, the 
+    // hash is calculated from the data as usual.
+    STRPOOL_U32 stored_hash = strpool_internal_find_in_blocks( pool, string, length );
+    if( stored_hash )
         {
-        int entry_index = pool->handles[ entry->handle_index ].entry_index;
+        STRPOOL_U64 existing = strpool_internal_find( pool, stored_hash, string, length );
+        if( existing ) return existing;
+        }
+    STRPOOL_U32 hash = strpool_internal_calculate_hash( string, length, pool->ignore_case ); 
+
+    #ifdef STRPOOL_CONCURRENT
+        STRPOOL_U64 existing = strpool_internal_find( pool, hash, string, length );
+        if( existing ) return existing;
 
-        // recycle string mem
-        for( int i = 0; i < pool->block_count; ++i )
+        strpool_internal_lock( pool );
+        STRPOOL_U64 handle = strpool_internal_inject( pool, hash, string, length );
+        strpool_internal_unlock( pool );
+        return handle;
+    #else
+        return strpool_internal_inject( pool, hash, string, length );
+    #endif
+    }
+
+
+STRPOOL_U64 strpool_find( strpool_t* pool, char const* string, int length )
+    {
+    if( !string || length <= 0 ) return 0;
+
+    STRPOOL_U32 stored_hash = strpool_internal_find_in_blocks( pool, string, length );
+    if( stored_hash )
+        {
+        STRPOOL_U64 existing = strpool_internal_find( pool, stored_hash, string, length );
+        if( existing ) return existing;
+        }
+    STRPOOL_U32 hash = strpool_internal_calculate_hash( string, length, pool->ignore_case ); 
+    STRPOOL_U64 handle = strpool_internal_find( pool, hash, string, length );
+
+    #ifdef STRPOOL_CONCURRENT
+        if( !handle )
+            {
+            strpool_internal_lock( pool );
+            handle = strpool_internal_find( pool, hash, string, length );
+            strpool_internal_unlock( pool );
+            }
+    #endif
+
+    return handle;
+    }
+
+
+// Bulk building works in phases, each of which is split into jobs that run in parallel. First, the input is cut into 
+// one chunk per job, and each job splits its chunk into lines and hashes them. The lines are then grouped by partition, 
+// where a partition is a range of slots in the hash table, and each partition is inserted into the table by a single 
+// job. Probing never leaves the partition: a line which would need to is deferred, and added the normal way at the end.
+// Insertion first just claims hash slots, so once all partitions are done, the exact number of new strings in each is 
+// known. Each partition then gets a range of entries and handles, and a storage block sized to fit, and finally its 
+// strings are copied in.
+
+typedef struct strpool_internal_line_t
+    {
+    STRPOOL_U64 offset;
+    int length;
+    STRPOOL_U32 hash;
+    int slot; // the hash slot claimed for the line, or -1 if the string was already there, or -2 if deferred
+    } strpool_internal_line_t;
+
+
+struct strpool_internal_build_t;
+
+typedef struct strpool_internal_build_job_t
+    {
+    struct strpool_internal_build_t* build;
+    int index;
+    STRPOOL_U64 start;
+    STRPOOL_U64 end;
+    strpool_internal_line_t* lines;
+    int line_count;
+    int* partition_counts;
+    } strpool_internal_build_job_t;
+
+
+typedef struct strpool_internal_build_t
+    {
+    strpool_t* pool;
+    char const* data;
+    int phase;
+    strpool_internal_build_job_t* jobs;
+    int job_count;
+    strpool_internal_line_t* lines;
+    int partition_count;
+    int partition_shift;
+    int* partition_start;
+    int* partition_added;
+    int* partition_size;
+    char** partition_data;
+    int entry_base;
+    int handle_base;
+    } strpool_internal_build_t;
+
+
+static void strpool_internal_build_split( strpool_internal_build_job_t* job )
+    {
+    strpool_internal_build_t* build = job->build;
+    char const* data = build->data;
+    int ignore_case = build->pool->ignore_case;
+
+    for( int pass = 0; pass < 2; ++pass )
+        {
+        // The first pass counts the lines, so the second one can store them without growing the array
+        if( pass == 1 )
             {
-            strpool_internal_block_t* block = &pool->blocks[ i ];
-            if( entry->data >= block->data && entry->data <= block->tail )
+            job->lines = (strpool_internal_line_t*) STRPOOL_MALLOC( build->pool->memctx, 
+                ( job->line_count > 0 ? job->line_count : 1 ) * sizeof( *job->lines ) );
+            STRPOOL_ASSERT( job->lines, "Allocation failed" );
+            }
+        int count = 0;
+        STRPOOL_U64 start = job->start;
+        while( start < job->end )
+            {
+            STRPOOL_U64 end = start;
+            while( end < job->end && data[ end ] != '\n' ) ++end;
+            STRPOOL_U64 length = end - start;
+            if( length > 0 && data[ end - 1 ] == '\r' ) --length;
+            if( length > 0 )
                 {
-                if( block->free_list < 0 )
+                STRPOOL_ASSERT( length < 0x7fffffff, "Line too long" );
+                if( pass == 1 )
                     {
-                    strpool_internal_free_block_t* new_entry = (strpool_internal_free_block_t*) ( entry->data );
-                    block->free_list = (int) ( entry->data - block->data );
-                    new_entry->next = -1;
-                    new_entry->size = entry->size;
+                    strpool_internal_line_t* line = &job->lines[ count ];
+                    line->offset = start;
+                    line->length = (int) length;
+                    line->hash = strpool_internal_calculate_hash( data + start, (int) length, ignore_case );
+                    line->slot = -1;
                     }
-                else
+                ++count;
+                }
+            start = end + 1;
+            }
+        job->line_count = count;
+        }
+    }
+
+
+static void strpool_internal_build_count( strpool_internal_build_job_t* job )
+    {
+    strpool_internal_build_t* build = job->build;
+    STRPOOL_U32 mask = (STRPOOL_U32)( build->pool->hash_capacity - 1 );
+    for( int i = 0; i < build->partition_count; ++i ) job->partition_counts[ i ] = 0;
+    for( int i = 0; i < job->line_count; ++i )
+        ++job->partition_counts[ ( job->lines[ i ].hash & mask ) >> build->partition_shift ];
+    }
+
+
+static void strpool_internal_build_scatter( strpool_internal_build_job_t* job )
+    {
+    strpool_internal_build_t* build = job->build;
+    STRPOOL_U32 mask = (STRPOOL_U32)( build->pool->hash_capacity - 1 );
+    for( int i = 0; i < job->line_count; ++i )
+        {
+        int partition = (int)( ( job->lines[ i ].hash & mask ) >> build->partition_shift );
+        build->lines[ job->partition_counts[ partition ]++ ] = job->lines[ i ];
+        }
+    }
+
+
+static void strpool_internal_build_insert( strpool_internal_build_job_t* job )
+    {
+    strpool_internal_build_t* build = job->build;
+    strpool_t* pool = build->pool;
+    strpool_internal_hash_slot_t* hash_table = pool->hash_table;
+    int mask = pool->hash_capacity - 1;
+    for( int partition = job->index; partition < build->partition_count; partition += build->job_count )
+        {
+        int range_end = ( partition + 1 ) << build->partition_shift;
+        int added = 0;
+        int size = 0;
+        for( int i = build->partition_start[ partition ]; i < build->partition_start[ partition + 1 ]; ++i )
+            {
+            strpool_internal_line_t* line = &build->lines[ i ];
+            char const* string = build->data + line->offset;
+            int base_slot = (int)( line->hash & (STRPOOL_U32) mask );
+            int base_count = hash_table[ base_slot ].base_count;
+            int slot = base_slot;
+            int first_free = -1;
+            int found = 0;
+            while( base_count > 0 && slot < range_end )
+                {
+                STRPOOL_U32 slot_hash = hash_table[ slot ].hash_key;
+                if( slot_hash == 0 && first_free < 0 ) first_free = slot;
+                if( slot_hash && (int)( slot_hash & (STRPOOL_U32) mask ) == base_slot )
                     {
-                    int free_list = block->free_list;
-                    int prev_list = -1;
-                    while( free_list >= 0 )
+                    --base_count;
+                    if( slot_hash == line->hash )
                         {
-                        strpool_internal_free_block_t* free_entry = 
-                            (strpool_internal_free_block_t*) ( pool->blocks[ i ].data + free_list );
-                        if( free_entry->size <= entry->size ) 
+                        // Slots claimed during the build refer to lines rather than entries, until the entries exist
+                        int index = hash_table[ slot ].entry_index;
+                        char const* existing = index < build->entry_base ? 
+                            pool->entries[ index ].data + 2 * sizeof( STRPOOL_U32 ) :
+                            build->data + build->lines[ index - build->entry_base ].offset;
+                        int existing_length = index < build->entry_base ? pool->entries[ index ].length :
+                            build->lines[ index - build->entry_base ].length;
+                        if( existing_length == line->length && 
+                            ( 
+                               ( !pool->ignore_case &&   STRPOOL_MEMCMP( existing, string, (size_t) line->length ) == 0 )
+                            || (  pool->ignore_case && STRPOOL_STRNICMP( existing, string, (size_t) line->length ) == 0 ) 
+                            ) 
+                          )
                             {
-                            strpool_internal_free_block_t* new_entry = (strpool_internal_free_block_t*) ( entry->data );
-                            if( prev_list < 0 )
-                                {
-                                new_entry->next = pool->blocks[ i ].free_list;
-                                pool->blocks[ i ].free_list = (int) ( entry->data - block->data );          
-                                }
-                            else
-                                {
-                                strpool_internal_free_block_t* prev_entry = 
-                                    (strpool_internal_free_block_t*) ( pool->blocks[ i ].data + prev_list );
-                                prev_entry->next = (int) ( entry->data - block->data );
-                                new_entry->next = free_entry->next;
-                                }
-                            new_entry->size = entry->size;
+                            found = 1;
                             break;
                             }
-                        prev_list = free_list;
-                        free_list = free_entry->next;
                         }
                     }
-                break;
+                ++slot;
+                }
+            if( found ) 
+                {
+                line->slot = -1;
+                continue;
+                }
+            if( first_free < 0 )
+                {
+                first_free = slot;
+                while( first_free < range_end && hash_table[ first_free ].hash_key ) ++first_free;
+                }
+            if( base_count > 0 || first_free >= range_end ) 
+                {
+                line->slot = -2; // Would have to probe past the end of the partition
+                continue;
                 }
+
+            hash_table[ first_free ].hash_key = line->hash;
+            hash_table[ first_free ].entry_index = build->entry_base + i;
+            ++hash_table[ base_slot ].base_count;
+            line->slot = first_free;
+            ++added;
+            size += strpool_internal_storage_size( pool, line->length + 1 + (int)( 2 * sizeof( STRPOOL_U32 ) ) );
+            STRPOOL_ASSERT( size > 0, "Partition too large" );
+            }
+        build->partition_added[ partition ] = added;
+        build->partition_size[ partition ] = size;
+        }
+    }
+
+
+static void strpool_internal_build_store( strpool_internal_build_job_t* job )
+    {
+    strpool_internal_build_t* build = job->build;
+    strpool_t* pool = build->pool;
+    for( int partition = job->index; partition < build->partition_count; partition += build->job_count )
+        {
+        int index = build->partition_added[ partition ];
+        char* data = build->partition_data[ partition ];
+        for( int i = build->partition_start[ partition ]; i < build->partition_start[ partition + 1 ]; ++i )
+            {
+            strpool_internal_line_t const* line = &build->lines[ i ];
+            if( line->slot < 0 ) continue;
+
+            int handle_index = build->handle_base + ( index - build->entry_base );
+            strpool_internal_entry_t* entry = &pool->entries[ index ];
+            entry->hash_slot = line->slot;
+            entry->handle_index = handle_index;
+            entry->data = data;
+            entry->size = strpool_internal_storage_size( pool, line->length + 1 + (int)( 2 * sizeof( STRPOOL_U32 ) ) );
+            entry->length = line->length;
+            entry->refcount = 0;
+            entry->shared = 0;
+            pool->handles[ handle_index ].entry_index = index;
+            pool->handles[ handle_index ].counter = 1;
+            #ifdef STRPOOL_STABLE_HANDLES
+                pool->handles[ handle_index ].data = data + 2 * sizeof( STRPOOL_U32 );
+                pool->handles[ handle_index ].length = line->length;
+            #endif
+            pool->hash_table[ line->slot ].entry_index = index;
+
+            *(STRPOOL_U32*)( data ) = line->hash;
+            *(STRPOOL_U32*)( data + sizeof( STRPOOL_U32 ) ) = (STRPOOL_U32) line->length;
+            STRPOOL_MEMCPY( data + 2 * sizeof( STRPOOL_U32 ), build->data + line->offset, (size_t) line->length );
+            data[ 2 * sizeof( STRPOOL_U32 ) + line->length ] = '\0';
+            data += entry->size;
+            ++index;
             }
+        }
+    }
+
 
-        // recycle handle
-        if( pool->handle_freelist_tail < 0 )
+static int strpool_internal_build_proc( void* user_data )
+    {
+    strpool_internal_build_job_t* job = (strpool_internal_build_job_t*) user_data;
+    switch( job->build->phase )
+        {
+        case 0: strpool_internal_build_split( job ); break;
+        case 1: strpool_internal_build_count( job ); break;
+        case 2: strpool_internal_build_scatter( job ); break;
+        case 3: strpool_internal_build_insert( job ); break;
+        case 4: strpool_internal_build_store( job ); break;
+        }
+    return 0;
+    }
+
+
+static void strpool_internal_build_run( strpool_internal_build_t* build, int phase )
+    {
+    build->phase = phase;
+    #ifdef STRPOOL_INTERNAL_THREADS
+        // The calling thread takes the first job itself
+        thread_ptr_t threads[ 64 ];
+        for( int i = 1; i < build->job_count; ++i )
+            threads[ i ] = thread_create( strpool_internal_build_proc, &build->jobs[ i ], "strpool_build", 
+                THREAD_STACK_SIZE_DEFAULT );
+        strpool_internal_build_proc( &build->jobs[ 0 ] );
+        for( int i = 1; i < build->job_count; ++i )
             {
-            STRPOOL_ASSERT( pool->handle_freelist_head < 0, "Freelist error" );
-            pool->handle_freelist_head = entry->handle_index;
-            pool->handle_freelist_tail = entry->handle_index;
+            thread_join( threads[ i ] );
+            thread_destroy( threads[ i ] );
             }
-        else
+    #else
+        for( int i = 0; i < build->job_count; ++i ) strpool_internal_build_proc( &build->jobs[ i ] );
+    #endif
+    }
+
+
+static int strpool_internal_processor_count( void )
+    {
+    #if !defined( STRPOOL_INTERNAL_THREADS )
+        return 1;
+    #elif defined( _WIN32 )
+        SYSTEM_INFO info;
+        GetSystemInfo( &info );
+        return (int) info.dwNumberOfProcessors;
+    #else
+        long count = sysconf( _SC_NPROCESSORS_ONLN );
+        return count > 0 ? (int) count : 1;
+    #endif
+    }
+
+
+int strpool_build_from_lines( strpool_t* pool, char const* data, STRPOOL_U64 size, int thread_count )
+    {
+    if( !data || size == 0 ) return 0;
+    strpool_internal_free_retired( pool );
+
+    // Use at most one thread per megabyte of input, as threads aren't free to start
+    if( thread_count <= 0 ) thread_count = strpool_internal_processor_count();
+    if( (STRPOOL_U64) thread_count > size / ( 1024 * 1024 ) + 1 ) thread_count = (int)( size / ( 1024 * 1024 ) + 1 );
+    if( thread_count > 64 ) thread_count = 64;
+    #ifndef STRPOOL_INTERNAL_THREADS
+        thread_count = 1;
+    #endif
+
+    strpool_internal_build_t build;
+    STRPOOL_MEMSET( &build, 0, sizeof( build ) );
+    build.pool = pool;
+    build.data = data;
+    build.job_count = thread_count;
+    strpool_internal_build_job_t jobs[ 64 ];
+    build.jobs = jobs;
+
+    // Chunks start at the beginning of a line, so no line is split between two jobs
+    STRPOOL_U64 start = 0;
+    for( int i = 0; i < thread_count; ++i )
+        {
+        STRPOOL_U64 end = i == thread_count - 1 ? size : ( size / (STRPOOL_U64) thread_count ) * (STRPOOL_U64)( i + 1 );
+        if( end < start ) end = start;
+        while( end < size && end > 0 && data[ end - 1 ] != '\n' ) ++end;
+        jobs[ i ].build = &build;
+        jobs[ i ].index = i;
+        jobs[ i ].start = start;
+        jobs[ i ].end = end;
+        jobs[ i ].lines = 0;
+        jobs[ i ].line_count = 0;
+        jobs[ i ].partition_counts = 0;
+        start = end;
+        }
+    strpool_internal_build_run( &build, 0 );
+
+    STRPOOL_U64 total = 0;
+    for( int i = 0; i < thread_count; ++i ) total += (STRPOOL_U64) jobs[ i ].line_count;
+    STRPOOL_ASSERT( total + (STRPOOL_U64) pool->entry_count < 0x40000000, "Too many strings" );
+    int line_count = (int) total;
+
+    // Size the tables for the case where every line is a new string
+    int needed = pool->entry_count + line_count;
+    int hash_capacity = pool->hash_capacity;
+    while( needed >= hash_capacity - hash_capacity / 3 ) hash_capacity *= 2;
+    if( hash_capacity != pool->hash_capacity ) strpool_internal_resize_hash_table( pool, hash_capacity );
+    while( pool->entry_capacity < needed ) strpool_internal_expand_entries( pool );
+    while( pool->handle_capacity < pool->handle_count + line_count ) strpool_internal_expand_handles( pool );
+
+    // Many more partitions than jobs, to even out the work, but with enough slots in each that few lines are deferred
+    int partition_bits = 0;
+    while( ( 1 << partition_bits ) < thread_count * 64 && ( 256 << partition_bits ) < hash_capacity ) ++partition_bits;
+    int capacity_bits = 0;
+    while( ( 1 << capacity_bits ) < hash_capacity ) ++capacity_bits;
+    build.partition_count = 1 << partition_bits;
+    build.partition_shift = capacity_bits - partition_bits;
+    build.entry_base = pool->entry_count;
+    build.handle_base = pool->handle_count;
+
+    int partition_count = build.partition_count;
+    int* counts = (int*) STRPOOL_MALLOC( pool->memctx, ( thread_count + 3 ) * ( partition_count + 1 ) * sizeof( int ) );
+    STRPOOL_ASSERT( counts, "Allocation failed" );
+    for( int i = 0; i < thread_count; ++i ) jobs[ i ].partition_counts = counts + i * ( partition_count + 1 );
+    build.partition_start = counts + thread_count * ( partition_count + 1 );
+    build.partition_added = build.partition_start + ( partition_count + 1 );
+    build.partition_size = build.partition_added + ( partition_count + 1 );
+    build.partition_data = (char**) STRPOOL_MALLOC( pool->memctx, partition_count * sizeof( char* ) );
+    STRPOOL_ASSERT( build.partition_data, "Allocation failed" );
+    build.lines = (strpool_internal_line_t*) STRPOOL_MALLOC( pool->memctx, 
+        ( line_count > 0 ? line_count : 1 ) * sizeof( *build.lines ) );
+    STRPOOL_ASSERT( build.lines, "Allocation failed" );
+
+    // Group the lines by partition, keeping them in input order within each partition
+    strpool_internal_build_run( &build, 1 );
+    int position = 0;
+    for( int partition = 0; partition < partition_count; ++partition )
+        {
+        build.partition_start[ partition ] = position;
+        for( int i = 0; i < thread_count; ++i )
+            {
+            int count = jobs[ i ].partition_counts[ partition ];
+            jobs[ i ].partition_counts[ partition ] = position;
+            position += count;
+            }
+        }
+    build.partition_start[ partition_count ] = position;
+    strpool_internal_build_run( &build, 2 );
+    for( int i = 0; i < thread_count; ++i ) STRPOOL_FREE( pool->memctx, jobs[ i ].lines );
+
+    strpool_internal_build_run( &build, 3 );
+
+    // Hand out entries, handles and storage for the new strings, partition by partition
+    int entry_index = pool->entry_count;
+    for( int partition = 0; partition < partition_count; ++partition )
+        {
+        int added = build.partition_added[ partition ];
+        build.partition_added[ partition ] = entry_index;
+        entry_index += added;
+        build.partition_data[ partition ] = 0;
+        if( build.partition_size[ partition ] > 0 )
             {
-            pool->handles[ pool->handle_freelist_tail ].entry_index = entry->handle_index;
-            pool->handle_freelist_tail = entry->handle_index;
+            int block = strpool_internal_add_block( pool, build.partition_size[ partition ] );
+            pool->blocks[ block ].tail = pool->blocks[ block ].data + build.partition_size[ partition ];
+            build.partition_data[ partition ] = pool->blocks[ block ].data;
             }
-        ++pool->handles[ entry->handle_index ].counter; // invalidate handle via counter
-        pool->handles[ entry->handle_index ].entry_index = -1;
+        }
+    strpool_internal_build_run( &build, 4 );
+
+    int added = entry_index - pool->entry_count;
+    pool->entry_count = entry_index;
+    pool->handle_count += added;
+    if( pool->prefix_index )
+        for( int i = build.handle_base; i < pool->handle_count; ++i ) strpool_internal_prefix_insert( pool, i );
+
+    // Lines which were deferred are added one by one, now that all the others are in place
+    for( int i = 0; i < line_count; ++i )
+        {
+        strpool_internal_line_t const* line = &build.lines[ i ];
+        if( line->slot != -2 ) continue;
+        int count = pool->entry_count;
+        strpool_internal_inject( pool, line->hash, data + line->offset, line->length );
+        added += pool->entry_count - count;
+        }
+
+    STRPOOL_FREE( pool->memctx, build.lines );
+    STRPOOL_FREE( pool->memctx, build.partition_data );
+    STRPOOL_FREE( pool->memctx, counts );
+    return added;
+    }
 
-        // recycle hash slot
-        STRPOOL_U32 hash = pool->hash_table[ entry->hash_slot ].hash_key;
-        int base_slot = (int)( hash & (STRPOOL_U32)( pool->hash_capacity - 1 ) );
-        STRPOOL_ASSERT( hash, "Invalid hash" );
-        --pool->hash_table[ base_slot ].base_count;
-        pool->hash_table[ entry->hash_slot ].hash_key = 0;
+
+static void strpool_internal_recycle_handle( strpool_t* pool, int handle_index )
+    {
+    if( pool->handle_freelist_tail < 0 )
+        {
+        STRPOOL_ASSERT( pool->handle_freelist_head < 0, "Freelist error" );
+        pool->handle_freelist_head = handle_index;
+        pool->handle_freelist_tail = handle_index;
+        }
+    else
+        {
+        pool->handles[ pool->handle_freelist_tail ].entry_index = handle_index;
+        pool->handle_freelist_tail = handle_index;
+        }
+    ++pool->handles[ handle_index ].counter; // invalidate handle via counter
+    pool->handles[ handle_index ].entry_index = -1;
+    #ifdef STRPOOL_STABLE_HANDLES
+        pool->handles[ handle_index ].data = 0;
+        pool->handles[ handle_index ].length = 0;
+    #endif
+    }
+
+
+static void strpool_internal_recycle_hash_slot( strpool_t* pool, int slot )
+    {
+    STRPOOL_U32 hash = pool->hash_table[ slot ].hash_key;
+    int base_slot = (int)( hash & (STRPOOL_U32)( pool->hash_capacity - 1 ) );
+    STRPOOL_ASSERT( hash, "Invalid hash" );
+    --pool->hash_table[ base_slot ].base_count;
+    pool->hash_table[ slot ].hash_key = 0;
+    }
+
+
+void strpool_discard( strpool_t* pool, STRPOOL_U64 handle )
+    {   
+    strpool_internal_entry_t* entry = strpool_internal_get_entry( pool, handle );
+    if( entry && entry->refcount == 0 )
+        {
+        if( pool->prefix_index ) strpool_internal_prefix_remove( pool, entry->handle_index );
+        int entry_index = pool->handles[ entry->handle_index ].entry_index;
+
+        // recycle string mem, unless it is stored inside another string, or holds other strings
+        if( entry->size == 0 )
+            --pool->shared_count;
+        else if( !entry->shared )
+            {
+            for( int i = 0; i < pool->block_count; ++i )
+                {
+                strpool_internal_block_t* block = &pool->blocks[ i ];
+                if( entry->data >= block->data && entry->data <= block->tail )
+                    {
+                    if( block->free_list < 0 )
+                        {
+                        strpool_internal_free_block_t* new_entry = (strpool_internal_free_block_t*) ( entry->data );
+                        block->free_list = (int) ( entry->data - block->data );
+                        new_entry->next = -1;
+                        new_entry->size = entry->size;
+                        }
+                    else
+                        {
+                        int free_list = block->free_list;
+                        int prev_list = -1;
+                        while( free_list >= 0 )
+                            {
+                            strpool_internal_free_block_t* free_entry = 
+                                (strpool_internal_free_block_t*) ( pool->blocks[ i ].data + free_list );
+                            if( free_entry->size <= entry->size ) 
+                                {
+                                strpool_internal_free_block_t* new_entry = (strpool_internal_free_block_t*) ( entry->data );
+                                if( prev_list < 0 )
+                                    {
+                                    new_entry->next = pool->blocks[ i ].free_list;
+                                    pool->blocks[ i ].free_list = (int) ( entry->data - block->data );          
+                                    }
+                                else
+                                    {
+                                    strpool_internal_free_block_t* prev_entry = 
+                                        (strpool_internal_free_block_t*) ( pool->blocks[ i ].data + prev_list );
+                                    prev_entry->next = (int) ( entry->data - block->data );
+                                    new_entry->next = free_entry->next;
+                                    }
+                                new_entry->size = entry->size;
+                                break;
+                                }
+                            prev_list = free_list;
+                            free_list = free_entry->next;
+                            }
+                        }
+                    break;
+                    }
+                }
+            }
+
+        strpool_internal_recycle_handle( pool, entry->handle_index );
+        strpool_internal_recycle_hash_slot( pool, entry->hash_slot );
 
         // recycle entry
         if( entry_index != pool->entry_count - 1 )
@@ -1152,6 +2643,179 @@ void strpool_discard( strpool_t* pool, STRPOOL_U64 handle )
     }
 
 
+// Fills `order` with the indices of all blocks, sorted by the address of their storage, for use with 
+// `strpool_internal_find_block`. There are usually few blocks, so a simple insertion sort is fine.
+static void strpool_internal_sort_blocks( strpool_t const* pool, int* order )
+    {
+    for( int i = 0; i < pool->block_count; ++i )
+        {
+        int j = i;
+        while( j > 0 && pool->blocks[ order[ j - 1 ] ].data > pool->blocks[ i ].data ) 
+            {
+            order[ j ] = order[ j - 1 ];
+            --j;
+            }
+        order[ j ] = i;
+        }
+    }
+
+
+// Binary search for the block holding the string storage at `data`
+static int strpool_internal_find_block( strpool_t const* pool, int const* order, char const* data )
+    {
+    int low = 0;
+    int high = pool->block_count - 1;
+    while( low < high )
+        {
+        int mid = ( low + high + 1 ) / 2;
+        if( pool->blocks[ order[ mid ] ].data <= data ) low = mid; else high = mid - 1;
+        }
+    STRPOOL_ASSERT( data >= pool->blocks[ order[ low ] ].data && data < pool->blocks[ order[ low ] ].tail, 
+        "Invalid block" );
+    return order[ low ];
+    }
+
+
+// Relinks the free list of a block so that it is sorted by size, largest first, as expected by 
+// `strpool_internal_get_data_storage`. All free slot sizes are powers of two, so it is done as a single bucket pass.
+// Returns the total number of free bytes in the block.
+static int strpool_internal_sort_free_list( strpool_internal_block_t* block )
+    {
+    int heads[ 32 ];
+    int tails[ 32 ];
+    for( int i = 0; i < 32; ++i ) { heads[ i ] = -1; tails[ i ] = -1; }
+
+    int free_size = 0;
+    int free_list = block->free_list;
+    while( free_list >= 0 )
+        {
+        strpool_internal_free_block_t* free_entry = (strpool_internal_free_block_t*) ( block->data + free_list );
+        int next = free_entry->next;
+        int bucket = 0;
+        while( bucket < 31 && ( (STRPOOL_U32) free_entry->size >> ( bucket + 1 ) ) ) ++bucket;
+        free_entry->next = -1;
+        if( tails[ bucket ] < 0 )
+            heads[ bucket ] = free_list;
+        else
+            ( (strpool_internal_free_block_t*) ( block->data + tails[ bucket ] ) )->next = free_list;
+        tails[ bucket ] = free_list;
+        free_size += free_entry->size;
+        free_list = next;
+        }
+
+    block->free_list = -1;
+    int tail = -1;
+    for( int i = 31; i >= 0; --i )
+        {
+        if( heads[ i ] < 0 ) continue;
+        if( tail < 0 )
+            block->free_list = heads[ i ];
+        else
+            ( (strpool_internal_free_block_t*) ( block->data + tail ) )->next = heads[ i ];
+        tail = tails[ i ];
+        }
+
+    return free_size;
+    }
+
+
+void strpool_discard_many( strpool_t* pool, STRPOOL_U64 const* handles, int count )
+    {
+    strpool_internal_free_retired( pool );
+
+    // Mark the entries to remove. A marked entry no longer has a reference count of 0, so a handle which occurs more 
+    // than once in the array will only be processed the first time.
+    int removed = 0;
+    for( int i = 0; i < count; ++i )
+        {
+        strpool_internal_entry_t* entry = strpool_internal_get_entry( pool, handles[ i ] );
+        if( entry && entry->refcount == 0 )
+            {
+            entry->refcount = -1;
+            ++removed;
+            }
+        }
+    if( removed == 0 ) return;
+
+    if( pool->prefix_index ) strpool_internal_prefix_filter( pool );
+
+    int block_count = pool->block_count;
+    int* block_order = (int*) STRPOOL_MALLOC( pool->memctx, 2 * block_count * sizeof( int ) );
+    STRPOOL_ASSERT( block_order, "Allocation failed" );
+    strpool_internal_sort_blocks( pool, block_order );
+    int* block_dirty = block_order + block_count;
+    for( int i = 0; i < block_count; ++i ) block_dirty[ i ] = 0;
+
+    // Compact the entry array in a single pass, releasing the handles and hash slots of removed entries, and handing 
+    // their storage back to their blocks
+    int index = 0;
+    for( int i = 0; i < pool->entry_count; ++i )
+        {
+        strpool_internal_entry_t* entry = &pool->entries[ i ];
+        if( entry->refcount < 0 )
+            {
+            strpool_internal_recycle_handle( pool, entry->handle_index );
+            strpool_internal_recycle_hash_slot( pool, entry->hash_slot );
+            if( entry->size == 0 )
+                {
+                --pool->shared_count;
+                }
+            else if( !entry->shared )
+                {
+                int block_index = strpool_internal_find_block( pool, block_order, entry->data );
+                strpool_internal_block_t* block = &pool->blocks[ block_index ];
+                strpool_internal_free_block_t* free_entry = (strpool_internal_free_block_t*) ( entry->data );
+                free_entry->size = entry->size;
+                free_entry->next = block->free_list;
+                block->free_list = (int) ( entry->data - block->data );
+                block_dirty[ block_index ] = 1;
+                }
+            }
+        else
+            {
+            if( index != i )
+                {
+                pool->entries[ index ] = *entry;
+                pool->hash_table[ entry->hash_slot ].entry_index = index;
+                pool->handles[ entry->handle_index ].entry_index = index;
+                }
+            ++index;
+            }
+        }
+    pool->entry_count = index;
+
+    // Restore free list order, and deallocate blocks where every byte used is now free. The current block is kept, but
+    // reset, so the space can be used again for new strings.
+    int block_index = 0;
+    for( int i = 0; i < block_count; ++i )
+        {
+        strpool_internal_block_t* block = &pool->blocks[ i ];
+        if( block_dirty[ i ] && strpool_internal_sort_free_list( block ) == (int) ( block->tail - block->data ) )
+            {
+            if( i != pool->current_block )
+                {
+                strpool_internal_release( pool, block->data );
+                continue;
+                }
+            block->tail = block->data;
+            block->free_list = -1;
+            }
+        if( i == pool->current_block ) pool->current_block = block_index;
+        pool->blocks[ block_index++ ] = *block;
+        }
+    pool->block_count = block_index;
+    STRPOOL_FREE( pool->memctx, block_order );
+
+    // Shrink the hash table if it is mostly empty
+    if( pool->entry_count * 4 < pool->hash_capacity )
+        {
+        int hash_capacity = (int) strpool_internal_pow2ceil( (STRPOOL_U32) pool->entry_count * 2 );
+        if( hash_capacity < pool->initial_entry_capacity * 2 ) hash_capacity = pool->initial_entry_capacity * 2;
+        if( hash_capacity < pool->hash_capacity ) strpool_internal_resize_hash_table( pool, hash_capacity );
+        }
+    }
+
+
 int strpool_incref( strpool_t* pool, STRPOOL_U64 handle )
     {
     strpool_internal_entry_t* entry = strpool_internal_get_entry( pool, handle );
@@ -1185,46 +2849,472 @@ int strpool_getref( strpool_t* pool, STRPOOL_U64 handle )
     }
 
 
-int strpool_isvalid( strpool_t const* pool, STRPOOL_U64 handle )
+#ifdef STRPOOL_STABLE_HANDLES
+
+    int strpool_isvalid( strpool_t const* pool, STRPOOL_U64 handle )
+        {
+        return strpool_internal_get_handle( pool, handle ) ? 1 : 0;
+        }
+
+
+    char const* strpool_cstr( strpool_t const* pool, STRPOOL_U64 handle )
+        {
+        strpool_internal_handle_t const* record = strpool_internal_get_handle( pool, handle );
+        if( record ) return record->data;
+        return NULL;
+        }
+
+
+    int strpool_length( strpool_t const* pool, STRPOOL_U64 handle )
+        {
+        strpool_internal_handle_t const* record = strpool_internal_get_handle( pool, handle );
+        if( record ) return record->length;
+        return 0;
+        }
+
+#else
+
+    int strpool_isvalid( strpool_t const* pool, STRPOOL_U64 handle )
+        {
+        strpool_internal_entry_t const* entry = strpool_internal_get_entry( pool, handle );
+        if( entry ) return 1;
+        return 0;
+        }
+
+
+    char const* strpool_cstr( strpool_t const* pool, STRPOOL_U64 handle )
+        {
+        strpool_internal_entry_t const* entry = strpool_internal_get_entry( pool, handle );
+        if( entry ) return entry->data + 2 * sizeof( STRPOOL_U32 ); // Skip leading hash value
+        return NULL;
+        }
+
+
+    int strpool_length( strpool_t const* pool, STRPOOL_U64 handle )
+        {
+        strpool_internal_entry_t const* entry = strpool_internal_get_entry( pool, handle );
+        if( entry ) return entry->length;
+        return 0;
+        }
+
+#endif /* STRPOOL_STABLE_HANDLES */
+
+
+int strpool_find_prefix( strpool_t const* pool, char const* prefix, int length, 
+    int (*callback)( void* user_data, STRPOOL_U64 handle, char const* string, int length ), void* user_data )
     {
-    strpool_internal_entry_t const* entry = strpool_internal_get_entry( pool, handle );
-    if( entry ) return 1;
-    return 0;
+    if( !pool->prefix_index ) return 0;
+    int const* main = pool->prefix_main;
+    int const* tail = pool->prefix_tail;
+    int main_pos = strpool_internal_prefix_search( pool, main, pool->prefix_main_count, prefix, length, 0 );
+    int main_end = strpool_internal_prefix_search( pool, main, pool->prefix_main_count, prefix, length, 1 );
+    int tail_pos = strpool_internal_prefix_search( pool, tail, pool->prefix_tail_count, prefix, length, 0 );
+    int tail_end = strpool_internal_prefix_search( pool, tail, pool->prefix_tail_count, prefix, length, 1 );
+
+    // Merge the matches from both runs, to report them in sorted order
+    int found = 0;
+    while( main_pos < main_end || tail_pos < tail_end )
+        {
+        if( main_pos < main_end && main[ main_pos ] < 0 ) { ++main_pos; continue; }
+        int main_length = 0;
+        int tail_length = 0;
+        char const* main_string = main_pos < main_end ? 
+            strpool_internal_handle_string( pool, main[ main_pos ], &main_length ) : NULL;
+        char const* tail_string = tail_pos < tail_end ? 
+            strpool_internal_handle_string( pool, tail[ tail_pos ], &tail_length ) : NULL;
+        int use_main = !tail_string || ( main_string && 
+            strpool_internal_compare( pool, main_string, main_length, tail_string, tail_length ) < 0 );
+        int handle_index = use_main ? main[ main_pos++ ] : tail[ tail_pos++ ];
+
+        ++found;
+        STRPOOL_U64 handle = strpool_internal_make_handle( handle_index, pool->handles[ handle_index ].counter, 
+            pool->index_mask, pool->counter_shift, pool->counter_mask );
+        if( !callback( user_data, handle, use_main ? main_string : tail_string, use_main ? main_length : tail_length ) ) 
+            break;
+        }
+    return found;
     }
 
 
-char const* strpool_cstr( strpool_t const* pool, STRPOOL_U64 handle )
+int strpool_count_prefix( strpool_t const* pool, char const* prefix, int length )
     {
-    strpool_internal_entry_t const* entry = strpool_internal_get_entry( pool, handle );
-    if( entry ) return entry->data + 2 * sizeof( STRPOOL_U32 ); // Skip leading hash value
-    return NULL;
+    if( !pool->prefix_index ) return 0;
+    int main_pos = strpool_internal_prefix_search( pool, pool->prefix_main, pool->prefix_main_count, prefix, length, 0 );
+    int main_end = strpool_internal_prefix_search( pool, pool->prefix_main, pool->prefix_main_count, prefix, length, 1 );
+    int count = strpool_internal_prefix_search( pool, pool->prefix_tail, pool->prefix_tail_count, prefix, length, 1 ) 
+        - strpool_internal_prefix_search( pool, pool->prefix_tail, pool->prefix_tail_count, prefix, length, 0 );
+    for( int i = main_pos; i < main_end; ++i ) if( pool->prefix_main[ i ] >= 0 ) ++count;
+    return count;
     }
 
 
-int strpool_length( strpool_t const* pool, STRPOOL_U64 handle )
+#ifndef STRPOOL_NO_IMAGE
+
+#define STRPOOL_INTERNAL_IMAGE_MAGIC 0x4d495053U // "SPIM", also used to detect endianness mismatch
+#define STRPOOL_INTERNAL_IMAGE_VERSION 2U
+
+
+static STRPOOL_U64 strpool_internal_image_align( STRPOOL_U64 offset )
     {
-    strpool_internal_entry_t const* entry = strpool_internal_get_entry( pool, handle );
-    if( entry ) return entry->length;
-    return 0;
+    return ( offset + 63U ) & ~(STRPOOL_U64) 63U;
+    }
+
+
+static int strpool_internal_image_write( FILE* fp, STRPOOL_U64* offset, void const* data, STRPOOL_U64 size )
+    {
+    static char const zeros[ 64 ] = { 0 };
+    STRPOOL_U64 aligned = strpool_internal_image_align( *offset );
+    if( aligned != *offset && fwrite( zeros, (size_t)( aligned - *offset ), 1, fp ) != 1 ) return 0;
+    if( size > 0 && fwrite( data, (size_t) size, 1, fp ) != 1 ) return 0;
+    *offset = aligned + size;
+    return 1;
+    }
+
+
+int strpool_save_image( strpool_t const* pool, char const* filename )
+    {
+    int* block_order = (int*) STRPOOL_MALLOC( pool->memctx, pool->block_count * sizeof( int ) );
+    STRPOOL_ASSERT( block_order, "Allocation failed" );
+    strpool_internal_sort_blocks( pool, block_order );
+    strpool_internal_image_block_t* blocks = (strpool_internal_image_block_t*) STRPOOL_MALLOC( pool->memctx, 
+        pool->block_count * sizeof( *blocks ) );
+    STRPOOL_ASSERT( blocks, "Allocation failed" );
+
+    // Lay out the image: header, hash table, entries, handles, block descriptors, and then the used part of each block
+    strpool_internal_image_header_t header;
+    STRPOOL_MEMSET( &header, 0, sizeof( header ) );
+    header.magic = STRPOOL_INTERNAL_IMAGE_MAGIC;
+    header.version = STRPOOL_INTERNAL_IMAGE_VERSION;
+    header.pointer_size = (STRPOOL_U32) sizeof( void* );
+    header.entry_size = (STRPOOL_U32) sizeof( strpool_internal_entry_t );
+    header.handle_size = (STRPOOL_U32) sizeof( strpool_internal_handle_t );
+    header.ignore_case = pool->ignore_case;
+    header.counter_shift = pool->counter_shift;
+    header.counter_mask = pool->counter_mask;
+    header.index_mask = pool->index_mask;
+    header.hash_capacity = pool->hash_capacity;
+    header.entry_count = pool->entry_count;
+    header.handle_count = pool->handle_count;
+    header.handle_freelist_head = pool->handle_freelist_head;
+    header.handle_freelist_tail = pool->handle_freelist_tail;
+    header.block_count = pool->block_count;
+    header.prefix_index = pool->prefix_index;
+    header.prefix_main_count = pool->prefix_main_count;
+    header.prefix_main_dead = pool->prefix_main_dead;
+    header.prefix_tail_count = pool->prefix_tail_count;
+
+    STRPOOL_U64 offset = sizeof( header );
+    header.hash_table_offset = strpool_internal_image_align( offset );
+    offset = header.hash_table_offset + pool->hash_capacity * sizeof( *pool->hash_table );
+    header.entries_offset = strpool_internal_image_align( offset );
+    offset = header.entries_offset + pool->entry_count * sizeof( *pool->entries );
+    header.handles_offset = strpool_internal_image_align( offset );
+    offset = header.handles_offset + pool->handle_count * sizeof( *pool->handles );
+    header.blocks_offset = strpool_internal_image_align( offset );
+    offset = header.blocks_offset + pool->block_count * sizeof( *blocks );
+    header.prefix_offset = strpool_internal_image_align( offset );
+    offset = header.prefix_offset + ( pool->prefix_main_count + pool->prefix_tail_count ) * sizeof( int );
+    for( int i = 0; i < pool->block_count; ++i )
+        {
+        blocks[ i ].offset = strpool_internal_image_align( offset );
+        blocks[ i ].size = (int)( pool->blocks[ i ].tail - pool->blocks[ i ].data );
+        blocks[ i ].free_list = pool->blocks[ i ].free_list;
+        offset = blocks[ i ].offset + blocks[ i ].size;
+        }
+    header.image_size = offset;
+
+    FILE* fp = fopen( filename, "wb" );
+    int result = fp != 0;
+    offset = 0;
+    if( result ) result = strpool_internal_image_write( fp, &offset, &header, sizeof( header ) );
+    if( result ) result = strpool_internal_image_write( fp, &offset, pool->hash_table, 
+        pool->hash_capacity * sizeof( *pool->hash_table ) );
+
+    // Entries are written in batches, with their data pointers replaced by offsets from the start of the image
+    if( result ) result = strpool_internal_image_write( fp, &offset, NULL, 0 ); // padding up to the entries
+    strpool_internal_entry_t batch[ 256 ];
+    for( int i = 0; result && i < pool->entry_count; i += 256 )
+        {
+        int count = pool->entry_count - i < 256 ? pool->entry_count - i : 256;
+        for( int j = 0; j < count; ++j )
+            {
+            strpool_internal_entry_t const* entry = &pool->entries[ i + j ];
+            int block = strpool_internal_find_block( pool, block_order, entry->data );
+            batch[ j ] = *entry;
+            batch[ j ].data = (char*)(size_t)( blocks[ block ].offset + ( entry->data - pool->blocks[ block ].data ) );
+            }
+        result = fwrite( batch, count * sizeof( *batch ), 1, fp ) == 1;
+        offset += count * sizeof( *batch );
+        }
+
+    #ifdef STRPOOL_STABLE_HANDLES
+        // Handle records hold string pointers as well, which are converted the same way as for entries
+        if( result ) result = strpool_internal_image_write( fp, &offset, NULL, 0 );
+        strpool_internal_handle_t handle_batch[ 256 ];
+        for( int i = 0; result && i < pool->handle_count; i += 256 )
+            {
+            int count = pool->handle_count - i < 256 ? pool->handle_count - i : 256;
+            for( int j = 0; j < count; ++j )
+                {
+                strpool_internal_handle_t const* handle = &pool->handles[ i + j ];
+                handle_batch[ j ] = *handle;
+                if( handle->data )
+                    {
+                    int block = strpool_internal_find_block( pool, block_order, handle->data );
+                    handle_batch[ j ].data = (char*)(size_t)( blocks[ block ].offset + 
+                        ( handle->data - pool->blocks[ block ].data ) );
+                    }
+                }
+            result = fwrite( handle_batch, count * sizeof( *handle_batch ), 1, fp ) == 1;
+            offset += count * sizeof( *handle_batch );
+            }
+    #else
+        if( result ) result = strpool_internal_image_write( fp, &offset, pool->handles, 
+            pool->handle_count * sizeof( *pool->handles ) );
+    #endif
+    if( result ) result = strpool_internal_image_write( fp, &offset, blocks, pool->block_count * sizeof( *blocks ) );
+    if( result ) result = strpool_internal_image_write( fp, &offset, pool->prefix_main, 
+        pool->prefix_main_count * sizeof( int ) );
+    if( result && pool->prefix_tail_count > 0 ) 
+        result = fwrite( pool->prefix_tail, pool->prefix_tail_count * sizeof( int ), 1, fp ) == 1;
+    offset += pool->prefix_tail_count * sizeof( int );
+    for( int i = 0; result && i < pool->block_count; ++i )
+        result = strpool_internal_image_write( fp, &offset, pool->blocks[ i ].data, (STRPOOL_U64) blocks[ i ].size );
+    STRPOOL_ASSERT( !result || offset == header.image_size, "Invalid image size" );
+
+    if( fp && fclose( fp ) != 0 ) result = 0;
+    STRPOOL_FREE( pool->memctx, blocks );
+    STRPOOL_FREE( pool->memctx, block_order );
+    return result;
+    }
+
+
+static void strpool_internal_unmap_image( strpool_t* pool )
+    {
+    if( !pool->image ) return;
+    #if defined( _WIN32 )
+        UnmapViewOfFile( pool->image );
+    #else
+        munmap( pool->image, (size_t) pool->image_size );
+    #endif
+    pool->image = 0;
+    pool->image_size = 0;
+    }
+
+
+// Maps the whole file as private copy-on-write pages, so the pool can modify its tables in place without the changes 
+// ever reaching the file
+static void* strpool_internal_map_file( char const* filename, STRPOOL_U64* size )
+    {
+    #if defined( _WIN32 )
+        HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 
+            NULL );
+        if( file == INVALID_HANDLE_VALUE ) return 0;
+        LARGE_INTEGER file_size;
+        void* ptr = 0;
+        if( GetFileSizeEx( file, &file_size ) && file_size.QuadPart > 0 )
+            {
+            HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+            if( mapping )
+                {
+                ptr = MapViewOfFile( mapping, FILE_MAP_COPY, 0, 0, 0 );
+                CloseHandle( mapping ); // the view keeps the mapping alive
+                }
+            }
+        CloseHandle( file );
+        *size = ptr ? (STRPOOL_U64) file_size.QuadPart : 0;
+        return ptr;
+    #else
+        int fd = open( filename, O_RDONLY );
+        if( fd < 0 ) return 0;
+        struct stat st;
+        void* ptr = 0;
+        if( fstat( fd, &st ) == 0 && st.st_size > 0 )
+            {
+            ptr = mmap( NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+            if( ptr == MAP_FAILED ) ptr = 0;
+            }
+        close( fd ); // the mapping stays valid after the file is closed
+        *size = ptr ? (STRPOOL_U64) st.st_size : 0;
+        return ptr;
+    #endif
+    }
+
+
+int strpool_map_image( strpool_t* pool, strpool_config_t const* config, char const* filename )
+    {
+    STRPOOL_U64 image_size = 0;
+    char* image = (char*) strpool_internal_map_file( filename, &image_size );
+    if( !image ) return 0;
+
+    strpool_internal_image_header_t const* header = (strpool_internal_image_header_t const*) image;
+    int valid = image_size >= sizeof( *header ) 
+        && header->magic == STRPOOL_INTERNAL_IMAGE_MAGIC 
+        && header->version == STRPOOL_INTERNAL_IMAGE_VERSION
+        && header->pointer_size == (STRPOOL_U32) sizeof( void* ) 
+        && header->entry_size == (STRPOOL_U32) sizeof( strpool_internal_entry_t )
+        && header->handle_size == (STRPOOL_U32) sizeof( strpool_internal_handle_t )
+        && header->image_size == image_size
+        && header->hash_capacity > 0 && header->block_count > 0
+        && header->hash_table_offset + header->hash_capacity * sizeof( strpool_internal_hash_slot_t ) <= image_size
+        && header->entries_offset + header->entry_count * sizeof( strpool_internal_entry_t ) <= image_size
+        && header->handles_offset + header->handle_count * sizeof( strpool_internal_handle_t ) <= image_size
+        && header->blocks_offset + header->block_count * sizeof( strpool_internal_image_block_t ) <= image_size
+        && header->prefix_offset + ( header->prefix_main_count + header->prefix_tail_count ) * sizeof( int ) <= image_size;
+    if( !valid )
+        {
+        #if defined( _WIN32 )
+            UnmapViewOfFile( image );
+        #else
+            munmap( image, (size_t) image_size );
+        #endif
+        return 0;
+        }
+
+    if( !config ) config = &strpool_default_config;
+    strpool_internal_apply_config( pool, config );
+    pool->ignore_case = header->ignore_case;
+    pool->prefix_index = header->prefix_index;
+    pool->counter_shift = header->counter_shift;
+    pool->counter_mask = header->counter_mask;
+    pool->index_mask = header->index_mask;
+    pool->image = image;
+    pool->image_size = image_size;
+
+    // The tables are used in place, right where they are in the mapped image
+    pool->hash_table = (strpool_internal_hash_slot_t*) ( image + header->hash_table_offset );
+    pool->hash_capacity = header->hash_capacity;
+    pool->entries = (strpool_internal_entry_t*) ( image + header->entries_offset );
+    pool->entry_capacity = header->entry_count;
+    pool->entry_count = header->entry_count;
+    pool->handles = (strpool_internal_handle_t*) ( image + header->handles_offset );
+    pool->handle_capacity = header->handle_count;
+    pool->handle_count = header->handle_count;
+    pool->handle_freelist_head = header->handle_freelist_head;
+    pool->handle_freelist_tail = header->handle_freelist_tail;
+
+    // Empty tables can't be grown by doubling, so those get a fresh allocation instead
+    if( pool->entry_capacity == 0 )
+        {
+        pool->entry_capacity = pool->initial_entry_capacity;
+        pool->entries = (strpool_internal_entry_t*) STRPOOL_MALLOC( pool->memctx, 
+            pool->entry_capacity * sizeof( *pool->entries ) );
+        STRPOOL_ASSERT( pool->entries, "Allocation failed" );
+        }
+    if( pool->handle_capacity == 0 )
+        {
+        pool->handle_capacity = pool->initial_entry_capacity;
+        pool->handles = (strpool_internal_handle_t*) STRPOOL_MALLOC( pool->memctx, 
+            pool->handle_capacity * sizeof( *pool->handles ) );
+        STRPOOL_ASSERT( pool->handles, "Allocation failed" );
+        }
+
+    for( int i = 0; i < pool->entry_count; ++i )
+        {
+        pool->entries[ i ].data = image + (size_t) pool->entries[ i ].data;
+        if( pool->entries[ i ].size == 0 ) ++pool->shared_count;
+        }
+    #ifdef STRPOOL_STABLE_HANDLES
+        for( int i = 0; i < header->handle_count; ++i )
+            if( pool->handles[ i ].data ) pool->handles[ i ].data = image + (size_t) pool->handles[ i ].data;
+    #endif
+
+    // Each saved block becomes a full block of its own. Its free slots can still be reused, but new strings will go to 
+    // newly allocated blocks. Empty blocks are dropped, as they would be pointing at the end of the image.
+    pool->block_capacity = pool->initial_block_capacity;
+    while( pool->block_capacity < header->block_count ) pool->block_capacity *= 2;
+    pool->blocks = (strpool_internal_block_t*) STRPOOL_MALLOC( pool->memctx, 
+        pool->block_capacity * sizeof( *pool->blocks ) );
+    STRPOOL_ASSERT( pool->blocks, "Allocation failed" );
+    pool->block_count = 0;
+    strpool_internal_image_block_t const* blocks = (strpool_internal_image_block_t const*)( image + header->blocks_offset );
+    for( int i = 0; i < header->block_count; ++i )
+        {
+        if( blocks[ i ].size == 0 ) continue;
+        strpool_internal_block_t* block = &pool->blocks[ pool->block_count++ ];
+        block->capacity = blocks[ i ].size;
+        block->data = image + blocks[ i ].offset;
+        block->tail = block->data + blocks[ i ].size;
+        block->free_list = blocks[ i ].free_list;
+        }
+    if( pool->block_count == 0 ) 
+        pool->current_block = strpool_internal_add_block( pool, pool->block_size );
+    else
+        pool->current_block = pool->block_count - 1;
+
+    // The main run of the prefix index is used in place, while the tail run is copied, as it is frequently modified
+    if( pool->prefix_index )
+        {
+        pool->prefix_main = header->prefix_main_count > 0 ? (int*)( image + header->prefix_offset ) : NULL;
+        pool->prefix_main_count = header->prefix_main_count;
+        pool->prefix_main_dead = header->prefix_main_dead;
+        pool->prefix_tail_capacity = 256;
+        while( pool->prefix_tail_capacity < header->prefix_tail_count ) pool->prefix_tail_capacity *= 2;
+        pool->prefix_tail = (int*) STRPOOL_MALLOC( pool->memctx, pool->prefix_tail_capacity * sizeof( int ) );
+        STRPOOL_ASSERT( pool->prefix_tail, "Allocation failed" );
+        STRPOOL_MEMCPY( pool->prefix_tail, image + header->prefix_offset + header->prefix_main_count * sizeof( int ), 
+            header->prefix_tail_count * sizeof( int ) );
+        pool->prefix_tail_count = header->prefix_tail_count;
+        }
+    return 1;
+    }
+
+#else
+
+    static void strpool_internal_unmap_image( strpool_t* pool ) { (void) pool; }
+
+#endif /* STRPOOL_NO_IMAGE */
+
+
+void strpool_iter_begin( strpool_t const* pool, strpool_iter_t* iter )
+    {
+    iter->index = 0;
+    iter->end = strpool_internal_load_int( &pool->entry_count );
+    }
+
+
+void strpool_iter_chunk( strpool_t const* pool, strpool_iter_t* iter, int chunk, int chunk_count )
+    {
+    STRPOOL_ASSERT( chunk_count > 0 && chunk >= 0 && chunk < chunk_count, "Invalid chunk" );
+    STRPOOL_U64 count = (STRPOOL_U64) strpool_internal_load_int( &pool->entry_count );
+    iter->index = (int) ( ( count * (STRPOOL_U64) chunk ) / (STRPOOL_U64) chunk_count );
+    iter->end = (int) ( ( count * (STRPOOL_U64) ( chunk + 1 ) ) / (STRPOOL_U64) chunk_count );
+    }
+
+
+int strpool_iter_next( strpool_t const* pool, strpool_iter_t* iter, STRPOOL_U64* handle, char const** string, 
+    int* length )
+    {
+    if( iter->index >= iter->end ) return 0;
+
+    strpool_internal_entry_t const* entry = &pool->entries[ iter->index++ ];
+    if( handle ) 
+        *handle = strpool_internal_make_handle( entry->handle_index, pool->handles[ entry->handle_index ].counter, 
+            pool->index_mask, pool->counter_shift, pool->counter_mask );
+    if( string ) *string = entry->data + 2 * sizeof( STRPOOL_U32 );
+    if( length ) *length = entry->length;
+    return 1;
     }
 
 
 char* strpool_collate( strpool_t const* pool, int* count )
     {
-    int size = 0;
-    for( int i = 0; i < pool->entry_count; ++i ) size += pool->entries[ i ].length + 1;
+    size_t size = 0;
+    for( int i = 0; i < pool->entry_count; ++i ) size += (size_t) pool->entries[ i ].length + 1;
     if( size == 0 ) return NULL;
 
-    char* strings = (char*) STRPOOL_MALLOC( pool->memctx, (size_t) size );
+    char* strings = (char*) STRPOOL_MALLOC( pool->memctx, size );
     STRPOOL_ASSERT( strings, "Allocation failed" );
     *count = pool->entry_count;
     char* ptr = strings;
-    for( int i = 0; i < pool->entry_count; ++i )
+    strpool_iter_t iter;
+    strpool_iter_begin( pool, &iter );
+    char const* string;
+    int length;
+    while( strpool_iter_next( pool, &iter, NULL, &string, &length ) )
         {
-        int len = pool->entries[ i ].length + 1;
-        char* src = pool->entries[ i ].data += 2 * sizeof( STRPOOL_U32 );
-        STRPOOL_MEMCPY( ptr, src, (size_t) len );
-        ptr += len;
+        STRPOOL_MEMCPY( ptr, string, (size_t) length + 1 );
+        ptr += length + 1;
         }
     return strings;
     }
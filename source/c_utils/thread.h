@@ -1047,8 +1047,10 @@ void thread_atomic_int_store( thread_atomic_int_t* atomic, int desired )
 
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ )
 
+        // __sync_lock_test_and_set is only an acquire barrier, so a full barrier is added to match InterlockedExchange.
+        // It must not be followed by __sync_lock_release, which would set the value back to 0.
+        __sync_synchronize();
         __sync_lock_test_and_set( &atomic->i, desired );
-        __sync_lock_release( &atomic->i );
     
     #else 
         #error Unknown platform.
@@ -1128,9 +1130,8 @@ int thread_atomic_int_swap( thread_atomic_int_t* atomic, int desired )
     
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ )
 
-        int old = (int)__sync_lock_test_and_set( &atomic->i, desired );
-        __sync_lock_release( &atomic->i );
-        return old;
+        __sync_synchronize(); // see thread_atomic_int_store
+        return (int)__sync_lock_test_and_set( &atomic->i, desired );
     
     #else 
         #error Unknown platform.
@@ -1184,8 +1185,8 @@ void thread_atomic_ptr_store( thread_atomic_ptr_t* atomic, void* desired )
     
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ )
 
+        __sync_synchronize(); // see thread_atomic_int_store
         __sync_lock_test_and_set( &atomic->ptr, desired );
-        __sync_lock_release( &atomic->ptr );
     
     #else 
         #error Unknown platform.
@@ -1206,9 +1207,8 @@ void* thread_atomic_ptr_swap( thread_atomic_ptr_t* atomic, void* desired )
     
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ )
 
-        void* old = __sync_lock_test_and_set( &atomic->ptr, desired );
-        __sync_lock_release( &atomic->ptr );
-        return old;
+        __sync_synchronize(); // see thread_atomic_int_store
+        return __sync_lock_test_and_set( &atomic->ptr, desired );
     
     #else 
         #error Unknown platform.
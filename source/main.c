@@ -11,6 +11,15 @@ typedef struct myobj_t {
     int count;
 } myobj_t;
 
+DEFINE_MAP( wordcount, str_t, int, map_hash_str, MAP_EQUAL )
+
+
+void print_entry( void* user_data, str_t key, void* item ) {
+    (void) user_data;
+    myobj_t const* entry = (myobj_t const*) item;
+    printf( "strmap_foreach: %s %s %d\n", cstr( key ), cstr( entry->name ), entry->count );
+}
+
 
 int main() {
     strmap_t* map = strmap_create( sizeof( myobj_t ) );
@@ -128,9 +137,123 @@ int main() {
     x = 4;
     printf( "bsearch(4): %d\n", array_bsearch( intarr, &x, compare_int ) );
     array_destroy( intarr );
-    
+
+    buffer_t* mapbuf = buffer_create();
+    strmap_save( map, mapbuf );
+    buffer_position_set( mapbuf, 0 );
+    strmap_t* loaded = strmap_load( mapbuf );
+    if( loaded ) {
+        myobj_t found3;
+        if( strmap_find( loaded, str("test"), &found3 ) ) {
+            printf( "strmap_load: %s %d\n", cstr( found3.name ), found3.count );
+        }
+        strmap_destroy( loaded );
+    }
+    buffer_destroy( mapbuf );
+
+    char const* request = "test?debug=1";
+    printf( "strmap_find_cstr: %d %d\n\n", (int) strmap_find_cstr( map, request, 4, &found ), 
+        (int) strmap_find_cstr( map, request, 7, &found ) );
+
+    printf( "strmap_count: %d\n", strmap_count( map ) );
+    strmap_foreach( map, print_entry, NULL );
+    printf( "\n" );
+
     strmap_destroy( map );
     
+    typedef struct pair_t {
+        str_t name;
+        int index;
+    } pair_t;
+    pair_t key = { str( "item" ), 0 };
+    blob_t key_a = blob( &key, sizeof( key ) );
+    key.index = 1;
+    blob_t key_b = blob( &key, sizeof( key ) );
+    key.index = 0;
+    blob_t key_c = blob( &key, sizeof( key ) );
+    pair_t const* key_data = (pair_t const*) blob_data( key_b );
+    printf( "blob: %d %d %d %s %d %d\n\n", (int) key_a, (int) key_b, (int) key_c, cstr( key_data->name ), 
+        key_data->index, blob_size( key_b ) );
+
+    wordcount_t counts;
+    wordcount_init( &counts );
+    char const* words[] = { "one", "two", "two", "three", "three", "three" };
+    for( int i = 0; i < (int)( sizeof( words ) / sizeof( *words ) ); ++i ) {
+        ++*wordcount_find_or_insert( &counts, str( words[ i ] ), NULL );
+    }
+    printf( "wordcount: %d %d %d %d\n\n", wordcount_count( &counts ), *wordcount_find( &counts, str( "one" ) ), 
+        *wordcount_find( &counts, str( "three" ) ), wordcount_find( &counts, str( "four" ) ) != NULL );
+    wordcount_term( &counts );
+
+    bloom_t seen;
+    bloom_init( &seen, 1000, 10 );
+    for( int i = 0; i < (int)( sizeof( words ) / sizeof( *words ) ); ++i ) {
+        bloom_add( &seen, map_hash_str( str( words[ i ] ) ) );
+    }
+    printf( "bloom: %d %d %d bytes\n\n", bloom_test( &seen, map_hash_str( str( "two" ) ) ), 
+        bloom_test( &seen, map_hash_str( str( "four" ) ) ), bloom_memory( &seen ) );
+    bloom_term( &seen );
+
+    intmap_t* squares = intmap_create( sizeof( int ) );
+    for( int i = 0; i < 1000; ++i ) {
+        int square = i * i;
+        intmap_insert( squares, i, &square );
+    }
+    int square = 0;
+    intmap_find( squares, 42, &square );
+    printf( "intmap: %d %d\n\n", intmap_count( squares ), square );
+
+    intmap_snapshot_t* snapshot = intmap_snapshot( squares );
+    square = -1;
+    intmap_update( squares, 42, &square );
+    intmap_remove( squares, 7 );
+    int before = 0;
+    intmap_snapshot_find( snapshot, 42, &before );
+    intmap_find( squares, 42, &square );
+    printf( "intmap_snapshot: %d %d, %d %d\n\n", intmap_snapshot_count( snapshot ), before, intmap_count( squares ),
+        square );
+    intmap_destroy( squares );
+    intmap_snapshot_release( snapshot );
+
+    #ifndef C_UTILS_THREAD_SAFE
+        strmap_t* votes = strmap_create( sizeof( int ) );
+        int vote = 1;
+        strmap_insert( votes, str( "yes" ), &vote );
+        strmap_snapshot_t* poll = strmap_snapshot( votes );
+        *(int*) strmap_get_ptr( votes, str( "yes" ) ) = 99;
+        int polled = 0;
+        strmap_snapshot_find( poll, str( "yes" ), &polled );
+        strmap_find( votes, str( "yes" ), &vote );
+        printf( "strmap_snapshot after strmap_get_ptr: %s (%d %d)\n\n", polled == 1 && vote == 99 ? "PASS" : "FAIL",
+            polled, vote );
+        strmap_destroy( votes );
+        strmap_snapshot_release( poll );
+    #endif
+
+    int ids[] = { 7, 3, 9, 3 };
+    int scores[] = { 70, 30, 90, 33 };
+    intmap_t* bulk = intmap_create_ex( sizeof( int ), 4, 0 );
+    intmap_insert_many( bulk, ids, scores, 4 );
+    int score = 0;
+    intmap_find( bulk, 3, &score );
+    printf( "intmap_insert_many: %d %d\n\n", intmap_count( bulk ), score );
+    intmap_destroy( bulk );
+
+    intcache_t* cache = intcache_create( sizeof( int ), 2, NULL, NULL );
+    for( int i = 1; i <= 3; ++i ) {
+        int square = i * i;
+        intcache_insert( cache, i, &square );
+        intcache_find( cache, 1, &square );
+    }
+    int cached = 0;
+    int64_t hits = 0;
+    int64_t evictions = 0;
+    bool found_two = intcache_find( cache, 2, &cached );
+    intcache_find( cache, 1, &cached );
+    intcache_stats( cache, &hits, NULL, &evictions );
+    printf( "intcache: %d %d %d hits, %d evictions\n\n", (int) found_two, cached, (int) hits, (int) evictions );
+    intcache_destroy( cache );
+
     buffer_t* buffer = buffer_create();
     str_t data = str( "This is some test data" );
     int length = len( data );